@@ -0,0 +1,527 @@
+/* * * * * * * * * * * * * * * * * * * * *
+**
+** Copyright 2012 Dominik Pretzsch
+**
+**    Licensed under the Apache License, Version 2.0 (the "License");
+**    you may not use this file except in compliance with the License.
+**    You may obtain a copy of the License at
+**
+**        http://www.apache.org/licenses/LICENSE-2.0
+**
+**    Unless required by applicable law or agreed to in writing, software
+**    distributed under the License is distributed on an "AS IS" BASIS,
+**    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+**    See the License for the specific language governing permissions and
+**    limitations under the License.
+**
+** * * * * * * * * * * * * * * * * * * */
+
+#include "COpenOTPAuthFlow.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// State shared with the request threads, which may outlive the flow
+// after a cancellation. 'generation' changes with every request and
+// cancellation: a thread only publishes its reply if it still matches.
+struct COpenOTPAuthFlow::Shared
+{
+	std::mutex lock;
+	std::condition_variable changed;
+	State state;
+	Result result;
+	unsigned int generation;
+	int running;
+	Listener listener;
+	// token of the request in progress
+	openotp_cancel_t *cancel;
+
+	// kept from the login for the challenge
+	std::string session;
+	std::string username;
+	std::string domain;
+};
+
+// Approval hints pending for all the flows. A single timer thread raises
+// them, started with the first one and left after AUTHFLOW_APPROVAL_HINT
+// with none pending. 'firing' is the flow it is calling the listener of.
+struct COpenOTPAuthFlow::Hints
+{
+	struct Entry
+	{
+		std::chrono::steady_clock::time_point due;
+		std::shared_ptr<Shared> shared;
+		unsigned int generation;
+	};
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<Entry> pending;
+	Shared *firing;
+	bool running;
+
+	Hints(): firing(NULL), running(false) {}
+};
+
+static bool _InProgress(COpenOTPAuthFlow::State state)
+{
+	return state == COpenOTPAuthFlow::STATE_LOGIN || state == COpenOTPAuthFlow::STATE_CHALLENGE;
+}
+
+COpenOTPAuthFlow::COpenOTPAuthFlow():
+	_shared(std::make_shared<Shared>())
+{
+	_shared->state = STATE_IDLE;
+	_shared->result.state = STATE_IDLE;
+	_shared->result.code = OPENOTP_FAILURE;
+	_shared->result.timeout = 0;
+	_shared->generation = 0;
+	_shared->running = 0;
+	_shared->cancel = NULL;
+}
+
+COpenOTPAuthFlow::~COpenOTPAuthFlow()
+{
+	Reset();
+
+	// a request thread still running must not call the owner any more
+	std::lock_guard<std::mutex> guard(_shared->lock);
+	_shared->listener = nullptr;
+}
+
+void COpenOTPAuthFlow::SetListener(Listener listener)
+{
+	std::lock_guard<std::mutex> guard(_shared->lock);
+	_shared->listener = listener;
+}
+
+bool COpenOTPAuthFlow::Login(const Request &request)
+{
+	unsigned int generation;
+	{
+		std::lock_guard<std::mutex> guard(_shared->lock);
+		if (_InProgress(_shared->state))
+			return false;
+		generation = ++_shared->generation;
+		_shared->state = STATE_LOGIN;
+		_shared->running++;
+		_Wipe(_shared->session);
+	}
+
+	try
+	{
+		std::thread(_Run, _shared, generation, true, request).detach();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> guard(_shared->lock);
+		_shared->state = STATE_FAILURE;
+		_shared->result.state = STATE_FAILURE;
+		_shared->result.code = OPENOTP_FAILURE;
+		_shared->result.message = "Cannot start the login request";
+		_shared->running--;
+		_shared->changed.notify_all();
+		return false;
+	}
+	return true;
+}
+
+bool COpenOTPAuthFlow::Challenge(const std::string &otpPassword, int priority)
+{
+	Request request;
+	unsigned int generation;
+	{
+		std::lock_guard<std::mutex> guard(_shared->lock);
+		if (_shared->state != STATE_CHALLENGE_REQUIRED)
+			return false;
+		request.username = _shared->username;
+		request.domain = _shared->domain;
+		request.otpPassword = otpPassword;
+		request.priority = priority;
+		generation = ++_shared->generation;
+		_shared->state = STATE_CHALLENGE;
+		_shared->running++;
+	}
+
+	try
+	{
+		std::thread(_Run, _shared, generation, false, request).detach();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> guard(_shared->lock);
+		_shared->state = STATE_CHALLENGE_REQUIRED;
+		_shared->running--;
+		_shared->changed.notify_all();
+		_Wipe(request.otpPassword);
+		return false;
+	}
+	_Wipe(request.otpPassword);
+	return true;
+}
+
+bool COpenOTPAuthFlow::Wait(Result *result, unsigned int ms)
+{
+	std::unique_lock<std::mutex> guard(_shared->lock);
+
+	if (ms == 0)
+	{
+		while (_InProgress(_shared->state))
+			_shared->changed.wait(guard);
+	}
+	else
+	{
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+		while (_InProgress(_shared->state))
+		{
+			if (_shared->changed.wait_until(guard, deadline) == std::cv_status::timeout && _InProgress(_shared->state))
+				return false;
+		}
+	}
+
+	if (result)
+		*result = _shared->result;
+	return true;
+}
+
+void COpenOTPAuthFlow::Cancel()
+{
+	Listener listener;
+	Result result;
+	{
+		std::lock_guard<std::mutex> guard(_shared->lock);
+		if (!_InProgress(_shared->state))
+			return;
+		_shared->generation++;
+		_shared->state = STATE_CANCELLED;
+		_shared->result.state = STATE_CANCELLED;
+		_shared->result.code = OPENOTP_FAILURE;
+		_shared->result.timeout = 0;
+		_shared->result.message.clear();
+		if (_shared->cancel)
+			openotp_cancel(_shared->cancel);
+		_shared->changed.notify_all();
+		listener = _shared->listener;
+		result = _shared->result;
+	}
+	// an approval hint being raised comes before the cancellation
+	_HintRemove(_shared.get());
+	if (listener)
+		listener(EVENT_CANCELLED, result);
+}
+
+void COpenOTPAuthFlow::Reset()
+{
+	Cancel();
+
+	std::lock_guard<std::mutex> guard(_shared->lock);
+	_Wipe(_shared->session);
+	_Wipe(_shared->username);
+	_Wipe(_shared->domain);
+	_shared->state = STATE_IDLE;
+	_shared->result.state = STATE_IDLE;
+	_shared->result.code = OPENOTP_FAILURE;
+	_shared->result.timeout = 0;
+	_shared->result.message.clear();
+}
+
+void COpenOTPAuthFlow::Join()
+{
+	std::unique_lock<std::mutex> guard(_shared->lock);
+	while (_shared->running > 0)
+		_shared->changed.wait(guard);
+}
+
+COpenOTPAuthFlow::State COpenOTPAuthFlow::GetState() const
+{
+	std::lock_guard<std::mutex> guard(_shared->lock);
+	return _shared->state;
+}
+
+bool COpenOTPAuthFlow::Running() const
+{
+	std::lock_guard<std::mutex> guard(_shared->lock);
+	return _shared->running > 0;
+}
+
+void COpenOTPAuthFlow::_Wipe(std::string &secret)
+{
+	// through a volatile pointer, the stores cannot be left out
+	volatile char *p = &secret[0];
+	for (size_t i = 0; i < secret.size(); i++)
+		p[i] = '\0';
+	secret.clear();
+}
+
+// Sends the login or the challenge from the calling thread.
+void COpenOTPAuthFlow::_Call(bool login, const Request &request, std::string &session, Result &result)
+{
+	// the copies handed to the library live in a secure arena, wiped
+	// and released at once after the call
+	openotp_secure_t *secure = openotp_secure_new(NULL);
+
+	if (!secure)
+		return;
+	if (login)
+	{
+		openotp_login_req_t lreq;
+		openotp_login_rep_t *lrep;
+
+		memset(&lreq, 0, sizeof(lreq));
+		lreq.username		= openotp_secure_strdup(secure, request.username.c_str());
+		lreq.domain			= openotp_secure_strdup(secure, request.domain.c_str());
+		lreq.ldapPassword	= openotp_secure_strdup(secure, request.ldapPassword.c_str());
+		lreq.otpPassword	= openotp_secure_strdup(secure, request.otpPassword.c_str());
+		lreq.client			= openotp_secure_strdup(secure, request.client.c_str());
+		lreq.source			= openotp_secure_strdup(secure, request.source.c_str());
+		lreq.settings		= openotp_secure_strdup(secure, request.settings.c_str());
+
+		lrep = openotp_login(&lreq, NULL);
+		openotp_secure_free(secure);
+
+		if (!lrep)
+			return;
+		result.code = lrep->code;
+		result.timeout = lrep->timeout;
+		if (lrep->message)
+			result.message = lrep->message;
+		if (lrep->session)
+			session = lrep->session;
+		openotp_login_rep_free(lrep);
+	}
+	else
+	{
+		openotp_challenge_req_t creq;
+		openotp_challenge_rep_t *crep;
+
+		memset(&creq, 0, sizeof(creq));
+		creq.username		= openotp_secure_strdup(secure, request.username.c_str());
+		creq.domain			= request.domain.empty() ? NULL : openotp_secure_strdup(secure, request.domain.c_str());
+		creq.session		= openotp_secure_strdup(secure, session.c_str());
+		creq.otpPassword	= openotp_secure_strdup(secure, request.otpPassword.c_str());
+
+		crep = openotp_challenge(&creq, NULL);
+		openotp_secure_free(secure);
+
+		if (!crep)
+			return;
+		result.code = crep->code;
+		if (crep->message)
+			result.message = crep->message;
+		openotp_challenge_rep_free(crep);
+	}
+}
+
+COpenOTPAuthFlow::Hints &COpenOTPAuthFlow::_GetHints()
+{
+	// never destroyed: the timer thread may still be leaving at exit
+	static Hints *hints = new Hints();
+	return *hints;
+}
+
+// Raises EVENT_WAITING_APPROVAL for the login 'generation' of the flow if
+// it is still in progress after AUTHFLOW_APPROVAL_HINT.
+void COpenOTPAuthFlow::_HintAdd(std::shared_ptr<Shared> shared, unsigned int generation)
+{
+	Hints &hints = _GetHints();
+	Hints::Entry entry;
+
+	entry.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(AUTHFLOW_APPROVAL_HINT);
+	entry.shared = shared;
+	entry.generation = generation;
+
+	std::lock_guard<std::mutex> guard(hints.lock);
+	if (!hints.running)
+	{
+		try
+		{
+			std::thread(_RunHints).detach();
+		}
+		catch (...)
+		{
+			// the login goes on without the hint
+			return;
+		}
+		hints.running = true;
+	}
+	hints.pending.push_back(entry);
+	hints.changed.notify_all();
+}
+
+// Drops the hints of the flow, waiting for one being raised: no
+// listener call of the hint follows.
+void COpenOTPAuthFlow::_HintRemove(Shared *shared)
+{
+	Hints &hints = _GetHints();
+	std::unique_lock<std::mutex> guard(hints.lock);
+
+	for (size_t i = 0; i < hints.pending.size(); )
+	{
+		if (hints.pending[i].shared.get() == shared)
+			hints.pending.erase(hints.pending.begin() + i);
+		else
+			i++;
+	}
+	while (hints.firing == shared)
+		hints.changed.wait(guard);
+}
+
+// Timer thread of the approval hints.
+void COpenOTPAuthFlow::_RunHints()
+{
+	Hints &hints = _GetHints();
+	std::unique_lock<std::mutex> guard(hints.lock);
+
+	for (;;)
+	{
+		if (hints.pending.empty())
+		{
+			if (hints.changed.wait_for(guard, std::chrono::milliseconds(AUTHFLOW_APPROVAL_HINT)) == std::cv_status::timeout && hints.pending.empty())
+			{
+				hints.running = false;
+				return;
+			}
+			continue;
+		}
+
+		size_t next = 0;
+		for (size_t i = 1; i < hints.pending.size(); i++)
+		{
+			if (hints.pending[i].due < hints.pending[next].due)
+				next = i;
+		}
+		if (std::chrono::steady_clock::now() < hints.pending[next].due)
+		{
+			hints.changed.wait_until(guard, hints.pending[next].due);
+			continue;
+		}
+
+		Hints::Entry entry = hints.pending[next];
+		hints.pending.erase(hints.pending.begin() + next);
+		hints.firing = entry.shared.get();
+		guard.unlock();
+
+		Listener listener;
+		Result result;
+
+		result.state = STATE_LOGIN;
+		result.code = OPENOTP_FAILURE;
+		result.timeout = 0;
+		{
+			std::lock_guard<std::mutex> shared_guard(entry.shared->lock);
+			if (entry.shared->generation == entry.generation && entry.shared->state == STATE_LOGIN)
+				listener = entry.shared->listener;
+		}
+		if (listener)
+			listener(EVENT_WAITING_APPROVAL, result);
+		listener = nullptr;
+		entry.shared.reset();
+
+		guard.lock();
+		hints.firing = NULL;
+		hints.changed.notify_all();
+	}
+}
+
+// Request thread: sends the login or the challenge and publishes the reply.
+void COpenOTPAuthFlow::_Run(std::shared_ptr<Shared> shared, unsigned int generation, bool login, Request request)
+{
+	Listener listener;
+	Result result;
+	Event event;
+	std::string session;
+	openotp_cancel_t *cancel = openotp_cancel_new(NULL);
+
+	result.state = login ? STATE_LOGIN : STATE_CHALLENGE;
+	result.code = OPENOTP_FAILURE;
+	result.timeout = 0;
+
+	{
+		std::lock_guard<std::mutex> guard(shared->lock);
+		if (shared->generation == generation)
+		{
+			listener = shared->listener;
+			shared->cancel = cancel;
+		}
+		else if (cancel)
+		{
+			openotp_cancel(cancel);
+		}
+		if (!login)
+			session = shared->session;
+	}
+	if (listener)
+		listener(EVENT_CONNECTING, result);
+
+	// a login held by the server for a push approval is reported by the
+	// timer thread while this one waits for the reply
+	if (login && listener)
+		_HintAdd(shared, generation);
+
+	// the priority and the cancellation are per thread
+	openotp_set_priority(request.priority, 0);
+	openotp_set_cancel(cancel);
+	_Call(login, request, session, result);
+	openotp_set_cancel(NULL);
+
+	_HintRemove(shared.get());
+
+	{
+		std::lock_guard<std::mutex> guard(shared->lock);
+		if (shared->cancel == cancel)
+			shared->cancel = NULL;
+	}
+	openotp_cancel_free(cancel);
+
+	_Wipe(request.ldapPassword);
+	_Wipe(request.otpPassword);
+
+	if (result.code == OPENOTP_SUCCESS)
+	{
+		result.state = STATE_SUCCESS;
+		event = EVENT_SUCCESS;
+	}
+	else if (login && result.code == OPENOTP_CHALLENGE)
+	{
+		result.state = STATE_CHALLENGE_REQUIRED;
+		event = EVENT_CHALLENGE_REQUIRED;
+	}
+	else
+	{
+		result.state = STATE_FAILURE;
+		event = EVENT_FAILURE;
+	}
+
+	listener = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(shared->lock);
+		shared->running--;
+		if (shared->generation == generation)
+		{
+			shared->state = result.state;
+			shared->result = result;
+			if (result.state == STATE_CHALLENGE_REQUIRED)
+			{
+				shared->session = session;
+				shared->username = request.username;
+				shared->domain = request.domain;
+			}
+			else
+			{
+				_Wipe(shared->session);
+			}
+			listener = shared->listener;
+		}
+		shared->changed.notify_all();
+	}
+	_Wipe(session);
+
+	if (listener)
+		listener(event, result);
+}
@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * * * *
+**
+** Copyright 2012 Dominik Pretzsch
+**
+**    Licensed under the Apache License, Version 2.0 (the "License");
+**    you may not use this file except in compliance with the License.
+**    You may obtain a copy of the License at
+**
+**        http://www.apache.org/licenses/LICENSE-2.0
+**
+**    Unless required by applicable law or agreed to in writing, software
+**    distributed under the License is distributed on an "AS IS" BASIS,
+**    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+**    See the License for the specific language governing permissions and
+**    limitations under the License.
+**
+** * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+// OpenOTP login -> challenge flow, independent of the credential provider
+// interfaces so that it builds and runs on any platform with libopenotp.
+// Each request runs on its own thread, which makes the OpenOTP call; the
+// caller waits for the result or gets the progress events from the
+// listener. The OpenOTP library must be initialized by the caller and stay
+// initialized while Running().
+
+#include <string>
+#include <functional>
+#include <memory>
+
+// the Linux copies of the header have no C++ guard
+extern "C" {
+#include <openotp.h>
+}
+
+// a login still pending after this delay is most likely waiting for the
+// user to approve a push notification (milliseconds)
+#define AUTHFLOW_APPROVAL_HINT 2000
+
+class COpenOTPAuthFlow
+{
+  public:
+	enum State
+	{
+		STATE_IDLE					= 0,
+		STATE_LOGIN					= 1,	// login request in progress
+		STATE_CHALLENGE_REQUIRED	= 2,	// waiting for the OTP of the user
+		STATE_CHALLENGE				= 3,	// challenge request in progress
+		STATE_SUCCESS				= 4,
+		STATE_FAILURE				= 5,
+		STATE_CANCELLED				= 6,
+	};
+
+	enum Event
+	{
+		EVENT_CONNECTING			= 0,
+		EVENT_WAITING_APPROVAL		= 1,
+		EVENT_CHALLENGE_REQUIRED	= 2,
+		EVENT_SUCCESS				= 3,
+		EVENT_FAILURE				= 4,
+		EVENT_CANCELLED				= 5,
+	};
+
+	struct Request
+	{
+		std::string username;
+		std::string domain;
+		std::string ldapPassword;
+		std::string otpPassword;
+		std::string client;
+		std::string source;
+		std::string settings;
+		int priority;				// OPENOTP_PRIORITY_*
+	};
+
+	struct Result
+	{
+		State state;
+		int code;					// OpenOTP reply code, OPENOTP_FAILURE if no reply
+		int timeout;				// seconds left to answer a challenge
+		std::string message;
+	};
+
+	// called on the request thread, except EVENT_WAITING_APPROVAL, raised by
+	// a timer thread shared by the flows, and EVENT_CANCELLED, raised on the
+	// thread of Cancel() or Reset() before it returns; must not call back
+	// into the flow
+	typedef std::function<void (Event event, const Result &result)> Listener;
+
+	COpenOTPAuthFlow();
+	~COpenOTPAuthFlow();
+
+	void SetListener(Listener listener);
+
+	// starts a login, from any state but a request in progress
+	bool Login(const Request &request);
+	// answers the challenge of the last login
+	bool Challenge(const std::string &otpPassword, int priority);
+
+	// waits until no request is in progress, 'ms' 0 for no limit;
+	// returns false on timeout
+	bool Wait(Result *result, unsigned int ms = 0);
+
+	// gives up the request in progress and interrupts its OpenOTP call
+	void Cancel();
+	// waits until no request thread uses the OpenOTP library any more,
+	// which after Cancel() takes no longer than the interrupted call
+	void Join();
+	// cancels and forgets the session of the last login
+	void Reset();
+
+	State GetState() const;
+	// true while a request thread still uses the OpenOTP library,
+	// also shortly after Cancel()
+	bool Running() const;
+
+  private:
+	struct Shared;
+	struct Hints;
+
+	static void _Run(std::shared_ptr<Shared> shared, unsigned int generation, bool login, Request request);
+	static void _Call(bool login, const Request &request, std::string &session, Result &result);
+	static Hints &_GetHints();
+	static void _HintAdd(std::shared_ptr<Shared> shared, unsigned int generation);
+	static void _HintRemove(Shared *shared);
+	static void _RunHints();
+	static void _Wipe(std::string &secret);
+
+	std::shared_ptr<Shared> _shared;
+
+	COpenOTPAuthFlow(const COpenOTPAuthFlow &);
+	COpenOTPAuthFlow &operator=(const COpenOTPAuthFlow &);
+};
@@ -0,0 +1,435 @@
+/* * * * * * * * * * * * * * * * * * * * *
+**
+** Copyright 2012 Dominik Pretzsch
+**
+**    Licensed under the Apache License, Version 2.0 (the "License");
+**    you may not use this file except in compliance with the License.
+**    You may obtain a copy of the License at
+**
+**        http://www.apache.org/licenses/LICENSE-2.0
+**
+**    Unless required by applicable law or agreed to in writing, software
+**    distributed under the License is distributed on an "AS IS" BASIS,
+**    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+**    See the License for the specific language governing permissions and
+**    limitations under the License.
+**
+** * * * * * * * * * * * * * * * * * * */
+
+#include "COpenOTPConfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "registry.h"
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+static void _Wipe(std::string &secret)
+{
+	volatile char *p = secret.empty() ? NULL : &secret[0];
+	for (size_t i = 0; i < secret.size(); i++)
+		p[i] = 0;
+	secret.clear();
+}
+
+// COpenOTPConfig::Snapshot //////////////////////////////////////////////////
+
+COpenOTPConfig::Snapshot::Snapshot():
+	soapTimeout(0),
+	version(0)
+{
+}
+
+COpenOTPConfig::Snapshot::~Snapshot()
+{
+	_Wipe(const_cast<std::string &>(certPassword));
+}
+
+bool COpenOTPConfig::Snapshot::SameConnection(const Snapshot &other) const
+{
+	return serverUrl == other.serverUrl &&
+		certFile == other.certFile &&
+		certPassword == other.certPassword &&
+		caFile == other.caFile &&
+		cacheFile == other.cacheFile &&
+		soapTimeout == other.soapTimeout;
+}
+
+bool COpenOTPConfig::Snapshot::operator==(const Snapshot &other) const
+{
+	return SameConnection(other) &&
+		clientId == other.clientId &&
+		defaultDomain == other.defaultDomain &&
+		userSettings == other.userSettings &&
+		loginText == other.loginText;
+}
+
+// Sources ///////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+
+// HKLM\REGISTRY_BASE_KEY, read through the helpers of registry.h
+class CRegistrySource : public COpenOTPConfig::Source
+{
+  public:
+	CRegistrySource():
+		_key(NULL),
+		_armed(false)
+	{
+		_changed = CreateEvent(NULL, FALSE, FALSE, NULL);
+		_interrupt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	~CRegistrySource()
+	{
+		if (_key)
+			RegCloseKey(_key);
+		if (_changed)
+			CloseHandle(_changed);
+		if (_interrupt)
+			CloseHandle(_interrupt);
+	}
+
+	bool Load(COpenOTPConfig::Snapshot *snapshot)
+	{
+		char value[1024];
+
+		_Read(CONF_SERVER_URL, value, snapshot->serverUrl);
+		_Read(CONF_CLIENT_ID, value, snapshot->clientId);
+		_Read(CONF_DEFAULT_DOMAIN, value, snapshot->defaultDomain);
+		_Read(CONF_USER_SETTINGS, value, snapshot->userSettings);
+		_Read(CONF_CERT_FILE, value, snapshot->certFile);
+		_Read(CONF_CERT_PASSWORD, value, snapshot->certPassword);
+		_Read(CONF_CA_FILE, value, snapshot->caFile);
+		_Read(CONF_LOGIN_TEXT, value, snapshot->loginText);
+		_Read(CONF_CACHE_FILE, value, snapshot->cacheFile);
+
+		readRegistryValueInteger(CONF_SOAP_TIMEOUT, &snapshot->soapTimeout);
+
+		SecureZeroMemory(value, sizeof(value));
+		return true;
+	}
+
+	bool WaitChange(unsigned int ms)
+	{
+		HANDLE events[2] = { _interrupt, _changed };
+
+		// the key may only be created after the provider started
+		if (!_key && RegOpenKeyEx(HKEY_LOCAL_MACHINE, REGISTRY_BASE_KEY, 0, KEY_NOTIFY, &_key) != ERROR_SUCCESS)
+			_key = NULL;
+
+		// a notification stays registered until it fires
+		if (_key && !_armed)
+			_armed = (RegNotifyChangeKeyValue(_key, TRUE, REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET, _changed, TRUE) == ERROR_SUCCESS);
+
+		switch (WaitForMultipleObjects(_armed ? 2 : 1, events, FALSE, ms))
+		{
+		case WAIT_OBJECT_0:
+			return false;
+		case WAIT_OBJECT_0 + 1:
+			_armed = false;
+			return true;
+		default:
+			return true;
+		}
+	}
+
+	void Interrupt()
+	{
+		SetEvent(_interrupt);
+	}
+
+  private:
+	static void _Read(int conf_value, char (&value)[1024], std::string &out)
+	{
+		ZeroMemory(value, sizeof(value));
+		if (readRegistryValueString(conf_value, sizeof(value), value) > 2) // 2 = size of a wchar_t NULL-terminator in byte
+			out = value;
+	}
+
+	HKEY _key;
+	HANDLE _changed;
+	HANDLE _interrupt;
+	bool _armed;
+};
+
+#else
+
+// "name=value" lines with the names of the registry values; empty
+// lines and lines starting with '#' or ';' are skipped
+class CFileSource : public COpenOTPConfig::Source
+{
+  public:
+	explicit CFileSource(const std::string &path):
+		_path(path),
+		_notify(-1)
+	{
+		std::string::size_type slash = path.rfind('/');
+
+		_dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+		_name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+		if (pipe(_interrupt) != 0)
+			_interrupt[0] = _interrupt[1] = -1;
+		else
+		{
+			fcntl(_interrupt[0], F_SETFL, O_NONBLOCK);
+			fcntl(_interrupt[1], F_SETFL, O_NONBLOCK);
+		}
+
+#ifdef __linux__
+		// watch the directory: editors and deployment tools replace the
+		// file by a rename, which a watch on the file itself would miss;
+		// a file is only read once it was written completely
+		_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_notify >= 0 && inotify_add_watch(_notify, _dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		{
+			close(_notify);
+			_notify = -1;
+		}
+#endif
+	}
+
+	~CFileSource()
+	{
+		if (_notify >= 0)
+			close(_notify);
+		if (_interrupt[0] >= 0)
+		{
+			close(_interrupt[0]);
+			close(_interrupt[1]);
+		}
+	}
+
+	bool Load(COpenOTPConfig::Snapshot *snapshot)
+	{
+		char line[2048];
+		FILE *file = fopen(_path.c_str(), "r");
+
+		if (!file)
+			return false;
+
+		while (fgets(line, sizeof(line), file))
+		{
+			char *value = strchr(line, '=');
+			std::string name;
+
+			if (line[0] == '#' || line[0] == ';' || !value)
+				continue;
+
+			*value++ = '\0';
+			name = _Trim(line);
+
+			if (name == "server_url")			snapshot->serverUrl = _Trim(value);
+			else if (name == "client_id")		snapshot->clientId = _Trim(value);
+			else if (name == "default_domain")	snapshot->defaultDomain = _Trim(value);
+			else if (name == "user_settings")	snapshot->userSettings = _Trim(value);
+			else if (name == "cert_file")		snapshot->certFile = _Trim(value);
+			else if (name == "cert_password")	snapshot->certPassword = _Trim(value);
+			else if (name == "ca_file")			snapshot->caFile = _Trim(value);
+			else if (name == "login_text")		snapshot->loginText = _Trim(value);
+			else if (name == "soap_timeout")	snapshot->soapTimeout = atoi(value);
+			else if (name == "cache_file")		snapshot->cacheFile = _Trim(value);
+		}
+
+		memset(line, 0, sizeof(line));
+		fclose(file);
+		return true;
+	}
+
+	bool WaitChange(unsigned int ms)
+	{
+		struct pollfd fds[2];
+		char buffer[4096];
+		bool changed = false;
+		int ready;
+
+		fds[0].fd = _interrupt[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = _notify;
+		fds[1].events = POLLIN;
+
+		do
+			ready = poll(fds, _notify >= 0 ? 2 : 1, (int)ms);
+		while (ready < 0 && errno == EINTR);
+
+		if (ready <= 0)
+			return true;
+
+		if (fds[0].revents)
+		{
+			while (read(_interrupt[0], buffer, sizeof(buffer)) > 0);
+			return false;
+		}
+
+#ifdef __linux__
+		ssize_t size;
+		while ((size = read(_notify, buffer, sizeof(buffer))) > 0)
+		{
+			for (char *p = buffer; p < buffer + size; )
+			{
+				struct inotify_event *event = (struct inotify_event *)p;
+				if (event->len && _name == event->name)
+					changed = true;
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+#endif
+		return changed;
+	}
+
+	void Interrupt()
+	{
+		if (_interrupt[1] >= 0 && write(_interrupt[1], "", 1) < 0)
+			return;		// full, a wake up is pending anyway
+	}
+
+  private:
+	static std::string _Trim(const char *value)
+	{
+		const char *end = value + strlen(value);
+
+		while (*value == ' ' || *value == '\t')
+			value++;
+		while (end > value && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+			end--;
+		return std::string(value, end);
+	}
+
+	std::string _path;
+	std::string _dir;
+	std::string _name;
+	int _notify;
+	int _interrupt[2];
+};
+
+#endif
+
+// COpenOTPConfig ////////////////////////////////////////////////////////////
+
+COpenOTPConfig &COpenOTPConfig::Instance()
+{
+#ifdef _WIN32
+	static COpenOTPConfig instance(NewRegistrySource());
+#else
+	static COpenOTPConfig instance(NewFileSource(getenv("OPENOTP_CP_CONFIG") ? getenv("OPENOTP_CP_CONFIG") : CONFIG_DEFAULT_FILE));
+#endif
+	return instance;
+}
+
+#ifdef _WIN32
+std::unique_ptr<COpenOTPConfig::Source> COpenOTPConfig::NewRegistrySource()
+{
+	return std::unique_ptr<Source>(new CRegistrySource());
+}
+#else
+std::unique_ptr<COpenOTPConfig::Source> COpenOTPConfig::NewFileSource(const std::string &path)
+{
+	return std::unique_ptr<Source>(new CFileSource(path));
+}
+#endif
+
+COpenOTPConfig::COpenOTPConfig(std::unique_ptr<Source> source):
+	_source(std::move(source)),
+	_watches(0),
+	_stop(false)
+{
+}
+
+COpenOTPConfig::~COpenOTPConfig()
+{
+	std::lock_guard<std::mutex> guard(_watch_lock);
+	if (_watcher.joinable())
+	{
+		_stop = true;
+		_source->Interrupt();
+		_watcher.join();
+	}
+}
+
+COpenOTPConfig::Ptr COpenOTPConfig::Get()
+{
+	Ptr current = std::atomic_load(&_current);
+
+	if (!current)
+	{
+		Reload();
+		current = std::atomic_load(&_current);
+	}
+	return current;
+}
+
+bool COpenOTPConfig::Reload()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	Ptr current = std::atomic_load(&_current);
+	std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+
+	// keep the settings in use while the source is unreadable, e.g. a
+	// file being replaced
+	if (!_source->Load(snapshot.get()) && current)
+		return false;
+
+	if (snapshot->loginText.empty())
+		snapshot->loginText = OPENOTP_DEFAULT_LOGIN_TEXT;
+
+	if (current && *snapshot == *current)
+		return false;
+
+	snapshot->version = current ? current->version + 1 : 1;
+	std::atomic_store(&_current, Ptr(snapshot));
+	return true;
+}
+
+void COpenOTPConfig::Watch()
+{
+	std::lock_guard<std::mutex> guard(_watch_lock);
+	if (_watches++ > 0)
+		return;
+
+	_stop = false;
+	try
+	{
+		_watcher = std::thread(&COpenOTPConfig::_Run, this);
+	}
+	catch (...)
+	{
+		// the snapshot read first stays in use
+	}
+}
+
+void COpenOTPConfig::Unwatch()
+{
+	std::lock_guard<std::mutex> guard(_watch_lock);
+	if (_watches == 0 || --_watches > 0)
+		return;
+
+	if (_watcher.joinable())
+	{
+		_stop = true;
+		_source->Interrupt();
+		_watcher.join();
+	}
+}
+
+void COpenOTPConfig::_Run()
+{
+	// start from the current settings, then follow the changes
+	Reload();
+
+	while (!_stop)
+	{
+		if (_source->WaitChange(CONFIG_POLL_INTERVAL) && !_stop)
+			Reload();
+	}
+}
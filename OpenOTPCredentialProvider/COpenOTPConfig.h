@@ -0,0 +1,126 @@
+/* * * * * * * * * * * * * * * * * * * * *
+**
+** Copyright 2012 Dominik Pretzsch
+**
+**    Licensed under the Apache License, Version 2.0 (the "License");
+**    you may not use this file except in compliance with the License.
+**    You may obtain a copy of the License at
+**
+**        http://www.apache.org/licenses/LICENSE-2.0
+**
+**    Unless required by applicable law or agreed to in writing, software
+**    distributed under the License is distributed on an "AS IS" BASIS,
+**    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+**    See the License for the specific language governing permissions and
+**    limitations under the License.
+**
+** * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+// Settings of the credential provider, read once into an immutable
+// snapshot which all the tiles share. Get() hands out the current
+// snapshot without locking; while watched, a background thread reloads
+// the settings when their source changes and swaps in a new snapshot.
+// Holders of the old one keep it until they let it go.
+//
+// The source is the registry on Windows and a "name=value" file on the
+// other platforms, which is enough to run the flow in tests.
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define OPENOTP_DEFAULT_LOGIN_TEXT "OpenOTP Login"
+
+// file read by the default source outside Windows, unless the
+// OPENOTP_CP_CONFIG environment variable names another one
+#define CONFIG_DEFAULT_FILE "/etc/openotp-cp.conf"
+
+// longest a watcher waits for a change notification before reading the
+// source again anyway, in case notifications cannot be set up (milliseconds)
+#define CONFIG_POLL_INTERVAL 60000
+
+class COpenOTPConfig
+{
+  public:
+	struct Snapshot
+	{
+		std::string serverUrl;
+		std::string clientId;
+		std::string defaultDomain;
+		std::string userSettings;
+		std::string certFile;
+		std::string certPassword;
+		std::string caFile;
+		std::string loginText;
+		std::string cacheFile;
+		int soapTimeout;
+
+		// increases with every snapshot swapped in
+		unsigned int version;
+
+		Snapshot();
+		~Snapshot();
+
+		// true if the OpenOTP library initialized with 'other' can keep
+		// serving this snapshot, without a new connection
+		bool SameConnection(const Snapshot &other) const;
+		bool operator==(const Snapshot &other) const;
+	};
+
+	typedef std::shared_ptr<const Snapshot> Ptr;
+
+	// where the settings come from
+	class Source
+	{
+	  public:
+		virtual ~Source() {}
+		// fills the values found, the others keep their default;
+		// returns false if the source cannot be read at all
+		virtual bool Load(Snapshot *snapshot) = 0;
+		// waits up to 'ms' for the source to change; returns true if it
+		// must be read again: it changed or the wait timed out
+		virtual bool WaitChange(unsigned int ms) = 0;
+		// makes WaitChange() return, from any thread
+		virtual void Interrupt() = 0;
+	};
+
+	// the settings of the process, from the default source
+	static COpenOTPConfig &Instance();
+
+	static std::unique_ptr<Source> NewRegistrySource();		// Windows only
+	static std::unique_ptr<Source> NewFileSource(const std::string &path);	// not on Windows
+
+	explicit COpenOTPConfig(std::unique_ptr<Source> source);
+	~COpenOTPConfig();
+
+	// current snapshot, read from the source on first use; never NULL
+	Ptr Get();
+
+	// reads the source now and swaps in a new snapshot if any value
+	// changed; returns true if it did
+	bool Reload();
+
+	// starts watching the source; watches nest, the watcher thread stops
+	// with the last Unwatch()
+	void Watch();
+	void Unwatch();
+
+  private:
+	void _Run();
+
+	std::unique_ptr<Source> _source;
+	std::shared_ptr<const Snapshot> _current;	// std::atomic_load/store only
+
+	std::mutex _lock;							// Reload()
+	std::mutex _watch_lock;						// Watch(), Unwatch()
+	std::thread _watcher;
+	int _watches;
+	std::atomic<bool> _stop;
+
+	COpenOTPConfig(const COpenOTPConfig &);
+	COpenOTPConfig &operator=(const COpenOTPConfig &);
+};
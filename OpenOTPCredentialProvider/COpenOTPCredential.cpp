@@ -24,12 +24,28 @@
 #include "COpenOTPCredential.h"
 #include "guid.h"
 
+// setting -> text of a tile field
+static std::wstring _Widen(const std::string &value)
+{
+	std::wstring wide;
+	int size = MultiByteToWideChar(CP_ACP, 0, value.c_str(), -1, NULL, 0);
+
+	if (size > 1)
+	{
+		wide.resize(size);
+		MultiByteToWideChar(CP_ACP, 0, value.c_str(), -1, &wide[0], size);
+		wide.resize(size - 1);
+	}
+	return wide;
+}
+
 // COpenOTPCredential ////////////////////////////////////////////////////////
 
 COpenOTPCredential::COpenOTPCredential():
     _cRef(1),
     _pCredProvCredentialEvents(NULL),
-	_openotp_is_challenge_request(false),
+	_openotp_initialized(false),
+	_openotp_prepared(false),
 	_user_name(NULL),
 	_domain_name(NULL)
 {
@@ -39,46 +55,33 @@ COpenOTPCredential::COpenOTPCredential():
     ZERO(_rgFieldStatePairs);
     ZERO(_rgFieldStrings);
 
-	ZERO(_openotp_server_url);
-	ZERO(_openotp_cert_file);
-	ZERO(_openotp_cert_password);
-	ZERO(_openotp_ca_file);
-	ZERO(_openotp_client_id);
-	ZERO(_openotp_default_domain);
-	ZERO(_openotp_user_settings);
-	ZERO(_openotp_login_text);
-
-	_openotp_login_request = *openotp_login_req_new();
-
-	_openotp_login_response.code    = 0;
-	_openotp_login_response.timeout = 0;
-	_openotp_login_response.data    = NULL;
-	_openotp_login_response.message = NULL;
-	_openotp_login_response.session = NULL;
-
-	_openotp_challenge_response.code    = 0;
-	_openotp_challenge_response.data    = NULL;
-	_openotp_challenge_response.message = NULL;
-
-	// Read OpenOTP config
-	readRegistryValueString(CONF_SERVER_URL, sizeof(_openotp_server_url), _openotp_server_url);
-	readRegistryValueString(CONF_CERT_FILE, sizeof(_openotp_cert_file), _openotp_cert_file);
-	readRegistryValueString(CONF_CERT_PASSWORD, sizeof(_openotp_cert_password), _openotp_cert_password);
-	readRegistryValueString(CONF_CA_FILE, sizeof(_openotp_ca_file), _openotp_ca_file);
-	readRegistryValueString(CONF_CLIENT_ID, sizeof(_openotp_client_id), _openotp_client_id);	
-	readRegistryValueString(CONF_DEFAULT_DOMAIN, sizeof(_openotp_default_domain), _openotp_default_domain);
-	readRegistryValueString(CONF_USER_SETTINGS, sizeof(_openotp_user_settings), _openotp_user_settings);
-
-	//readRegistryValueString(CONF_LOGIN_TEXT, sizeof(_openotp_login_text), _openotp_login_text);
-	if (readRegistryValueString(CONF_LOGIN_TEXT, sizeof(_openotp_login_text), _openotp_login_text) <= 2) // 2 = size of a wchar_t NULL-terminator in byte
-		strcpy_s(_openotp_login_text, sizeof(_openotp_login_text), OPENOTP_DEFAULT_LOGIN_TEXT);
-
-	readRegistryValueInteger(CONF_SOAP_TIMEOUT, &_openotp_soap_timeout);
-	// END Read OpenOTP config
+	ZERO(_openotp_server_url_runtime);
+
+	// OpenOTP config, read once for all the tiles of the process
+	_config = COpenOTPConfig::Instance().Get();
+
+	// the listener keeps the status, not the tile
+	_status = std::make_shared<Status>();
+	_status->credential = this;
+	_status->events = NULL;
+	_status->idleState = CPFS_HIDDEN;
+	std::shared_ptr<Status> status = _status;
+	_auth_flow.SetListener([status](COpenOTPAuthFlow::Event event, const COpenOTPAuthFlow::Result &) {
+		_OnFlowEvent(status, event);
+	});
 }
 
 COpenOTPCredential::~COpenOTPCredential()
 {
+	// DISABLE OPENOTP IN EVERY CASE: the request in progress is cancelled and
+	// its thread leaves the library before it is terminated, the URL it keeps
+	// is wiped after that
+	_SetStatusEvents(NULL);
+	_auth_flow.Reset();
+	_auth_flow.Join();
+	_OpenOTPTerminate();
+	///
+
 	if (_rgFieldStrings[SFI_OTP_USERNAME])
     {
         // CoTaskMemFree (below) deals with NULL, but StringCchLength does not.
@@ -110,23 +113,7 @@ COpenOTPCredential::~COpenOTPCredential()
     }
 
 	/// Make sure _openotp-runtime is clean
-	ZERO(_openotp_server_url);
-	ZERO(_openotp_cert_file);
-	ZERO(_openotp_ca_file);
-	ZERO(_openotp_client_id);
-	ZERO(_openotp_default_domain);
-	ZERO(_openotp_user_settings);
-	ZERO(_openotp_login_text);
-
-	SecureZeroMemory(_openotp_cert_password, sizeof(_openotp_cert_password));
-
-	_ClearOpenOTPLoginReqRep(&_openotp_login_request, &_openotp_login_response);
-	_ClearOpenOTPChallengeReqRep(NULL, &_openotp_challenge_response);
-
-	// DISABLE OPENOTP IN EVERY CASE
-	_openotp_is_challenge_request = false;
-	openotp_terminate(NULL);
-	///
+	ZERO(_openotp_server_url_runtime);
 
 	DllRelease();
 }
@@ -167,12 +154,7 @@ HRESULT COpenOTPCredential::Initialize(
 		//	hr = SHStrDupW(OPENOTP_DEFAULT_LOGIN_TEXT, &_rgFieldStrings[SFI_OTP_LARGE_TEXT]);
 		//else
 		//{
-			wchar_t large_text[sizeof(_openotp_login_text)];
-
-			int size = MultiByteToWideChar(CP_ACP, 0, _openotp_login_text, -1, large_text, 0);
-			MultiByteToWideChar(CP_ACP, 0, _openotp_login_text, -1, large_text, size);
-
-			hr = SHStrDupW(large_text, &_rgFieldStrings[SFI_OTP_LARGE_TEXT]);
+			hr = SHStrDupW(_Widen(_config->loginText).c_str(), &_rgFieldStrings[SFI_OTP_LARGE_TEXT]);
 		//}
 
 		//hr = SHStrDupW(L"", &_rgFieldStrings[SFI_OTP_LARGE_TEXT]);
@@ -224,12 +206,17 @@ HRESULT COpenOTPCredential::Advise(
     }
     _pCredProvCredentialEvents = pcpce;
     _pCredProvCredentialEvents->AddRef();
+	_SetStatusEvents(_pCredProvCredentialEvents);
     return S_OK;
 }
 
 // LogonUI calls this to tell us to release the callback.
 HRESULT COpenOTPCredential::UnAdvise()
 {
+	// the request in progress has no tile to report to any more
+	_SetStatusEvents(NULL);
+	_auth_flow.Cancel();
+
     if (_pCredProvCredentialEvents)
     {
         _pCredProvCredentialEvents->Release();
@@ -248,6 +235,12 @@ HRESULT COpenOTPCredential::SetSelected(__out BOOL* pbAutoLogon)
 {
     *pbAutoLogon = FALSE;  
 
+	// Connect to the OpenOTP server in background while the user is typing,
+	// so that only the SOAP round trip is left when the form is submitted.
+	_openotp_prepared = false;
+	if (_OpenOTPInitialize())
+		_openotp_prepared = (openotp_prepare(NULL) != 0);
+
     return S_OK;
 }
 
@@ -314,8 +307,8 @@ HRESULT COpenOTPCredential::SetDeselected()
 	}
 
 	// DISABLE OPENOTP IN EVERY CASE
-	_openotp_is_challenge_request = false;
-	openotp_terminate(NULL);
+	_auth_flow.Reset();
+	_OpenOTPTerminate();
 
     return hr;
 }
@@ -438,6 +431,10 @@ HRESULT COpenOTPCredential::SetStringValue(
         PWSTR* ppwszStored = &_rgFieldStrings[dwFieldID];
         CoTaskMemFree(*ppwszStored);
         hr = SHStrDupW(pwz, ppwszStored);
+
+		// First keystroke: warm up the connection if not done on selection
+		if (!_openotp_prepared && _OpenOTPInitialize())
+			_openotp_prepared = (openotp_prepare(NULL) != 0);
     }
     else
     {
@@ -532,6 +529,8 @@ HRESULT COpenOTPCredential::GetSerialization(
 
 	HRESULT hrOpenOtp, hr = E_FAIL;
 	BOOL error = false;
+	COpenOTPAuthFlow::Result result;
+	bool challenge = (_auth_flow.GetState() == COpenOTPAuthFlow::STATE_CHALLENGE_REQUIRED);
 
 	INIT_ZERO_WCHAR(username, 64);
 	INIT_ZERO_WCHAR(domain, 64);
@@ -544,15 +543,10 @@ HRESULT COpenOTPCredential::GetSerialization(
 		_domain_name = _wcsdup(domain);
 	else
 	{
-		if ((!_domain_name || !_domain_name[0]) && _openotp_default_domain && _openotp_default_domain[0])
+		if ((!_domain_name || !_domain_name[0]) && !_config->defaultDomain.empty())
 		{
 			// ... _domain_name is not set (logon scenario is most likely NOT unlock) and a default domain exists, so we set it to the default openotp domain
-
-			// TODO: Preset arguments using a macro (even for the vice versa function) and NOT using a function
-			int size = MultiByteToWideChar(CP_ACP, 0, _openotp_default_domain, -1, domain, 0);
-			MultiByteToWideChar(CP_ACP, 0, _openotp_default_domain, -1, domain, size);
-
-			_domain_name = _wcsdup(domain);
+			_domain_name = _wcsdup(_Widen(_config->defaultDomain).c_str());
 		}
 
 		// ... _domain_name already set or no default domain, nothing to do
@@ -563,12 +557,12 @@ HRESULT COpenOTPCredential::GetSerialization(
 	_domain_name = _wcsdup(domain);
 	//*/
 
-	if (!_openotp_is_challenge_request)
+	if (!challenge)
 	{   
-		hrOpenOtp = _OpenOTPCheck(username, _domain_name, _rgFieldStrings[SFI_OTP_LDAP_PASS], _rgFieldStrings[SFI_OTP_PASS]);
+		hrOpenOtp = _OpenOTPCheck(username, _domain_name, _rgFieldStrings[SFI_OTP_LDAP_PASS], _rgFieldStrings[SFI_OTP_PASS], &result);
 	}
 	else
-		hrOpenOtp = _OpenOTPChallenge(_rgFieldStrings[SFI_OTP_CHALLENGE]);
+		hrOpenOtp = _OpenOTPChallenge(_rgFieldStrings[SFI_OTP_CHALLENGE], &result);
 
 	if (SUCCEEDED(hrOpenOtp)) 
 	{
@@ -576,19 +570,17 @@ HRESULT COpenOTPCredential::GetSerialization(
 		goto CleanUpAndReturn;
 	}
 
-	if (!_openotp_is_challenge_request) 
+	if (!challenge) 
 	{
 		if (hrOpenOtp == OOTP_CHALLENGE)
 		{
 			*pcpsiOptionalStatusIcon = CPSI_NONE;
 			*pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
 
-			_openotp_is_challenge_request = true;
-
 			wchar_t large_text[100], small_text[100];
-			MultiByteToWideChar(CP_ACP, 0, _openotp_login_response.message, -1, large_text, sizeof(large_text) / sizeof(large_text[0]));
+			MultiByteToWideChar(CP_ACP, 0, result.message.c_str(), -1, large_text, sizeof(large_text) / sizeof(large_text[0]));
 
-			swprintf_s(small_text, sizeof(small_text), OPENOTP_TIMEOUT_TEXT, _openotp_login_response.timeout);
+			swprintf_s(small_text, sizeof(small_text), OPENOTP_TIMEOUT_TEXT, result.timeout);
 
 			if (_cpus == CPUS_UNLOCK_WORKSTATION)
 				_SetFieldScenario(SCENARIO_UNLOCK_CHALLENGE, large_text, small_text);
@@ -601,8 +593,6 @@ HRESULT COpenOTPCredential::GetSerialization(
 		{
 			if (_pCredProvCredentialEvents)
 			{
-				// TODO: Show default fail message if .message is NULL
-
 				if (_cpus == CPUS_UNLOCK_WORKSTATION)
 					_SetFieldScenario(SCENARIO_UNLOCK_BASE/*, large_text, NULL*/);
 				else
@@ -616,10 +606,10 @@ HRESULT COpenOTPCredential::GetSerialization(
 				_pCredProvCredentialEvents->SetFieldString(this, SFI_OTP_CHALLENGE,    L"");
 			}
 
-			if (_openotp_login_response.message)
+			if (!result.message.empty())
 			{
 				wchar_t error_msg[100];
-				MultiByteToWideChar(CP_ACP, 0, _openotp_login_response.message, -1, error_msg, sizeof(error_msg) / sizeof(error_msg[0]));
+				MultiByteToWideChar(CP_ACP, 0, result.message.c_str(), -1, error_msg, sizeof(error_msg) / sizeof(error_msg[0]));
 
 				SHStrDupW(error_msg, ppwszOptionalStatusText);
 			}
@@ -631,20 +621,12 @@ HRESULT COpenOTPCredential::GetSerialization(
 			*pcpgsr = CPGSR_NO_CREDENTIAL_NOT_FINISHED;
 
 			error = true; 
-			//_ClearOpenOTPLoginReqRep(&_openotp_login_request, &_openotp_login_response);
 		}
 	}
 	else 
 	{
 		if (_pCredProvCredentialEvents)
 		{
-			wchar_t *large_text = NULL;
-			if (_openotp_challenge_response.message) 
-			{
-				int size = MultiByteToWideChar(CP_ACP, 0, _openotp_challenge_response.message, -1, large_text, 0);
-				MultiByteToWideChar(CP_ACP, 0, _openotp_challenge_response.message, -1, large_text, size);
-			}
-
 			if (_cpus == CPUS_UNLOCK_WORKSTATION)
 				_SetFieldScenario(SCENARIO_UNLOCK_BASE/*, large_text, NULL*/);
 			else
@@ -658,12 +640,10 @@ HRESULT COpenOTPCredential::GetSerialization(
 			_pCredProvCredentialEvents->SetFieldString(this, SFI_OTP_CHALLENGE,     L"");
 		}
 
-		_openotp_is_challenge_request = false;
-
-		if (_openotp_challenge_response.message)
+		if (!result.message.empty())
 		{
 			wchar_t error_msg[100];
-			MultiByteToWideChar(CP_ACP, 0, _openotp_challenge_response.message, -1, error_msg, sizeof(error_msg) / sizeof(error_msg[0]));
+			MultiByteToWideChar(CP_ACP, 0, result.message.c_str(), -1, error_msg, sizeof(error_msg) / sizeof(error_msg[0]));
 
 			SHStrDupW(error_msg, ppwszOptionalStatusText);
 		}
@@ -675,19 +655,15 @@ HRESULT COpenOTPCredential::GetSerialization(
 		*pcpgsr = CPGSR_NO_CREDENTIAL_FINISHED;
 
 		error = true;
-		//_ClearOpenOTPLoginReqRep(&_openotp_login_request, &_openotp_login_response);
-		//_ClearOpenOTPChallengeReqRep(NULL, &_openotp_challenge_response);
 	}
 
 CleanUpAndReturn:
 	ZERO(username);
 	ZERO(domain);
 
+	// back to a fresh login, also after a failed challenge
 	if (error)
-	{
-		_ClearOpenOTPLoginReqRep(&_openotp_login_request, &_openotp_login_response);
-		_ClearOpenOTPChallengeReqRep(NULL, &_openotp_challenge_response);
-	}
+		_auth_flow.Reset();
 
     //return hr;
 	return S_OK;
@@ -702,7 +678,7 @@ HRESULT COpenOTPCredential::_DoKerberosLogon(
 {
 	HRESULT hr;
 
-	WCHAR wsz[sizeof(_openotp_default_domain)];
+	WCHAR wsz[64];
     DWORD cch = ARRAYSIZE(wsz);
 	BOOL  bGetCompName = true;
 
@@ -761,54 +737,19 @@ HRESULT COpenOTPCredential::_DoKerberosLogon(
 	return hr;
 }
 
-int COpenOTPCredential::_GetFirstActiveIPAddress(
-	__out_opt char *ip_addr
-	)
-{
-	const int MAX_IP_LENGTH = 16; // Maximum length including trailing zero
-	WSAData wsaData;
-
-    if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
-        return 1;
-    }
-
-	char hostname[80];
-    if (gethostname(hostname, sizeof(hostname)) == SOCKET_ERROR) {
-        return 2;
-    }
-
-	struct hostent *phe = gethostbyname(hostname);
-
-    if (phe == 0) {
-        return 3;
-    }
-
-    //for (int i = 0; phe->h_addr_list[i] != 0; i++) {
-	if (phe->h_addr_list[0] != 0)
-	{
-        struct in_addr addr;
-        memcpy(&addr, phe->h_addr_list[0/*i*/], sizeof(struct in_addr));
-
-		//ip_addr = _strdup(inet_ntoa(addr));
-		strcpy_s(ip_addr, MAX_IP_LENGTH, inet_ntoa(addr));
-    }
-
-	return 0;
-}
-
 HRESULT COpenOTPCredential::_OpenOTPCheck(
 	__deref_in PWSTR user,
 	__deref_in PWSTR domain,
 	__deref_in PWSTR ldapPass, 
-	__deref_in PWSTR otpPass
+	__deref_in PWSTR otpPass,
+	__out COpenOTPAuthFlow::Result *result
 	)
 {
 	const int MAX_IP_LENGTH = 16;
 
 	HRESULT hr = E_FAIL;
 
-	openotp_login_rep_t *lrep = NULL;
-	openotp_login_req_t *lreq = NULL;
+	COpenOTPAuthFlow::Request request;
 
 	INIT_ZERO_CHAR(c_user, 64);
 	INIT_ZERO_CHAR(c_domain, 64);
@@ -816,137 +757,212 @@ HRESULT COpenOTPCredential::_OpenOTPCheck(
 	INIT_ZERO_CHAR(c_otpPass, 64);
 	INIT_ZERO_CHAR(c_ip_addr, MAX_IP_LENGTH);
 
-	//// INITIALIZE OPENOTP
-	if (!openotp_initialize(
-		(_openotp_server_url[0]    == NULL) ? NULL : _openotp_server_url, 
-		(_openotp_cert_file[0]     == NULL) ? NULL : _openotp_cert_file, 
-		(_openotp_cert_password[0] == NULL) ? NULL : _openotp_cert_password, 
-		(_openotp_ca_file[0]       == NULL) ? NULL : _openotp_ca_file, 
-		_openotp_soap_timeout, 
-		NULL)) goto CleanUpAndReturn;
+	//// INITIALIZE OPENOTP, with the settings of the moment
+	_config = COpenOTPConfig::Instance().Get();
+	if (!_OpenOTPInitialize()) goto CleanUpAndReturn;
 
 	_WideCharToChar(user, sizeof(c_user), c_user);
 	_WideCharToChar(domain, sizeof(c_domain), c_domain);
 	_WideCharToChar(ldapPass, sizeof(c_ldapPass), c_ldapPass);
 	_WideCharToChar(otpPass, sizeof(c_ldapPass), c_otpPass);
 
-	//// FORM REQUEST
-	_GetFirstActiveIPAddress(c_ip_addr);
+	//// FORM REQUEST, the source is the address the server sees the connection from
+	openotp_source_address(c_ip_addr, sizeof(c_ip_addr), NULL);
 
-	lreq = openotp_login_req_new();
-	lreq->username		= _strdup(c_user);
-	lreq->ldapPassword	= _strdup(c_ldapPass);
-	lreq->otpPassword	= _strdup(c_otpPass);
+	request.username		= c_user;
+	request.ldapPassword	= c_ldapPass;
+	request.otpPassword		= c_otpPass;
 
-	lreq->client	= _strdup(_openotp_client_id);
-	lreq->domain	= (c_domain[0]!=NULL) ? _strdup(c_domain) : _strdup(_openotp_default_domain);
-	lreq->settings	= _strdup(_openotp_user_settings);
+	request.client		= _config->clientId;
+	request.domain		= (c_domain[0]!=NULL) ? std::string(c_domain) : _config->defaultDomain;
+	request.settings	= _config->userSettings;
 
-	lreq->source    = _strdup(c_ip_addr);
+	request.source		= c_ip_addr;
+	request.priority	= _cpus == CPUS_UNLOCK_WORKSTATION ? OPENOTP_PRIORITY_UNLOCK : OPENOTP_PRIORITY_LOGON;
 
 	//// SEND REQUEST
-	lrep = openotp_login(lreq, NULL);
-
-	//// CHECK RESPONSE
-	if (!lrep)
+	if (_cpus == CPUS_UNLOCK_WORKSTATION)
+		_SetStatusIdle(WORKSTATION_LOCKED ? WORKSTATION_LOCKED : L"", CPFS_DISPLAY_IN_BOTH);
+	else
+		_SetStatusIdle(L"", CPFS_HIDDEN);
+	if (!_auth_flow.Login(request))
 		goto CleanUpAndReturn;
-
-	//// SAVING RESPONSE AND REQUEST FOR LATER REUSE
-	_openotp_login_request.client       = _strdup(lreq->client);
-	_openotp_login_request.domain       = _strdup(lreq->domain);
-	_openotp_login_request.ldapPassword = _strdup(lreq->ldapPassword);
-	_openotp_login_request.otpPassword  = _strdup(lreq->otpPassword);
-	_openotp_login_request.settings     = _strdup(lreq->settings);	
-	_openotp_login_request.username     = _strdup(lreq->username);
-	_openotp_login_request.source		= _strdup(lreq->source);
-
-	_openotp_login_response.code		= lrep->code;
-	_openotp_login_response.timeout		= lrep->timeout;
-	_openotp_login_response.data		= _strdup(lrep->data);
-	_openotp_login_response.message		= _strdup(lrep->message);
-	_openotp_login_response.session		= _strdup(lrep->session);
-
-	if (lrep->code == OPENOTP_FAILURE)
+	if (!_OpenOTPWait(result))
 		goto CleanUpAndReturn;
 
-	if (lrep->code == OPENOTP_CHALLENGE) {
+	//// CHECK RESPONSE
+	if (result->state == COpenOTPAuthFlow::STATE_CHALLENGE_REQUIRED) {
 		hr = OOTP_CHALLENGE;
 		goto CleanUpAndReturn;
 	}
 
-	// lrep->code == OPENOTP_SUCCESS
-	hr = S_OK;
+	if (result->state == COpenOTPAuthFlow::STATE_SUCCESS)
+		hr = S_OK;
 
 CleanUpAndReturn:
 	ZERO(c_user);
 	ZERO(c_domain);
-	ZERO(c_ldapPass);
-	ZERO(c_otpPass);
+	SecureZeroMemory(c_ldapPass, sizeof(c_ldapPass));
+	SecureZeroMemory(c_otpPass, sizeof(c_otpPass));
 	ZERO(c_ip_addr);
 
-	_ClearOpenOTPLoginReqRep(lreq, lrep);
-	openotp_terminate(NULL);
+	SecureZeroMemory(&request.ldapPassword[0], request.ldapPassword.size());
+	SecureZeroMemory(&request.otpPassword[0], request.otpPassword.size());
+
+	// Keep OpenOTP initialized and warm up the connection for the challenge request
+	if (hr == OOTP_CHALLENGE)
+		_openotp_prepared = (openotp_prepare(NULL) != 0);
+	else
+		_OpenOTPTerminate();
 
 	return hr;
 }
 
 HRESULT COpenOTPCredential::_OpenOTPChallenge(
-	__deref_in PWSTR challenge
+	__deref_in PWSTR challenge,
+	__out COpenOTPAuthFlow::Result *result
 	)
 {
 	HRESULT hr = E_FAIL;
 
-	openotp_challenge_rep_t *crep = NULL;
-	openotp_challenge_req_t *creq = NULL;
-
 	INIT_ZERO_CHAR(c_challenge, 64);
 
 	//// INITIALIZE OPENOTP
-	if (!openotp_initialize(
-		(_openotp_server_url[0]    == NULL) ? NULL : _openotp_server_url, 
-		(_openotp_cert_file[0]     == NULL) ? NULL : _openotp_cert_file, 
-		(_openotp_cert_password[0] == NULL) ? NULL : _openotp_cert_password, 
-		(_openotp_ca_file[0]       == NULL) ? NULL : _openotp_ca_file, 
-		_openotp_soap_timeout, 
-		NULL)) goto CleanUpAndReturn;
+	if (!_OpenOTPInitialize()) goto CleanUpAndReturn;
 
 	_WideCharToChar(challenge, sizeof(c_challenge), c_challenge);
 
-	//// FORM REQUEST
-	creq = openotp_challenge_req_new();
-    creq->otpPassword = _strdup(c_challenge);
+	//// SEND REQUEST, the session of the login is kept by the flow
+	_SetStatusIdle(L"", CPFS_HIDDEN);
+	if (!_auth_flow.Challenge(c_challenge, _cpus == CPUS_UNLOCK_WORKSTATION ? OPENOTP_PRIORITY_UNLOCK : OPENOTP_PRIORITY_LOGON))
+		goto CleanUpAndReturn;
+	if (!_OpenOTPWait(result))
+		goto CleanUpAndReturn;
+
+	//// CHECK RESPONSE
+	if (result->state == COpenOTPAuthFlow::STATE_SUCCESS)
+		hr = S_OK;
 
-	creq->session  = _strdup(_openotp_login_response.session);
-	creq->username = _strdup(_openotp_login_request.username);
-	if (_openotp_login_request.domain) creq->domain = _strdup(_openotp_login_request.domain);
-	//if (_openotp_login_request.client) creq->client = _strdup(_openotp_login_request.client);
+CleanUpAndReturn:
+	SecureZeroMemory(c_challenge, sizeof(c_challenge));
 
-	//// SEND REQUEST
-	crep = openotp_challenge(creq, NULL);
+	_OpenOTPTerminate();
 
-	//// CHECK RESPONSE
-	if (!crep) goto CleanUpAndReturn;
+	return hr;
+}
 
-	//// SAVING RESPONSE FOR LATER REUSE
-	_openotp_challenge_response.code    = crep->code;
-	_openotp_challenge_response.data	= _strdup(crep->data);
-	_openotp_challenge_response.message	= _strdup(crep->message);
+BOOL COpenOTPCredential::_OpenOTPInitialize()
+{
+	COpenOTPConfig::Ptr config = COpenOTPConfig::Instance().Get();
 
-	if (crep->code == OPENOTP_FAILURE)
-		goto CleanUpAndReturn;
+	// the warm connection is kept as long as the server settings are
+	if (_openotp_initialized && config->SameConnection(*_openotp_config))
+		return TRUE;
 
-	if (crep->code == OPENOTP_SUCCESS)
-		hr = S_OK;
+	// a cancelled request still uses the library, the new settings are
+	// taken by the next request
+	_OpenOTPTerminate();
+	if (_openotp_initialized)
+		return TRUE;
 
-CleanUpAndReturn:
-	//openotp_challenge_req_free(creq);
-	//openotp_challenge_rep_free(crep);
-	ZERO(c_challenge);
+	strncpy_s(_openotp_server_url_runtime, sizeof(_openotp_server_url_runtime), config->serverUrl.c_str(), _TRUNCATE);
+
+	// optional, lets LogonUI processes resume the TLS session of the previous one
+	if (!config->cacheFile.empty())
+		openotp_cache_open((char *)config->cacheFile.c_str(), NULL);
+
+	// the library keeps the file names and the password, _openotp_config
+	// keeps them alive
+	if (!openotp_initialize(
+		(_openotp_server_url_runtime[0] == NULL) ? NULL : _openotp_server_url_runtime, 
+		config->certFile.empty()     ? NULL : (char *)config->certFile.c_str(), 
+		config->certPassword.empty() ? NULL : (char *)config->certPassword.c_str(), 
+		config->caFile.empty()       ? NULL : (char *)config->caFile.c_str(), 
+		config->soapTimeout, 
+		NULL)) return FALSE;
+
+	_openotp_config = config;
+	_openotp_initialized = true;
+	return TRUE;
+}
+
+void COpenOTPCredential::_OpenOTPTerminate()
+{
+	_openotp_prepared = false;
+
+	// a cancelled request still uses the library, the next logon reuses it
+	if (!_openotp_initialized || _auth_flow.Running())
+		return;
 
-	_ClearOpenOTPChallengeReqRep(creq, crep);	
 	openotp_terminate(NULL);
+	_openotp_config.reset();
+	_openotp_initialized = false;
+}
 
-	return hr;
+BOOL COpenOTPCredential::_OpenOTPWait(
+	__out COpenOTPAuthFlow::Result *result
+	)
+{
+	int timeout = _openotp_config && _openotp_config->soapTimeout > 0 ? _openotp_config->soapTimeout : OPENOTP_DEFAULT_SOAP_TIMEOUT;
+
+	if (_auth_flow.Wait(result, timeout * 2000 + OPENOTP_WAIT_MARGIN))
+		return TRUE;
+
+	// the library did not give up in time, the tile does
+	_auth_flow.Cancel();
+	_auth_flow.Wait(result);
+	return FALSE;
+}
+
+// Listener of the flow: shows the progress of the request in the status
+// field of the tile, and what the field showed before once it ends.
+void COpenOTPCredential::_OnFlowEvent(
+	__in std::shared_ptr<Status> status,
+	__in COpenOTPAuthFlow::Event event
+	)
+{
+	std::lock_guard<std::mutex> guard(status->lock);
+	PCWSTR text = status->idleText.c_str();
+	CREDENTIAL_PROVIDER_FIELD_STATE state = status->idleState;
+
+	if (!status->events)
+		return;
+
+	switch (event)
+	{
+	case COpenOTPAuthFlow::EVENT_CONNECTING:
+		text = OPENOTP_CONNECTING_TEXT;
+		state = CPFS_DISPLAY_IN_SELECTED_TILE;
+		break;
+	case COpenOTPAuthFlow::EVENT_WAITING_APPROVAL:
+		text = OPENOTP_APPROVAL_TEXT;
+		state = CPFS_DISPLAY_IN_SELECTED_TILE;
+		break;
+	default:
+		break;
+	}
+
+	status->events->SetFieldString(status->credential, SFI_OTP_SMALL_TEXT, text);
+	status->events->SetFieldState(status->credential, SFI_OTP_SMALL_TEXT, state);
+}
+
+void COpenOTPCredential::_SetStatusEvents(
+	__in_opt ICredentialProviderCredentialEvents *events
+	)
+{
+	// waits for a listener call in progress
+	std::lock_guard<std::mutex> guard(_status->lock);
+	_status->events = events;
+}
+
+void COpenOTPCredential::_SetStatusIdle(
+	__in PCWSTR text,
+	__in CREDENTIAL_PROVIDER_FIELD_STATE state
+	)
+{
+	std::lock_guard<std::mutex> guard(_status->lock);
+	_status->idleText = text;
+	_status->idleState = state;
 }
 
 void COpenOTPCredential::_SeparateUserAndDomainName(
@@ -980,90 +996,6 @@ void COpenOTPCredential::_SeparateUserAndDomainName(
 	}
 }
 
-void COpenOTPCredential::_ClearOpenOTPChallengeReqRep(
-		__out_opt openotp_challenge_req_t *creq,
-		__out_opt openotp_challenge_rep_t *crep
-		)
-{
-	if (creq)
-	{
-		/*
-		if (creq->client)
-			for(int i=0;creq->client[i]!=NULL;i++)
-				creq->client[i] = NULL;
-		*/
-		if (creq->domain)
-			for(int i=0;creq->domain[i]!=NULL;i++)
-				creq->domain[i] = NULL;
-		if (creq->otpPassword)
-			for(int i=0;creq->otpPassword[i]!=NULL;i++)
-				creq->otpPassword[i] = NULL;
-		if (creq->session)
-			for(int i=0;creq->session[i]!=NULL;i++)
-				creq->session[i] = NULL;
-		if (creq->username)
-			for(int i=0;creq->username[i]!=NULL;i++)
-				creq->username[i] = NULL;
-	}
-
-	if (crep)
-	{
-		crep->code = 0;
-		if (crep->data)
-			for(int i=0;crep->data[i]!=NULL;i++)
-				crep->data[i] = NULL;
-		if (crep->message)
-			for(int i=0;crep->message[i]!=NULL;i++)
-				crep->message[i] = NULL;
-	}
-}
-
-void COpenOTPCredential::_ClearOpenOTPLoginReqRep(
-		__out_opt openotp_login_req_t *lreq,
-		__out_opt openotp_login_rep_t *lrep
-		)
-{
-	if (lreq)
-	{
-		if (lreq->client)
-			for(int i=0;lreq->client[i]!=NULL;i++)
-				lreq->client[i] = NULL;
-		if (lreq->domain)
-			for(int i=0;lreq->domain[i]!=NULL;i++)
-				lreq->domain[i] = NULL;
-		if (lreq->ldapPassword)
-			for(int i=0;lreq->ldapPassword[i]!=NULL;i++)
-				lreq->ldapPassword[i] = NULL;
-		if (lreq->otpPassword)
-			for(int i=0;lreq->otpPassword[i]!=NULL;i++)
-				lreq->otpPassword[i] = NULL;
-		if (lreq->settings)
-			for(int i=0;lreq->settings[i]!=NULL;i++)
-				lreq->settings[i] = NULL;
-		if (lreq->source)
-			for(int i=0;lreq->source[i]!=NULL;i++)
-				lreq->source[i] = NULL;
-		if (lreq->username)
-			for(int i=0;lreq->username[i]!=NULL;i++)
-				lreq->username[i] = NULL;
-	}
-
-	if (lrep)
-	{
-		lrep->code = 0;
-		lrep->timeout = 0;
-		if (lrep->data)
-			for(int i=0;lrep->data[i]!=NULL;i++)
-				lrep->data[i] = NULL;
-		if (lrep->message)
-			for(int i=0;lrep->message[i]!=NULL;i++)
-				lrep->message[i] = NULL;
-		if (lrep->session)
-			for(int i=0;lrep->session[i]!=NULL;i++)
-				lrep->session[i] = NULL;
-	}
-}
-
 void COpenOTPCredential::_SetFieldScenario(
 	__in FIELD_SCENARIO scenario
 	)
@@ -1128,12 +1060,7 @@ void COpenOTPCredential::_SetFieldScenario(
 		_pCredProvCredentialEvents->SetFieldString(this, SFI_OTP_LARGE_TEXT, large_text);
 	else
 	{
-		wchar_t text[sizeof(_openotp_login_text)];
-
-		int size = MultiByteToWideChar(CP_ACP, 0, _openotp_login_text, -1, text, 0);
-		MultiByteToWideChar(CP_ACP, 0, _openotp_login_text, -1, text, size);
-
-		_pCredProvCredentialEvents->SetFieldString(this, SFI_OTP_LARGE_TEXT, text);
+		_pCredProvCredentialEvents->SetFieldString(this, SFI_OTP_LARGE_TEXT, _Widen(_config->loginText).c_str());
 	}
 
 	if (small_text)
@@ -24,7 +24,12 @@
 #include "resource.h"
 
 #include <openotp.h>
-#include "registry.h"
+#include "COpenOTPAuthFlow.h"
+#include "COpenOTPConfig.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
 
 //#include "CMultiOneTimePassword.h"
 
@@ -32,8 +37,14 @@
 #define OOTP_FAILURE	((HRESULT)0x88809002)
 #define OOTP_SUCCESS	((HRESULT)0x88809101)
 
-#define OPENOTP_DEFAULT_LOGIN_TEXT "OpenOTP Login"
 #define OPENOTP_TIMEOUT_TEXT L"Timeout: %i secs."
+#define OPENOTP_CONNECTING_TEXT L"Contacting the OpenOTP server..."
+#define OPENOTP_APPROVAL_TEXT L"Waiting for your approval on your mobile..."
+
+// a request is given up after the SOAP timeout on each of the two servers
+// and this margin for the connections (milliseconds)
+#define OPENOTP_DEFAULT_SOAP_TIMEOUT	10
+#define OPENOTP_WAIT_MARGIN				5000
 #define WORKSTATION_LOCKED _user_name
 
 enum FIELD_SCENARIO
@@ -135,16 +146,6 @@ class COpenOTPCredential : public ICredentialProviderCredential
 		__in FIELD_SCENARIO scenario
 		);
 
-	void COpenOTPCredential::_ClearOpenOTPChallengeReqRep(
-		__in openotp_challenge_req_t *creq,
-		__in openotp_challenge_rep_t *crep
-		);
-
-	void COpenOTPCredential::_ClearOpenOTPLoginReqRep(
-		__out_opt openotp_login_req_t *lreq,
-		__out_opt openotp_login_rep_t *lrep
-		);
-
 	void COpenOTPCredential::_SeparateUserAndDomainName(
 		__in wchar_t *domain_slash_username,
 		__out wchar_t *username,
@@ -153,10 +154,6 @@ class COpenOTPCredential : public ICredentialProviderCredential
 		__in_opt int sizeDomain
 		);
 
-	int COpenOTPCredential::_GetFirstActiveIPAddress(
-		__deref_out_opt char *ip_addr
-		);
-
   private:
     LONG                                  _cRef;
 
@@ -180,29 +177,61 @@ class COpenOTPCredential : public ICredentialProviderCredential
 		__deref_in PWSTR user, 
 		__deref_in PWSTR domain, 
 		__deref_in PWSTR ldapPass, 
-		__deref_in PWSTR otpPass
+		__deref_in PWSTR otpPass,
+		__out COpenOTPAuthFlow::Result *result
 	);
 
 	HRESULT COpenOTPCredential::_OpenOTPChallenge(
-		__deref_in PWSTR challenge
+		__deref_in PWSTR challenge,
+		__out COpenOTPAuthFlow::Result *result
 	);
 
-	openotp_login_req_t					 _openotp_login_request;
-	openotp_login_rep_t					 _openotp_login_response;
+	BOOL COpenOTPCredential::_OpenOTPInitialize();
+
+	void COpenOTPCredential::_OpenOTPTerminate();
+
+	BOOL COpenOTPCredential::_OpenOTPWait(
+		__out COpenOTPAuthFlow::Result *result
+	);
+
+	// login -> challenge state, the credential only maps it to the tile
+	COpenOTPAuthFlow					 _auth_flow;
+
+	// status field of the tile, updated by the listener of the flow; shared
+	// with the request threads, which may outlive the tile after a cancellation
+	struct Status
+	{
+		std::mutex lock;
+		ICredentialProviderCredential *credential;
+		ICredentialProviderCredentialEvents *events;	// NULL once unadvised
+		std::wstring idleText;							// shown again when the request ends
+		CREDENTIAL_PROVIDER_FIELD_STATE idleState;
+	};
+	std::shared_ptr<Status>				 _status;
+
+	static void COpenOTPCredential::_OnFlowEvent(
+		__in std::shared_ptr<Status> status,
+		__in COpenOTPAuthFlow::Event event
+	);
+
+	void COpenOTPCredential::_SetStatusEvents(
+		__in_opt ICredentialProviderCredentialEvents *events
+	);
+
+	void COpenOTPCredential::_SetStatusIdle(
+		__in PCWSTR text,
+		__in CREDENTIAL_PROVIDER_FIELD_STATE state
+	);
 
-	bool								 _openotp_is_challenge_request;
-	openotp_challenge_rep_t				 _openotp_challenge_response;	
+	bool								 _openotp_initialized;
+	bool								 _openotp_prepared;
 
-	char								 _openotp_server_url[1024];
-	char								 _openotp_cert_file[512];
-	char								 _openotp_cert_password[64];
-	char								 _openotp_ca_file[512];
-	char								 _openotp_client_id[64];
-	char								 _openotp_default_domain[64];
-	char								 _openotp_user_settings[1024];
-	char								 _openotp_login_text[64];
+	// settings of the tile, taken again for each request
+	COpenOTPConfig::Ptr					 _config;
+	// settings the library was initialized with
+	COpenOTPConfig::Ptr					 _openotp_config;
 
-	int									 _openotp_soap_timeout;	
+	char								 _openotp_server_url_runtime[1024]; // openotp_initialize() splits the URL list in place
 
 	// END OpenOTP
 
@@ -33,6 +33,9 @@ COpenOTPProvider::COpenOTPProvider():
     DllAddRef();
 
     ZeroMemory(_rgpCredentials, sizeof(_rgpCredentials));
+
+	// follow the changes of the OpenOTP config while LogonUI shows the tiles
+	COpenOTPConfig::Instance().Watch();
 }
 
 COpenOTPProvider::~COpenOTPProvider()
@@ -52,6 +55,8 @@ COpenOTPProvider::~COpenOTPProvider()
         _rgpCredentials[0]->Release();
     }
 
+	COpenOTPConfig::Instance().Unwatch();
+
     DllRelease();
 }
 
@@ -20,7 +20,8 @@ enum CONF_VALUE
 	CONF_CA_FILE			= 6,
 	CONF_LOGIN_TEXT			= 7,
 	CONF_SOAP_TIMEOUT		= 8,
-	CONF_NUM_VALUES			= 9,
+	CONF_CACHE_FILE			= 9,
+	CONF_NUM_VALUES			= 10,
 };
 
 static const PWSTR s_CONF_VALUES[] =
@@ -34,6 +35,7 @@ static const PWSTR s_CONF_VALUES[] =
 	L"ca_file",
 	L"login_text",
 	L"soap_timeout",
+	L"cache_file",
 };
 
 DWORD readRegistryValueString( __in int conf_value, __in int buffer_size, __deref_out_opt char* data );
@@ -0,0 +1,682 @@
+/*
+ RCDevs OpenOTP Development Library
+ Copyright (c) 2010-2013 RCDevs SA, All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#if !defined(WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	// struct ucred
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "broker.h"
+#include "endpoint.h"
+#include "nanohttp/nanohttp-thread.h"
+#include "nanohttp/nanohttp-socket.h"
+#include "nanohttp/nanohttp-logging.h"
+
+#ifndef WIN32
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define BROKER_CLIENTS_MAX 64
+
+typedef struct broker_buf_t {
+   unsigned char *data;
+   unsigned int length;   // bytes used (writer) or available (reader)
+   unsigned int pos;      // read position
+   int error;             // set by an overflow or a short frame
+} broker_buf_t;
+
+static void broker_put_int(broker_buf_t *buf, unsigned int value) {
+   if (buf->length + 4 > BROKER_FRAME_MAX) {
+      buf->error = 1;
+      return;
+   }
+   buf->data[buf->length++] = value >> 24;
+   buf->data[buf->length++] = value >> 16;
+   buf->data[buf->length++] = value >> 8;
+   buf->data[buf->length++] = value;
+}
+
+static void broker_put_str(broker_buf_t *buf, const char *value) {
+   unsigned int len;
+   
+   if (value == NULL) {
+      broker_put_int(buf, BROKER_NULL);
+      return;
+   }
+   len = strlen(value);
+   broker_put_int(buf, len);
+   if (buf->error || buf->length + len > BROKER_FRAME_MAX) {
+      buf->error = 1;
+      return;
+   }
+   memcpy(buf->data + buf->length, value, len);
+   buf->length += len;
+}
+
+static unsigned int broker_get_int(broker_buf_t *buf) {
+   unsigned char *ptr;
+   
+   if (buf->error || buf->pos + 4 > buf->length) {
+      buf->error = 1;
+      return 0;
+   }
+   ptr = buf->data + buf->pos;
+   buf->pos += 4;
+   return ((unsigned int)ptr[0] << 24) | ((unsigned int)ptr[1] << 16) | ((unsigned int)ptr[2] << 8) | ptr[3];
+}
+
+static char *broker_get_str(broker_buf_t *buf) {
+   unsigned int len = broker_get_int(buf);
+   char *value;
+   
+   if (buf->error || len == BROKER_NULL) return NULL;
+   if (len > buf->length - buf->pos || (value = malloc(len + 1)) == NULL) {
+      buf->error = 1;
+      return NULL;
+   }
+   memcpy(value, buf->data + buf->pos, len);
+   value[len] = 0;
+   buf->pos += len;
+   return value;
+}
+
+// frames carry passwords, they are wiped before being released
+static void broker_buf_free(broker_buf_t *buf) {
+   if (buf->data == NULL) return;
+   memset(buf->data, 0, BROKER_FRAME_MAX);
+   free(buf->data);
+   buf->data = NULL;
+}
+
+static int broker_buf_init(broker_buf_t *buf) {
+   buf->data = malloc(BROKER_FRAME_MAX);
+   buf->length = 0;
+   buf->pos = 0;
+   buf->error = 0;
+   return buf->data != NULL;
+}
+
+static int broker_write_all(int sock, const unsigned char *data, unsigned int length) {
+   ssize_t n;
+   
+   while (length > 0) {
+      n = send(sock, data, length, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return 0;
+      data += n;
+      length -= n;
+   }
+   return 1;
+}
+
+static int broker_read_all(int sock, unsigned char *data, unsigned int length) {
+   ssize_t n;
+   
+   while (length > 0) {
+      n = recv(sock, data, length, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return 0;
+      data += n;
+      length -= n;
+   }
+   return 1;
+}
+
+static int broker_send(int sock, int type, broker_buf_t *buf) {
+   unsigned char header[5];
+   unsigned int length = buf->length + 1;
+   
+   header[0] = length >> 24;
+   header[1] = length >> 16;
+   header[2] = length >> 8;
+   header[3] = length;
+   header[4] = type;
+   return broker_write_all(sock, header, 5) && broker_write_all(sock, buf->data, buf->length);
+}
+
+// reads one frame into buf and returns its type, or -1
+static int broker_receive(int sock, broker_buf_t *buf) {
+   unsigned char header[5];
+   unsigned int length;
+   
+   if (!broker_read_all(sock, header, 5)) return -1;
+   length = ((unsigned int)header[0] << 24) | ((unsigned int)header[1] << 16) | ((unsigned int)header[2] << 8) | header[3];
+   if (length < 1 || length - 1 > BROKER_FRAME_MAX) return -1;
+   buf->length = length - 1;
+   buf->pos = 0;
+   buf->error = 0;
+   if (!broker_read_all(sock, buf->data, buf->length)) return -1;
+   return header[4];
+}
+
+static int broker_address(const char *path, struct sockaddr_un *addr) {
+   if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   strcpy(addr->sun_path, path);
+   return 1;
+}
+
+// Client side
+
+// Sends the request in buf and replaces it with the reply. Returns 1 if the
+// broker answered with the expected reply type, logging its error otherwise.
+static int broker_call(const char *path, int type, broker_buf_t *buf, void(*log_handler)()) {
+   struct sockaddr_un addr;
+   struct timeval tv;
+   char *message;
+   int sock, reply, ready;
+   
+   if (buf->error) {
+      if (log_handler != NULL) (*log_handler)("broker request too large");
+      return 0;
+   }
+   if (!broker_address(path, &addr)) {
+      if (log_handler != NULL) (*log_handler)("broker socket path too long");
+      return 0;
+   }
+   if (hsocket_cancelled()) {
+      if (log_handler != NULL) (*log_handler)("broker request cancelled");
+      return 0;
+   }
+   
+   if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      if (log_handler != NULL) (*log_handler)("cannot create broker socket");
+      return 0;
+   }
+   tv.tv_sec = BROKER_TIMEOUT;
+   tv.tv_usec = 0;
+   setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+   
+   if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      if (log_handler != NULL) (*log_handler)("cannot connect to the broker");
+      close(sock);
+      return 0;
+   }
+   
+   reply = -1;
+   ready = 0;
+   if (broker_send(sock, type, buf)) {
+      // the reply takes a server round trip, which a cancellation cuts short;
+      // closing the connection cancels the request in the broker as well
+      while ((ready = hsocket_wait(sock, 0, BROKER_TIMEOUT * 1000)) == -1 && errno == EINTR);
+      if (ready > 0) reply = broker_receive(sock, buf);
+   }
+   close(sock);
+   
+   if (reply == (type | BROKER_REPLY)) return 1;
+   if (ready == HSOCKET_CANCELLED) {
+      if (log_handler != NULL) (*log_handler)("broker request cancelled");
+      return 0;
+   }
+   if (reply == BROKER_ERROR) {
+      message = broker_get_str(buf);
+      if (log_handler != NULL) (*log_handler)(message != NULL ? message : "broker request failed");
+      if (message != NULL) free(message);
+   }
+   else if (log_handler != NULL) (*log_handler)("no reply from the broker");
+   return 0;
+}
+
+// the broker queues the request with the class and deadline of the caller
+static void broker_put_priority(broker_buf_t *buf) {
+   int priority, timeout;
+   
+   endpoint_get_priority(&priority, &timeout);
+   broker_put_int(buf, priority);
+   broker_put_int(buf, timeout);
+}
+
+openotp_login_rep_t *broker_login(const char *path, int type, void *request, void(*log_handler)()) {
+   openotp_login_rep_t *response = NULL;
+   broker_buf_t buf;
+   
+   if (!broker_buf_init(&buf)) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      return NULL;
+   }
+   
+   broker_put_int(&buf, type);
+   if (type == OPENOTP_SIMPLE_LOGIN) {
+      openotp_simple_login_req_t *req = request;
+      broker_put_str(&buf, req->username);
+      broker_put_str(&buf, req->domain);
+      broker_put_str(&buf, req->anyPassword);
+      broker_put_str(&buf, req->client);
+      broker_put_str(&buf, req->source);
+      broker_put_str(&buf, req->settings);
+   } else {
+      openotp_normal_login_req_t *req = request;
+      broker_put_str(&buf, req->username);
+      broker_put_str(&buf, req->domain);
+      broker_put_str(&buf, req->ldapPassword);
+      broker_put_str(&buf, req->otpPassword);
+      broker_put_str(&buf, req->client);
+      broker_put_str(&buf, req->source);
+      broker_put_str(&buf, req->settings);
+   }
+   broker_put_priority(&buf);
+   
+   if (!broker_call(path, BROKER_LOGIN, &buf, log_handler)) goto error;
+   
+   response = malloc(sizeof(openotp_login_rep_t));
+   if (response == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   response->code = broker_get_int(&buf);
+   response->message = broker_get_str(&buf);
+   response->session = broker_get_str(&buf);
+   response->data = broker_get_str(&buf);
+   response->timeout = broker_get_int(&buf);
+   if (buf.error) {
+      if (log_handler != NULL) (*log_handler)("invalid broker reply");
+      goto error;
+   }
+   
+   broker_buf_free(&buf);
+   return response;
+   
+   error:
+   broker_buf_free(&buf);
+   if (response != NULL) openotp_login_rep_free(response);
+   return NULL;
+}
+
+openotp_challenge_rep_t *broker_challenge(const char *path, openotp_challenge_req_t *request, void(*log_handler)()) {
+   openotp_challenge_rep_t *response = NULL;
+   broker_buf_t buf;
+   
+   if (!broker_buf_init(&buf)) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      return NULL;
+   }
+   
+   broker_put_str(&buf, request->username);
+   broker_put_str(&buf, request->domain);
+   broker_put_str(&buf, request->session);
+   broker_put_str(&buf, request->otpPassword);
+   broker_put_priority(&buf);
+   
+   if (!broker_call(path, BROKER_CHALLENGE, &buf, log_handler)) goto error;
+   
+   response = malloc(sizeof(openotp_challenge_rep_t));
+   if (response == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   response->code = broker_get_int(&buf);
+   response->message = broker_get_str(&buf);
+   response->data = broker_get_str(&buf);
+   if (buf.error) {
+      if (log_handler != NULL) (*log_handler)("invalid broker reply");
+      goto error;
+   }
+   
+   broker_buf_free(&buf);
+   return response;
+   
+   error:
+   broker_buf_free(&buf);
+   if (response != NULL) openotp_challenge_rep_free(response);
+   return NULL;
+}
+
+openotp_status_rep_t *broker_status(const char *path, void(*log_handler)()) {
+   openotp_status_rep_t *response = NULL;
+   broker_buf_t buf;
+   
+   if (!broker_buf_init(&buf)) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      return NULL;
+   }
+   
+   if (!broker_call(path, BROKER_STATUS, &buf, log_handler)) goto error;
+   
+   response = malloc(sizeof(openotp_status_rep_t));
+   if (response == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   response->status = broker_get_int(&buf);
+   response->message = broker_get_str(&buf);
+   if (buf.error) {
+      if (log_handler != NULL) (*log_handler)("invalid broker reply");
+      goto error;
+   }
+   
+   broker_buf_free(&buf);
+   return response;
+   
+   error:
+   broker_buf_free(&buf);
+   if (response != NULL) openotp_status_rep_free(response);
+   return NULL;
+}
+
+// Server side
+
+static volatile long broker_run = 0;
+static volatile long broker_clients = 0;
+static void(*broker_log_handler)() = NULL;
+
+// Requests in progress, watched by the accept loop: a client which hangs up
+// while its request is sent to the server cancels it (see broker_watch_check).
+typedef struct broker_watch_t {
+   int sock;
+   hcancel_t *cancel;     // NULL for a free slot
+   int busy;              // the client sent data, do not watch it anymore
+} broker_watch_t;
+
+static broker_watch_t broker_watches[BROKER_CLIENTS_MAX];
+static hmutex_t broker_watch_lock = HMUTEX_INITIALIZER;
+
+static void broker_watch(int sock, hcancel_t *cancel, int on) {
+   int i;
+   
+   hmutex_lock(&broker_watch_lock);
+   for (i = 0; i < BROKER_CLIENTS_MAX; i++) {
+      if (on && broker_watches[i].cancel == NULL) {
+	 broker_watches[i].sock = sock;
+	 broker_watches[i].cancel = cancel;
+	 broker_watches[i].busy = 0;
+	 break;
+      }
+      if (!on && broker_watches[i].cancel == cancel) {
+	 broker_watches[i].cancel = NULL;
+	 break;
+      }
+   }
+   hmutex_unlock(&broker_watch_lock);
+}
+
+// adds the watched clients to fds and returns the highest socket
+static int broker_watch_fds(fd_set *fds, int max) {
+   int i;
+   
+   hmutex_lock(&broker_watch_lock);
+   for (i = 0; i < BROKER_CLIENTS_MAX; i++) {
+      if (broker_watches[i].cancel == NULL || broker_watches[i].busy) continue;
+      FD_SET(broker_watches[i].sock, fds);
+      if (broker_watches[i].sock > max) max = broker_watches[i].sock;
+   }
+   hmutex_unlock(&broker_watch_lock);
+   return max;
+}
+
+// a client waits for its reply without writing: a readable socket is a hang up
+static void broker_watch_check(fd_set *fds) {
+   char ch;
+   int i;
+   
+   hmutex_lock(&broker_watch_lock);
+   for (i = 0; i < BROKER_CLIENTS_MAX; i++) {
+      if (broker_watches[i].cancel == NULL || broker_watches[i].busy || !FD_ISSET(broker_watches[i].sock, fds)) continue;
+      if (recv(broker_watches[i].sock, &ch, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+	 log_verbose2("Broker client %d gone, cancelling its request", broker_watches[i].sock);
+	 hcancel_trigger(broker_watches[i].cancel);
+      }
+      broker_watches[i].busy = 1;
+   }
+   hmutex_unlock(&broker_watch_lock);
+}
+
+// the log handler has no context, so the last error of each worker is
+// kept in a thread local buffer and sent back with BROKER_ERROR
+static HTHREAD_LOCAL char broker_error[256];
+
+static void broker_capture(char *message) {
+   strncpy(broker_error, message, sizeof(broker_error) - 1);
+   broker_error[sizeof(broker_error) - 1] = 0;
+   if (broker_log_handler != NULL) (*broker_log_handler)(message);
+}
+
+static void broker_free_strings(char **strings, int count) {
+   int i;
+   
+   for (i = 0; i < count; i++) {
+      if (strings[i] == NULL) continue;
+      memset(strings[i], 0, strlen(strings[i]));
+      free(strings[i]);
+   }
+}
+
+// root and the broker account may pass the source address of a login;
+// for the other clients of the group it could be forged to match a policy
+static int broker_trusted(int sock) {
+   struct ucred cred;
+   socklen_t length = sizeof(cred);
+   
+   if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) return 0;
+   return cred.uid == 0 || cred.uid == geteuid();
+}
+
+// decodes the request in buf, runs it and encodes the reply in its place
+static int broker_dispatch(int type, broker_buf_t *buf, int trusted) {
+   char *fields[7] = { NULL };
+   int count = 0, login_type = 0, priority = ENDPOINT_PRIORITY_LOGON, timeout = 0, i;
+   
+   broker_error[0] = 0;
+   if (type == BROKER_LOGIN) {
+      login_type = broker_get_int(buf);
+      count = login_type == OPENOTP_SIMPLE_LOGIN ? 6 : 7;
+   }
+   else if (type == BROKER_CHALLENGE) count = 4;
+   else if (type != BROKER_STATUS) {
+      strcpy(broker_error, "unknown broker request");
+      goto error;
+   }
+   for (i = 0; i < count; i++) fields[i] = broker_get_str(buf);
+   // optional, older clients do not send them
+   if (type != BROKER_STATUS && buf->pos < buf->length) {
+      priority = broker_get_int(buf);
+      timeout = broker_get_int(buf);
+   }
+   if (buf->error || buf->pos != buf->length || (type == BROKER_LOGIN && login_type != OPENOTP_SIMPLE_LOGIN && login_type != OPENOTP_NORMAL_LOGIN && login_type != OPENOTP_COMPAT_LOGIN)) {
+      strcpy(broker_error, "invalid broker request");
+      goto error;
+   }
+   if (type == BROKER_LOGIN && !trusted && fields[login_type == OPENOTP_SIMPLE_LOGIN ? 4 : 5] != NULL) {
+      strcpy(broker_error, "source not allowed for this broker client");
+      goto error;
+   }
+   
+   buf->length = 0;
+   endpoint_set_priority(priority, timeout);
+   if (type == BROKER_LOGIN) {
+      openotp_simple_login_req_t simple = { fields[0], fields[1], fields[2], fields[3], fields[4], fields[5] };
+      openotp_normal_login_req_t normal = { fields[0], fields[1], fields[2], fields[3], fields[4], fields[5], fields[6] };
+      openotp_login_rep_t *rep;
+      
+      rep = openotp_login_wrapper(login_type, login_type == OPENOTP_SIMPLE_LOGIN ? (void*)&simple : (void*)&normal, broker_capture);
+      if (rep == NULL) goto error;
+      broker_put_int(buf, rep->code);
+      broker_put_str(buf, rep->message);
+      broker_put_str(buf, rep->session);
+      broker_put_str(buf, rep->data);
+      broker_put_int(buf, rep->timeout);
+      openotp_login_rep_free(rep);
+   }
+   else if (type == BROKER_CHALLENGE) {
+      openotp_challenge_req_t req = { fields[0], fields[1], fields[2], fields[3] };
+      openotp_challenge_rep_t *rep;
+      
+      rep = openotp_challenge(&req, broker_capture);
+      if (rep == NULL) goto error;
+      broker_put_int(buf, rep->code);
+      broker_put_str(buf, rep->message);
+      broker_put_str(buf, rep->data);
+      openotp_challenge_rep_free(rep);
+   }
+   else {
+      openotp_status_rep_t *rep;
+      
+      rep = openotp_status(broker_capture);
+      if (rep == NULL) goto error;
+      broker_put_int(buf, rep->status);
+      broker_put_str(buf, rep->message);
+      openotp_status_rep_free(rep);
+   }
+   
+   endpoint_set_priority(ENDPOINT_PRIORITY_LOGON, 0);
+   broker_free_strings(fields, count);
+   return type | BROKER_REPLY;
+   
+   error:
+   endpoint_set_priority(ENDPOINT_PRIORITY_LOGON, 0);
+   broker_free_strings(fields, count);
+   buf->length = 0;
+   buf->error = 0;
+   broker_put_str(buf, broker_error[0] ? broker_error : "request failed");
+   return BROKER_ERROR;
+}
+
+static void *broker_worker(void *data) {
+   int sock = (int)(long)data;
+   hcancel_t *cancel;
+   broker_buf_t buf;
+   int type, trusted;
+   
+   trusted = broker_trusted(sock);
+   // one token for the connection, which ends with a cancelled request
+   cancel = hcancel_new();
+   hsocket_set_cancel(cancel);
+   if (broker_buf_init(&buf)) {
+      // a client may send several requests on its connection
+      while ((type = broker_receive(sock, &buf)) >= 0) {
+         if (cancel != NULL) broker_watch(sock, cancel, 1);
+         type = broker_dispatch(type, &buf, trusted);
+         if (cancel != NULL) broker_watch(sock, cancel, 0);
+         if (hcancel_triggered(cancel) || !broker_send(sock, type, &buf)) break;
+      }
+      broker_buf_free(&buf);
+   }
+   hsocket_set_cancel(NULL);
+   hcancel_free(cancel);
+   close(sock);
+   hatomic_dec(&broker_clients);
+   return NULL;
+}
+
+int broker_serve(const char *path, void(*log_handler)()) {
+   struct sockaddr_un addr;
+   struct timeval tv;
+   fd_set fds;
+   mode_t mask;
+   int sock, client, max;
+   
+   if (!broker_address(path, &addr)) {
+      if (log_handler != NULL) (*log_handler)("broker socket path too long");
+      return 0;
+   }
+   if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      if (log_handler != NULL) (*log_handler)("cannot create broker socket");
+      return 0;
+   }
+   unlink(path);
+   // clients must be root or in the broker group: the socket is created
+   // with mode 0660, there is no window where others could connect
+   mask = umask(0117);
+   if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      umask(mask);
+      if (log_handler != NULL) (*log_handler)("cannot bind broker socket");
+      close(sock);
+      return 0;
+   }
+   umask(mask);
+   if (listen(sock, BROKER_CLIENTS_MAX) != 0) {
+      if (log_handler != NULL) (*log_handler)("cannot bind broker socket");
+      close(sock);
+      unlink(path);
+      return 0;
+   }
+   
+   broker_log_handler = log_handler;
+   broker_run = 1;
+   log_verbose2("Broker listening on %s", path);
+   
+   while (broker_run) {
+      // wake up every second to notice broker_stop() and the new requests to watch
+      FD_ZERO(&fds);
+      FD_SET(sock, &fds);
+      max = broker_watch_fds(&fds, sock);
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      if (select(max + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+      broker_watch_check(&fds);
+      if (!FD_ISSET(sock, &fds)) continue;
+      
+      if ((client = accept(sock, NULL, NULL)) < 0) continue;
+      if (hatomic_inc(&broker_clients) > BROKER_CLIENTS_MAX) {
+         log_warn1("Too many broker clients");
+         hatomic_dec(&broker_clients);
+         close(client);
+         continue;
+      }
+      if (hthread_start(broker_worker, (void*)(long)client) != 0) {
+         hatomic_dec(&broker_clients);
+         close(client);
+      }
+   }
+   
+   close(sock);
+   unlink(path);
+   return 1;
+}
+
+void broker_stop(void) {
+   broker_run = 0;
+}
+
+#else
+
+// no Unix domain sockets with the Windows toolchain
+
+openotp_login_rep_t *broker_login(const char *path, int type, void *request, void(*log_handler)()) {
+   if (log_handler != NULL) (*log_handler)("broker not supported on this platform");
+   return NULL;
+}
+
+openotp_challenge_rep_t *broker_challenge(const char *path, openotp_challenge_req_t *request, void(*log_handler)()) {
+   if (log_handler != NULL) (*log_handler)("broker not supported on this platform");
+   return NULL;
+}
+
+openotp_status_rep_t *broker_status(const char *path, void(*log_handler)()) {
+   if (log_handler != NULL) (*log_handler)("broker not supported on this platform");
+   return NULL;
+}
+
+int broker_serve(const char *path, void(*log_handler)()) {
+   if (log_handler != NULL) (*log_handler)("broker not supported on this platform");
+   return 0;
+}
+
+void broker_stop(void) {
+}
+
+#endif
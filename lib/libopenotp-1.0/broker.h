@@ -0,0 +1,75 @@
+/*
+ RCDevs OpenOTP Development Library
+ Copyright (c) 2010-2013 RCDevs SA, All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __BROKER_H
+#define __BROKER_H
+
+#include "openotp.h"
+
+// Local authentication broker: one long-lived process owns the connections,
+// health state and TLS sessions toward the OpenOTP servers and the other
+// processes send their requests to it over a Unix domain socket.
+//
+// Each frame is a 4 bytes length (big endian, counting the type byte and
+// the payload), a type byte and the payload. Integers are 4 bytes big
+// endian, strings a 4 bytes length (BROKER_NULL for NULL) and the bytes.
+//
+//   BROKER_LOGIN      int login type, then the request fields in struct order
+//   BROKER_CHALLENGE  username, domain, session, otpPassword
+//   BROKER_STATUS     no payload
+//
+// Login and challenge requests may end with two ints, the priority and the
+// time left of the caller in milliseconds (see openotp_set_priority()).
+//
+// The reply has the request type with BROKER_REPLY set and the response
+// fields in struct order, or BROKER_ERROR and a message.
+//
+// A client which closes its connection before the reply cancels its request.
+
+// login types, also sent on the broker socket
+#define OPENOTP_SIMPLE_LOGIN 1
+#define OPENOTP_NORMAL_LOGIN 2
+#define OPENOTP_COMPAT_LOGIN 3
+
+#define BROKER_LOGIN 1
+#define BROKER_CHALLENGE 2
+#define BROKER_STATUS 3
+#define BROKER_REPLY 0x80
+#define BROKER_ERROR 0xFF
+
+#define BROKER_NULL 0xFFFFFFFF
+#define BROKER_FRAME_MAX 65536
+
+// clients give up on a broker which does not answer (seconds)
+#define BROKER_TIMEOUT 120
+
+// broker URL prefix accepted by openotp_initialize()
+#define BROKER_URL_PREFIX "unix:"
+
+// openotp.c
+openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_handler)());
+
+openotp_login_rep_t *broker_login(const char *path, int type, void *request, void(*log_handler)());
+openotp_challenge_rep_t *broker_challenge(const char *path, openotp_challenge_req_t *request, void(*log_handler)());
+openotp_status_rep_t *broker_status(const char *path, void(*log_handler)());
+
+int broker_serve(const char *path, void(*log_handler)());
+void broker_stop(void);
+
+#endif
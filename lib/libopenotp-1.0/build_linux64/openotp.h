@@ -96,6 +96,31 @@ typedef struct openotp_status_rep_t {
    char *message;
 } openotp_status_rep_t;
 
+typedef struct openotp_admission_stats_t {
+   long admitted;        // requests sent
+   long queued;          // requests which waited for a free slot
+   long shed;            // requests refused because their deadline could not be met
+   long queue_time;      // total waiting time in milliseconds
+   long queue_time_max;  // longest wait in milliseconds
+   int active;           // requests in progress
+   int waiting;          // requests waiting for a slot
+} openotp_admission_stats_t;
+
+// cancellation token (see openotp_cancel_new)
+typedef struct openotp_cancel_t openotp_cancel_t;
+
+// secure memory arena (see openotp_secure_new)
+typedef struct openotp_secure_t openotp_secure_t;
+
+// request priorities for openotp_set_priority()
+#define OPENOTP_PRIORITY_UNLOCK 0
+#define OPENOTP_PRIORITY_LOGON 1
+#define OPENOTP_PRIORITY_BACKGROUND 2
+
+// server selection policies for openotp_route_add()
+#define OPENOTP_ROUTE_FAILOVER 0
+#define OPENOTP_ROUTE_HASH 1
+
 
 #if defined(WINDOWS) || defined(WIN32) || defined(WIN64)
 #define EXPORT __declspec(dllexport)
@@ -115,6 +140,114 @@ typedef struct openotp_status_rep_t {
 EXPORT int openotp_initialize(char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)());
 EXPORT int openotp_terminate(void(*log_handler)());
 
+/*
+ * openotp_route_add() sends the requests of a domain to their own OpenOTP servers:
+ * - domain: matched without case against the domain of the request, or the UPN suffix of
+ *   the username (user@domain) when the request has no domain
+ * - url: the servers of the domain, comma separated like in openotp_initialize()
+ * - policy: OPENOTP_ROUTE_FAILOVER tries the servers in order, OPENOTP_ROUTE_HASH spreads
+ *   the users over the servers and keeps each user on the same server while it is up
+ * Each domain has its own connections, server health and admission control; the other
+ * requests and openotp_status() go to the servers of openotp_initialize(), whose SSL
+ * settings are used by all routes. Routes are added after openotp_initialize() and before
+ * the first request and openotp_prober_start(), in the process which sends the requests
+ * (the broker if any): openotp_route_add() fails afterwards, the table is then only read.
+ * They are removed by openotp_terminate().
+ */
+EXPORT int openotp_route_add(char *domain, char *url, int policy, void(*log_handler)());
+
+/*
+ * openotp_prober_start() starts a background thread which checks every OpenOTP server each
+ * 'interval' seconds with the status method and keeps a connection ready. Requests are
+ * sent to the servers which are up first and openotp_status() is answered from the last
+ * check if it is not older than 'ttl' seconds (set 0 to always query the server).
+ * openotp_prober_stop() stops the thread; openotp_terminate() stops it as well.
+ */
+EXPORT int openotp_prober_start(int interval, int ttl, void(*log_handler)());
+EXPORT int openotp_prober_stop(void(*log_handler)());
+
+/*
+ * openotp_cache_open() maps a cache file shared by all the processes using the library,
+ * which keeps resolved server addresses so that a new process does not wait for DNS.
+ * It is used for OpenOTP, TiQR and OpenSSO servers and should be opened before the first
+ * request. The file is created for the service account only (mode 0600) and is refused
+ * if another user can write it. Broken or expired entries are ignored. TLS sessions are
+ * resumed within a process and never written to the file.
+ * openotp_cache_close() unmaps the file.
+ */
+EXPORT int openotp_cache_open(char *path, void(*log_handler)());
+EXPORT int openotp_cache_close(void(*log_handler)());
+
+/*
+ * Local broker (Linux only): openotp_broker_serve() runs in a process initialized with the
+ * OpenOTP server URL(s) and answers the login, challenge and status requests of the other
+ * processes on the Unix domain socket 'path', reusing its connections, server health state
+ * and TLS sessions. It blocks until openotp_broker_stop() is called. A client process calls
+ * openotp_initialize() with the URL "unix:<path>" and uses the same API as usual; the cert,
+ * pass and ca parameters are then ignored. The socket is reserved to root and the group of
+ * the broker (mode 0660). Only root and the broker account may set the login 'source', the
+ * logins of other clients which set it are refused.
+ */
+EXPORT int openotp_broker_serve(char *path, void(*log_handler)());
+EXPORT int openotp_broker_stop(void(*log_handler)());
+
+/*
+ * Admission control: openotp_admission_set() allows at most 'limit' requests in progress
+ * with each OpenOTP server (set 0 to disable, the default). The other requests wait for a
+ * free slot, workstation unlocks first, then logons, then the prober status checks, at
+ * most 'max_wait' milliseconds (set 0 for no limit). A request which cannot get its reply
+ * before the deadline of its caller is refused at once and tried on the next server, then
+ * fails. openotp_set_priority() sets the priority and the time left in milliseconds
+ * (set 0 for no deadline) of the next requests of the calling thread; it is forwarded to
+ * the broker. openotp_admission_stats() returns the counters of the queue.
+ */
+EXPORT int openotp_admission_set(int limit, int max_wait, void(*log_handler)());
+EXPORT void openotp_set_priority(int priority, int timeout);
+EXPORT int openotp_admission_stats(openotp_admission_stats_t *stats, void(*log_handler)());
+
+/*
+ * Cancellation: openotp_cancel_new() creates a token (after openotp_initialize()) and
+ * openotp_set_cancel() makes the next requests of the calling thread use it (set NULL for
+ * none), the TiQR and OpenSSO requests included. openotp_cancel() may be called from any
+ * thread: the requests using the token fail at once, whether they are connecting, in the
+ * SSL handshake, waiting for a reply or for a free slot, and are not sent to another server.
+ * A cancelled tiqr_check() also cancels its TiQR session, and a TiQR or OpenSSO start whose
+ * reply arrives after the cancellation stops the new session. With the broker, closing the
+ * connection cancels the request in the broker process. A token stays cancelled and must be
+ * freed with openotp_cancel_free() once no thread uses it anymore.
+ */
+EXPORT openotp_cancel_t *openotp_cancel_new(void(*log_handler)());
+EXPORT void openotp_set_cancel(openotp_cancel_t *cancel);
+EXPORT void openotp_cancel(openotp_cancel_t *cancel);
+EXPORT void openotp_cancel_free(openotp_cancel_t *cancel);
+
+// openotp_prepare() starts DNS resolution, connect and SSL handshake to the OpenOTP server
+// in background and keeps the connection ready for the next request. It returns immediately.
+EXPORT int openotp_prepare(void(*log_handler)());
+
+// openotp_set_http2() offers HTTP/2 to the HTTPS servers when set to 1, before openotp_initialize().
+// A server which accepts it in the SSL handshake gets a single connection per process, shared
+// by the concurrent requests of all the threads. Other servers keep using HTTP/1.1.
+EXPORT void openotp_set_http2(int enable);
+
+// openotp_source_address() writes to 'addr' the local IP address the requests leave from towards
+// the OpenOTP server tried first, to be sent as the source of a login. It is the address of the
+// last connection to the server (see openotp_prepare), kept until the network interfaces or routes
+// change, so that no DNS lookup is made on the login path. 16 bytes are enough for 'addr'.
+EXPORT int openotp_source_address(char *addr, int size, void(*log_handler)());
+
+/*
+ * Secure memory: openotp_secure_new() takes an arena of memory pages locked in RAM, so that
+ * they are not written to swap, and left out of core dumps where the system allows it.
+ * openotp_secure_strdup() copies a string into it, typically the fields of a request built
+ * on the stack, and openotp_secure_free() wipes all the strings of the arena at once and
+ * releases it. Such a request must not be freed with openotp_*_req_free(). The library
+ * also serializes its SOAP requests into arenas and wipes the XML text before freeing it.
+ */
+EXPORT openotp_secure_t *openotp_secure_new(void(*log_handler)());
+EXPORT char *openotp_secure_strdup(openotp_secure_t *secure, const char *str);
+EXPORT void openotp_secure_free(openotp_secure_t *secure);
+
 // OpenOTP functions
 
 EXPORT openotp_login_rep_t *openotp_simple_login(openotp_simple_login_req_t *request, void(*log_handler)());
@@ -137,6 +270,12 @@ EXPORT openotp_challenge_req_t *openotp_challenge_req_new(void);
 EXPORT void openotp_challenge_req_free(openotp_challenge_req_t *request);
 EXPORT void openotp_challenge_rep_free(openotp_challenge_rep_t *response);
 
+// openotp_login_batch() and openotp_challenge_batch() send 'count' requests pipelined over one
+// connection and store each reply in 'responses' at the same index as its request. Requests
+// which failed get a NULL response. They return the number of replies received.
+EXPORT int openotp_login_batch(openotp_login_req_t **requests, openotp_login_rep_t **responses, int count, void(*log_handler)());
+EXPORT int openotp_challenge_batch(openotp_challenge_req_t **requests, openotp_challenge_rep_t **responses, int count, void(*log_handler)());
+
 EXPORT openotp_status_rep_t *openotp_status(void(*log_handler)());
 EXPORT void openotp_status_rep_free(openotp_status_rep_t *response); 
 
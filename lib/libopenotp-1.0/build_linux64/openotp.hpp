@@ -0,0 +1,325 @@
+/*
+ RCDevs OpenOTP/TiQR Development Library
+ Copyright (c) 2010-2013 RCDevs SA, All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _OPENOTP_HPP
+#define _OPENOTP_HPP 1
+
+// C++ wrapper over the OpenOTP functions of openotp.h (header only).
+//
+// - Requests are builders which keep pointers to the caller strings: nothing
+//   is copied, the strings must live until the call returns.
+// - Replies own the structure returned by the library and free it when they
+//   go out of scope. Their string fields borrow from it (string_ref, which
+//   converts to std::string_view with C++17).
+// - Requests and replies are move only. No function throws: failures are
+//   returned in a result with the message the library logged.
+//
+// Only needs C++11 rvalue references, so it also builds with Visual C++ 2012.
+//
+//   openotp::library lib;
+//   if (!lib.initialize("https://server:8443/openotp/").ok()) ...
+//   openotp::result<openotp::login_reply> rep = openotp::login(
+//      openotp::login_request().username(user).ldap_password(pass));
+//   if (rep.ok() && rep.value().is_challenge()) ...
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "openotp.h"
+}
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define OPENOTP_HAVE_STRING_VIEW 1
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define OPENOTP_NOEXCEPT throw()
+#define OPENOTP_THREAD_LOCAL __declspec(thread)
+#elif defined(_MSC_VER)
+#define OPENOTP_NOEXCEPT noexcept
+#define OPENOTP_THREAD_LOCAL thread_local
+#else
+#define OPENOTP_NOEXCEPT noexcept
+#define OPENOTP_THREAD_LOCAL __thread
+#endif
+
+namespace openotp {
+
+namespace detail {
+
+#define OPENOTP_ERROR_SIZE 256
+
+// the log handler has no context, the last message of each thread is kept here
+inline char *last_error() OPENOTP_NOEXCEPT {
+   static OPENOTP_THREAD_LOCAL char message[OPENOTP_ERROR_SIZE];
+   return message;
+}
+
+extern "C" inline void capture_error(char *message) {
+   char *last = last_error();
+   if (message == NULL) return;
+   strncpy(last, message, OPENOTP_ERROR_SIZE - 1);
+   last[OPENOTP_ERROR_SIZE - 1] = 0;
+}
+
+inline void (*log_handler())() {
+   last_error()[0] = 0;
+   return reinterpret_cast<void(*)()>(&capture_error);
+}
+
+} // namespace detail
+
+// Non owning view of a NUL terminated string (NULL when the field is missing).
+class string_ref {
+public:
+   string_ref() OPENOTP_NOEXCEPT : data_(NULL) {}
+   explicit string_ref(const char *data) OPENOTP_NOEXCEPT : data_(data) {}
+
+   const char *c_str() const OPENOTP_NOEXCEPT { return data_ != NULL ? data_ : ""; }
+   const char *data() const OPENOTP_NOEXCEPT { return data_; }
+   size_t size() const OPENOTP_NOEXCEPT { return data_ != NULL ? strlen(data_) : 0; }
+   bool empty() const OPENOTP_NOEXCEPT { return data_ == NULL || data_[0] == 0; }
+   bool is_null() const OPENOTP_NOEXCEPT { return data_ == NULL; }
+   std::string str() const { return std::string(c_str()); }
+#ifdef OPENOTP_HAVE_STRING_VIEW
+   std::string_view view() const OPENOTP_NOEXCEPT { return std::string_view(c_str()); }
+   operator std::string_view() const OPENOTP_NOEXCEPT { return view(); }
+#endif
+
+private:
+   const char *data_;
+};
+
+// Success flag and error message of a call.
+class status {
+public:
+   status() OPENOTP_NOEXCEPT : ok_(true) { message_[0] = 0; }
+
+   bool ok() const OPENOTP_NOEXCEPT { return ok_; }
+   const char *message() const OPENOTP_NOEXCEPT { return message_; }
+
+   static status failure(const char *message) OPENOTP_NOEXCEPT {
+      status s;
+      s.ok_ = false;
+      strncpy(s.message_, message != NULL && message[0] ? message : "request failed", OPENOTP_ERROR_SIZE - 1);
+      s.message_[OPENOTP_ERROR_SIZE - 1] = 0;
+      return s;
+   }
+
+private:
+   bool ok_;
+   char message_[OPENOTP_ERROR_SIZE];
+};
+
+// A reply, or the status explaining why there is none.
+template <class T>
+class result : public status {
+public:
+   result(T &&value) OPENOTP_NOEXCEPT : status(), value_(static_cast<T&&>(value)) {}
+   result(const status &error) OPENOTP_NOEXCEPT : status(error), value_() {}
+   result(result &&other) OPENOTP_NOEXCEPT : status(other), value_(static_cast<T&&>(other.value_)) {}
+   result &operator=(result &&other) OPENOTP_NOEXCEPT {
+      status::operator=(other);
+      value_ = static_cast<T&&>(other.value_);
+      return *this;
+   }
+
+   T &value() OPENOTP_NOEXCEPT { return value_; }
+   const T &value() const OPENOTP_NOEXCEPT { return value_; }
+
+private:
+   result(const result &);
+   result &operator=(const result &);
+
+   T value_;
+};
+
+// Owns a structure returned by the library, freed with Free.
+template <class Rep, void (*Free)(Rep *)>
+class reply {
+public:
+   reply() OPENOTP_NOEXCEPT : rep_(NULL) {}
+   explicit reply(Rep *rep) OPENOTP_NOEXCEPT : rep_(rep) {}
+   reply(reply &&other) OPENOTP_NOEXCEPT : rep_(other.rep_) { other.rep_ = NULL; }
+   reply &operator=(reply &&other) OPENOTP_NOEXCEPT {
+      if (this != &other) {
+         if (rep_ != NULL) Free(rep_);
+         rep_ = other.rep_;
+         other.rep_ = NULL;
+      }
+      return *this;
+   }
+   ~reply() { if (rep_ != NULL) Free(rep_); }
+
+   const Rep *get() const OPENOTP_NOEXCEPT { return rep_; }
+
+protected:
+   Rep *rep_;
+
+private:
+   reply(const reply &);
+   reply &operator=(const reply &);
+};
+
+class login_reply : public reply<openotp_login_rep_t, openotp_login_rep_free> {
+   typedef reply<openotp_login_rep_t, openotp_login_rep_free> base;
+public:
+   login_reply() OPENOTP_NOEXCEPT {}
+   explicit login_reply(openotp_login_rep_t *rep) OPENOTP_NOEXCEPT : base(rep) {}
+   login_reply(login_reply &&other) OPENOTP_NOEXCEPT : base(static_cast<base&&>(other)) {}
+   login_reply &operator=(login_reply &&other) OPENOTP_NOEXCEPT { base::operator=(static_cast<base&&>(other)); return *this; }
+
+   int code() const OPENOTP_NOEXCEPT { return rep_ != NULL ? rep_->code : OPENOTP_FAILURE; }
+   bool is_success() const OPENOTP_NOEXCEPT { return code() == OPENOTP_SUCCESS; }
+   bool is_challenge() const OPENOTP_NOEXCEPT { return code() == OPENOTP_CHALLENGE; }
+   int timeout() const OPENOTP_NOEXCEPT { return rep_ != NULL ? rep_->timeout : 0; }
+   string_ref message() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->message : NULL); }
+   string_ref session() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->session : NULL); }
+   string_ref data() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->data : NULL); }
+};
+
+class challenge_reply : public reply<openotp_challenge_rep_t, openotp_challenge_rep_free> {
+   typedef reply<openotp_challenge_rep_t, openotp_challenge_rep_free> base;
+public:
+   challenge_reply() OPENOTP_NOEXCEPT {}
+   explicit challenge_reply(openotp_challenge_rep_t *rep) OPENOTP_NOEXCEPT : base(rep) {}
+   challenge_reply(challenge_reply &&other) OPENOTP_NOEXCEPT : base(static_cast<base&&>(other)) {}
+   challenge_reply &operator=(challenge_reply &&other) OPENOTP_NOEXCEPT { base::operator=(static_cast<base&&>(other)); return *this; }
+
+   int code() const OPENOTP_NOEXCEPT { return rep_ != NULL ? rep_->code : OPENOTP_FAILURE; }
+   bool is_success() const OPENOTP_NOEXCEPT { return code() == OPENOTP_SUCCESS; }
+   string_ref message() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->message : NULL); }
+   string_ref data() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->data : NULL); }
+};
+
+class status_reply : public reply<openotp_status_rep_t, openotp_status_rep_free> {
+   typedef reply<openotp_status_rep_t, openotp_status_rep_free> base;
+public:
+   status_reply() OPENOTP_NOEXCEPT {}
+   explicit status_reply(openotp_status_rep_t *rep) OPENOTP_NOEXCEPT : base(rep) {}
+   status_reply(status_reply &&other) OPENOTP_NOEXCEPT : base(static_cast<base&&>(other)) {}
+   status_reply &operator=(status_reply &&other) OPENOTP_NOEXCEPT { base::operator=(static_cast<base&&>(other)); return *this; }
+
+   bool is_up() const OPENOTP_NOEXCEPT { return rep_ != NULL && rep_->status != 0; }
+   string_ref message() const OPENOTP_NOEXCEPT { return string_ref(rep_ != NULL ? rep_->message : NULL); }
+};
+
+// Login request builder, keeps pointers to the caller strings.
+class login_request {
+public:
+   login_request() OPENOTP_NOEXCEPT { memset(&req_, 0, sizeof(req_)); }
+   login_request(login_request &&other) OPENOTP_NOEXCEPT : req_(other.req_) {}
+
+   login_request &username(const char *value) OPENOTP_NOEXCEPT { req_.username = const_cast<char*>(value); return *this; }
+   login_request &domain(const char *value) OPENOTP_NOEXCEPT { req_.domain = const_cast<char*>(value); return *this; }
+   login_request &ldap_password(const char *value) OPENOTP_NOEXCEPT { req_.ldapPassword = const_cast<char*>(value); return *this; }
+   login_request &otp_password(const char *value) OPENOTP_NOEXCEPT { req_.otpPassword = const_cast<char*>(value); return *this; }
+   login_request &client(const char *value) OPENOTP_NOEXCEPT { req_.client = const_cast<char*>(value); return *this; }
+   login_request &source(const char *value) OPENOTP_NOEXCEPT { req_.source = const_cast<char*>(value); return *this; }
+   login_request &settings(const char *value) OPENOTP_NOEXCEPT { req_.settings = const_cast<char*>(value); return *this; }
+
+   // the library does not modify the request
+   openotp_login_req_t *get() const OPENOTP_NOEXCEPT { return const_cast<openotp_login_req_t*>(&req_); }
+
+private:
+   login_request(const login_request &);
+   login_request &operator=(const login_request &);
+
+   openotp_login_req_t req_;
+};
+
+// Challenge request builder, keeps pointers to the caller strings.
+class challenge_request {
+public:
+   challenge_request() OPENOTP_NOEXCEPT { memset(&req_, 0, sizeof(req_)); }
+   challenge_request(challenge_request &&other) OPENOTP_NOEXCEPT : req_(other.req_) {}
+
+   challenge_request &username(const char *value) OPENOTP_NOEXCEPT { req_.username = const_cast<char*>(value); return *this; }
+   challenge_request &domain(const char *value) OPENOTP_NOEXCEPT { req_.domain = const_cast<char*>(value); return *this; }
+   challenge_request &session(const char *value) OPENOTP_NOEXCEPT { req_.session = const_cast<char*>(value); return *this; }
+   challenge_request &otp_password(const char *value) OPENOTP_NOEXCEPT { req_.otpPassword = const_cast<char*>(value); return *this; }
+   // the reply must outlive the request
+   challenge_request &session(const login_reply &reply) OPENOTP_NOEXCEPT { return session(reply.session().data()); }
+
+   openotp_challenge_req_t *get() const OPENOTP_NOEXCEPT { return const_cast<openotp_challenge_req_t*>(&req_); }
+
+private:
+   challenge_request(const challenge_request &);
+   challenge_request &operator=(const challenge_request &);
+
+   openotp_challenge_req_t req_;
+};
+
+// Calls openotp_initialize() and openotp_terminate() when it goes out of scope.
+// The URL is copied: the library keeps pointers into it.
+class library {
+public:
+   library() OPENOTP_NOEXCEPT : initialized_(false) {}
+   ~library() { terminate(); }
+
+   status initialize(const char *url, const char *cert = NULL, const char *pass = NULL, const char *ca = NULL, int timeout = 0) OPENOTP_NOEXCEPT {
+      if (initialized_) return status::failure("OpenOTP already initialized");
+      if (url == NULL) return status::failure("missing OpenOTP server URL");
+      url_.assign(url, url + strlen(url) + 1);
+      if (!openotp_initialize(&url_[0], const_cast<char*>(cert), const_cast<char*>(pass), const_cast<char*>(ca), timeout, detail::log_handler()))
+         return status::failure(detail::last_error());
+      initialized_ = true;
+      return status();
+   }
+
+   void terminate() OPENOTP_NOEXCEPT {
+      if (!initialized_) return;
+      openotp_terminate(NULL);
+      initialized_ = false;
+   }
+
+   bool initialized() const OPENOTP_NOEXCEPT { return initialized_; }
+
+private:
+   library(const library &);
+   library &operator=(const library &);
+
+   bool initialized_;
+   std::vector<char> url_;
+};
+
+inline result<login_reply> login(const login_request &request) OPENOTP_NOEXCEPT {
+   openotp_login_rep_t *rep = openotp_login(request.get(), detail::log_handler());
+   if (rep == NULL) return status::failure(detail::last_error());
+   return login_reply(rep);
+}
+
+inline result<challenge_reply> challenge(const challenge_request &request) OPENOTP_NOEXCEPT {
+   openotp_challenge_rep_t *rep = openotp_challenge(request.get(), detail::log_handler());
+   if (rep == NULL) return status::failure(detail::last_error());
+   return challenge_reply(rep);
+}
+
+inline result<status_reply> server_status() OPENOTP_NOEXCEPT {
+   openotp_status_rep_t *rep = openotp_status(detail::log_handler());
+   if (rep == NULL) return status::failure(detail::last_error());
+   return status_reply(rep);
+}
+
+} // namespace openotp
+
+#endif
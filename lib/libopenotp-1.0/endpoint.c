@@ -0,0 +1,979 @@
+/*
+ RCDevs OpenOTP Development Library
+ Copyright (c) 2010-2013 RCDevs SA, All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include "endpoint.h"
+#include "nanohttp/nanohttp-client.h"
+#include "nanohttp/nanohttp-server.h"
+#include "nanohttp/nanohttp-logging.h"
+
+// The state of each endpoint is protected by a sequence counter: writers
+// (serialized by the group lock) make it odd while they copy the state,
+// readers retry until they got a copy with the same even counter.
+
+static void endpoint_set_state(endpoint_t *endpoint, endpoint_state_t *state) {
+   hatomic_inc(&endpoint->seq);
+   hatomic_barrier();
+   endpoint->state = *state;
+   hatomic_barrier();
+   hatomic_inc(&endpoint->seq);
+}
+
+void endpoint_get_state(endpoint_t *endpoint, endpoint_state_t *state) {
+   long seq;
+
+   do {
+      while ((seq = endpoint->seq) & 1) hatomic_barrier();
+      hatomic_barrier();
+      *state = endpoint->state;
+      hatomic_barrier();
+   } while (seq != endpoint->seq);
+}
+
+// same smoothing as the TCP round trip estimator (RFC 6298)
+static void endpoint_estimate(int *srtt, int *rttvar, long sample) {
+   long delta;
+
+   if (*srtt == 0) {
+      *srtt = sample > 0 ? (int)sample : 1;
+      *rttvar = (int)(sample / 2);
+      return;
+   }
+   delta = sample > *srtt ? sample - *srtt : *srtt - sample;
+   *rttvar = (int)((3 * (long)*rttvar + delta) / 4);
+   *srtt = (int)((7 * (long)*srtt + sample) / 8);
+   if (*srtt == 0) *srtt = 1;
+}
+
+static void endpoint_report_connect(endpoint_group_t *group, int index, long connect) {
+   endpoint_t *endpoint = &group->endpoints[index];
+   endpoint_state_t state;
+
+   hmutex_lock(&group->lock);
+   state = endpoint->state;
+   endpoint_estimate(&state.connect_rtt, &state.connect_rttvar, connect);
+   endpoint_set_state(endpoint, &state);
+   hmutex_unlock(&group->lock);
+}
+
+static int endpoint_rto(int srtt, int rttvar, int min, int max) {
+   int rto = srtt + (4 * rttvar > ENDPOINT_RTT_GRANULARITY ? 4 * rttvar : ENDPOINT_RTT_GRANULARITY);
+
+   if (rto < min) rto = min;
+   return rto < max ? rto : max;
+}
+
+/*
+ * Timeouts derived from the round trips observed with an endpoint, bounded
+ * by the configured timeout; 0 (the configured timeout) while there is no
+ * estimate. Reads are only bounded for status requests: a login may wait
+ * for the user to answer a push notification.
+ */
+static void endpoint_timeouts(endpoint_group_t *group, int index, SoapCtx *request, int *connect, int *read) {
+   endpoint_state_t state;
+   xmlNodePtr method;
+   int max = httpd_get_timeout() * 1000;
+
+   endpoint_get_state(&group->endpoints[index], &state);
+   *connect = *read = 0;
+   if (state.connect_rtt > 0) *connect = endpoint_rto(state.connect_rtt, state.connect_rttvar, ENDPOINT_CONNECT_MIN, max);
+   if (state.rtt > 0 && request != NULL) {
+      method = soap_env_get_method(request->env);
+      if (method != NULL && strcmp((char*)method->name, group->status_method) == 0) *read = endpoint_rto(state.rtt, state.rttvar, ENDPOINT_READ_MIN, max);
+   }
+}
+
+static void endpoint_report(endpoint_group_t *group, int index, int health, long rtt, int probed, int status, const char *message) {
+   endpoint_t *endpoint = &group->endpoints[index];
+   endpoint_state_t state;
+
+   hmutex_lock(&group->lock);
+   state = endpoint->state;
+   if (state.health != health) log_verbose3("%s server %s", endpoint->url, health == ENDPOINT_UP ? "is up" : "is down");
+   state.health = health;
+   state.updated = time(NULL);
+   if (health == ENDPOINT_UP && rtt >= 0) endpoint_estimate(&state.rtt, &state.rttvar, rtt);
+   if (probed) {
+      state.checked = state.updated;
+      state.status = status;
+      state.message[0] = 0;
+      if (message != NULL) {
+	 strncpy(state.message, message, sizeof(state.message) - 1);
+	 state.message[sizeof(state.message) - 1] = 0;
+      }
+   }
+   endpoint_set_state(endpoint, &state);
+   hmutex_unlock(&group->lock);
+}
+
+void endpoint_group_set(endpoint_group_t *group, char *url1, char *url2) {
+   char *urls[2];
+   int count = 0;
+
+   if (url1 != NULL) urls[count++] = url1;
+   if (url2 != NULL) urls[count++] = url2;
+   endpoint_group_set_urls(group, urls, count);
+}
+
+// the URLs are tried in this order; beyond ENDPOINT_MAX they are ignored
+void endpoint_group_set_urls(endpoint_group_t *group, char **urls, int count) {
+   endpoint_state_t state;
+   int i;
+
+   memset(&state, 0, sizeof(state));
+   hmutex_lock(&group->lock);
+   group->count = 0;
+   for (i = 0; i < count && i < ENDPOINT_MAX; i++) {
+      group->endpoints[i].url = urls[i];
+      group->endpoints[i].hash = endpoint_hash(urls[i]);
+      group->count++;
+   }
+   for (i = 0; i < ENDPOINT_MAX; i++) endpoint_set_state(&group->endpoints[i], &state);
+   memset(group->affinity, 0, sizeof(group->affinity));
+   hmutex_unlock(&group->lock);
+}
+
+void endpoint_group_reset(endpoint_group_t *group) {
+   endpoint_prober_stop(group);
+   hmutex_lock(&group->lock);
+   group->count = 0;
+   hmutex_unlock(&group->lock);
+}
+
+/*
+ * Fills order with the endpoint indexes in the order they should be tried:
+ * servers which are up or unknown first (in configured order), then the
+ * ones marked down. Returns the number of endpoints.
+ */
+int endpoint_order(endpoint_group_t *group, int *order) {
+   endpoint_state_t state;
+   int down[ENDPOINT_MAX];
+   int i, n = 0, d = 0;
+   time_t now = time(NULL);
+
+   for (i = 0; i < group->count; i++) {
+      endpoint_get_state(&group->endpoints[i], &state);
+      if (state.health == ENDPOINT_DOWN && now - state.updated < ENDPOINT_DOWN_RETRY) down[d++] = i;
+      else order[n++] = i;
+   }
+   for (i = 0; i < d; i++) order[n++] = down[i];
+   return n;
+}
+
+/*
+ * FNV-1a hash of a string, case insensitive.
+ */
+unsigned int endpoint_hash(const char *str) {
+   unsigned int hash = 2166136261U;
+
+   for (; *str; str++) {
+      hash ^= (unsigned char)tolower((unsigned char)*str);
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+/*
+ * Consistent hashing: returns the endpoint with the highest weight for
+ * key among the ones not marked down (rendezvous hashing), or -1 if they
+ * all are. A key keeps its endpoint while it is up, and only the keys of
+ * an endpoint which goes down move, each to its next highest weight.
+ */
+int endpoint_pick(endpoint_group_t *group, unsigned int key) {
+   endpoint_state_t state;
+   unsigned int weight, best = 0;
+   time_t now = time(NULL);
+   int i, index = -1;
+
+   for (i = 0; i < group->count; i++) {
+      endpoint_get_state(&group->endpoints[i], &state);
+      if (state.health == ENDPOINT_DOWN && now - state.updated < ENDPOINT_DOWN_RETRY) continue;
+      // murmur3 finalizer, spreads the combined hashes
+      weight = key ^ group->endpoints[i].hash;
+      weight ^= weight >> 16;
+      weight *= 0x85ebca6bU;
+      weight ^= weight >> 13;
+      weight *= 0xc2b2ae35U;
+      weight ^= weight >> 16;
+      if (index < 0 || weight > best) {
+	 best = weight;
+	 index = i;
+      }
+   }
+   return index;
+}
+
+/*
+ * Same as endpoint_order() with the preferred endpoint moved first, unless
+ * it is marked down.
+ */
+static int endpoint_order_prefer(endpoint_group_t *group, int *order, int preferred) {
+   endpoint_state_t state;
+   int i, count;
+
+   count = endpoint_order(group, order);
+   if (preferred < 0 || preferred >= count) return count;
+   endpoint_get_state(&group->endpoints[preferred], &state);
+   if (state.health == ENDPOINT_DOWN && time(NULL) - state.updated < ENDPOINT_DOWN_RETRY) return count;
+
+   for (i = 0; i < count && order[i] != preferred; i++);
+   for (; i > 0; i--) order[i] = order[i-1];
+   order[0] = preferred;
+   return count;
+}
+
+/*
+ * Admission control
+ *
+ * With a limit set, at most 'limit' requests are in progress with each
+ * endpoint; the other callers wait in priority order (unlock, then logon,
+ * then background) and FIFO within a class. A caller whose deadline (see
+ * endpoint_set_priority) or the group max_wait cannot be met, judging from
+ * the queue ahead of it and the endpoint round trip time, is refused at
+ * once or when its wait expires: the request goes to the next endpoint or
+ * fails with ENDPOINT_ERROR_BUSY.
+ */
+
+static HTHREAD_LOCAL int endpoint_priority = ENDPOINT_PRIORITY_LOGON;
+static HTHREAD_LOCAL hclock_t endpoint_deadline = 0;
+
+/*
+ * Sets the class and the time left (milliseconds, 0 for no deadline) of the
+ * requests of the calling thread.
+ */
+void endpoint_set_priority(int priority, int timeout) {
+   if (priority < ENDPOINT_PRIORITY_UNLOCK || priority > ENDPOINT_PRIORITY_BACKGROUND) priority = ENDPOINT_PRIORITY_LOGON;
+   endpoint_priority = priority;
+   endpoint_deadline = timeout > 0 ? hclock_ms() + timeout : 0;
+}
+
+void endpoint_get_priority(int *priority, int *timeout) {
+   long left = endpoint_deadline ? (long)(endpoint_deadline - hclock_ms()) : 0;
+
+   *priority = endpoint_priority;
+   *timeout = endpoint_deadline == 0 ? 0 : left > 0 ? (int)left : 1;
+}
+
+// grants the free slots of an endpoint to the first waiters; the group lock must be held
+static void endpoint_admission_grant(endpoint_group_t *group, int index) {
+   endpoint_waiter_t *waiter;
+
+   while (group->waiters[index] != NULL && (group->limit <= 0 || group->active[index] < group->limit)) {
+      waiter = group->waiters[index];
+      group->waiters[index] = waiter->next;
+      group->active[index]++;
+      group->stats.active++;
+      group->stats.waiting--;
+      waiter->granted = 1;
+      hevent_set(&waiter->event);
+   }
+}
+
+void endpoint_admission_set(endpoint_group_t *group, int limit, int max_wait) {
+   int i;
+
+   hmutex_lock(&group->lock);
+   group->limit = limit > 0 ? limit : 0;
+   group->max_wait = max_wait > 0 ? max_wait : 0;
+   for (i = 0; i < ENDPOINT_MAX; i++) endpoint_admission_grant(group, i);
+   hmutex_unlock(&group->lock);
+}
+
+void endpoint_admission_stats(endpoint_group_t *group, endpoint_admission_stats_t *stats) {
+   hmutex_lock(&group->lock);
+   *stats = group->stats;
+   hmutex_unlock(&group->lock);
+}
+
+static void endpoint_leave(endpoint_group_t *group, int index);
+
+/*
+ * Takes a slot of the endpoint for the calling thread, waiting for one if
+ * needed. Returns 0 if the request must not be sent to this endpoint and
+ * -1 if the request of the thread was cancelled.
+ */
+static int endpoint_admit(endpoint_group_t *group, int index) {
+   endpoint_waiter_t waiter, **link;
+   endpoint_state_t state;
+   hclock_t now, deadline;
+   long expected, waited;
+   int ahead;
+
+   if (hsocket_cancelled()) return -1;
+
+   hmutex_lock(&group->lock);
+   if (group->limit <= 0 || (group->active[index] < group->limit && group->waiters[index] == NULL)) {
+      group->active[index]++;
+      group->stats.active++;
+      group->stats.admitted++;
+      hmutex_unlock(&group->lock);
+      return 1;
+   }
+
+   // the request must be sent in time to get its reply before the deadline
+   endpoint_get_state(&group->endpoints[index], &state);
+   now = hclock_ms();
+   deadline = endpoint_deadline ? endpoint_deadline - state.rtt : 0;
+   if (group->max_wait > 0 && (deadline == 0 || now + group->max_wait < deadline)) deadline = now + group->max_wait;
+
+   waiter.priority = endpoint_priority;
+   waiter.granted = 0;
+   ahead = 0;
+   for (link = &group->waiters[index]; *link != NULL && (*link)->priority <= waiter.priority; link = &(*link)->next) ahead++;
+   expected = (long)(ahead / group->limit + 1) * state.rtt;
+   if ((deadline != 0 && now + expected > deadline) || hevent_init(&waiter.event) != 0) {
+      group->stats.shed++;
+      hmutex_unlock(&group->lock);
+      return 0;
+   }
+   waiter.next = *link;
+   *link = &waiter;
+   group->stats.queued++;
+   group->stats.waiting++;
+   hmutex_unlock(&group->lock);
+
+   // a cancellation wakes the waiter up as well
+   hcancel_set_event(hsocket_get_cancel(), &waiter.event);
+   if (deadline != 0) hevent_timedwait(&waiter.event, deadline - now > 0 ? (long)(deadline - now) : 1);
+   else hevent_wait(&waiter.event);
+   hcancel_set_event(hsocket_get_cancel(), NULL);
+
+   hmutex_lock(&group->lock);
+   if (!waiter.granted) {
+      for (link = &group->waiters[index]; *link != &waiter; link = &(*link)->next);
+      *link = waiter.next;
+      group->stats.waiting--;
+      group->stats.shed++;
+   } else {
+      group->stats.admitted++;
+      waited = (long)(hclock_ms() - now);
+      group->stats.queue_time += waited;
+      if (waited > group->stats.queue_time_max) group->stats.queue_time_max = waited;
+   }
+   hmutex_unlock(&group->lock);
+   hevent_destroy(&waiter.event);
+   if (waiter.granted && hsocket_cancelled()) {
+      endpoint_leave(group, index);
+      return -1;
+   }
+   return waiter.granted ? 1 : hsocket_cancelled() ? -1 : 0;
+}
+
+static void endpoint_leave(endpoint_group_t *group, int index) {
+   hmutex_lock(&group->lock);
+   group->active[index]--;
+   group->stats.active--;
+   endpoint_admission_grant(group, index);
+   hmutex_unlock(&group->lock);
+}
+
+static herror_t endpoint_busy(endpoint_group_t *group, int index) {
+   return herror_new("endpoint_invoke", ENDPOINT_ERROR_BUSY, "%s server %s busy", group->name, group->endpoints[index].url);
+}
+
+static herror_t endpoint_cancelled(endpoint_group_t *group) {
+   return herror_new("endpoint_invoke", HSOCKET_ERROR_CANCELLED, "%s request cancelled", group->name);
+}
+
+herror_t endpoint_invoke(endpoint_group_t *group, SoapCtx *request, SoapCtx **response) {
+   return endpoint_invoke_to(group, -1, request, response, NULL);
+}
+
+/*
+ * Sends the request to the preferred endpoint first (set -1 for none) and
+ * returns the index of the endpoint which answered in index (if not NULL).
+ * While another endpoint remains to fail over to, the timeouts follow the
+ * round trips observed with the endpoint (see endpoint_timeouts); the last
+ * one is given the configured timeout.
+ */
+herror_t endpoint_invoke_to(endpoint_group_t *group, int preferred, SoapCtx *request, SoapCtx **response, int *index) {
+   int order[ENDPOINT_MAX];
+   herror_t err = H_OK;
+   hclock_t start;
+   long elapsed, connect;
+   int i, count, admitted, connect_timeout, read_timeout;
+
+   count = endpoint_order_prefer(group, order, preferred);
+   if (count == 0) return herror_new("endpoint_invoke", GENERAL_INVALID_PARAM, "No %s server configured", group->name);
+
+   for (i = 0; i < count; i++) {
+      if (err != H_OK) herror_release(err);
+      if ((admitted = endpoint_admit(group, order[i])) < 0) return endpoint_cancelled(group);
+      if (admitted == 0) {
+	 err = endpoint_busy(group, order[i]);
+	 continue;
+      }
+      if (i < count - 1) endpoint_timeouts(group, order[i], request, &connect_timeout, &read_timeout);
+      else connect_timeout = read_timeout = 0;
+      hsocket_set_timeouts(connect_timeout, read_timeout);
+      start = hclock_ms();
+      err = soap_client_invoke(request, response, group->endpoints[order[i]].url, "");
+      elapsed = (long)(hclock_ms() - start);
+      connect = hsocket_get_connect_time();
+      hsocket_set_timeouts(0, 0);
+      endpoint_leave(group, order[i]);
+      if (connect >= 0) endpoint_report_connect(group, order[i], connect);
+      if (err == H_OK) {
+	 endpoint_report(group, order[i], ENDPOINT_UP, connect >= 0 ? elapsed - connect : elapsed, 0, 0, NULL);
+	 if (index != NULL) *index = order[i];
+	 return H_OK;
+      }
+      // the server is not to blame and no other one must be tried
+      if (herror_code(err) == HSOCKET_ERROR_CANCELLED || hsocket_cancelled()) {
+	 herror_release(err);
+	 return endpoint_cancelled(group);
+      }
+      log_verbose3("%s request failed (%s)", group->endpoints[order[i]].url, herror_message(err));
+      endpoint_report(group, order[i], ENDPOINT_DOWN, -1, 0, 0, NULL);
+   }
+   return err;
+}
+
+herror_t endpoint_invoke_batch(endpoint_group_t *group, SoapCtx **requests, SoapCtx **responses, herror_t *errors, int count) {
+   return endpoint_invoke_batch_to(group, NULL, requests, responses, errors, NULL, count);
+}
+
+/*
+ * Sends the requests pipelined over one connection per endpoint. Each
+ * request goes to its preferred endpoint first (preferred may be NULL),
+ * then the ones which failed are sent to their next endpoint in order.
+ * On return, responses[i] is set and indexes[i] (if not NULL) holds the
+ * endpoint which answered, or errors[i] holds the last error of request i.
+ */
+herror_t endpoint_invoke_batch_to(endpoint_group_t *group, int *preferred, SoapCtx **requests, SoapCtx **responses, herror_t *errors, int *indexes, int count) {
+   int order[ENDPOINT_MAX];
+   int orders[ENDPOINT_MAX][ENDPOINT_MAX];
+   SoapCtx **calls = NULL;
+   SoapCtx **replies = NULL;
+   herror_t *status = NULL;
+   int *index = NULL;
+   int *tries = NULL;
+   herror_t err = H_OK;
+   long connect;
+   int i, j, e, n, answered, admitted, endpoints, connect_timeout, read_timeout;
+
+   if (count <= 0) return H_OK;
+   endpoints = endpoint_order(group, order);
+   if (endpoints == 0) return herror_new("endpoint_invoke_batch", GENERAL_INVALID_PARAM, "No %s server configured", group->name);
+
+   // order of the endpoints for the requests preferring each endpoint
+   for (e = 0; e < endpoints; e++) endpoint_order_prefer(group, orders[e], e);
+
+   for (i = 0; i < count; i++) {
+      responses[i] = NULL;
+      errors[i] = H_OK;
+   }
+
+   calls = malloc(count * sizeof(SoapCtx*));
+   replies = malloc(count * sizeof(SoapCtx*));
+   status = malloc(count * sizeof(herror_t));
+   index = malloc(count * sizeof(int));
+   tries = calloc(count, sizeof(int));
+   if (calls == NULL || replies == NULL || status == NULL || index == NULL || tries == NULL) {
+      err = herror_new("endpoint_invoke_batch", GENERAL_INVALID_PARAM, "Memory allocation failed");
+      goto error;
+   }
+
+   // each round sends every pending request to the next endpoint in its order
+   for (i = 0; i < endpoints; i++) {
+      for (e = 0; e < endpoints; e++) {
+	 for (j = 0, n = 0; j < count; j++) {
+	    if (responses[j] != NULL || tries[j] != i) continue;
+	    if (preferred != NULL && preferred[j] >= 0 && preferred[j] < endpoints) {
+	       if (orders[preferred[j]][i] != order[e]) continue;
+	    }
+	    else if (order[i] != order[e]) continue;
+	    index[n] = j;
+	    calls[n++] = requests[j];
+	 }
+	 if (n == 0) continue;
+
+	 if ((admitted = endpoint_admit(group, order[e])) < 0) {
+	    err = endpoint_cancelled(group);
+	    goto error;
+	 }
+	 if (admitted == 0) {
+	    for (j = 0; j < n; j++) {
+	       if (errors[index[j]] != H_OK) herror_release(errors[index[j]]);
+	       errors[index[j]] = endpoint_busy(group, order[e]);
+	       tries[index[j]]++;
+	    }
+	    continue;
+	 }
+	 // connect quickly while another round remains
+	 if (i < endpoints - 1) endpoint_timeouts(group, order[e], NULL, &connect_timeout, &read_timeout);
+	 else connect_timeout = read_timeout = 0;
+	 hsocket_set_timeouts(connect_timeout, 0);
+	 err = soap_client_invoke_batch(calls, replies, status, n, group->endpoints[order[e]].url, "");
+	 connect = hsocket_get_connect_time();
+	 hsocket_set_timeouts(0, 0);
+	 endpoint_leave(group, order[e]);
+	 if (connect >= 0) endpoint_report_connect(group, order[e], connect);
+	 if (err != H_OK) goto error;
+	 if (hsocket_cancelled()) {
+	    for (j = 0; j < n; j++) {
+	       if (replies[j] != NULL) soap_ctx_free(replies[j]);
+	       if (status[j] != H_OK) herror_release(status[j]);
+	    }
+	    err = endpoint_cancelled(group);
+	    goto error;
+	 }
+
+	 for (j = 0, answered = 0; j < n; j++) {
+	    if (errors[index[j]] != H_OK) herror_release(errors[index[j]]);
+	    errors[index[j]] = status[j];
+	    responses[index[j]] = replies[j];
+	    if (indexes != NULL) indexes[index[j]] = order[e];
+	    tries[index[j]]++;
+	    if (status[j] == H_OK) answered++;
+	 }
+	 if (answered > 0) endpoint_report(group, order[e], ENDPOINT_UP, -1, 0, 0, NULL);
+	 else {
+	    log_verbose3("%s batch request failed (%s)", group->endpoints[order[e]].url, herror_message(status[0]));
+	    endpoint_report(group, order[e], ENDPOINT_DOWN, -1, 0, 0, NULL);
+	 }
+      }
+   }
+
+   error:
+   if (calls != NULL) free(calls);
+   if (replies != NULL) free(replies);
+   if (status != NULL) free(status);
+   if (index != NULL) free(index);
+   if (tries != NULL) free(tries);
+   return err;
+}
+
+/*
+ * Shared requests
+ *
+ * Concurrent calls of an idempotent method with the same arguments (status
+ * checks, OpenSSO session checks, TiQR QR codes) are sent once: the first
+ * caller sends the request and the others of the group wait for its reply,
+ * which they all parse. The reply is freed by the last endpoint_response_free().
+ * Logins and challenges must never be shared.
+ */
+
+/*
+ * Returns the key of a shared request: the method and the 'count' string
+ * arguments which follow (NULL allowed), or NULL if out of memory.
+ */
+char *endpoint_flight_key(const char *method, int count, ...) {
+   va_list args;
+   const char *arg;
+   size_t size;
+   char *key, *ptr;
+   int i;
+
+   size = strlen(method) + 1;
+   va_start(args, count);
+   for (i = 0; i < count; i++) {
+      arg = va_arg(args, const char *);
+      size += arg != NULL ? strlen(arg) + 12 : 2;
+   }
+   va_end(args);
+
+   key = malloc(size);
+   if (key == NULL) return NULL;
+   ptr = key + sprintf(key, "%s", method);
+   // length prefixed so that different arguments never give the same key
+   va_start(args, count);
+   for (i = 0; i < count; i++) {
+      arg = va_arg(args, const char *);
+      if (arg != NULL) ptr += sprintf(ptr, "\n%u:%s", (unsigned int)strlen(arg), arg);
+      else ptr += sprintf(ptr, "\n-");
+   }
+   va_end(args);
+   return key;
+}
+
+/*
+ * Like endpoint_invoke_to(), but joins the request in progress with the same
+ * key if any (set key NULL to never share). The response must be freed with
+ * endpoint_response_free(*flight, *response).
+ */
+herror_t endpoint_invoke_shared(endpoint_group_t *group, int preferred, const char *key, SoapCtx *request, SoapCtx **response, int *index, endpoint_flight_t **flight) {
+   endpoint_flight_t *current, **link;
+   herror_t err;
+
+   *flight = NULL;
+   if (key == NULL) return endpoint_invoke_to(group, preferred, request, response, index);
+
+   hmutex_lock(&group->lock);
+   for (current = group->flights; current != NULL; current = current->next) {
+      if (strcmp(current->key, key) == 0) break;
+   }
+   if (current != NULL) {
+      hatomic_inc(&current->refs);
+      hmutex_unlock(&group->lock);
+
+      // the event is shared by all the callers: a cancelled one only leaves
+      if (hsocket_get_cancel() == NULL) hevent_wait(&current->done);
+      else while (hevent_timedwait(&current->done, ENDPOINT_JOIN_SLICE) != 0) {
+	 if (hsocket_cancelled()) {
+	    endpoint_response_free(current, NULL);
+	    return endpoint_cancelled(group);
+	 }
+      }
+      // the cancellation of the first caller is not the one of the others
+      if (current->failed && current->errcode == HSOCKET_ERROR_CANCELLED && !hsocket_cancelled()) {
+	 endpoint_response_free(current, NULL);
+	 return endpoint_invoke_shared(group, preferred, key, request, response, index, flight);
+      }
+      if (current->failed) {
+	 err = herror_new(current->errfunc != NULL ? current->errfunc : "endpoint_invoke_shared", current->errcode, "%s",
+			  current->errmsg != NULL ? current->errmsg : "Shared request failed");
+	 endpoint_response_free(current, NULL);
+	 return err;
+      }
+      *response = current->response;
+      if (index != NULL) *index = current->index;
+      *flight = current;
+      return H_OK;
+   }
+
+   current = calloc(1, sizeof(endpoint_flight_t));
+   if (current == NULL || hevent_init(&current->done) != 0) {
+      hmutex_unlock(&group->lock);
+      if (current != NULL) free(current);
+      return endpoint_invoke_to(group, preferred, request, response, index);
+   }
+   current->key = key;
+   current->refs = 1;
+   current->next = group->flights;
+   group->flights = current;
+   hmutex_unlock(&group->lock);
+
+   err = endpoint_invoke_to(group, preferred, request, &current->response, &current->index);
+   if (err != H_OK) {
+      current->failed = 1;
+      current->errcode = herror_code(err);
+      current->errfunc = herror_func(err) != NULL ? strdup(herror_func(err)) : NULL;
+      current->errmsg = herror_message(err) != NULL ? strdup(herror_message(err)) : NULL;
+   }
+
+   // later callers start a new request
+   hmutex_lock(&group->lock);
+   for (link = &group->flights; *link != NULL; link = &(*link)->next) {
+      if (*link == current) {
+	 *link = current->next;
+	 break;
+      }
+   }
+   current->key = NULL;
+   hmutex_unlock(&group->lock);
+   hevent_set(&current->done);
+
+   if (err != H_OK) {
+      endpoint_response_free(current, NULL);
+      return err;
+   }
+   *response = current->response;
+   if (index != NULL) *index = current->index;
+   *flight = current;
+   return H_OK;
+}
+
+void endpoint_response_free(endpoint_flight_t *flight, SoapCtx *response) {
+   if (flight == NULL) {
+      if (response != NULL) soap_ctx_free(response);
+      return;
+   }
+   if (hatomic_dec(&flight->refs) > 0) return;
+
+   if (flight->response != NULL) soap_ctx_free(flight->response);
+   if (flight->errfunc != NULL) free(flight->errfunc);
+   if (flight->errmsg != NULL) free(flight->errmsg);
+   hevent_destroy(&flight->done);
+   free(flight);
+}
+
+/*
+ * Session affinity
+ *
+ * A session created by one server (login challenge, TiQR or OpenSSO session)
+ * may be unknown to the others, so the follow-up requests of the session are
+ * sent to the endpoint which created it first. Sessions are kept in a small
+ * open addressed table per group until they expire.
+ */
+
+static unsigned int endpoint_affinity_hash(const char *session) {
+   unsigned int hash = 5381;
+
+   while (*session) hash = hash * 33 + (unsigned char)*session++;
+   return hash;
+}
+
+// returns the slot of the session, or NULL; the group lock must be held
+static endpoint_affinity_t *endpoint_affinity_find(endpoint_group_t *group, const char *session) {
+   endpoint_affinity_t *entry;
+   unsigned int slot;
+   int i;
+
+   slot = endpoint_affinity_hash(session);
+   for (i = 0; i < ENDPOINT_AFFINITY_SIZE; i++) {
+      entry = &group->affinity[(slot + i) % ENDPOINT_AFFINITY_SIZE];
+      if (entry->session[0] == 0) return NULL;
+      if (strcmp(entry->session, session) == 0) return entry;
+   }
+   return NULL;
+}
+
+/*
+ * Returns the endpoint which created the session, or -1 if unknown.
+ */
+int endpoint_affinity_get(endpoint_group_t *group, const char *session) {
+   endpoint_affinity_t *entry;
+   int index = -1;
+
+   if (group->count < 2 || session == NULL) return -1;
+
+   hmutex_lock(&group->lock);
+   entry = endpoint_affinity_find(group, session);
+   if (entry != NULL && entry->expires >= time(NULL)) index = entry->index;
+   hmutex_unlock(&group->lock);
+   return index;
+}
+
+void endpoint_affinity_set(endpoint_group_t *group, const char *session, int index, int ttl) {
+   endpoint_affinity_t *entry, *oldest = NULL;
+   unsigned int slot;
+   time_t now = time(NULL);
+   int i;
+
+   if (group->count < 2 || session == NULL || index < 0) return;
+   if (strlen(session) >= ENDPOINT_SESSION_MAX) return;
+   if (ttl <= 0) ttl = ENDPOINT_AFFINITY_TTL;
+
+   hmutex_lock(&group->lock);
+   entry = endpoint_affinity_find(group, session);
+   if (entry == NULL) {
+      // reuse the first free or expired slot of the probe sequence; when there
+      // is none, the entry closest to expiry makes room (probes stay unbroken
+      // since only entries in use are replaced)
+      slot = endpoint_affinity_hash(session);
+      for (i = 0; i < ENDPOINT_AFFINITY_SIZE; i++) {
+	 entry = &group->affinity[(slot + i) % ENDPOINT_AFFINITY_SIZE];
+	 if (entry->session[0] == 0 || entry->expires < now) break;
+	 if (oldest == NULL || entry->expires < oldest->expires) oldest = entry;
+      }
+      if (i == ENDPOINT_AFFINITY_SIZE) entry = oldest;
+      strcpy(entry->session, session);
+   }
+   entry->index = index;
+   entry->expires = now + ttl;
+   hmutex_unlock(&group->lock);
+}
+
+void endpoint_affinity_clear(endpoint_group_t *group, const char *session) {
+   endpoint_affinity_t *entry;
+
+   if (group->count < 2 || session == NULL) return;
+
+   hmutex_lock(&group->lock);
+   entry = endpoint_affinity_find(group, session);
+   // keep the slot used so the probe sequences through it stay valid
+   if (entry != NULL) entry->expires = 0;
+   hmutex_unlock(&group->lock);
+}
+
+/*
+ * Background prober
+ */
+
+static void endpoint_probe(endpoint_group_t *group, int index) {
+   endpoint_t *endpoint = &group->endpoints[index];
+   SoapCtx *soap_request = NULL;
+   SoapCtx *soap_response = NULL;
+   herror_t err = H_OK;
+   xmlNodePtr method, node;
+   char *value, *name, *message = NULL;
+   int status = 0, connect_timeout, read_timeout;
+   hclock_t start;
+   long rtt, connect;
+
+   err = soap_ctx_new_with_method(group->urn, group->status_method, &soap_request);
+   if (err != H_OK) goto error;
+   soap_request->idempotent = 1;
+
+   // probes give way to the requests of the users, until the next round
+   endpoint_set_priority(ENDPOINT_PRIORITY_BACKGROUND, group->prober_interval * 1000);
+   // not admitted, or stopped (-1) while waiting for a slot: no slot to leave
+   if (endpoint_admit(group, index) <= 0) {
+      soap_ctx_free(soap_request);
+      return;
+   }
+   // a slow server is reported down early when another one can take over
+   if (group->count > 1) endpoint_timeouts(group, index, soap_request, &connect_timeout, &read_timeout);
+   else connect_timeout = read_timeout = 0;
+   hsocket_set_timeouts(connect_timeout, read_timeout);
+   start = hclock_ms();
+   err = soap_client_invoke(soap_request, &soap_response, endpoint->url, "");
+   rtt = (long)(hclock_ms() - start);
+   // stopped, the server did not fail
+   if (err != H_OK && herror_code(err) == HSOCKET_ERROR_CANCELLED) {
+      hsocket_set_timeouts(0, 0);
+      endpoint_leave(group, index);
+      herror_release(err);
+      soap_ctx_free(soap_request);
+      return;
+   }
+   connect = hsocket_get_connect_time();
+   hsocket_set_timeouts(0, 0);
+   endpoint_leave(group, index);
+   if (connect >= 0) {
+      endpoint_report_connect(group, index, connect);
+      rtt -= connect;
+   }
+   if (err != H_OK) goto error;
+
+   if (soap_env_get_fault(soap_response->env)) goto error;
+   method = soap_env_get_method(soap_response->env);
+   if (method == NULL || strcasecmp((char*)method->name, group->status_response) != 0) goto error;
+
+   node = soap_xml_get_children(method);
+   while (node != NULL) {
+      name = (char*)node->name;
+      value = soap_xml_get_text(node);
+      if (value != NULL) {
+	 if (strcasecmp(name, "status") == 0) {
+	    if (strcasecmp(value, "1") == 0 || strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 || strcasecmp(value, "ok") == 0) status = 1;
+	    else status = 0;
+	    xmlFree(value);
+	 }
+	 else if (strcasecmp(name, "message") == 0 && message == NULL) message = value;
+	 else xmlFree(value);
+      }
+      node = soap_xml_get_next(node);
+   }
+
+   endpoint_report(group, index, ENDPOINT_UP, rtt, 1, status, message);
+   if (message != NULL) xmlFree(message);
+   soap_ctx_free(soap_request);
+   soap_ctx_free(soap_response);
+
+   // keep a connection ready for the next request
+   hsocket_set_timeouts(connect_timeout, 0);
+   err = httpc_prepare(endpoint->url);
+   connect = hsocket_get_connect_time();
+   hsocket_set_timeouts(0, 0);
+   if (connect >= 0) endpoint_report_connect(group, index, connect);
+   if (err != H_OK) herror_release(err);
+   return;
+
+   error:
+   if (err != H_OK) {
+      log_verbose3("%s status check failed (%s)", endpoint->url, herror_message(err));
+      herror_release(err);
+   }
+   endpoint_report(group, index, ENDPOINT_DOWN, -1, 0, 0, NULL);
+   if (soap_request != NULL) soap_ctx_free(soap_request);
+   if (soap_response != NULL) soap_ctx_free(soap_response);
+}
+
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+endpoint_prober_thread(void *data) {
+   endpoint_group_t *group = data;
+   int i, wait;
+
+   hsocket_set_cancel(group->prober_cancel);
+   while (group->prober_run) {
+      for (i = 0; i < group->count && group->prober_run; i++) endpoint_probe(group, i);
+      for (wait = group->prober_interval * 10; wait > 0 && group->prober_run; wait--) hthread_msleep(100);
+   }
+   hsocket_set_cancel(NULL);
+
+#ifdef WIN32
+   return 0;
+#else
+   return NULL;
+#endif
+}
+
+// serializes the starts and stops of the probers, held while a prober is joined
+static hmutex_t endpoint_prober_lock = HMUTEX_INITIALIZER;
+
+int endpoint_prober_start(endpoint_group_t *group, int interval, int ttl) {
+   int ok = 0;
+
+   hmutex_lock(&endpoint_prober_lock);
+   if (group->prober_active) goto done;
+   if ((group->prober_cancel = hcancel_new()) == NULL) goto done;
+
+   group->prober_interval = interval > 0 ? interval : 1;
+   group->prober_ttl = ttl;
+   group->prober_run = 1;
+   if (hthread_create(&group->prober_thread, endpoint_prober_thread, group) != 0) {
+      group->prober_run = 0;
+      hcancel_free(group->prober_cancel);
+      group->prober_cancel = NULL;
+      goto done;
+   }
+   group->prober_active = 1;
+   ok = 1;
+
+   done:
+   hmutex_unlock(&endpoint_prober_lock);
+   return ok;
+}
+
+/*
+ * Returns once the prober has exited: the group may be freed afterwards.
+ * A status check in progress is cancelled.
+ */
+void endpoint_prober_stop(endpoint_group_t *group) {
+   hmutex_lock(&endpoint_prober_lock);
+   if (group->prober_active) {
+      group->prober_run = 0;
+      hcancel_trigger(group->prober_cancel);
+      hthread_join(group->prober_thread);
+      hcancel_free(group->prober_cancel);
+      group->prober_cancel = NULL;
+      group->prober_active = 0;
+   }
+   hmutex_unlock(&endpoint_prober_lock);
+}
+
+/*
+ * Returns 1 and the last status reply of the endpoint a request would be
+ * sent to, if the prober received it less than prober_ttl seconds ago.
+ */
+int endpoint_cached_status(endpoint_group_t *group, int *status, char **message) {
+   endpoint_state_t state;
+   int order[ENDPOINT_MAX];
+
+   if (!group->prober_run || group->prober_ttl <= 0) return 0;
+   if (endpoint_order(group, order) == 0) return 0;
+
+   endpoint_get_state(&group->endpoints[order[0]], &state);
+   if (state.health != ENDPOINT_UP || state.checked == 0) return 0;
+   if (time(NULL) - state.checked > group->prober_ttl) return 0;
+
+   *status = state.status;
+   *message = state.message[0] ? strdup(state.message) : NULL;
+   return 1;
+}
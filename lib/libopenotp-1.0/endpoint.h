@@ -0,0 +1,185 @@
+/*
+ RCDevs OpenOTP Development Library
+ Copyright (c) 2010-2013 RCDevs SA, All rights reserved.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __ENDPOINT_H
+#define __ENDPOINT_H
+
+#include <time.h>
+#include "libcsoap/soap-client.h"
+#include "nanohttp/nanohttp-thread.h"
+
+// Server endpoints of one service (OpenOTP, TiQR or OpenSSO) with their
+// health state, used to route SOAP requests to the servers which are up.
+
+#define ENDPOINT_MAX 4
+
+#define ENDPOINT_UNKNOWN 0
+#define ENDPOINT_UP 1
+#define ENDPOINT_DOWN 2
+
+// a server marked down by a failed request is retried after this delay (seconds)
+#define ENDPOINT_DOWN_RETRY 30
+
+// sessions are routed to the endpoint which created them for this long
+// when the reply gives no timeout (seconds)
+#define ENDPOINT_AFFINITY_TTL 300
+#define ENDPOINT_AFFINITY_SIZE 256
+#define ENDPOINT_SESSION_MAX 64
+
+// a caller waiting for the reply of a shared request checks its
+// cancellation token that often (ms)
+#define ENDPOINT_JOIN_SLICE 50
+
+// adaptive timeouts (milliseconds), see endpoint_invoke_to
+#define ENDPOINT_CONNECT_MIN 200
+#define ENDPOINT_READ_MIN 1000
+#define ENDPOINT_RTT_GRANULARITY 50
+
+// admission control: request classes, served in this order when an endpoint is busy
+#define ENDPOINT_PRIORITY_UNLOCK 0
+#define ENDPOINT_PRIORITY_LOGON 1
+#define ENDPOINT_PRIORITY_BACKGROUND 2
+
+// error of a request shed because its deadline could not be met
+#define ENDPOINT_ERROR_BUSY 1800
+
+// published state of one endpoint, read without locking (see endpoint_get_state)
+typedef struct endpoint_state_t {
+   int health;
+   int rtt;          // smoothed round trip time of a request in milliseconds
+   int rttvar;       // and its mean deviation
+   int connect_rtt;  // same for opening a connection
+   int connect_rttvar;
+   time_t updated;   // last health change or request
+   time_t checked;   // last status reply received by the prober
+   int status;       // last status reply
+   char message[128];
+} endpoint_state_t;
+
+typedef struct endpoint_t {
+   char *url;
+   volatile long seq;   // odd while the state is being written
+   endpoint_state_t state;
+   unsigned int hash;   // of the URL, see endpoint_pick
+} endpoint_t;
+
+// session to endpoint binding, protected by the group lock
+typedef struct endpoint_affinity_t {
+   char session[ENDPOINT_SESSION_MAX];
+   int index;
+   time_t expires;
+} endpoint_affinity_t;
+
+// request in progress shared by concurrent identical calls (see endpoint_invoke_shared)
+typedef struct endpoint_flight_t {
+   struct endpoint_flight_t *next;
+   const char *key;      // NULL once the reply is received
+   volatile long refs;
+   hevent_t done;
+   SoapCtx *response;
+   int index;
+   int failed;
+   int errcode;
+   char *errfunc;
+   char *errmsg;
+} endpoint_flight_t;
+
+// caller waiting for a free slot of an endpoint, on its stack
+typedef struct endpoint_waiter_t {
+   struct endpoint_waiter_t *next;
+   int priority;
+   int granted;
+   hevent_t event;
+} endpoint_waiter_t;
+
+typedef struct endpoint_admission_stats_t {
+   long admitted;        // requests sent
+   long queued;          // requests which had to wait for a slot
+   long shed;            // requests refused because of their deadline
+   long queue_time;      // total time spent waiting (milliseconds)
+   long queue_time_max;
+   int active;           // requests in progress, all endpoints
+   int waiting;
+} endpoint_admission_stats_t;
+
+typedef struct endpoint_group_t {
+   const char *name;
+   const char *urn;
+   const char *status_method;
+   const char *status_response;
+   int count;
+   endpoint_t endpoints[ENDPOINT_MAX];
+   hmutex_t lock;   // serializes state writers
+   // background prober, started and stopped under endpoint_prober_lock
+   volatile long prober_run;
+   int prober_active;
+   hthread_t prober_thread;
+   hcancel_t *prober_cancel;     // aborts the status check in progress
+   int prober_interval;
+   int prober_ttl;
+   endpoint_affinity_t affinity[ENDPOINT_AFFINITY_SIZE];
+   endpoint_flight_t *flights;   // shared requests in progress, protected by the group lock
+   // admission control, protected by the group lock
+   int limit;                    // requests in progress per endpoint, 0 for no limit
+   int max_wait;                 // longest wait for a slot (milliseconds), 0 for none
+   int active[ENDPOINT_MAX];
+   endpoint_waiter_t *waiters[ENDPOINT_MAX];
+   endpoint_admission_stats_t stats;
+} endpoint_group_t;
+
+#define ENDPOINT_GROUP_INITIALIZER(name, urn, method, response) \
+   { name, urn, method, response, 0, \
+     {{NULL, 0, {0, 0, 0, 0, 0, 0, 0, 0, ""}, 0}}, \
+     HMUTEX_INITIALIZER, 0, 0, 0, NULL, 0, 0, \
+     {{"", 0, 0}}, NULL, \
+     0, 0, {0}, {NULL}, {0, 0, 0, 0, 0, 0, 0} }
+
+void endpoint_group_set(endpoint_group_t *group, char *url1, char *url2);
+void endpoint_group_set_urls(endpoint_group_t *group, char **urls, int count);
+void endpoint_group_reset(endpoint_group_t *group);
+
+void endpoint_get_state(endpoint_t *endpoint, endpoint_state_t *state);
+int endpoint_order(endpoint_group_t *group, int *order);
+
+unsigned int endpoint_hash(const char *str);
+int endpoint_pick(endpoint_group_t *group, unsigned int key);
+
+herror_t endpoint_invoke(endpoint_group_t *group, SoapCtx *request, SoapCtx **response);
+herror_t endpoint_invoke_to(endpoint_group_t *group, int preferred, SoapCtx *request, SoapCtx **response, int *index);
+herror_t endpoint_invoke_batch(endpoint_group_t *group, SoapCtx **requests, SoapCtx **responses, herror_t *errors, int count);
+herror_t endpoint_invoke_batch_to(endpoint_group_t *group, int *preferred, SoapCtx **requests, SoapCtx **responses, herror_t *errors, int *indexes, int count);
+
+char *endpoint_flight_key(const char *method, int count, ...);
+herror_t endpoint_invoke_shared(endpoint_group_t *group, int preferred, const char *key, SoapCtx *request, SoapCtx **response, int *index, endpoint_flight_t **flight);
+void endpoint_response_free(endpoint_flight_t *flight, SoapCtx *response);
+
+void endpoint_set_priority(int priority, int timeout);
+void endpoint_get_priority(int *priority, int *timeout);
+void endpoint_admission_set(endpoint_group_t *group, int limit, int max_wait);
+void endpoint_admission_stats(endpoint_group_t *group, endpoint_admission_stats_t *stats);
+
+int endpoint_affinity_get(endpoint_group_t *group, const char *session);
+void endpoint_affinity_set(endpoint_group_t *group, const char *session, int index, int ttl);
+void endpoint_affinity_clear(endpoint_group_t *group, const char *session);
+
+int endpoint_prober_start(endpoint_group_t *group, int interval, int ttl);
+void endpoint_prober_stop(endpoint_group_t *group);
+int endpoint_cached_status(endpoint_group_t *group, int *status, char **message);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-cache.h>
+
+// Checks the cache file of nanohttp shared between processes: an entry written by one
+// process is read by another which mapped the file on its own, a reader never gets an
+// entry half written by a writer of another process, the file is created with mode 0600
+// and a file other users may write is refused, and hcache_open() / hcache_close() while
+// threads read the cache neither crash them nor hand them an unmapped page. After each
+// hcache_open() or hcache_close() the test maps an inaccessible block of the size of the
+// file, which takes the place of a mapping just released, so that a reader still using
+// it faults instead of reading a new mapping at the same address.
+
+#define TYPE 100
+#define VALUE 1000
+#define RUN_MS 500
+#define READERS 4
+#define SWAPS 300
+#define FILE_SIZE (HCACHE_SLOT_SIZE * (HCACHE_SLOTS + 1))
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+static long long now_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int open_cache(const char *path) {
+   herror_t status = hcache_open(path);
+
+   if (status == H_OK) return 1;
+   herror_release(status);
+   return 0;
+}
+
+// waits up to 'ms' for the entry 'key' to hold 'value'
+static int wait_entry(const char *key, const char *value, int ms) {
+   char data[64];
+   int length;
+   long long end = now_ms() + ms;
+
+   do {
+      length = hcache_get(TYPE, key, data, sizeof(data) - 1);
+      if (length >= 0) {
+         data[length] = '\0';
+         if (!strcmp(data, value)) return 1;
+      }
+      usleep(1000);
+   } while (now_ms() < end);
+   return 0;
+}
+
+// a value of VALUE bytes all equal to 'n'
+static void fill(unsigned char *data, int n) {
+   memset(data, n & 0xff, VALUE);
+}
+
+static int whole(const unsigned char *data, int length) {
+   int i;
+
+   if (length != VALUE) return 0;
+   for (i = 1; i < length; i++)
+      if (data[i] != data[0]) return 0;
+   return 1;
+}
+
+static volatile int stop = 0;
+static volatile long reads = 0, torn = 0;
+
+static void *reader(void *arg) {
+   unsigned char data[VALUE];
+   int length;
+
+   while (!stop) {
+      if ((length = hcache_get(TYPE, "shared", data, sizeof(data))) >= 0 && !whole(data, length))
+         __sync_fetch_and_add(&torn, 1);
+      hcache_put(TYPE, "reader", "x", 1, 60);
+      __sync_fetch_and_add(&reads, 1);
+   }
+   return NULL;
+}
+
+int main(int argc, char *argv[]) {
+   char dir[] = "/tmp/nanohttp_cache_testXXXXXX";
+   char path[256], other[256], open_path[256], *paths[2];
+   void *guards[SWAPS];
+   unsigned char data[VALUE];
+   pthread_t threads[READERS];
+   struct stat st;
+   pid_t child;
+   long long end;
+   int status, length, fd, i, n;
+
+   if (mkdtemp(dir) == NULL) {
+      printf("FAIL: cannot create %s\n", dir);
+      return 1;
+   }
+   snprintf(path, sizeof(path), "%s/cache", dir);
+   snprintf(other, sizeof(other), "%s/other", dir);
+   snprintf(open_path, sizeof(open_path), "%s/open", dir);
+
+   check(open_cache(path) && hcache_enabled(), "hcache_open() creates the file");
+   check(stat(path, &st) == 0 && (st.st_mode & 0777) == 0600, "the file has mode 0600");
+
+   // each process maps the file on its own after the fork
+   hcache_close();
+   if ((child = fork()) == 0) {
+      if (!open_cache(path)) _exit(2);
+      hcache_put(TYPE, "child", "from the child", 15, 60);
+      _exit(wait_entry("parent", "from the parent", 5000) ? 0 : 1);
+   }
+   open_cache(path);
+   hcache_put(TYPE, "parent", "from the parent", 15, 60);
+   check(wait_entry("child", "from the child", 5000), "the parent reads the entry of the child");
+   check(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+         "the child reads the entry of the parent");
+
+   // a writer in another process against readers in this one
+   if ((child = fork()) == 0) {
+      if (!open_cache(path)) _exit(2);
+      end = now_ms() + RUN_MS;
+      for (n = 0; now_ms() < end; n++) {
+         fill(data, n);
+         hcache_put(TYPE, "shared", data, VALUE, 60);
+      }
+      _exit(0);
+   }
+   for (i = 0; i < READERS; i++)
+      pthread_create(&threads[i], NULL, reader, NULL);
+   waitpid(child, &status, 0);
+   stop = 1;
+   for (i = 0; i < READERS; i++)
+      pthread_join(threads[i], NULL);
+   length = hcache_get(TYPE, "shared", data, sizeof(data));
+   printf("%ld reads against the writer of another process\n", reads);
+   check(WIFEXITED(status) && WEXITSTATUS(status) == 0 && whole(data, length), "the writer process filled the entry");
+   check(torn == 0, "readers never get a half written entry");
+
+   // a file other users may write could redirect the requests
+   fd = open(other, O_RDWR | O_CREAT, 0600);
+   check(fd >= 0 && fchmod(fd, 0666) == 0 && !open_cache(other), "a file writable by others is refused");
+   close(fd);
+   check(hcache_enabled() && wait_entry("child", "from the child", 0), "the open file is kept after a refusal");
+   check(open_cache(path) && wait_entry("child", "from the child", 0), "opening the same file again keeps it");
+
+   // the mapping replaced and closed under the readers
+   stop = 0;
+   reads = 0;
+   paths[0] = path;
+   paths[1] = open_path;
+   for (i = 0; i < READERS; i++)
+      pthread_create(&threads[i], NULL, reader, NULL);
+   for (n = 0; n < SWAPS; n++) {
+      if (n % 3 == 2)
+         hcache_close();
+      else
+         open_cache(paths[n % 2]);
+      guards[n] = mmap(NULL, FILE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      usleep(1000);
+   }
+   stop = 1;
+   for (i = 0; i < READERS; i++)
+      pthread_join(threads[i], NULL);
+   for (i = 0; i < SWAPS; i++)
+      if (guards[i] != MAP_FAILED) munmap(guards[i], FILE_SIZE);
+   printf("%d opens and closes under %ld reads\n", n, reads);
+   check(n > 0 && reads > 0, "hcache_open() and hcache_close() under the readers");
+
+   hcache_close();
+   check(!hcache_enabled() && hcache_get(TYPE, "child", data, sizeof(data)) == -1, "nothing read once closed");
+
+   unlink(path);
+   unlink(other);
+   unlink(open_path);
+   rmdir(dir);
+   return failures ? 1 : 0;
+}
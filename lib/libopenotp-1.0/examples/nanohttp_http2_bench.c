@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nanohttp_tls_server.h"
+
+// Compares SOAP sized POSTs over HTTPS with the pooled HTTP/1.1 connections of httpc,
+// a connection per concurrent request, and with streams of a single HTTP/2 session,
+// against the server of nanohttp_tls_server.h. Each mode runs on one thread and then on
+// THREADS threads at once; the connections are opened by a warm-up before the timing, so
+// the difference is the framing and the header coding of each request, and for the
+// concurrent runs the sharing of one TLS connection.
+
+#define THREADS 8
+#define REQUEST 800
+#define RESPONSE 600
+
+static void usage(char *prog) {
+   printf("Usage: %s [<ITERATIONS>]\n", prog);
+   fflush(stdout);
+   exit(1);
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char request_body[REQUEST], response_body[RESPONSE];
+static char url[64];
+static long iterations = 2000;
+
+// reads the request and answers RESPONSE bytes
+static void service(httpd_conn_t *conn, hrequest_t *req) {
+   char buffer[1024], length[16];
+
+   while (http_input_stream_is_ready(req->in))
+      if (http_input_stream_read(req->in, (byte_t *) buffer, sizeof(buffer)) <= 0) break;
+   sprintf(length, "%d", RESPONSE);
+   httpd_set_header(conn, HEADER_CONTENT_LENGTH, length);
+   httpd_set_header(conn, HEADER_CONTENT_TYPE, "text/xml");
+   httpd_send_header(conn, 200, "OK");
+   http_output_stream_write(conn->out, (byte_t *) response_body, RESPONSE);
+}
+
+static void post(http_version_t version) {
+   httpc_conn_t *conn = httpc_new();
+   hresponse_t *res = NULL;
+   herror_t status;
+   char buffer[1024], length[16];
+   int total = 0, n;
+
+   sprintf(length, "%d", REQUEST);
+   httpc_set_header(conn, HEADER_CONTENT_LENGTH, length);
+   httpc_set_header(conn, HEADER_CONTENT_TYPE, "text/xml");
+   httpc_set_header(conn, "SOAPAction", "\"openotpSimpleLogin\"");
+   if ((status = httpc_post_begin(conn, url)) != H_OK
+      || (status = http_output_stream_write(conn->out, (byte_t *) request_body, REQUEST)) != H_OK
+      || (status = httpc_post_end(conn, &res)) != H_OK) {
+      printf("POST failed (%s)\n", herror_message(status));
+      exit(1);
+   }
+   while (http_input_stream_is_ready(res->in)
+          && (n = http_input_stream_read(res->in, (byte_t *) buffer, sizeof(buffer))) > 0)
+      total += n;
+   if (res->errcode != 200 || res->version != version || total != RESPONSE) {
+      printf("Unexpected response (%d, version %d, %d bytes)\n", res->errcode, res->version, total);
+      exit(1);
+   }
+   if (httpc_response_reusable(res)) {
+      hresponse_free(res);
+      httpc_park_free(conn);
+   } else {
+      hresponse_free(res);
+      httpc_close_free(conn);
+   }
+}
+
+static http_version_t run_version;
+
+static void *run(void *arg) {
+   long i;
+
+   for (i=0; i<iterations; i++)
+      post(run_version);
+   return NULL;
+}
+
+// ns per request of 'threads' threads posting 'iterations' requests each
+static double timed(http_version_t version, int threads) {
+   pthread_t ids[THREADS];
+   double start;
+   int i;
+
+   run_version = version;
+   start = now();
+   for (i=0; i<threads; i++)
+      pthread_create(&ids[i], NULL, run, NULL);
+   for (i=0; i<threads; i++)
+      pthread_join(ids[i], NULL);
+   return (now() - start) / (iterations * threads);
+}
+
+// opens the connections of THREADS concurrent requests
+static void warm_up(http_version_t version) {
+   long saved = iterations;
+
+   iterations = 20;
+   timed(version, THREADS);
+   iterations = saved;
+}
+
+int main(int argc, char *argv[]) {
+   double h1_one, h1_many, h2_one, h2_many;
+
+   if (argc > 2) usage(argv[0]);
+   if (argc == 2 && (iterations = atol(argv[1])) <= 0) usage(argv[0]);
+
+   memset(request_body, 'q', REQUEST);
+   memset(response_body, 'r', RESPONSE);
+   signal(SIGPIPE, SIG_IGN);
+   if (!tls_server_start(service)) exit(1);
+
+   // the pool and the sessions are kept per host: each mode has its own
+   tls_server_alpn(0, 0);
+   snprintf(url, sizeof(url), "https://127.0.0.1:%d/soap", tls_server_port);
+   warm_up(HTTP_1_1);
+   h1_one = timed(HTTP_1_1, 1);
+   h1_many = timed(HTTP_1_1, THREADS);
+
+   tls_server_alpn(1, 1);
+   snprintf(url, sizeof(url), "https://127.0.0.2:%d/soap", tls_server_port);
+   warm_up(HTTP_2);
+   h2_one = timed(HTTP_2, 1);
+   h2_many = timed(HTTP_2, THREADS);
+
+   printf("HTTP/1.1 pool, 1 thread: %.1f ns per request\n", h1_one);
+   printf("HTTP/2 session, 1 thread: %.1f ns per request\n", h2_one);
+   printf("HTTP/1.1 pool, %d threads: %.1f ns per request\n", THREADS, h1_many);
+   printf("HTTP/2 session, %d threads: %.1f ns per request\n", THREADS, h2_many);
+
+   tls_server_stop();
+   exit(0);
+}
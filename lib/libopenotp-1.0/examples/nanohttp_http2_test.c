@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <nanohttp/nanohttp-http2.h>
+#include "nanohttp_tls_server.h"
+
+// Checks the HTTP/2 transport of nanohttp in two ways.
+//  - Against a peer written here which frames the replies by hand, on a cleartext
+//    connection given to http2_session_new(): the client preface, the SETTINGS exchange
+//    and SETTINGS_MAX_CONCURRENT_STREAMS, the Huffman coded header block of RFC 7541 C.6.1
+//    split in HEADERS and CONTINUATION, fields taken from the dynamic table in the next
+//    block, RST_STREAM with REFUSED_STREAM and CANCEL, GOAWAY, and a COMPRESSION_ERROR.
+//  - Through httpc against the server of nanohttp_tls_server.h: a client offering "h2" to
+//    a server whose ALPN does not select it falls back to HTTP/1.1, and once the server
+//    selects it, the headers of the requests come back unchanged from the server: HPACK
+//    encoded and decoded both ways, Huffman coded or not, indexed or not.
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_GOAWAY 0x7
+#define H2_CONTINUATION 0x9
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define ROUNDS 20
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+// RFC 7541 C.6.1: :status 302, cache-control private, date, location, Huffman coded
+static const unsigned char rfc_block[] = {
+   0x48, 0x82, 0x64, 0x02, 0x58, 0x85, 0xae, 0xc3, 0x77, 0x1a, 0x4b, 0x61, 0x96, 0xd0, 0x7a, 0xbe,
+   0x94, 0x10, 0x54, 0xd4, 0x44, 0xa8, 0x20, 0x05, 0x95, 0x04, 0x0b, 0x81, 0x66, 0xe0, 0x82, 0xa6,
+   0x2d, 0x1b, 0xff, 0x6e, 0x91, 0x9d, 0x29, 0xad, 0x17, 0x18, 0x63, 0xc7, 0x8f, 0x0b, 0x97, 0xc8,
+   0xe9, 0xae, 0x82, 0xae, 0x43, 0xd3
+};
+
+// the four fields of rfc_block, from the dynamic table
+static const unsigned char indexed_block[] = { 0xc1, 0xc0, 0xbf, 0xbe };
+
+// :status 200 from the static table
+static const unsigned char ok_block[] = { 0x88 };
+
+// index 70: past the static table and the empty dynamic table
+static const unsigned char bad_block[] = { 0xc6 };
+
+/*
+ * The peer
+ */
+
+static int settings_acked = 0;
+
+static int peer_read(int fd, void *buffer, int size) {
+   int done = 0, n;
+
+   while (done < size) {
+      if ((n = recv(fd, (char *) buffer + done, size - done, 0)) <= 0) return 0;
+      done += n;
+   }
+   return 1;
+}
+
+static void peer_send(int fd, int type, int flags, unsigned int id, const void *payload, int length) {
+   unsigned char header[9];
+
+   header[0] = length >> 16;
+   header[1] = length >> 8;
+   header[2] = length;
+   header[3] = type;
+   header[4] = flags;
+   header[5] = id >> 24;
+   header[6] = id >> 16;
+   header[7] = id >> 8;
+   header[8] = id;
+   send(fd, header, 9, MSG_NOSIGNAL);
+   if (length > 0) send(fd, payload, length, MSG_NOSIGNAL);
+}
+
+static void peer_settings(int fd, int max_streams) {
+   unsigned char setting[6] = { 0, 0x3, max_streams >> 24, max_streams >> 16, max_streams >> 8, max_streams };
+   peer_send(fd, H2_SETTINGS, 0, 0, setting, 6);
+}
+
+static void peer_code(int fd, int type, unsigned int id, unsigned int last, unsigned int code) {
+   unsigned char payload[8] = { last >> 24, last >> 16, last >> 8, last, code >> 24, code >> 16, code >> 8, code };
+
+   if (type == H2_GOAWAY)
+      peer_send(fd, type, 0, id, payload, 8);
+   else
+      peer_send(fd, type, 0, id, payload + 4, 4);
+}
+
+// reads the frames of the client until one of 'type' (with the ACK flag for SETTINGS),
+// acknowledging its SETTINGS on the way; returns its stream and fills 'payload'
+static int peer_expect(int fd, int type, unsigned int *id, int *flags, unsigned char *payload) {
+   unsigned char header[9], buffer[16384];
+   int length;
+
+   for (;;) {
+      if (!peer_read(fd, header, 9)) return 0;
+      length = (header[0] << 16) | (header[1] << 8) | header[2];
+      if (length > (int) sizeof(buffer) || !peer_read(fd, buffer, length)) return 0;
+      if (header[3] == H2_SETTINGS && (header[4] & FLAG_ACK))
+         settings_acked++;
+      else if (header[3] == H2_SETTINGS)
+         peer_send(fd, H2_SETTINGS, FLAG_ACK, 0, NULL, 0);
+      if (header[3] != type || (type == H2_SETTINGS && !(header[4] & FLAG_ACK))) continue;
+      if (id) *id = ((header[5] & 0x7f) << 24) | (header[6] << 16) | (header[7] << 8) | header[8];
+      if (flags) *flags = header[4];
+      if (payload) memcpy(payload, buffer, length);
+      return 1;
+   }
+}
+
+static int peer_listen(int *port) {
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 4) < 0
+      || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+      perror("peer");
+      exit(1);
+   }
+   *port = ntohs(addr.sin_port);
+   return fd;
+}
+
+// opens a client session to the peer and returns the socket of the peer
+static int peer_session(int listener, int port, hurl_t *url, http2_session_t **session) {
+   struct timeval timeout = { 5, 0 };
+   char preface[24];
+   hsocket_t sock;
+   herror_t status;
+   int fd;
+
+   hsocket_init(&sock);
+   if ((status = hsocket_open(&sock, "127.0.0.1", port, 0)) != H_OK) {
+      printf("Cannot connect to the peer (%s)\n", herror_message(status));
+      exit(1);
+   }
+   fd = accept(listener, NULL, NULL);
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   if ((status = http2_session_new(&sock, url, session)) != H_OK) {
+      printf("Cannot start the session (%s)\n", herror_message(status));
+      exit(1);
+   }
+   check(peer_read(fd, preface, 24) && !memcmp(preface, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24), "client preface");
+   return fd;
+}
+
+static herror_t request(http2_session_t *session, hurl_t *url, http2_stream_t **queue) {
+   return http2_send(session, HTTP_REQUEST_GET, url, NULL, NULL, 0, queue);
+}
+
+static int error_code(herror_t status) {
+   int code = status == H_OK ? 0 : herror_code(status);
+
+   if (status != H_OK) herror_release(status);
+   return code;
+}
+
+static int is_header(hresponse_t *res, const char *name, const char *value) {
+   char *got = hpairnode_get_ignore_case(res->header, (char *) name);
+   return got != NULL && !strcmp(got, value);
+}
+
+static int is_rfc_response(hresponse_t *res) {
+   return res->errcode == 302 && is_header(res, "cache-control", "private")
+      && is_header(res, "date", "Mon, 21 Oct 2013 20:13:21 GMT")
+      && is_header(res, "location", "https://www.example.com");
+}
+
+static void peer_checks() {
+   http2_stream_t *queue = NULL;
+   http2_session_t *session, *found;
+   hresponse_t *res = NULL;
+   unsigned char payload[16384];
+   unsigned int id, a, b;
+   char url_text[64], body[16];
+   int listener, port, fd, flags, n;
+   herror_t status;
+   hurl_t url;
+
+   listener = peer_listen(&port);
+   snprintf(url_text, sizeof(url_text), "http://127.0.0.1:%d/peer", port);
+   hurl_parse(&url, url_text);
+   fd = peer_session(listener, port, &url, &session);
+
+   peer_settings(fd, 1);
+   check(peer_expect(fd, H2_SETTINGS, NULL, NULL, NULL) && settings_acked == 1, "the client acknowledges the SETTINGS of the server");
+
+   check(request(session, &url, &queue) == H_OK, "request sent");
+   found = http2_session_find(&url);
+   check(found == NULL, "SETTINGS_MAX_CONCURRENT_STREAMS 1 keeps a second request off the session");
+   http2_session_release(found);
+
+   // the block split in the middle of the Huffman coded date
+   check(peer_expect(fd, H2_HEADERS, &id, &flags, NULL) && id == 1 && (flags & FLAG_END_STREAM) && (flags & FLAG_END_HEADERS),
+         "request HEADERS on stream 1");
+   peer_send(fd, H2_HEADERS, FLAG_END_STREAM, id, rfc_block, 20);
+   peer_send(fd, H2_CONTINUATION, 0, id, rfc_block + 20, 10);
+   peer_send(fd, H2_CONTINUATION, FLAG_END_HEADERS, id, rfc_block + 30, sizeof(rfc_block) - 30);
+   status = http2_receive(&queue, &res);
+   check(status == H_OK && res->version == HTTP_2 && is_rfc_response(res),
+         "Huffman coded block of RFC 7541 C.6.1 in HEADERS and CONTINUATION");
+   if (status == H_OK) hresponse_free(res); else herror_release(status);
+   found = http2_session_find(&url);
+   check(found == session, "the session takes a request again once the stream is done");
+   http2_session_release(found);
+
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &id, NULL, NULL);
+   peer_send(fd, H2_HEADERS, FLAG_END_HEADERS, id, indexed_block, sizeof(indexed_block));
+   peer_send(fd, H2_DATA, FLAG_END_STREAM, id, "hello", 5);
+   status = http2_receive(&queue, &res);
+   n = status == H_OK ? http_input_stream_read(res->in, (byte_t *) body, sizeof(body) - 1) : -1;
+   check(status == H_OK && is_rfc_response(res) && n == 5 && !memcmp(body, "hello", 5),
+         "fields of the dynamic table from the previous block, and the DATA");
+   if (status == H_OK) hresponse_free(res); else herror_release(status);
+
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &id, NULL, NULL);
+   peer_code(fd, H2_RST_STREAM, id, 0, 0x7);
+   check(error_code(http2_receive(&queue, &res)) == HTTP2_ERROR_REFUSED, "RST_STREAM REFUSED_STREAM fails the request as refused");
+
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &id, NULL, NULL);
+   peer_code(fd, H2_RST_STREAM, id, 0, 0x8);
+   check(error_code(http2_receive(&queue, &res)) == HTTP2_ERROR_STREAM, "RST_STREAM CANCEL fails the request");
+
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &id, NULL, NULL);
+   peer_send(fd, H2_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, id, ok_block, sizeof(ok_block));
+   status = http2_receive(&queue, &res);
+   check(status == H_OK && res->errcode == 200, "the session goes on after the resets");
+   if (status == H_OK) hresponse_free(res); else herror_release(status);
+
+   // two streams, the server going away after the first one
+   peer_settings(fd, 10);
+   peer_expect(fd, H2_SETTINGS, NULL, NULL, NULL);
+   request(session, &url, &queue);
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &a, NULL, NULL);
+   peer_expect(fd, H2_HEADERS, &b, NULL, NULL);
+   peer_send(fd, H2_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, a, ok_block, sizeof(ok_block));
+   peer_code(fd, H2_GOAWAY, 0, a, 0);
+   status = http2_receive(&queue, &res);
+   check(status == H_OK && res->errcode == 200, "GOAWAY: the streams up to the last one are answered");
+   if (status == H_OK) hresponse_free(res); else herror_release(status);
+   check(error_code(http2_receive(&queue, &res)) == HTTP2_ERROR_REFUSED, "GOAWAY: the streams above the last one are refused");
+   found = http2_session_find(&url);
+   check(found == NULL, "GOAWAY: no new request finds the session");
+   http2_session_release(found);
+   check(error_code(request(session, &url, &queue)) == HTTP2_ERROR_REFUSED, "GOAWAY: the session refuses new streams");
+   http2_session_release(session);
+   check(!peer_expect(fd, -1, NULL, NULL, NULL), "the connection is closed once the session is released");
+   close(fd);
+
+   // a field index out of the tables
+   fd = peer_session(listener, port, &url, &session);
+   request(session, &url, &queue);
+   peer_expect(fd, H2_HEADERS, &id, NULL, NULL);
+   peer_send(fd, H2_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, id, bad_block, sizeof(bad_block));
+   check(error_code(http2_receive(&queue, &res)) == HTTP2_ERROR_PROTOCOL, "a bad header block fails the request");
+   check(peer_expect(fd, H2_GOAWAY, NULL, NULL, payload) && payload[7] == 0x9, "and the connection with COMPRESSION_ERROR");
+   http2_session_release(session);
+   close(fd);
+   close(listener);
+}
+
+/*
+ * Through httpc and the server
+ */
+
+static volatile http_version_t served_version;
+
+// sends back the x-echo and authorization headers, and the path
+static void echo(httpd_conn_t *conn, hrequest_t *req) {
+   hpair_t *pair;
+   char length[16];
+
+   served_version = req->version;
+   for (pair = req->header; pair; pair = pair->next)
+      if (!strncasecmp(pair->key, "x-echo", 6) || !strcasecmp(pair->key, "authorization"))
+         httpd_add_header(conn, pair->key, pair->value);
+   sprintf(length, "%d", (int) strlen(req->path));
+   httpd_set_header(conn, HEADER_CONTENT_LENGTH, length);
+   httpd_send_header(conn, 200, "OK");
+   http_output_stream_write_string(conn->out, req->path);
+}
+
+// GETs 'url' with the given x-echo headers and checks they come back with the path
+static int get(const char *url, const char *path, const char **headers, http_version_t version) {
+   httpc_conn_t *conn = httpc_new();
+   hresponse_t *res = NULL;
+   herror_t status;
+   char body[256], full[128];
+   int ok, n, i;
+
+   for (i = 0; headers && headers[i]; i += 2)
+      httpc_add_header(conn, headers[i], headers[i + 1]);
+   snprintf(full, sizeof(full), "%s%s", url, path);
+   if ((status = httpc_get(conn, &res, full)) != H_OK) {
+      printf("GET %s failed (%s)\n", full, herror_message(status));
+      herror_release(status);
+      httpc_close_free(conn);
+      return 0;
+   }
+   n = http_input_stream_read(res->in, (byte_t *) body, sizeof(body) - 1);
+   ok = res->errcode == 200 && res->version == version && served_version == version
+      && n == (int) strlen(path) && !memcmp(body, path, n);
+   for (i = 0; headers && headers[i]; i += 2)
+      ok = ok && is_header(res, headers[i], headers[i + 1]);
+   if (httpc_response_reusable(res)) {
+      hresponse_free(res);
+      httpc_park_free(conn);
+   } else {
+      hresponse_free(res);
+      httpc_close_free(conn);
+   }
+   return ok;
+}
+
+static void alpn_checks() {
+   char plain[64], h2[64], value[80], path[32];
+   const char *headers[] = {
+      // shorter Huffman coded
+      "x-echo-text", "a lowercase value which the huffman code makes shorter",
+      // longer Huffman coded: sent as is
+      "x-echo-raw", "~{|}^~{|}^~{|}^\\",
+      // never indexed
+      "authorization", "Basic dXNlcjpwYXNz",
+      // a new value each time, under a name of the dynamic table
+      "x-echo-count", value,
+      NULL
+   };
+   hurl_t url;
+   http2_session_t *session;
+   int i, ok;
+
+   snprintf(plain, sizeof(plain), "https://127.0.0.1:%d", tls_server_port);
+   snprintf(h2, sizeof(h2), "https://127.0.0.2:%d", tls_server_port);
+
+   // the client offers h2, the server selects nothing
+   tls_server_alpn(0, 1);
+   strcpy(value, "0");
+   check(get(plain, "/fallback", headers, HTTP_1_1), "a client offering h2 falls back to HTTP/1.1 without ALPN h2");
+   snprintf(value, sizeof(value), "%s/", plain);
+   hurl_parse(&url, value);
+   session = http2_session_find(&url);
+   check(session == NULL, "no HTTP/2 session to that server");
+   http2_session_release(session);
+
+   tls_server_alpn(1, 1);
+   for (i = 0, ok = 1; i < ROUNDS; i++) {
+      snprintf(value, sizeof(value), "%d", i * 7919);
+      snprintf(path, sizeof(path), "/round/%d", i);
+      ok = ok && get(h2, path, headers, HTTP_2);
+   }
+   check(ok, "headers sent over h2 come back unchanged, Huffman coded or not, indexed or not");
+   snprintf(value, sizeof(value), "%s/", h2);
+   hurl_parse(&url, value);
+   session = http2_session_find(&url);
+   check(session != NULL, "the requests share one HTTP/2 session");
+   http2_session_release(session);
+}
+
+int main(int argc, char *argv[]) {
+   // the peer closes connections the sessions may still write to
+   signal(SIGPIPE, SIG_IGN);
+   if (!tls_server_start(echo)) return 1;
+
+   peer_checks();
+   alpn_checks();
+
+   tls_server_stop();
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <nanohttp/nanohttp-pool.h>
+
+// Checks the block pool of nanohttp: the alignment of the blocks, that a thread which
+// allocates and releases in a loop stops calling malloc once its free lists are filled,
+// that larger blocks always go to malloc, that the lists of a thread are given back
+// when it exits, and that hpool_destroy() gives back the lists of all the threads and
+// leaves a pool which still works. Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=free against
+// libopenotp.a so that the calls of the pool to malloc and free are counted.
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void __real_free(void *ptr);
+
+static volatile long mallocs = 0, frees = 0;
+
+void *__wrap_malloc(size_t size) {
+   __sync_fetch_and_add(&mallocs, 1);
+   return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+   __sync_fetch_and_add(&mallocs, 1);
+   return __real_calloc(count, size);
+}
+
+void __wrap_free(void *ptr) {
+   if (ptr != NULL) __sync_fetch_and_add(&frees, 1);
+   __real_free(ptr);
+}
+
+#define BLOCKS HPOOL_CACHE_MAX
+#define ROUNDS 10000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+struct align_double { char c; double x; };
+struct align_long_long { char c; long long x; };
+struct align_pointer { char c; void *x; };
+
+static size_t max_align() {
+   size_t align = offsetof(struct align_double, x);
+   if (offsetof(struct align_long_long, x) > align) align = offsetof(struct align_long_long, x);
+   if (offsetof(struct align_pointer, x) > align) align = offsetof(struct align_pointer, x);
+   return align;
+}
+
+// allocates and releases BLOCKS blocks of each size, ROUNDS times
+static void churn(size_t size) {
+   void *blocks[BLOCKS];
+   int round, i;
+
+   for (round = 0; round < ROUNDS; round++) {
+      for (i = 0; i < BLOCKS; i++) blocks[i] = hpool_alloc(size);
+      for (i = 0; i < BLOCKS; i++) hpool_free(blocks[i]);
+   }
+}
+
+static void *thread_churn(void *data) {
+   churn((size_t) HPOOL_MIN_SIZE);
+   return NULL;
+}
+
+static volatile int parked = 0, release = 0;
+
+// keeps its lists until released
+static void *thread_park(void *data) {
+   churn((size_t) HPOOL_MIN_SIZE);
+   parked = 1;
+   while (!release) usleep(1000);
+   return NULL;
+}
+
+int main(int argc, char *argv[]) {
+   size_t align = max_align(), size, largest = (size_t) HPOOL_MIN_SIZE << (HPOOL_CLASSES - 1);
+   long before_mallocs, before_frees;
+   pthread_t thread;
+   void *ptr;
+   int misaligned = 0, c;
+
+   for (size = 1; size <= 2 * largest; size += 7) {
+      ptr = hpool_alloc(size);
+      if (ptr == NULL || (size_t) ptr % align != 0) misaligned++;
+      hpool_free(ptr);
+   }
+   check(misaligned == 0, "blocks aligned like malloc");
+
+   // the first round fills the free lists of each class
+   for (c = 0; c < HPOOL_CLASSES; c++) churn((size_t) HPOOL_MIN_SIZE << c);
+   before_mallocs = mallocs;
+   for (c = 0; c < HPOOL_CLASSES; c++) churn((size_t) HPOOL_MIN_SIZE << c);
+   printf("%ld mallocs for %ld pooled allocations\n", mallocs - before_mallocs, (long) HPOOL_CLASSES * ROUNDS * BLOCKS);
+   check(mallocs == before_mallocs, "no malloc once the free lists are filled");
+
+   before_mallocs = mallocs;
+   before_frees = frees;
+   churn(largest + 1);
+   check(mallocs - before_mallocs == (long) ROUNDS * BLOCKS && frees - before_frees == (long) ROUNDS * BLOCKS,
+         "larger blocks go to malloc");
+
+   before_mallocs = mallocs;
+   before_frees = frees;
+   if (pthread_create(&thread, NULL, thread_churn, NULL) != 0 || pthread_join(thread, NULL) != 0) {
+      printf("FAIL: cannot run the thread\n");
+      return 1;
+   }
+   // only the calls of the pool are wrapped, not those of the C library for the thread
+   check(mallocs - before_mallocs == frees - before_frees, "lists released when the thread exits");
+
+   // the lists of this thread are full, those of the parked thread hold one class
+   for (c = 0; c < HPOOL_CLASSES; c++) churn((size_t) HPOOL_MIN_SIZE << c);
+   if (pthread_create(&thread, NULL, thread_park, NULL) != 0) {
+      printf("FAIL: cannot run the thread\n");
+      return 1;
+   }
+   while (!parked) usleep(1000);
+   before_mallocs = mallocs;
+   before_frees = frees;
+   hpool_destroy();
+   check(mallocs == before_mallocs && frees - before_frees == (long) (HPOOL_CLASSES + 1) * BLOCKS + 2,
+         "hpool_destroy() releases the lists of all the threads");
+   before_frees = frees;
+   release = 1;
+   pthread_join(thread, NULL);
+   check(frees == before_frees, "nothing left to release when the thread exits");
+
+   churn((size_t) HPOOL_MIN_SIZE);
+   before_mallocs = mallocs;
+   churn((size_t) HPOOL_MIN_SIZE);
+   check(mallocs == before_mallocs, "the pool works again after hpool_destroy()");
+
+   return failures ? 1 : 0;
+}
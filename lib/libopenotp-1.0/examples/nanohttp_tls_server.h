@@ -0,0 +1,151 @@
+#ifndef NANOHTTP_TLS_SERVER_H
+#define NANOHTTP_TLS_SERVER_H
+
+// In-process HTTPS server of nanohttp for the tests and benchmarks of the examples, on a
+// free port: a self-signed certificate is written to a temporary file, the server takes
+// HTTP/2 when ALPN selects it and HTTP/1.1 with keep-alive otherwise, and every path goes
+// to the given service. The SSL context is shared with the clients of the process: a
+// client offers "h2" when hssl_set_http2(1) was called, the server accepts it when the
+// context was last built by hssl_module_init() with HTTP/2 on (see tls_server_alpn()).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-server.h>
+#include <nanohttp/nanohttp-client.h>
+#include <nanohttp/nanohttp-ssl.h>
+
+static char tls_server_dir[] = "/tmp/nanohttp_tls_serverXXXXXX";
+static char tls_server_pem[64];
+static pthread_t tls_server_thread;
+static int tls_server_port = 0;
+
+// writes a self-signed certificate for 127.0.0.1 and its key in one PEM file
+static int tls_server_certificate(const char *path) {
+   EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+   EVP_PKEY *key = NULL;
+   X509 *cert = X509_new();
+   X509_NAME *name;
+   FILE *file = NULL;
+   int ok;
+
+   ok = ctx != NULL && cert != NULL && EVP_PKEY_keygen_init(ctx) > 0
+      && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0 && EVP_PKEY_keygen(ctx, &key) > 0;
+   if (ok) {
+      X509_set_version(cert, 2);
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_get_notBefore(cert), -60);
+      X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+      name = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+      X509_set_issuer_name(cert, name);
+      ok = X509_set_pubkey(cert, key) && X509_sign(cert, key, EVP_sha256()) > 0
+         && (file = fopen(path, "w")) != NULL;
+   }
+   if (ok) {
+      ok = PEM_write_X509(file, cert) && PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL);
+      ok = fclose(file) == 0 && ok;
+   }
+   X509_free(cert);
+   EVP_PKEY_free(key);
+   EVP_PKEY_CTX_free(ctx);
+   return ok;
+}
+
+static int tls_server_free_port() {
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   int fd = socket(AF_INET, SOCK_STREAM, 0), port = 0;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0
+      && getsockname(fd, (struct sockaddr *) &addr, &len) == 0)
+      port = ntohs(addr.sin_port);
+   close(fd);
+   return port;
+}
+
+static void *tls_server_run(void *data) {
+   herror_t status;
+
+   if ((status = httpd_run()) != H_OK) {
+      printf("Server failed (%s)\n", herror_message(status));
+      herror_release(status);
+   }
+   return NULL;
+}
+
+// rebuilds the SSL context with HTTP/2 on or off for the server; the clients offer
+// "h2" as long as hssl_set_http2(1) is in effect
+static int tls_server_alpn(int server_h2, int client_h2) {
+   herror_t status;
+
+   hssl_set_http2(server_h2);
+   if ((status = hssl_module_init(0, NULL)) != H_OK) {
+      printf("Cannot rebuild the SSL context (%s)\n", herror_message(status));
+      herror_release(status);
+      return 0;
+   }
+   hssl_set_http2(client_h2);
+   return 1;
+}
+
+// starts the server and the client module, HTTP/2 on both sides
+static int tls_server_start(httpd_service service) {
+   char port[16];
+   char *argv[] = { (char *) "tls_server", (char *) NHTTPD_ARG_PORT, port, (char *) NHTTP_ARG_HTTP2, (char *) "1" };
+   herror_t status;
+
+   if (mkdtemp(tls_server_dir) == NULL) {
+      printf("Cannot create %s\n", tls_server_dir);
+      return 0;
+   }
+   snprintf(tls_server_pem, sizeof(tls_server_pem), "%s/server.pem", tls_server_dir);
+   if (!tls_server_certificate(tls_server_pem)) {
+      printf("Cannot write the certificate\n");
+      return 0;
+   }
+   if ((tls_server_port = tls_server_free_port()) == 0) {
+      printf("No free port\n");
+      return 0;
+   }
+   snprintf(port, sizeof(port), "%d", tls_server_port);
+
+   hssl_enable();
+   hssl_set_certificate(tls_server_pem);
+   if ((status = httpd_init(5, argv)) != H_OK || (status = httpc_init(5, argv)) != H_OK) {
+      printf("Cannot start the server (%s)\n", herror_message(status));
+      herror_release(status);
+      return 0;
+   }
+   if (httpd_register_default("/", service) < 0) {
+      printf("Cannot register the service\n");
+      return 0;
+   }
+   pthread_create(&tls_server_thread, NULL, tls_server_run, NULL);
+   return 1;
+}
+
+// stops the server within its one second accept poll: httpd_run() took SIGINT
+static void tls_server_stop() {
+   httpc_destroy();
+   raise(SIGINT);
+   pthread_join(tls_server_thread, NULL);
+   unlink(tls_server_pem);
+   rmdir(tls_server_dir);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <COpenOTPAuthFlow.h>
+#include "openotp_mock.h"
+
+// Compares a login and its challenge sent through the flow of the credential provider,
+// Login() / Challenge() and Wait(), with the same requests sent by openotp_login() and
+// openotp_challenge() on the calling thread, against the mock server of openotp_mock.h.
+// The difference is the cost of the flow per authentication: its request thread, the
+// copies of the credentials and the state shared with the caller. Each run alternates
+// the two to spread the noise of the server.
+
+static void usage(char *prog) {
+   printf("Usage: %s [<ITERATIONS>]\n", prog);
+   fflush(stdout);
+   exit(1);
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double direct(long iterations) {
+   double start = now();
+   long i;
+
+   for (i=0; i<iterations; i++) {
+      openotp_login_req_t lreq;
+      openotp_login_rep_t *lrep;
+      openotp_challenge_req_t creq;
+      openotp_challenge_rep_t *crep;
+
+      memset(&lreq, 0, sizeof(lreq));
+      lreq.username = (char*) "jdoe";
+      lreq.domain = (char*) "Default";
+      lreq.ldapPassword = (char*) "LdapPassword#2024";
+      lreq.client = (char*) "AuthFlowBench";
+      if ((lrep = openotp_login(&lreq, NULL)) == NULL || lrep->code != OPENOTP_CHALLENGE) {
+         printf("Login failed\n");
+         exit(1);
+      }
+
+      memset(&creq, 0, sizeof(creq));
+      creq.username = (char*) "jdoe";
+      creq.domain = (char*) "Default";
+      creq.session = lrep->session;
+      creq.otpPassword = (char*) MOCK_OTP;
+      if ((crep = openotp_challenge(&creq, NULL)) == NULL || crep->code != OPENOTP_SUCCESS) {
+         printf("Challenge failed\n");
+         exit(1);
+      }
+      openotp_challenge_rep_free(crep);
+      openotp_login_rep_free(lrep);
+   }
+   return (now() - start) / iterations;
+}
+
+static double flow(long iterations) {
+   COpenOTPAuthFlow flow;
+   COpenOTPAuthFlow::Request req;
+   COpenOTPAuthFlow::Result result;
+   double start = now();
+   long i;
+
+   req.username = "jdoe";
+   req.domain = "Default";
+   req.ldapPassword = "LdapPassword#2024";
+   req.client = "AuthFlowBench";
+   req.priority = OPENOTP_PRIORITY_LOGON;
+   for (i=0; i<iterations; i++) {
+      if (!flow.Login(req) || !flow.Wait(&result) || result.state != COpenOTPAuthFlow::STATE_CHALLENGE_REQUIRED) {
+         printf("Login failed\n");
+         exit(1);
+      }
+      if (!flow.Challenge(MOCK_OTP, OPENOTP_PRIORITY_LOGON) || !flow.Wait(&result) || result.state != COpenOTPAuthFlow::STATE_SUCCESS) {
+         printf("Challenge failed\n");
+         exit(1);
+      }
+   }
+   return (now() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+   double times[2] = { 0, 0 };
+   long iterations = 1000;
+   int run;
+
+   if (argc > 2) usage(argv[0]);
+   if (argc == 2 && (iterations = atol(argv[1])) <= 0) usage(argv[0]);
+
+   openotp_mock server;
+   // the library keeps the URL
+   std::string url = server.url();
+   if (!openotp_initialize((char *) url.c_str(), NULL, NULL, NULL, 10, NULL)) {
+      printf("Cannot initialize the library\n");
+      exit(1);
+   }
+
+   // the first requests open the connection, they are not counted
+   direct(1);
+   flow(1);
+
+   for (run=0; run<4; run++)
+      times[run % 2] += run % 2 ? flow(iterations) : direct(iterations);
+
+   printf("Login and challenge, C API: %.0f ns per authentication\n", times[0] / 2);
+   printf("Login and challenge, COpenOTPAuthFlow: %.0f ns per authentication\n", times[1] / 2);
+   openotp_terminate(NULL);
+   exit(0);
+}
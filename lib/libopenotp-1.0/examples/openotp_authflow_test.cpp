@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <COpenOTPAuthFlow.h>
+#include "openotp_mock.h"
+
+// Checks the login -> challenge flow of the credential provider against the mock server
+// of openotp_mock.h: the states and events of a login, a challenge and their failures,
+// the approval hint of a login held by the server, that a request takes a single thread,
+// that Cancel() reports the cancellation at once, on its own thread, and nothing of the
+// request after it, and that Join() returns once the interrupted call is over.
+
+struct recorded
+{
+   COpenOTPAuthFlow::Event event;
+   COpenOTPAuthFlow::State state;
+   std::thread::id thread;
+};
+
+static std::mutex lock;
+static std::vector<recorded> events;
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+static void listener(COpenOTPAuthFlow::Event event, const COpenOTPAuthFlow::Result &result) {
+   recorded r = { event, result.state, std::this_thread::get_id() };
+   std::lock_guard<std::mutex> guard(lock);
+   events.push_back(r);
+}
+
+static std::vector<recorded> take() {
+   std::lock_guard<std::mutex> guard(lock);
+   std::vector<recorded> taken;
+   taken.swap(events);
+   return taken;
+}
+
+static bool same(const std::vector<recorded> &got, const std::vector<COpenOTPAuthFlow::Event> &expected) {
+   if (got.size() != expected.size()) return false;
+   for (size_t i = 0; i < got.size(); i++)
+      if (got[i].event != expected[i]) return false;
+   return true;
+}
+
+static int threads() {
+   DIR *dir = opendir("/proc/self/task");
+   struct dirent *entry;
+   int count = 0;
+
+   if (dir == NULL) return -1;
+   while ((entry = readdir(dir)) != NULL)
+      if (entry->d_name[0] != '.') count++;
+   closedir(dir);
+   return count;
+}
+
+static COpenOTPAuthFlow::Request request(const char *username) {
+   COpenOTPAuthFlow::Request req;
+
+   req.username = username;
+   req.domain = "Default";
+   req.ldapPassword = "LdapPassword#2024";
+   req.client = "AuthFlowTest";
+   req.priority = OPENOTP_PRIORITY_LOGON;
+   return req;
+}
+
+// the listener gets the last event after Wait() returns
+static void wait_idle(COpenOTPAuthFlow &flow) {
+   for (int i = 0; i < 500 && flow.Running(); i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   // lets the request thread return after it published the reply
+   std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+int main(int argc, char *argv[]) {
+   openotp_mock server;
+   // the library keeps the URL
+   std::string url = server.url();
+   COpenOTPAuthFlow::Result result;
+   std::vector<recorded> got;
+   typedef COpenOTPAuthFlow F;
+
+   if (!openotp_initialize((char *) url.c_str(), NULL, NULL, NULL, 10, NULL)) {
+      printf("FAIL: cannot initialize the library\n");
+      return 1;
+   }
+
+   {
+      COpenOTPAuthFlow flow;
+      flow.SetListener(listener);
+
+      check(flow.Login(request("alice")) && flow.Wait(&result, 5000), "login answered");
+      wait_idle(flow);
+      got = take();
+      check(result.state == F::STATE_CHALLENGE_REQUIRED && result.code == OPENOTP_CHALLENGE && result.timeout == 60,
+            "login asks for a challenge");
+      check(same(got, { F::EVENT_CONNECTING, F::EVENT_CHALLENGE_REQUIRED }), "login events");
+      check(got.size() == 2 && got[0].thread != std::this_thread::get_id() && got[0].thread == got[1].thread,
+            "login events on the request thread");
+
+      check(flow.Challenge(MOCK_OTP, OPENOTP_PRIORITY_LOGON) && flow.Wait(&result, 5000), "challenge answered");
+      wait_idle(flow);
+      check(result.state == F::STATE_SUCCESS && result.code == OPENOTP_SUCCESS, "challenge with the session of the login succeeds");
+      check(same(take(), { F::EVENT_CONNECTING, F::EVENT_SUCCESS }), "challenge events");
+      check(!flow.Challenge(MOCK_OTP, OPENOTP_PRIORITY_LOGON), "no second challenge for the session");
+
+      flow.Login(request("alice"));
+      flow.Wait(NULL);
+      wait_idle(flow);
+      take();
+      check(flow.Challenge("000000", OPENOTP_PRIORITY_LOGON) && flow.Wait(&result, 5000) && result.state == F::STATE_FAILURE,
+            "wrong OTP fails");
+      wait_idle(flow);
+      check(same(take(), { F::EVENT_CONNECTING, F::EVENT_FAILURE }), "failure events");
+
+      flow.Login(request("bad"));
+      check(flow.Wait(&result, 5000) && result.state == F::STATE_FAILURE && result.code == OPENOTP_FAILURE, "rejected login fails");
+      wait_idle(flow);
+      take();
+
+      server.login_delay = AUTHFLOW_APPROVAL_HINT + 500;
+      check(flow.Login(request("slow")) && !flow.Wait(&result, 200) && flow.GetState() == F::STATE_LOGIN,
+            "Wait() times out while the login is pending");
+      check(flow.Wait(&result, AUTHFLOW_APPROVAL_HINT + 5000) && result.state == F::STATE_CHALLENGE_REQUIRED, "held login answered");
+      wait_idle(flow);
+      got = take();
+      check(same(got, { F::EVENT_CONNECTING, F::EVENT_WAITING_APPROVAL, F::EVENT_CHALLENGE_REQUIRED }), "approval hint before the reply");
+      check(got.size() == 3 && got[1].thread != got[0].thread && got[1].state == F::STATE_LOGIN, "approval hint on the timer thread");
+
+      server.login_delay = 5000;
+      check(flow.Login(request("slow")), "held login started");
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      flow.Cancel();
+      long cancel_ms = (long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+      got = take();
+      check(cancel_ms < 100, "Cancel() returns at once");
+      check(same(got, { F::EVENT_CONNECTING, F::EVENT_CANCELLED }) && got[1].thread == std::this_thread::get_id(),
+            "EVENT_CANCELLED on the thread of Cancel()");
+      check(flow.GetState() == F::STATE_CANCELLED && flow.Wait(&result, 1) && result.state == F::STATE_CANCELLED, "cancelled state");
+      start = std::chrono::steady_clock::now();
+      flow.Join();
+      long join_ms = (long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+      check(!flow.Running() && join_ms < 1000, "the OpenOTP call is interrupted, Join() waits for its thread");
+      std::this_thread::sleep_for(std::chrono::milliseconds(AUTHFLOW_APPROVAL_HINT + 200));
+      check(take().empty() && flow.GetState() == F::STATE_CANCELLED, "nothing reported after the cancellation");
+   }
+
+   {
+      COpenOTPAuthFlow flow;
+      int before;
+
+      // without a listener, no timer thread: a request takes one thread
+      server.login_delay = 500;
+      flow.Login(request("alice"));
+      flow.Wait(NULL);
+      wait_idle(flow);
+      before = threads();
+      flow.Login(request("slow"));
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      int during = threads();
+      flow.Wait(NULL);
+      printf("%d threads before the login, %d during\n", before, during);
+      check(before > 0 && during == before + 1, "one thread per request");
+   }
+
+   openotp_terminate(NULL);
+   return failures ? 1 : 0;
+}
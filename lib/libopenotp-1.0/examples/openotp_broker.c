@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <openotp.h>
+
+void usage(char *prog) {
+   printf("Usage: %s <OPENOTP_URL> <SOCKET_PATH> [-c | --cert <CERT_FILE>] [-p | --pass <CERT_PASSWORD>] [-a | --ca <CA_FILE>] [-t | --timeout <SECONDS>] [-f | --cache <CACHE_FILE>]\n", prog); 
+   fflush(stdout);
+   exit(1);
+}
+
+void _stop(int sig) {
+   openotp_broker_stop(NULL);
+}
+
+int main(int argc, char *argv[]) {
+   char *cert = NULL, *pass = NULL, *ca = NULL, *cache = NULL;
+   int timeout = 0;
+   int i;
+   
+   void _log(char *str) {
+      printf("%s\n", str);
+      fflush(stdout);
+   }
+   
+   if (argc<3) usage(argv[0]);
+   
+   for (i=3; i<argc; i+=2) {
+      if (i+1==argc) usage(argv[0]);
+      if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cert") == 0) cert = argv[i+1];
+      else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pass") == 0) pass = argv[i+1];
+      else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--ca") == 0) ca = argv[i+1];
+      else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0) timeout = atoi(argv[i+1]);
+      else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--cache") == 0) cache = argv[i+1];
+      else usage(argv[0]);
+   }
+   
+   if (cache != NULL && !openotp_cache_open(cache, &_log)) exit(1);
+   if (!openotp_initialize(argv[1], cert, pass, ca, timeout, &_log)) exit(1);
+   
+   // keep the servers health and a warm connection for the clients
+   openotp_prober_start(30, 10, &_log);
+   
+   signal(SIGINT, _stop);
+   signal(SIGTERM, _stop);
+   
+   if (!openotp_broker_serve(argv[2], &_log)) exit(1);
+   
+   openotp_terminate(&_log);
+   exit(0);
+}
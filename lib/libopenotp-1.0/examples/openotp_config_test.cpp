@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <COpenOTPConfig.h>
+
+// Checks the settings of the credential provider read from a file: readers calling Get()
+// in a loop always see a complete snapshot while the file is replaced by a rename and
+// rewritten in place, the watcher picks up each change long before CONFIG_POLL_INTERVAL,
+// watches nest, and the last Unwatch() stops the watcher thread and the reloads.
+
+#define CHANGES 50
+#define READERS 4
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+static int threads() {
+   DIR *dir = opendir("/proc/self/task");
+   struct dirent *entry;
+   int count = 0;
+
+   if (dir == NULL) return -1;
+   while ((entry = readdir(dir)) != NULL)
+      if (entry->d_name[0] != '.') count++;
+   closedir(dir);
+   return count;
+}
+
+// all the values of version 'n' carry 'n'
+static std::string contents(int n) {
+   return "# test settings\n"
+      "server_url = http://127.0.0.1:" + std::to_string(8000 + n) + "/openotp/\n"
+      "client_id=client-" + std::to_string(n) + "\n"
+      "login_text=Login " + std::to_string(n) + "\n"
+      "soap_timeout=" + std::to_string(n) + "\n";
+}
+
+static bool write_file(const std::string &path, int n) {
+   std::string text = contents(n);
+   FILE *file = fopen(path.c_str(), "w");
+
+   if (file == NULL) return false;
+   fwrite(text.data(), 1, text.size(), file);
+   return fclose(file) == 0;
+}
+
+// as editors and deployment tools do: a new file renamed over the old one
+static bool replace_file(const std::string &path, int n) {
+   std::string temp = path + ".new";
+   return write_file(temp, n) && rename(temp.c_str(), path.c_str()) == 0;
+}
+
+static bool consistent(const COpenOTPConfig::Snapshot &s) {
+   int n = s.soapTimeout;
+   return s.serverUrl == "http://127.0.0.1:" + std::to_string(8000 + n) + "/openotp/"
+      && s.clientId == "client-" + std::to_string(n) && s.loginText == "Login " + std::to_string(n);
+}
+
+// waits for the settings of version 'n', up to 'ms'
+static bool wait_for(COpenOTPConfig &config, int n, int ms) {
+   for (; ms > 0; ms -= 5) {
+      if (config.Get()->soapTimeout == n) return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+   }
+   return config.Get()->soapTimeout == n;
+}
+
+int main(int argc, char *argv[]) {
+   char dir[] = "/tmp/openotp_config_testXXXXXX";
+   std::atomic<bool> stop(false);
+   std::atomic<long> reads(0), torn(0), backwards(0);
+   std::vector<std::thread> readers;
+   int n, missed = 0, baseline;
+
+   if (mkdtemp(dir) == NULL) {
+      printf("FAIL: cannot create %s\n", dir);
+      return 1;
+   }
+   std::string path = std::string(dir) + "/openotp-cp.conf";
+   write_file(path, 1);
+
+   {
+      COpenOTPConfig config(COpenOTPConfig::NewFileSource(path));
+
+      check(consistent(*config.Get()) && config.Get()->soapTimeout == 1 && config.Get()->version == 1, "first read");
+      baseline = threads();
+      config.Watch();
+      check(threads() == baseline + 1, "Watch() starts the watcher thread");
+
+      for (int i = 0; i < READERS; i++) {
+         readers.push_back(std::thread([&]() {
+            int last = 0;
+            while (!stop) {
+               COpenOTPConfig::Ptr snapshot = config.Get();
+               if (!consistent(*snapshot)) torn++;
+               if (snapshot->soapTimeout < last) backwards++;
+               last = snapshot->soapTimeout;
+               reads++;
+            }
+         }));
+      }
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (n = 2; n <= CHANGES; n++) {
+         if (!(n % 2 ? write_file(path, n) : replace_file(path, n)) || !wait_for(config, n, 2000))
+            missed++;
+      }
+      long ms = (long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+      stop = true;
+      for (size_t i = 0; i < readers.size(); i++)
+         readers[i].join();
+
+      printf("%d changes in %ld ms, %ld reads\n", CHANGES - 1, ms, (long) reads);
+      check(missed == 0, "every rename and in-place write picked up by the watcher");
+      check(torn == 0, "readers never see a mixed snapshot");
+      check(backwards == 0, "readers never go back to older settings");
+      check(config.Get()->version == CHANGES, "one snapshot per change");
+
+      config.Watch();
+      config.Unwatch();
+      check(threads() == baseline + 1, "watches nest");
+      replace_file(path, ++n);
+      check(wait_for(config, n, 2000), "still watching after the inner Unwatch()");
+
+      config.Unwatch();
+      check(threads() == baseline, "the last Unwatch() stops the watcher thread");
+      replace_file(path, n + 1);
+      write_file(path, n + 2);
+      check(!wait_for(config, n + 1, 500) && !wait_for(config, n + 2, 0) && config.Get()->soapTimeout == n,
+            "no reload once unwatched");
+
+      unlink(path.c_str());
+      check(!config.Reload() && config.Get()->soapTimeout == n, "settings kept while the file is missing");
+   }
+
+   rmdir(dir);
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-logging.h>
+
+// Measures what the disabled verbose messages cost on the request path: a log macro,
+// the same message sent to hlog_verbose() without the level check of the macros, and
+// the dump of a request header with and without its guard.
+
+void usage(char *prog) {
+   printf("Usage: %s [<ITERATIONS>]\n", prog);
+   fflush(stdout);
+   exit(1);
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile long sink;
+
+int main(int argc, char *argv[]) {
+   const char *path = "/openotp/";
+   hpair_t *header = NULL;
+   double start, empty, macro, call, guarded, dump;
+   long iterations = 10000000, i;
+
+   if (argc > 2) usage(argv[0]);
+   if (argc == 2 && (iterations = atol(argv[1])) <= 0) usage(argv[0]);
+
+   header = hpairnode_new("Host", "otp.example.com", header);
+   header = hpairnode_new("Content-Type", "text/xml", header);
+   header = hpairnode_new("Content-Length", "512", header);
+   header = hpairnode_new("SoapAction", "openotpNormalLogin", header);
+   header = hpairnode_new("Connection", "keep-alive", header);
+
+   // the default level, verbose messages disabled
+   hlog_set_level(HLOG_DEBUG);
+
+   start = now();
+   for (i=0; i<iterations; i++) sink = i;
+   empty = (now() - start) / iterations;
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      log_verbose3("Path '%s' (%d bytes)", path, (int) strlen(path));
+      sink = i;
+   }
+   macro = (now() - start) / iterations;
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      hlog_verbose(__FUNCTION__, "Path '%s' (%d bytes)", path, (int) strlen(path));
+      sink = i;
+   }
+   call = (now() - start) / iterations;
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      if (hlog_enabled(HLOG_VERBOSE)) hpairnode_dump_deep(header);
+      sink = i;
+   }
+   guarded = (now() - start) / iterations;
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      hpairnode_dump_deep(header);
+      sink = i;
+   }
+   dump = (now() - start) / iterations;
+
+   printf("Empty loop: %.2f ns\n", empty);
+   printf("Disabled log macro: %.2f ns\n", macro);
+   printf("Unchecked hlog_verbose() call: %.2f ns\n", call);
+   printf("Guarded header dump: %.2f ns\n", guarded);
+   printf("Unguarded header dump: %.2f ns\n", dump);
+
+   hpairnode_free_deep(header);
+   exit(0);
+}
@@ -0,0 +1,243 @@
+#ifndef OPENOTP_MOCK_H
+#define OPENOTP_MOCK_H
+
+// In-process OpenOTP server for the tests and benchmarks of the examples, on a free
+// port of 127.0.0.1. It answers the SOAP requests over HTTP/1.1 with keep-alive:
+//  - openotpStatus: up;
+//  - openotpLogin: a challenge with session MOCK_SESSION, a failure for the user
+//    "bad", after login_delay ms for the user "slow" (a push approval);
+//  - openotpChallenge: a success for MOCK_SESSION and the OTP MOCK_OTP, else a failure.
+// It counts the connections and the requests, can drop the next requests without an
+// answer (drop_next), and close its idle connections, as a server does after a while.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MOCK_SESSION "MOCKSESSION1"
+#define MOCK_OTP "123456"
+
+class openotp_mock
+{
+  public:
+   std::atomic<int> connections, requests, logins, challenges;
+   std::atomic<int> login_delay, drop_next;
+
+   openotp_mock(): connections(0), requests(0), logins(0), challenges(0), login_delay(0), drop_next(0),
+      _stop(false), _port(0)
+   {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof(addr);
+      int on = 1;
+
+      _listen = socket(AF_INET, SOCK_STREAM, 0);
+      setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (bind(_listen, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(_listen, 64) < 0
+         || getsockname(_listen, (struct sockaddr *) &addr, &len) < 0)
+      {
+         perror("mock server");
+         exit(1);
+      }
+      _port = ntohs(addr.sin_port);
+      _acceptor = std::thread(&openotp_mock::_Accept, this);
+   }
+
+   ~openotp_mock()
+   {
+      _stop = true;
+      shutdown(_listen, SHUT_RDWR);
+      _acceptor.join();
+      close(_listen);
+      {
+         std::lock_guard<std::mutex> guard(_lock);
+         for (size_t i = 0; i < _clients.size(); i++)
+            shutdown(_clients[i], SHUT_RDWR);
+      }
+      for (size_t i = 0; i < _workers.size(); i++)
+         _workers[i].join();
+   }
+
+   std::string url() const
+   {
+      return "http://127.0.0.1:" + std::to_string(_port) + "/openotp/";
+   }
+
+   // closes the connections waiting for a request
+   void close_idle()
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      for (size_t i = 0; i < _clients.size(); i++)
+         if (_idle[i])
+            shutdown(_clients[i], SHUT_RDWR);
+   }
+
+  private:
+   std::atomic<bool> _stop;
+   int _listen, _port;
+   std::thread _acceptor;
+   std::mutex _lock;
+   std::vector<int> _clients;
+   std::vector<bool> _idle;
+   std::vector<std::thread> _workers;
+
+   void _Accept()
+   {
+      for (;;)
+      {
+         int client = accept(_listen, NULL, NULL), on = 1;
+
+         if (client < 0)
+            return;
+         setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+         std::lock_guard<std::mutex> guard(_lock);
+         if (_stop)
+         {
+            close(client);
+            return;
+         }
+         connections++;
+         _clients.push_back(client);
+         _idle.push_back(true);
+         _workers.push_back(std::thread(&openotp_mock::_Serve, this, client));
+      }
+   }
+
+   // text of the element 'name', with or without a namespace prefix
+   static std::string _Element(const std::string &body, const char *name)
+   {
+      size_t length = strlen(name), start = 0, end;
+
+      while ((start = body.find(name, start)) != std::string::npos)
+      {
+         if (start > 0 && (body[start - 1] == '<' || body[start - 1] == ':')
+            && (body[start + length] == ' ' || body[start + length] == '>'))
+            break;
+         start += length;
+      }
+      if (start == std::string::npos || (start = body.find('>', start)) == std::string::npos
+         || (end = body.find('<', start)) == std::string::npos)
+         return "";
+      return body.substr(start + 1, end - start - 1);
+   }
+
+   void _SetIdle(int client, bool idle)
+   {
+      std::lock_guard<std::mutex> guard(_lock);
+      for (size_t i = 0; i < _clients.size(); i++)
+         if (_clients[i] == client)
+            _idle[i] = idle;
+   }
+
+   // sleeps 'ms' unless the server stops
+   void _Sleep(int ms)
+   {
+      for (; ms > 0 && !_stop; ms -= 10)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+
+   void _Serve(int client)
+   {
+      std::string in;
+      char buf[4096];
+
+      for (;;)
+      {
+         size_t head, length;
+         ssize_t n;
+
+         _SetIdle(client, in.empty());
+         while ((head = in.find("\r\n\r\n")) == std::string::npos)
+         {
+            if ((n = recv(client, buf, sizeof(buf), 0)) <= 0)
+               goto done;
+            in.append(buf, n);
+            _SetIdle(client, false);
+         }
+         std::string headers = in.substr(0, head);
+         for (size_t i = 0; i < headers.size(); i++)
+            headers[i] = tolower(headers[i]);
+         size_t field = headers.find("content-length:");
+         length = field == std::string::npos ? 0 : strtoul(headers.c_str() + field + 15, NULL, 10);
+         while (in.size() < head + 4 + length)
+         {
+            if ((n = recv(client, buf, sizeof(buf), 0)) <= 0)
+               goto done;
+            in.append(buf, n);
+         }
+         std::string body = in.substr(head + 4, length);
+         in.erase(0, head + 4 + length);
+         requests++;
+
+         // a server closing the connection as the request arrives
+         int drop = drop_next;
+         while (drop > 0 && !drop_next.compare_exchange_weak(drop, drop - 1));
+         if (drop > 0)
+            goto done;
+
+         std::string method, items;
+         if (body.find("openotpLogin") != std::string::npos)
+         {
+            std::string username = _Element(body, "username");
+            logins++;
+            method = "openotpLogin";
+            if (username == "slow")
+               _Sleep(login_delay);
+            if (username == "bad")
+               items = "<code>0</code><message>invalid credentials</message>";
+            else
+               items = "<code>2</code><message>challenge</message><session>" MOCK_SESSION "</session><timeout>60</timeout>";
+         }
+         else if (body.find("openotpChallenge") != std::string::npos)
+         {
+            challenges++;
+            method = "openotpChallenge";
+            if (_Element(body, "session") == MOCK_SESSION && _Element(body, "otpPassword") == MOCK_OTP)
+               items = "<code>1</code><message>authentication success</message>";
+            else
+               items = "<code>0</code><message>invalid OTP</message>";
+         }
+         else
+         {
+            method = "openotpStatus";
+            items = "<status>true</status><message>server up</message>";
+         }
+
+         std::string reply = "<?xml version=\"1.0\"?><SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+            "<SOAP-ENV:Body><ns1:" + method + "Response xmlns:ns1=\"urn:openotp\">" + items + "</ns1:" + method + "Response>"
+            "</SOAP-ENV:Body></SOAP-ENV:Envelope>";
+         std::string out = "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: " + std::to_string(reply.size()) + "\r\n\r\n" + reply;
+         // the client may be gone after a cancellation
+         if (send(client, out.data(), out.size(), MSG_NOSIGNAL) < 0)
+            goto done;
+      }
+     done:
+      std::lock_guard<std::mutex> guard(_lock);
+      for (size_t i = 0; i < _clients.size(); i++)
+      {
+         if (_clients[i] == client)
+         {
+            _clients.erase(_clients.begin() + i);
+            _idle.erase(_idle.begin() + i);
+            break;
+         }
+      }
+      close(client);
+   }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+extern "C" {
+#include <openotp.h>
+}
+#include "openotp_mock.h"
+
+// Checks openotp_prepare() against the mock server of openotp_mock.h: the connection is
+// opened ahead of the first request and used by it, a parked connection closed by the
+// server is dropped before use, a status request whose reused connection is closed by
+// the server is sent again on a new one while a login is not, and a warm-up still
+// running when the library is terminated does not outlive it.
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) failures++;
+}
+
+// waits up to 'ms' for the server to count 'count' connections
+static bool wait_connections(openotp_mock &server, int count, int ms) {
+   for (; ms > 0 && server.connections < count; ms -= 5)
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+   return server.connections >= count;
+}
+
+static bool status() {
+   openotp_status_rep_t *rep = openotp_status(NULL);
+   bool ok = rep != NULL && rep->status == 1;
+
+   if (rep != NULL) openotp_status_rep_free(rep);
+   return ok;
+}
+
+static bool login() {
+   openotp_login_req_t req;
+   openotp_login_rep_t *rep;
+   bool ok;
+
+   memset(&req, 0, sizeof(req));
+   req.username = (char *) "jdoe";
+   req.ldapPassword = (char *) "LdapPassword#2024";
+   rep = openotp_login(&req, NULL);
+   ok = rep != NULL && rep->code == OPENOTP_CHALLENGE;
+   if (rep != NULL) openotp_login_rep_free(rep);
+   return ok;
+}
+
+int main(int argc, char *argv[]) {
+   openotp_mock server;
+   // the library keeps the URL
+   std::string url = server.url();
+   int requests, i;
+
+   if (!openotp_initialize((char *) url.c_str(), NULL, NULL, NULL, 10, NULL)) {
+      printf("FAIL: cannot initialize the library\n");
+      return 1;
+   }
+
+   check(openotp_prepare(NULL) && wait_connections(server, 1, 2000) && server.requests == 0,
+         "openotp_prepare() connects before any request");
+   check(openotp_prepare(NULL) && (std::this_thread::sleep_for(std::chrono::milliseconds(100)), server.connections == 1),
+         "no second warm-up while a connection is parked");
+   check(status() && server.connections == 1 && server.requests == 1, "the request uses the prepared connection");
+   check(status() && server.connections == 1 && server.requests == 2, "the connection is kept for the next request");
+
+   server.close_idle();
+   std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   check(status() && server.connections == 2 && server.requests == 3,
+         "a parked connection closed by the server is replaced before the request");
+
+   server.drop_next = 1;
+   check(status() && server.connections == 3 && server.requests == 5,
+         "a status request is sent again when the server closes the reused connection");
+
+   server.drop_next = 1;
+   requests = server.requests;
+   check(!login() && server.requests == requests + 1 && server.logins == 0,
+         "a login is not sent twice");
+
+   openotp_terminate(NULL);
+
+   // terminated while the warm-ups are running: a warm-up outliving openotp_terminate()
+   // shows as a crash or a sanitizer report, or as a connection opened after it
+   for (i = 0; i < 20; i++) {
+      openotp_initialize((char *) url.c_str(), NULL, NULL, NULL, 10, NULL);
+      openotp_prepare(NULL);
+      openotp_terminate(NULL);
+   }
+   requests = server.connections;
+   std::this_thread::sleep_for(std::chrono::milliseconds(200));
+   check(server.connections == requests, "openotp_terminate() waits for the warm-ups");
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openotp.h>
+
+// Compares copying the fields of a login request with one malloc per field, each wiped
+// and freed one by one, and with a secure arena wiped and released in a single pass.
+// Both paths allocate, fill, wipe and free the same seven strings.
+
+#define FIELDS 7
+
+void usage(char *prog) {
+   printf("Usage: %s [<ITERATIONS>]\n", prog);
+   fflush(stdout);
+   exit(1);
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void wipe(char *str) {
+   volatile char *p = str;
+   while (*p) *p++ = 0;
+}
+
+int main(int argc, char *argv[]) {
+   const char *fields[FIELDS] = { "jdoe", "Default", "LdapPassword#2024", "123456", "OpenOTPCP", "192.168.1.20", "" };
+   char *copies[FIELDS];
+   openotp_secure_t *secure;
+   double start, scattered, arena;
+   long iterations = 1000000, i;
+   int j;
+
+   void _log(char *str) {
+      printf("%s\n", str);
+      fflush(stdout);
+   }
+
+   if (argc > 2) usage(argv[0]);
+   if (argc == 2 && (iterations = atol(argv[1])) <= 0) usage(argv[0]);
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      for (j=0; j<FIELDS; j++)
+         if ((copies[j] = strdup(fields[j])) == NULL) exit(1);
+      for (j=0; j<FIELDS; j++) {
+         wipe(copies[j]);
+         free(copies[j]);
+      }
+   }
+   scattered = (now() - start) / iterations;
+
+   start = now();
+   for (i=0; i<iterations; i++) {
+      if ((secure = openotp_secure_new(&_log)) == NULL) exit(1);
+      for (j=0; j<FIELDS; j++)
+         if ((copies[j] = openotp_secure_strdup(secure, fields[j])) == NULL) exit(1);
+      openotp_secure_free(secure);
+   }
+   arena = (now() - start) / iterations;
+
+   printf("Scattered mallocs: %.1f ns per request\n", scattered);
+   printf("Secure arena: %.1f ns per request\n", arena);
+   exit(0);
+}
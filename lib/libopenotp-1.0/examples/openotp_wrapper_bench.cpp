@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openotp.hpp>
+
+// Compares the C++ wrapper of openotp.hpp with the C API on the same server: status and
+// login requests sent with openotp_status() / openotp_login() and their _free(), then with
+// openotp::server_status() / openotp::login() and the reply objects. Both use the same
+// keep-alive connection, so the difference is the cost of the wrapper per request. Each
+// run alternates the two APIs to spread the noise of the server. The C calls get the log
+// handler of the wrapper as well, so that failures are reported the same way.
+
+static void usage(char *prog) {
+   printf("Usage: %s <OPENOTP_URL> [<ITERATIONS>]\n", prog);
+   fflush(stdout);
+   exit(1);
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile long sink;
+
+static double c_status(long iterations) {
+   double start = now();
+   long i;
+
+   for (i=0; i<iterations; i++) {
+      openotp_status_rep_t *rep = openotp_status(openotp::detail::log_handler());
+      if (rep == NULL) {
+         printf("%s\n", openotp::detail::last_error());
+         exit(1);
+      }
+      sink = rep->status;
+      openotp_status_rep_free(rep);
+   }
+   return (now() - start) / iterations;
+}
+
+static double cpp_status(long iterations) {
+   double start = now();
+   long i;
+
+   for (i=0; i<iterations; i++) {
+      openotp::result<openotp::status_reply> rep = openotp::server_status();
+      if (!rep.ok()) {
+         printf("%s\n", rep.message());
+         exit(1);
+      }
+      sink = rep.value().is_up();
+   }
+   return (now() - start) / iterations;
+}
+
+static double c_login(long iterations) {
+   double start = now();
+   long i;
+
+   for (i=0; i<iterations; i++) {
+      openotp_login_req_t req;
+      openotp_login_rep_t *rep;
+
+      memset(&req, 0, sizeof(req));
+      req.username = (char*) "jdoe";
+      req.domain = (char*) "Default";
+      req.ldapPassword = (char*) "LdapPassword#2024";
+      req.client = (char*) "WrapperBench";
+      if ((rep = openotp_login(&req, openotp::detail::log_handler())) == NULL) {
+         printf("%s\n", openotp::detail::last_error());
+         exit(1);
+      }
+      sink = rep->code;
+      openotp_login_rep_free(rep);
+   }
+   return (now() - start) / iterations;
+}
+
+static double cpp_login(long iterations) {
+   double start = now();
+   long i;
+
+   for (i=0; i<iterations; i++) {
+      openotp::result<openotp::login_reply> rep = openotp::login(openotp::login_request()
+         .username("jdoe").domain("Default").ldap_password("LdapPassword#2024").client("WrapperBench"));
+      if (!rep.ok()) {
+         printf("%s\n", rep.message());
+         exit(1);
+      }
+      sink = rep.value().code();
+   }
+   return (now() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+   double status[2] = { 0, 0 }, login[2] = { 0, 0 };
+   long iterations = 1000;
+   int run;
+
+   if (argc < 2 || argc > 3) usage(argv[0]);
+   if (argc == 3 && (iterations = atol(argv[2])) <= 0) usage(argv[0]);
+
+   openotp::library lib;
+   openotp::status st = lib.initialize(argv[1]);
+   if (!st.ok()) {
+      printf("%s\n", st.message());
+      exit(1);
+   }
+
+   // the first requests open the connection, they are not counted
+   c_status(1);
+   cpp_status(1);
+
+   for (run=0; run<4; run++) {
+      status[run % 2] += run % 2 ? cpp_status(iterations) : c_status(iterations);
+      login[run % 2] += run % 2 ? cpp_login(iterations) : c_login(iterations);
+   }
+
+   printf("Status, C API: %.0f ns per request\n", status[0] / 2);
+   printf("Status, C++ wrapper: %.0f ns per request\n", status[1] / 2);
+   printf("Login, C API: %.0f ns per request\n", login[0] / 2);
+   printf("Login, C++ wrapper: %.0f ns per request\n", login[1] / 2);
+   exit(0);
+}
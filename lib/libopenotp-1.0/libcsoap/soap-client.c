@@ -25,6 +25,10 @@
 #include <config.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -35,6 +39,7 @@
 
 #include <nanohttp/nanohttp-logging.h>
 #include <nanohttp/nanohttp-client.h>
+#include <nanohttp/nanohttp-secure.h>
 
 #include "soap-client.h"
 
@@ -59,6 +64,46 @@ _soap_client_build_result(hresponse_t * res, SoapEnv ** env)
   return soap_env_new_from_stream(res->in, env);
 }
 
+/*
+  Initial size of the buffer a request is serialized in. Requests
+  fit in it, so that libxml2 does not leave copies of the passwords
+  behind when it grows the buffer.
+*/
+#define SOAP_CLIENT_BUFFER_SIZE 8192
+
+/*
+  Serializes the envelope of 'call' into a secure arena, which the
+  caller releases with hsecure_free(). The buffer of libxml2 is wiped
+  before it is freed.
+*/
+static herror_t
+_soap_client_serialize(SoapCtx * call, hsecure_t ** secure, char **content)
+{
+  xmlBufferPtr buffer;
+
+  if (!(buffer = xmlBufferCreateSize(SOAP_CLIENT_BUFFER_SIZE)))
+    return herror_new("_soap_client_serialize", SOAP_ERROR_CLIENT_INIT,
+                      "Unable to create the request buffer");
+
+  xmlNodeDump(buffer, call->env->root->doc, call->env->root, 1, 0);
+
+  if ((*secure = hsecure_new()) != NULL
+      && !(*content = hsecure_strdup(*secure, (const char *) xmlBufferContent(buffer))))
+  {
+    hsecure_free(*secure);
+    *secure = NULL;
+  }
+
+  hsecure_wipe((void *) xmlBufferContent(buffer), xmlBufferLength(buffer));
+  xmlBufferFree(buffer);
+
+  if (*secure == NULL)
+    return herror_new("_soap_client_serialize", SOAP_ERROR_CLIENT_INIT,
+                      "Unable to allocate the request");
+
+  return H_OK;
+}
+
 herror_t
 soap_client_init_args(int argc, char *argv[])
 {
@@ -70,6 +115,7 @@ void
 soap_client_destroy(void)
 {
   httpc_destroy();
+  soap_env_destroy();
 
   return;
 }
@@ -85,7 +131,7 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
   SoapEnv *res_env;
 
   /* Buffer variables */
-  xmlBufferPtr buffer;
+  hsecure_t *secure;
   char *content;
   char tmp[15];
 
@@ -97,18 +143,21 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
   char start_id[150];
   static int counter = 1;
   part_t *part;
+  int retried = 0, sent;
 
   /* for copy attachments */
   char href[MAX_HREF_SIZE];
 
   /* Create buffer */
-  buffer = xmlBufferCreate();
-  xmlNodeDump(buffer, call->env->root->doc, call->env->root, 1, 0);
-  content = (char *) xmlBufferContent(buffer);
+  if ((status = _soap_client_serialize(call, &secure, &content)) != H_OK)
+    return status;
 
   /* Transport via HTTP */
+retry:
+  sent = 0;
   if (!(conn = httpc_new()))
   {
+    hsecure_free(secure);
     return herror_new("soap_client_invoke", SOAP_ERROR_CLIENT_INIT,
                       "Unable to create SOAP client!");
   }
@@ -117,7 +166,9 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
   if (soap_action != NULL)
     httpc_set_header(conn, "SoapAction", soap_action);
 
-  httpc_set_header(conn, HEADER_CONNECTION, "Close");
+  /* plain requests keep the connection for the next one */
+  if (call->attachments)
+    httpc_set_header(conn, HEADER_CONNECTION, "Close");
 
   /* check for attachments */
   if (!call->attachments)
@@ -128,24 +179,34 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
     sprintf(tmp, "%d", (int) strlen(content));
     httpc_set_header(conn, HEADER_CONTENT_LENGTH, tmp);
 
-    if ((status = httpc_post_begin(conn, url)) != H_OK)
+    if ((status = httpc_post_begin(conn, url)) == H_OK
+        && (status = http_output_stream_write_string(conn->out, content)) == H_OK
+        && (status = httpc_post_finish(conn)) == H_OK)
     {
-      httpc_close_free(conn);
-      xmlBufferFree(buffer);
-      return status;
-    }
-
-    if ((status = http_output_stream_write_string(conn->out, content)) != H_OK)
-    {
-      httpc_close_free(conn);
-      xmlBufferFree(buffer);
-      return status;
+      sent = 1;
+      status = httpc_receive(conn, &res);
     }
 
-    if ((status = httpc_post_end(conn, &res)) != H_OK)
+    if (status != H_OK)
     {
+      /* a pooled connection may have been dropped by the server while
+         it was idle, so give the request one more try on a new one.
+         Only when the server closed it before answering, and unless the
+         whole request may have reached it: a login or a challenge sent
+         twice can consume the OTP or push twice. An incomplete body is
+         never processed. */
+      if (conn->reused && !retried
+          && herror_code(status) == HSOCKET_ERROR_CLOSED
+          && (!sent || call->idempotent))
+      {
+        log_verbose2("Retrying on a new connection (%s)", herror_message(status));
+        herror_release(status);
+        httpc_close_free(conn);
+        retried = 1;
+        goto retry;
+      }
       httpc_close_free(conn);
-      xmlBufferFree(buffer);
+      hsecure_free(secure);
       return status;
     }
   }
@@ -160,21 +221,21 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
     if ((status = httpc_mime_begin(conn, url, start_id, "", "text/xml")) != H_OK)
     {
       httpc_close_free(conn);
-      xmlBufferFree(buffer);
+      hsecure_free(secure);
       return status;
     }
 
     if ((status = httpc_mime_next(conn, start_id, "text/xml", "binary")) != H_OK)
     {
       httpc_close_free(conn);
-      xmlBufferFree(buffer);
+      hsecure_free(secure);
       return status;
     }
 
     if ((status = http_output_stream_write(conn->out, content, strlen(content))) != H_OK)
     {
       httpc_close_free(conn);
-      xmlBufferFree(buffer);
+      hsecure_free(secure);
       return status;
     }
 
@@ -188,7 +249,7 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
       {
         log_error2("Send file failed. Status:%d", status);
         httpc_close_free(conn);
-        xmlBufferFree(buffer);
+        hsecure_free(secure);
         return status;
       }
     }
@@ -196,13 +257,13 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
     if ((status = httpc_mime_end(conn, &res)) != H_OK)
     {
       httpc_close_free(conn);
-      xmlBufferFree(buffer);
+      hsecure_free(secure);
       return status;
     }
   }
 
   /* Free buffer */
-  xmlBufferFree(buffer);
+  hsecure_free(secure);
 
   /* Build result */
   if ((status = _soap_client_build_result(res, &res_env)) != H_OK)
@@ -233,9 +294,175 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
     }
   }
 
-  hresponse_free(res);
-  httpc_close_free(conn);
+  if (!call->attachments && httpc_response_reusable(res))
+  {
+    hresponse_free(res);
+    httpc_park_free(conn);
+  }
+  else
+  {
+    hresponse_free(res);
+    httpc_close_free(conn);
+  }
 
   return H_OK;
 }
 
+
+/*
+  Number of requests written ahead of the responses read
+  on a pipelined connection.
+*/
+#define SOAP_CLIENT_PIPELINE_DEPTH 16
+
+static herror_t
+_soap_client_send(httpc_conn_t * conn, SoapCtx * call, const char *url)
+{
+  herror_t status;
+  hsecure_t *secure;
+  char *content;
+  char tmp[15];
+
+  if ((status = _soap_client_serialize(call, &secure, &content)) != H_OK)
+    return status;
+
+  sprintf(tmp, "%d", (int) strlen(content));
+  httpc_set_header(conn, HEADER_CONTENT_LENGTH, tmp);
+
+  if ((status = httpc_post_begin(conn, url)) == H_OK
+      && (status = http_output_stream_write_string(conn->out, content)) == H_OK)
+    status = httpc_post_finish(conn);
+
+  hsecure_free(secure);
+
+  return status;
+}
+
+static herror_t
+_soap_client_copy_error(herror_t err)
+{
+  return herror_new(herror_func(err), herror_code(err), "%s",
+                    herror_message(err));
+}
+
+herror_t
+soap_client_invoke_batch(SoapCtx ** calls, SoapCtx ** responses,
+                         herror_t * errors, int count, const char *url,
+                         const char *soap_action)
+{
+  /* Status */
+  herror_t status = H_OK;
+
+  /* Result document */
+  SoapEnv *res_env;
+
+  /* Transport variables */
+  httpc_conn_t *conn = NULL;
+  hresponse_t *res;
+
+  /* next request to send, next response to read */
+  int sent = 0, done = 0;
+  int keep_alive = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (calls[i]->attachments)
+      return herror_new("soap_client_invoke_batch", GENERAL_INVALID_PARAM,
+                        "Attachments can not be sent in a batch");
+    responses[i] = NULL;
+    errors[i] = H_OK;
+  }
+
+  while (done < count)
+  {
+    if (conn == NULL)
+    {
+      if (!(conn = httpc_new()))
+      {
+        status = herror_new("soap_client_invoke_batch", SOAP_ERROR_CLIENT_INIT,
+                            "Unable to create SOAP client!");
+        break;
+      }
+      if (soap_action != NULL)
+        httpc_set_header(conn, "SoapAction", soap_action);
+      httpc_set_header(conn, HEADER_CONTENT_TYPE, "text/xml");
+      /* the server closed the previous connection after the response
+         of 'done - 1' and did not process the requests which followed */
+      sent = done;
+    }
+
+    /* keep the pipeline filled */
+    status = H_OK;
+    while (sent < count && sent - done < SOAP_CLIENT_PIPELINE_DEPTH)
+    {
+      if ((status = _soap_client_send(conn, calls[sent], url)) != H_OK)
+        break;
+      sent++;
+    }
+
+    if (sent == done)
+    {
+      /* nothing could be sent, the server is not reachable */
+      if (status == H_OK)
+        status = herror_new("soap_client_invoke_batch", GENERAL_INVALID_PARAM,
+                            "Request could not be sent");
+      break;
+    }
+    if (status != H_OK)
+    {
+      /* read the responses of what was sent before the failure */
+      herror_release(status);
+      status = H_OK;
+    }
+
+    while (done < sent)
+    {
+      if ((status = httpc_receive(conn, &res)) != H_OK)
+        break;
+
+      if ((errors[done] = _soap_client_build_result(res, &res_env)) == H_OK)
+        responses[done] = soap_ctx_new(res_env);
+      done++;
+
+      keep_alive = httpc_response_reusable(res);
+      hresponse_free(res);
+      if (!keep_alive)
+        break;
+    }
+
+    if (status != H_OK)
+    {
+      /* the requests without a response may have been processed: they
+         fail rather than be sent again, a login or a challenge must not
+         be replayed. The ones not sent yet go on a new connection. */
+      log_verbose3("Pipeline broken, %d requests failed (%s)", sent - done,
+                   herror_message(status));
+      while (done < sent - 1)
+        errors[done++] = _soap_client_copy_error(status);
+      errors[done++] = status;
+      status = H_OK;
+      keep_alive = 0;
+    }
+
+    if (!keep_alive)
+    {
+      httpc_close_free(conn);
+      conn = NULL;
+    }
+  }
+
+  /* fail the requests which could not be sent */
+  for (i = done; i < count; i++)
+    errors[i] = (i == count - 1) ? status : _soap_client_copy_error(status);
+
+  if (conn != NULL)
+  {
+    if (done == count && keep_alive)
+      httpc_park_free(conn);
+    else
+      httpc_close_free(conn);
+  }
+
+  return H_OK;
+}
@@ -60,6 +60,30 @@ void soap_client_destroy();
 herror_t soap_client_invoke(SoapCtx * ctx, SoapCtx ** response,
                             const char *url, const char *soap_action);
 
+/**
+   Sends several envelopes to the same soap server over one
+   kept alive connection, without waiting for each response
+   before sending the next one (HTTP/1.1 pipelining). The
+   responses are read back in order. If the connection breaks,
+   the requests without a response fail: the server may have
+   processed them. The requests not sent yet go on a new
+   connection.
+
+   @param calls envelopes to send
+   @param responses the result envelopes, NULL for failed requests
+   @param errors the status of each request
+   @param count number of envelopes
+   @param url url to the soap server
+   @soap_action value for "SoapAction:" in the 
+    HTTP request header.
+
+    @returns H_OK if the batch was processed, the status
+    of each request is in errors.
+ */
+herror_t soap_client_invoke_batch(SoapCtx ** calls, SoapCtx ** responses,
+                                  herror_t * errors, int count,
+                                  const char *url, const char *soap_action);
+
 
 
 /**
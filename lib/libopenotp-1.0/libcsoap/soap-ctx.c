@@ -55,6 +55,7 @@ soap_ctx_new(SoapEnv * env)     /* should only be used internally */
   ctx->env = env;
   ctx->attachments = NULL;
   ctx->action = NULL;
+  ctx->idempotent = 0;
 
   return ctx;
 }
@@ -40,6 +40,7 @@ typedef struct _SoapCtx
   char *action;
   hrequest_t *http;
   attachments_t *attachments;
+  int idempotent;               /* may be sent again if the connection drops */
 } SoapCtx;
 
 #ifdef __cplusplus
@@ -49,7 +49,12 @@
 #include <libxml/xmlstring.h>
 #endif
 
+#include <libxml/parser.h>
+#include <libxml/dict.h>
+
 #include <nanohttp/nanohttp-logging.h>
+#include <nanohttp/nanohttp-secure.h>
+#include <nanohttp/nanohttp-thread.h>
 
 #include "soap-xml.h"
 #include "soap-env.h"
@@ -356,16 +361,316 @@ _soap_env_xml_io_close(void *ctx)
 }
 
 
+/*
+  Responses are parsed by a push parser kept by each thread, fed
+  with the body as it arrives. The names of the documents go to a
+  dictionary of the parser whose parent, shared by all the threads,
+  is seeded with the SOAP names and those given to
+  soap_env_parser_seed(). The parent is only read once the first
+  parser exists, which makes it safe to share without locking.
+  A parser whose own dictionary grew past SOAP_ENV_DICT_MAX names
+  is replaced, the documents still using it keep it alive. The
+  parsers of all the threads are linked by their _private field, so
+  that soap_env_destroy() frees them with the thread key.
+*/
+#define SOAP_ENV_DICT_MAX 4096
+#define SOAP_ENV_CHUNK_SIZE 4096
+
+static xmlDictPtr _soap_env_dict = NULL;
+static int _soap_env_dict_frozen = 0;
+static hmutex_t _soap_env_dict_lock = HMUTEX_INITIALIZER;
+
+static const char *const _soap_env_names[] = {
+  "Envelope", "Header", "Body", "Fault", "faultcode", "faultstring",
+  "faultactor", "detail", "encodingStyle", "type", "SOAP-ENV",
+  "SOAP-ENC", "xsi", "xsd", "xsd:string", "xsd:integer", "xsd:boolean",
+  NULL
+};
+
+/* the key and the list are protected by the dictionary lock */
+static xmlParserCtxtPtr _soap_env_parsers = NULL;
+#ifdef WIN32
+static DWORD _soap_env_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t _soap_env_key;
+static volatile int _soap_env_key_ok = 0;
+#endif
+
+static void
+_soap_env_dict_add(const char *const *names)
+{
+  for (; *names != NULL; names++)
+    xmlDictLookup(_soap_env_dict, BAD_CAST * names, -1);
+}
+
+static xmlDictPtr
+_soap_env_dict_create(void)
+{
+  static const char *const ns[] = {
+    soap_env_ns, soap_env_enc, soap_xsi_ns, soap_xsd_ns, NULL
+  };
+
+  if (_soap_env_dict == NULL && (_soap_env_dict = xmlDictCreate()) != NULL)
+  {
+    _soap_env_dict_add(_soap_env_names);
+    _soap_env_dict_add(ns);
+  }
+  return _soap_env_dict;
+}
+
+void
+soap_env_parser_seed(const char *const *names)
+{
+  if (names == NULL)
+    return;
+
+  hmutex_lock(&_soap_env_dict_lock);
+  if (!_soap_env_dict_frozen && _soap_env_dict_create() != NULL)
+    _soap_env_dict_add(names);
+  else
+    log_verbose1("Names given after the first response are not shared");
+  hmutex_unlock(&_soap_env_dict_lock);
+}
+
+#ifdef WIN32
+static VOID WINAPI
+#else
+static void
+#endif
+_soap_env_parser_release(void *data)
+{
+  xmlParserCtxtPtr *ptr;
+  int found = 0;
+
+  if (data == NULL)
+    return;
+
+  /* not in the list once soap_env_destroy has taken it */
+  hmutex_lock(&_soap_env_dict_lock);
+  for (ptr = &_soap_env_parsers; *ptr != NULL;
+       ptr = (xmlParserCtxtPtr *) & (*ptr)->_private)
+  {
+    if (*ptr == (xmlParserCtxtPtr) data)
+    {
+      *ptr = (xmlParserCtxtPtr) (*ptr)->_private;
+      found = 1;
+      break;
+    }
+  }
+  hmutex_unlock(&_soap_env_dict_lock);
+
+  if (found)
+    xmlFreeParserCtxt((xmlParserCtxtPtr) data);
+}
+
+/* sets the parser of the calling thread */
+static int
+_soap_env_parser_set(xmlParserCtxtPtr ctxt)
+{
+#ifdef WIN32
+  return FlsSetValue(_soap_env_key, ctxt) ? 0 : -1;
+#else
+  return pthread_setspecific(_soap_env_key, ctxt);
+#endif
+}
+
+/*--------------------------------------------------
+FUNCTION: _soap_env_parser_new
+DESC: Creates a push parser using a dictionary of
+its own on top of the shared one.
+----------------------------------------------------*/
+static xmlParserCtxtPtr
+_soap_env_parser_new(void)
+{
+  xmlParserCtxtPtr ctxt;
+  xmlDictPtr dict;
+
+  hmutex_lock(&_soap_env_dict_lock);
+  _soap_env_dict_frozen = 1;
+  _soap_env_dict_create();
+  hmutex_unlock(&_soap_env_dict_lock);
+  if (_soap_env_dict == NULL)
+    return NULL;
+
+  if (!(ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL)))
+    return NULL;
+  if (!(dict = xmlDictCreateSub(_soap_env_dict)))
+  {
+    xmlFreeParserCtxt(ctxt);
+    return NULL;
+  }
+
+  /* the names the parser compares by address come from the new dictionary */
+  if (ctxt->dict != NULL)
+    xmlDictFree(ctxt->dict);
+  ctxt->dict = dict;
+  ctxt->str_xml = xmlDictLookup(dict, BAD_CAST "xml", 3);
+  ctxt->str_xmlns = xmlDictLookup(dict, BAD_CAST "xmlns", 5);
+  ctxt->str_xml_ns = xmlDictLookup(dict, XML_XML_NAMESPACE, 36);
+
+  return ctxt;
+}
+
+/*--------------------------------------------------
+FUNCTION: _soap_env_parser
+DESC: Returns the push parser of the calling thread,
+ready for a new document, or NULL.
+----------------------------------------------------*/
+static xmlParserCtxtPtr
+_soap_env_parser(void)
+{
+  xmlParserCtxtPtr ctxt;
+
+#ifdef WIN32
+  if (_soap_env_key == FLS_OUT_OF_INDEXES)
+  {
+    hmutex_lock(&_soap_env_dict_lock);
+    if (_soap_env_key == FLS_OUT_OF_INDEXES)
+      _soap_env_key = FlsAlloc(_soap_env_parser_release);
+    hmutex_unlock(&_soap_env_dict_lock);
+    if (_soap_env_key == FLS_OUT_OF_INDEXES)
+      return NULL;
+  }
+  ctxt = (xmlParserCtxtPtr) FlsGetValue(_soap_env_key);
+#else
+  if (!_soap_env_key_ok)
+  {
+    hmutex_lock(&_soap_env_dict_lock);
+    if (!_soap_env_key_ok)
+      _soap_env_key_ok = pthread_key_create(&_soap_env_key, _soap_env_parser_release) == 0;
+    hmutex_unlock(&_soap_env_dict_lock);
+    if (!_soap_env_key_ok)
+      return NULL;
+  }
+  ctxt = (xmlParserCtxtPtr) pthread_getspecific(_soap_env_key);
+#endif
+
+  /* the slot is cleared first, the parser is not freed twice at the
+     exit of the thread if no new one can be made */
+  if (ctxt != NULL && xmlDictSize(ctxt->dict) > SOAP_ENV_DICT_MAX)
+  {
+    _soap_env_parser_set(NULL);
+    _soap_env_parser_release(ctxt);
+    ctxt = NULL;
+  }
+
+  if (ctxt == NULL)
+  {
+    if (!(ctxt = _soap_env_parser_new()))
+      return NULL;
+    if (_soap_env_parser_set(ctxt) != 0)
+    {
+      xmlFreeParserCtxt(ctxt);
+      return NULL;
+    }
+    hmutex_lock(&_soap_env_dict_lock);
+    ctxt->_private = _soap_env_parsers;
+    _soap_env_parsers = ctxt;
+    hmutex_unlock(&_soap_env_dict_lock);
+  }
+  else if (xmlCtxtResetPush(ctxt, NULL, 0, NULL, NULL) != 0)
+    return NULL;
+
+  xmlCtxtUseOptions(ctxt, 0);
+  return ctxt;
+}
+
+
+/*--------------------------------------------------
+FUNCTION: soap_env_destroy
+----------------------------------------------------*/
+void
+soap_env_destroy(void)
+{
+  xmlParserCtxtPtr ctxt, next;
+#ifdef WIN32
+  DWORD key;
+#else
+  pthread_key_t key;
+  int key_ok;
+#endif
+
+  hmutex_lock(&_soap_env_dict_lock);
+  key = _soap_env_key;
+#ifdef WIN32
+  _soap_env_key = FLS_OUT_OF_INDEXES;
+#else
+  key_ok = _soap_env_key_ok;
+  _soap_env_key_ok = 0;
+#endif
+  hmutex_unlock(&_soap_env_dict_lock);
+
+  /* FlsFree runs the callback for the values of the fibers, which
+     takes the lock */
+#ifdef WIN32
+  if (key != FLS_OUT_OF_INDEXES)
+    FlsFree(key);
+#else
+  if (key_ok)
+    pthread_key_delete(key);
+#endif
+
+  hmutex_lock(&_soap_env_dict_lock);
+  ctxt = _soap_env_parsers;
+  _soap_env_parsers = NULL;
+  hmutex_unlock(&_soap_env_dict_lock);
+
+  for (; ctxt != NULL; ctxt = next)
+  {
+    next = (xmlParserCtxtPtr) ctxt->_private;
+    xmlFreeParserCtxt(ctxt);
+  }
+}
+
 herror_t
 soap_env_new_from_stream(http_input_stream_t * in, SoapEnv ** out)
 {
+  xmlParserCtxtPtr ctxt;
   xmlDocPtr doc;
+  char buffer[SOAP_ENV_CHUNK_SIZE];
+  int len;
+
+  /* without a parser of its own, the thread uses a new one */
+  if (!(ctxt = _soap_env_parser()))
+  {
+    doc = xmlReadIO(_soap_env_xml_io_read,
+                    _soap_env_xml_io_close, in, "", NULL, 0);
+
+    if (in->err != H_OK)
+      return in->err;
+
+    if (doc == NULL)
+      return herror_new("soap_env_new_from_stream",
+                        XML_ERROR_PARSE, "Trying to parse not valid xml");
+
+    return soap_env_new_from_doc(doc, out);
+  }
+
+  /* each read returns what arrived, parsed before waiting for more */
+  while (ctxt->wellFormed && http_input_stream_is_ready(in))
+  {
+    if ((len = http_input_stream_read(in, (byte_t *) buffer, sizeof(buffer))) <= 0)
+      break;
+    xmlParseChunk(ctxt, buffer, len, 0);
+  }
+
+  if (in->err == H_OK && ctxt->wellFormed)
+    xmlParseChunk(ctxt, NULL, 0, 1);
+
+  doc = ctxt->myDoc;
+  ctxt->myDoc = NULL;
 
-  doc = xmlReadIO(_soap_env_xml_io_read,
-                  _soap_env_xml_io_close, in, "", NULL, 0);
+  if (in->err != H_OK || !ctxt->wellFormed)
+  {
+    if (doc != NULL)
+      xmlFreeDoc(doc);
+
+    if (in->err != H_OK)
+      return in->err;
 
-  if (in->err != H_OK)
-    return in->err;
+    return herror_new("soap_env_new_from_stream",
+                      XML_ERROR_PARSE, "Trying to parse not valid xml");
+  }
 
   if (doc == NULL)
     return herror_new("soap_env_new_from_stream",
@@ -481,6 +786,37 @@ soap_env_pop_item(SoapEnv * call)
 }
 
 
+/*
+  Wipes the text of the tree before it is freed: requests carry the
+  passwords and responses may carry other secrets. Strings owned by
+  the dictionary of the document are shared and left alone.
+*/
+static void
+_soap_env_wipe(xmlDocPtr doc, xmlNodePtr node)
+{
+  xmlAttrPtr attr;
+
+  for (; node != NULL; node = node->next)
+  {
+    switch (node->type)
+    {
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+      if (node->content != NULL
+          && !(doc->dict != NULL && xmlDictOwns(doc->dict, node->content)))
+        hsecure_wipe(node->content, strlen((const char *) node->content));
+      break;
+    case XML_ELEMENT_NODE:
+      for (attr = node->properties; attr != NULL; attr = attr->next)
+        _soap_env_wipe(doc, attr->children);
+      _soap_env_wipe(doc, node->children);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
 void
 soap_env_free(SoapEnv * env)
 {
@@ -488,6 +824,7 @@ soap_env_free(SoapEnv * env)
   {
     if (env->root)
     {
+      _soap_env_wipe(env->root->doc, env->root);
       xmlFreeDoc(env->root->doc);
     }
     free(env);
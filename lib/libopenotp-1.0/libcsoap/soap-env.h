@@ -178,6 +178,22 @@ herror_t soap_env_new_from_buffer(const char *buffer, SoapEnv ** out);
 */
 herror_t soap_env_new_from_stream(http_input_stream_t * in, SoapEnv ** out);
 
+/**
+  Adds names to the dictionary shared by the parsers of all the
+  threads, typically the elements of the expected responses, so
+  that the parsers find them instead of copying them. Names given
+  after the first response was parsed are ignored.
+
+   @param names the names, ended by NULL
+*/
+void soap_env_parser_seed(const char *const *names);
+
+/**
+  Frees the parsers of all the threads and releases the thread key,
+  once no other thread parses. The next response creates them again.
+*/
+void soap_env_destroy(void);
+
 /* --------------------------------------------------- */
 /*      XML Serializer functions  and typedefs         */
 /* --------------------------------------------------- */
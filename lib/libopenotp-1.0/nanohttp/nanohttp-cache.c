@@ -0,0 +1,705 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stddef.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <sddl.h>
+#include <aclapi.h>
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include "nanohttp-cache.h"
+#include "nanohttp-thread.h"
+#include "nanohttp-logging.h"
+
+/* version 1 also kept SSL sessions, they are wiped with the old layout */
+#define HCACHE_MAGIC		"NHCACHE2"
+#define HCACHE_PROBES		4
+/* a slot left odd longer than this belongs to a writer which died */
+#define HCACHE_WRITE_TIMEOUT	5
+
+#ifdef WIN32
+typedef volatile LONG hcache_seq_t;
+#else
+typedef volatile int hcache_seq_t;
+#endif
+
+/* fixed size fields only, the file is shared by 32 and 64 bit processes */
+typedef struct _hcache_slot
+{
+  hcache_seq_t seq;
+  int type;
+  int length;
+  unsigned int checksum;
+  long long expires;
+  long long stamp;
+  char key[HCACHE_KEY_SIZE];
+  unsigned char data[1];
+} hcache_slot_t;
+
+#define HCACHE_DATA_SIZE	(HCACHE_SLOT_SIZE - (int) offsetof(hcache_slot_t, data))
+#define HCACHE_FILE_SIZE	(HCACHE_SLOT_SIZE * (HCACHE_SLOTS + 1))
+
+typedef struct _hcache_header
+{
+  char magic[8];
+  int slots;
+  int slot_size;
+} hcache_header_t;
+
+/* the mapping is read without locking: readers count themselves
+   in the counter of the current epoch around each access. A mapping
+   replaced or closed moves the epoch on, then is unmapped once the
+   counter of the previous epoch drains, which later readers do not
+   hold up. The lock serializes hcache_open and hcache_close. */
+static unsigned char *volatile _hcache_map = NULL;
+static volatile long _hcache_epoch = 0;
+static volatile long _hcache_readers[2] = { 0, 0 };
+static hmutex_t _hcache_open_lock = HMUTEX_INITIALIZER;
+static char *_hcache_path = NULL;
+#ifdef WIN32
+static HANDLE _hcache_file = INVALID_HANDLE_VALUE;
+static HANDLE _hcache_mapping = NULL;
+#endif
+
+static hcache_slot_t *
+_hcache_slot(unsigned char *map, unsigned int index)
+{
+  /* the header takes the first slot */
+  return (hcache_slot_t *) (map + HCACHE_SLOT_SIZE * (1 + index % HCACHE_SLOTS));
+}
+
+/* returns the mapping to read, or NULL, counted in the counter
+   'side' until _hcache_leave */
+static unsigned char *
+_hcache_enter(int *side)
+{
+  unsigned char *map;
+  long epoch;
+
+  for (;;)
+  {
+    epoch = _hcache_epoch;
+    *side = (int) (epoch & 1);
+    hatomic_inc(&_hcache_readers[*side]);
+    /* moved on in between: the retiring thread may not wait for us */
+    if (_hcache_epoch == epoch)
+      break;
+    hatomic_dec(&_hcache_readers[*side]);
+  }
+
+  /* not read ahead of the epoch */
+  hatomic_barrier();
+  if ((map = _hcache_map) == NULL)
+    hatomic_dec(&_hcache_readers[*side]);
+  return map;
+}
+
+static void
+_hcache_leave(int side)
+{
+  hatomic_dec(&_hcache_readers[side]);
+}
+
+static unsigned int
+_hcache_fnv(unsigned int hash, const void *data, int length)
+{
+  const unsigned char *ptr = (const unsigned char *) data;
+
+  while (length-- > 0)
+  {
+    hash ^= *ptr++;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static unsigned int
+_hcache_hash(int type, const char *key)
+{
+  unsigned int hash = 2166136261U;
+
+  hash = _hcache_fnv(hash, &type, sizeof(type));
+  return _hcache_fnv(hash, key, strlen(key));
+}
+
+static unsigned int
+_hcache_checksum(int type, const char *key, int length, long long expires,
+                 const void *data)
+{
+  unsigned int hash = 2166136261U;
+
+  hash = _hcache_fnv(hash, &type, sizeof(type));
+  hash = _hcache_fnv(hash, &length, sizeof(length));
+  hash = _hcache_fnv(hash, &expires, sizeof(expires));
+  hash = _hcache_fnv(hash, key, strlen(key));
+  return _hcache_fnv(hash, data, length);
+}
+
+#ifdef WIN32
+static int
+_hcache_trusted(PSID sid, PSID user)
+{
+  return IsWellKnownSid(sid, WinLocalSystemSid)
+    || IsWellKnownSid(sid, WinBuiltinAdministratorsSid)
+    || (user != NULL && EqualSid(sid, user));
+}
+
+/*--------------------------------------------------
+FUNCTION: _hcache_private
+DESC: Returns 1 if an existing cache file is owned by
+SYSTEM, the Administrators or the user of the
+process, and no one else may write it.
+----------------------------------------------------*/
+static int
+_hcache_private(HANDLE file)
+{
+  PSECURITY_DESCRIPTOR sd = NULL;
+  PSID owner = NULL, user = NULL;
+  PACL dacl = NULL;
+  ACE_HEADER *ace;
+  ACCESS_MASK mask;
+  HANDLE token;
+  DWORD size, i;
+  BYTE buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+  int ok;
+
+  if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+  {
+    if (GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &size))
+      user = ((TOKEN_USER *) buffer)->User.Sid;
+    CloseHandle(token);
+  }
+
+  if (GetSecurityInfo(file, SE_FILE_OBJECT,
+                      OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+                      &owner, NULL, &dacl, NULL, &sd) != ERROR_SUCCESS)
+    return 0;
+
+  /* a NULL DACL lets everyone in */
+  ok = owner != NULL && dacl != NULL && _hcache_trusted(owner, user);
+  for (i = 0; ok && i < dacl->AceCount; i++)
+  {
+    if (!GetAce(dacl, i, (LPVOID *) &ace))
+      ok = 0;
+    else if (ace->AceType == ACCESS_DENIED_ACE_TYPE || (ace->AceFlags & INHERIT_ONLY_ACE))
+      continue;
+    else if (ace->AceType != ACCESS_ALLOWED_ACE_TYPE)
+      ok = 0;
+    else
+    {
+      ACCESS_ALLOWED_ACE *allowed = (ACCESS_ALLOWED_ACE *) ace;
+      PSID sid = (PSID) &allowed->SidStart;
+
+      mask = allowed->Mask & (GENERIC_ALL | GENERIC_WRITE | FILE_WRITE_DATA | FILE_APPEND_DATA
+                              | FILE_WRITE_EA | FILE_WRITE_ATTRIBUTES | DELETE | WRITE_DAC | WRITE_OWNER);
+      /* OWNER RIGHTS stands for the owner, checked above */
+      if (mask != 0 && !_hcache_trusted(sid, user) && !IsWellKnownSid(sid, WinCreatorOwnerRightsSid))
+        ok = 0;
+    }
+  }
+
+  LocalFree(sd);
+  return ok;
+}
+#endif
+
+/*--------------------------------------------------
+FUNCTION: _hcache_retire
+DESC: Unmaps a mapping no longer published once the
+readers which may still use it are gone.
+----------------------------------------------------*/
+static void
+#ifdef WIN32
+_hcache_retire(unsigned char *map, HANDLE mapping, HANDLE file)
+#else
+_hcache_retire(unsigned char *map)
+#endif
+{
+  int side = (int) (_hcache_epoch & 1);
+
+  /* the readers of the new epoch see the new mapping */
+  hatomic_inc(&_hcache_epoch);
+  while (_hcache_readers[side] > 0)
+    hthread_msleep(1);
+
+#ifdef WIN32
+  if (map != NULL)
+    UnmapViewOfFile(map);
+  if (mapping != NULL)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+#else
+  if (map != NULL)
+    munmap(map, HCACHE_FILE_SIZE);
+#endif
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hcache_map_file
+DESC: Maps the cache file, creating it if needed.
+----------------------------------------------------*/
+static herror_t
+#ifdef WIN32
+_hcache_map_file(const char *path, unsigned char **out, HANDLE *out_mapping, HANDLE *out_file)
+#else
+_hcache_map_file(const char *path, unsigned char **out)
+#endif
+{
+  hcache_header_t *header;
+  unsigned char *map;
+
+#ifdef WIN32
+  HANDLE file, mapping;
+
+  {
+    SECURITY_ATTRIBUTES sa;
+    int err;
+
+    /* like mode 0600: the owner and the system only */
+    memset(&sa, 0, sizeof(sa));
+    sa.nLength = sizeof(sa);
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;GA;;;OW)(A;;GA;;;SY)",
+                                                              SDDL_REVISION_1,
+                                                              &sa.lpSecurityDescriptor,
+                                                              NULL))
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cannot build cache file permissions (%d)", GetLastError());
+
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                       OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    err = GetLastError();
+    LocalFree(sa.lpSecurityDescriptor);
+    if (file == INVALID_HANDLE_VALUE)
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cannot open cache file %s (%d)", path, err);
+
+    /* the permissions above only apply to a new file; addresses
+       written by another user could redirect the requests */
+    if (err == ERROR_ALREADY_EXISTS && !_hcache_private(file))
+    {
+      CloseHandle(file);
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cache file %s is not private to this user", path);
+    }
+  }
+
+  /* grows the file to the mapping size */
+  mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, 0, HCACHE_FILE_SIZE, NULL);
+  if (mapping == NULL
+      || !(map = (unsigned char *) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS,
+                                                 0, 0, HCACHE_FILE_SIZE)))
+  {
+    int err = GetLastError();
+    if (mapping != NULL)
+      CloseHandle(mapping);
+    CloseHandle(file);
+    return herror_new("hcache_open", FILE_ERROR_OPEN,
+                      "Cannot map cache file %s (%d)", path, err);
+  }
+#else
+  {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cannot open cache file %s (%s)", path, strerror(errno));
+
+    /* addresses written by another user could redirect the requests */
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 022))
+    {
+      close(fd);
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cache file %s is not private to this user", path);
+    }
+
+    if (st.st_size != HCACHE_FILE_SIZE && ftruncate(fd, HCACHE_FILE_SIZE) < 0)
+    {
+      herror_t err = herror_new("hcache_open", FILE_ERROR_OPEN,
+                                "Cannot size cache file %s (%s)", path, strerror(errno));
+      close(fd);
+      return err;
+    }
+
+    map = (unsigned char *) mmap(NULL, HCACHE_FILE_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == (unsigned char *) MAP_FAILED)
+      return herror_new("hcache_open", FILE_ERROR_OPEN,
+                        "Cannot map cache file %s (%s)", path, strerror(errno));
+  }
+#endif
+
+  /* a new file, or one of another layout, is cleared. Processes
+     racing here all write the same content. */
+  header = (hcache_header_t *) map;
+  if (memcmp(header->magic, HCACHE_MAGIC, sizeof(header->magic))
+      || header->slots != HCACHE_SLOTS || header->slot_size != HCACHE_SLOT_SIZE)
+  {
+    log_verbose2("Initializing cache file %s", path);
+    memset(map, 0, HCACHE_FILE_SIZE);
+    header->slots = HCACHE_SLOTS;
+    header->slot_size = HCACHE_SLOT_SIZE;
+    hatomic_barrier();
+    memcpy(header->magic, HCACHE_MAGIC, sizeof(header->magic));
+  }
+
+  *out = map;
+#ifdef WIN32
+  *out_mapping = mapping;
+  *out_file = file;
+#endif
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcache_open
+DESC: Maps the cache file, creating it if needed.
+The file already open is kept, another one replaces
+it once its readers are gone.
+----------------------------------------------------*/
+herror_t
+hcache_open(const char *path)
+{
+  unsigned char *map, *old;
+  herror_t status;
+  char *copy;
+#ifdef WIN32
+  HANDLE mapping, file, old_mapping, old_file;
+#endif
+
+  if (path == NULL)
+    return herror_new("hcache_open", GENERAL_INVALID_PARAM, "path is NULL");
+
+  hmutex_lock(&_hcache_open_lock);
+  if (_hcache_map != NULL && !strcmp(_hcache_path, path))
+  {
+    hmutex_unlock(&_hcache_open_lock);
+    return H_OK;
+  }
+
+  if (!(copy = strdup(path)))
+  {
+    hmutex_unlock(&_hcache_open_lock);
+    return herror_new("hcache_open", GENERAL_INVALID_PARAM, "Out of memory");
+  }
+#ifdef WIN32
+  status = _hcache_map_file(path, &map, &mapping, &file);
+#else
+  status = _hcache_map_file(path, &map);
+#endif
+  if (status != H_OK)
+  {
+    free(copy);
+    hmutex_unlock(&_hcache_open_lock);
+    return status;
+  }
+
+  /* the header is written before the readers see the mapping */
+  hatomic_barrier();
+  old = _hcache_map;
+  _hcache_map = map;
+  free(_hcache_path);
+  _hcache_path = copy;
+#ifdef WIN32
+  old_mapping = _hcache_mapping;
+  old_file = _hcache_file;
+  _hcache_mapping = mapping;
+  _hcache_file = file;
+  if (old != NULL)
+    _hcache_retire(old, old_mapping, old_file);
+#else
+  if (old != NULL)
+    _hcache_retire(old);
+#endif
+  hmutex_unlock(&_hcache_open_lock);
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcache_close
+----------------------------------------------------*/
+void
+hcache_close(void)
+{
+  unsigned char *map;
+
+  hmutex_lock(&_hcache_open_lock);
+  map = _hcache_map;
+  _hcache_map = NULL;
+  free(_hcache_path);
+  _hcache_path = NULL;
+#ifdef WIN32
+  _hcache_retire(map, _hcache_mapping, _hcache_file);
+  _hcache_mapping = NULL;
+  _hcache_file = INVALID_HANDLE_VALUE;
+#else
+  _hcache_retire(map);
+#endif
+  hmutex_unlock(&_hcache_open_lock);
+
+  return;
+}
+
+int
+hcache_enabled(void)
+{
+  return _hcache_map != NULL;
+}
+
+static int
+_hcache_get(unsigned char *map, int type, const char *key, void *data, int size)
+{
+  hcache_slot_t *slot;
+  char slot_key[HCACHE_KEY_SIZE];
+  unsigned int hash, checksum;
+  long long expires;
+  int seq, length;
+  int i;
+
+  if (key == NULL || strlen(key) >= HCACHE_KEY_SIZE)
+    return -1;
+
+  hash = _hcache_hash(type, key);
+  for (i = 0; i < HCACHE_PROBES; i++)
+  {
+    slot = _hcache_slot(map, hash + i);
+
+    seq = slot->seq;
+    if (seq & 1)
+      continue;
+    hatomic_barrier();
+
+    if (slot->type != type || strncmp(slot->key, key, HCACHE_KEY_SIZE))
+      continue;
+    length = slot->length;
+    expires = slot->expires;
+    checksum = slot->checksum;
+    memcpy(slot_key, slot->key, HCACHE_KEY_SIZE);
+    if (length < 0 || length > HCACHE_DATA_SIZE || length > size)
+      return -1;
+    memcpy(data, slot->data, length);
+
+    hatomic_barrier();
+    if (slot->seq != seq)
+      return -1;                /* being rewritten, take it as a miss */
+
+    slot_key[HCACHE_KEY_SIZE - 1] = '\0';
+    if (expires <= (long long) time(NULL)
+        || checksum != _hcache_checksum(type, slot_key, length, expires, data))
+      return -1;
+
+    return length;
+  }
+
+  return -1;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcache_get
+DESC: Copies a valid entry into data and returns
+its length, or -1.
+----------------------------------------------------*/
+int
+hcache_get(int type, const char *key, void *data, int size)
+{
+  unsigned char *map;
+  int length, side;
+
+  if ((map = _hcache_enter(&side)) == NULL)
+    return -1;
+  length = _hcache_get(map, type, key, data, size);
+  _hcache_leave(side);
+
+  return length;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hcache_lock
+DESC: Makes the slot sequence odd. Returns the new
+value, or 0 if another writer holds the slot.
+----------------------------------------------------*/
+static int
+_hcache_lock(hcache_slot_t *slot)
+{
+  int seq = slot->seq;
+
+  if (seq & 1)
+  {
+    if ((long long) time(NULL) - slot->stamp < HCACHE_WRITE_TIMEOUT)
+      return 0;
+    /* the writer died, its partial entry fails the checksum */
+    if (!hatomic_cas(&slot->seq, seq, seq + 1))
+      return 0;
+    seq++;
+  }
+  if (!hatomic_cas(&slot->seq, seq, seq + 1))
+    return 0;
+
+  slot->stamp = (long long) time(NULL);
+  return seq + 1;
+}
+
+static void
+_hcache_unlock(hcache_slot_t *slot, int seq)
+{
+  hatomic_barrier();
+  slot->seq = seq + 1;
+
+  return;
+}
+
+static void
+_hcache_put(unsigned char *map, int type, const char *key, const void *data, int length, int ttl)
+{
+  hcache_slot_t *slot, *victim = NULL;
+  unsigned int hash;
+  long long now;
+  int seq, i;
+
+  if (key == NULL || strlen(key) >= HCACHE_KEY_SIZE
+      || length < 0 || length > HCACHE_DATA_SIZE)
+    return;
+
+  /* same key first, then a free or expired slot, then the
+     one expiring first */
+  now = (long long) time(NULL);
+  hash = _hcache_hash(type, key);
+  for (i = 0; i < HCACHE_PROBES; i++)
+  {
+    slot = _hcache_slot(map, hash + i);
+    if (slot->type == type && !strncmp(slot->key, key, HCACHE_KEY_SIZE))
+    {
+      victim = slot;
+      break;
+    }
+    if (victim == NULL || (victim->expires > now && slot->expires < victim->expires))
+      victim = slot;
+  }
+
+  if (!(seq = _hcache_lock(victim)))
+    return;
+
+  victim->type = type;
+  victim->length = length;
+  victim->expires = now + ttl;
+  strcpy(victim->key, key);
+  memcpy(victim->data, data, length);
+  victim->checksum = _hcache_checksum(type, key, length, victim->expires, data);
+
+  _hcache_unlock(victim, seq);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcache_put
+----------------------------------------------------*/
+void
+hcache_put(int type, const char *key, const void *data, int length, int ttl)
+{
+  unsigned char *map;
+  int side;
+
+  if ((map = _hcache_enter(&side)) == NULL)
+    return;
+  _hcache_put(map, type, key, data, length, ttl);
+  _hcache_leave(side);
+
+  return;
+}
+
+static void
+_hcache_remove(unsigned char *map, int type, const char *key)
+{
+  hcache_slot_t *slot;
+  unsigned int hash;
+  int seq, i;
+
+  if (key == NULL || strlen(key) >= HCACHE_KEY_SIZE)
+    return;
+
+  hash = _hcache_hash(type, key);
+  for (i = 0; i < HCACHE_PROBES; i++)
+  {
+    slot = _hcache_slot(map, hash + i);
+    if (slot->type != type || strncmp(slot->key, key, HCACHE_KEY_SIZE))
+      continue;
+    if ((seq = _hcache_lock(slot)))
+    {
+      slot->expires = 0;
+      _hcache_unlock(slot, seq);
+    }
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcache_remove
+----------------------------------------------------*/
+void
+hcache_remove(int type, const char *key)
+{
+  unsigned char *map;
+  int side;
+
+  if ((map = _hcache_enter(&side)) == NULL)
+    return;
+  _hcache_remove(map, type, key);
+  _hcache_leave(side);
+
+  return;
+}
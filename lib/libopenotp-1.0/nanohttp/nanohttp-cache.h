@@ -0,0 +1,97 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifndef NANO_HTTP_CACHE_H
+#define NANO_HTTP_CACHE_H
+
+/*
+  Cache of resolved addresses shared by all the processes which open
+  the same file. The file is memory mapped and
+  divided in fixed size slots. Each slot is guarded by a sequence
+  counter: a writer makes it odd with a compare and swap (and gives
+  up if another writer holds it), readers copy the slot and retry
+  when the counter changed. Entries carry an expiry time and a
+  checksum, so a torn or corrupted slot is just a cache miss.
+
+  The file is created for its owner only and is refused if another
+  user could write it. SSL sessions are not kept here: they are
+  cached in the memory of each process (see nanohttp-ssl.c).
+*/
+
+#include <nanohttp/nanohttp-common.h>
+
+#define HCACHE_DNS		1
+
+#define HCACHE_SLOTS		128
+#define HCACHE_SLOT_SIZE	4096
+#define HCACHE_KEY_SIZE		128
+
+/* seconds a resolved address is used without asking DNS again */
+#define HCACHE_DNS_TTL		300
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Maps the cache file, creating it if needed. Calling it again
+  with the same file does nothing; with another file, the mapping
+  is replaced once the readers in progress are done.
+
+  @returns H_OK on success or a herror_t struct on failure.
+*/
+herror_t hcache_open(const char *path);
+
+/**
+  Unmaps the cache file once the readers in progress are done.
+  The file is kept for the next process.
+*/
+void hcache_close(void);
+
+/**
+  @returns 1 if a cache file is open.
+*/
+int hcache_enabled(void);
+
+/**
+  Copies the entry of the given type and key into data.
+
+  @returns the length of the entry, or -1 if there is no valid
+  entry or it is larger than size.
+*/
+int hcache_get(int type, const char *key, void *data, int size);
+
+/**
+  Stores an entry valid for ttl seconds. Does nothing if the
+  entry does not fit in a slot or the slot is being written by
+  another thread or process.
+*/
+void hcache_put(int type, const char *key, const void *data, int length, int ttl);
+
+/**
+  Invalidates the entry of the given type and key.
+*/
+void hcache_remove(int type, const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -52,6 +52,147 @@
 #include "nanohttp-client.h"
 #include "nanohttp-socket.h"
 #include "nanohttp-logging.h"
+#include "nanohttp-ssl.h"
+#include "nanohttp-thread.h"
+#include "nanohttp-pool.h"
+
+/*
+  Pool of connections opened ahead of time by httpc_prepare().
+  A parked connection is handed to the next request for the
+  same host, port and protocol instead of opening a new one.
+*/
+#define HTTPC_POOL_SIZE		8
+#define HTTPC_POOL_MAX_IDLE	30	/* seconds */
+
+#define HTTPC_POOL_FREE		0
+#define HTTPC_POOL_PENDING	1
+#define HTTPC_POOL_IDLE		2
+
+typedef struct _httpc_pool_entry
+{
+  int state;
+  int ssl;
+  int port;
+  char host[URL_MAX_HOST_SIZE];
+  time_t stamp;
+  hsocket_t sock;
+} httpc_pool_entry_t;
+
+static httpc_pool_entry_t _httpc_pool[HTTPC_POOL_SIZE];
+static hmutex_t _httpc_pool_lock = HMUTEX_INITIALIZER;
+static int _httpc_pool_generation = 0;
+/* warm-ups running, from their start to their last use of the
+   sockets; httpc_destroy() waits for them */
+static int _httpc_pool_pending = 0;
+
+static int
+_httpc_pool_match(httpc_pool_entry_t *entry, hurl_t *url, int ssl)
+{
+  return entry->port == url->port && entry->ssl == ssl
+    && !strcmp(entry->host, url->host);
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpc_pool_take
+DESC: Moves a parked connection for the given url
+into sock. Returns 1 if one was found, 0 otherwise.
+----------------------------------------------------*/
+static int
+_httpc_pool_take(hurl_t *url, int ssl, hsocket_t *sock)
+{
+  httpc_pool_entry_t *entry;
+  hsocket_t tmp;
+  time_t stamp;
+  int i;
+
+  for (;;)
+  {
+    hmutex_lock(&_httpc_pool_lock);
+    for (i = 0, entry = NULL; i < HTTPC_POOL_SIZE; i++)
+    {
+      if (_httpc_pool[i].state == HTTPC_POOL_IDLE
+          && _httpc_pool_match(&_httpc_pool[i], url, ssl))
+      {
+        entry = &_httpc_pool[i];
+        break;
+      }
+    }
+    if (entry == NULL)
+    {
+      hmutex_unlock(&_httpc_pool_lock);
+      return 0;
+    }
+    tmp = entry->sock;
+    stamp = entry->stamp;
+    entry->state = HTTPC_POOL_FREE;
+    hmutex_unlock(&_httpc_pool_lock);
+
+    if (time(NULL) - stamp <= HTTPC_POOL_MAX_IDLE
+        && hsocket_is_alive(&tmp))
+    {
+      log_verbose4("Reusing connection to %s:%d (%d)", url->host, url->port, tmp.sock);
+      *sock = tmp;
+      return 1;
+    }
+
+    log_verbose3("Dropping stale connection to %s:%d", url->host, url->port);
+    hsocket_close(&tmp);
+  }
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpc_pool_put
+DESC: Parks an open connection for the next request
+to the given url. Returns 1 if it was parked, 0 if
+the pool is full.
+----------------------------------------------------*/
+static int
+_httpc_pool_put(hurl_t *url, int ssl, hsocket_t *sock)
+{
+  int i;
+
+  hmutex_lock(&_httpc_pool_lock);
+  for (i = 0; i < HTTPC_POOL_SIZE; i++)
+  {
+    if (_httpc_pool[i].state == HTTPC_POOL_FREE)
+    {
+      _httpc_pool[i].ssl = ssl;
+      _httpc_pool[i].port = url->port;
+      strcpy(_httpc_pool[i].host, url->host);
+      _httpc_pool[i].sock = *sock;
+      _httpc_pool[i].stamp = time(NULL);
+      _httpc_pool[i].state = HTTPC_POOL_IDLE;
+      hmutex_unlock(&_httpc_pool_lock);
+      return 1;
+    }
+  }
+  hmutex_unlock(&_httpc_pool_lock);
+
+  return 0;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpc_pool_clear
+DESC: Closes all parked connections. Connections
+still being opened are closed when they complete.
+----------------------------------------------------*/
+static void
+_httpc_pool_clear(void)
+{
+  int i;
+
+  hmutex_lock(&_httpc_pool_lock);
+  _httpc_pool_generation++;
+  for (i = 0; i < HTTPC_POOL_SIZE; i++)
+  {
+    if (_httpc_pool[i].state == HTTPC_POOL_IDLE)
+      hsocket_close(&(_httpc_pool[i].sock));
+    _httpc_pool[i].state = HTTPC_POOL_FREE;
+  }
+  hmutex_unlock(&_httpc_pool_lock);
+
+  return;
+}
 
 /*--------------------------------------------------
 FUNCTION: httpc_init
@@ -71,6 +212,24 @@ DESC: Destroy the http client module
 void
 httpc_destroy(void)
 {
+  int pending;
+
+  _httpc_pool_clear();
+
+  /* running warm-ups use the sockets and the SSL context, and may
+     still register an HTTP/2 session and start its reader; they
+     end within the connect timeout */
+  for (;;)
+  {
+    hmutex_lock(&_httpc_pool_lock);
+    pending = _httpc_pool_pending;
+    hmutex_unlock(&_httpc_pool_lock);
+    if (pending == 0)
+      break;
+    hthread_msleep(10);
+  }
+
+  http2_destroy();
   hsocket_module_destroy();
 
   return;
@@ -89,12 +248,13 @@ httpc_new(void)
   herror_t status;
   httpc_conn_t *res;
  
-  if (!(res = (httpc_conn_t *) malloc(sizeof(httpc_conn_t))))
+  if (!(res = (httpc_conn_t *) hpool_alloc(sizeof(httpc_conn_t))))
     return NULL;
 
   if ((status = hsocket_init(&res->sock)) != H_OK)
   {
     log_warn2("hsocket_init failed (%s)", herror_message(status));
+    hpool_free(res);
     return NULL;
   }
 
@@ -103,7 +263,11 @@ httpc_new(void)
   res->out = NULL;
   res->_dime_package_nr = 0;
   res->_dime_sent_bytes = 0;
+  res->reused = 0;
   res->id = counter++;
+  res->method = HTTP_REQUEST_POST;
+  res->h2 = NULL;
+  res->h2_queue = NULL;
 
   return res;
 }
@@ -134,8 +298,12 @@ httpc_free(httpc_conn_t * conn)
     conn->out = NULL;
   }
 
+  /* the session stays open for the other requests */
+  http2_abort(&conn->h2_queue);
+  http2_session_release(conn->h2);
+
   hsocket_free(&(conn->sock));
-  free(conn);
+  hpool_free(conn);
 
   return;
 }
@@ -156,6 +324,35 @@ httpc_close_free(httpc_conn_t * conn)
   return;
 }
 
+/*--------------------------------------------------
+ FUNCTION: httpc_park_free
+ DESC: Parks the connection of the given http client
+ object in the pool for the next request to the same
+ server, or closes it if the pool is full. Then frees
+ the object.
+ ----------------------------------------------------*/
+void
+httpc_park_free(httpc_conn_t * conn)
+{
+  if (conn == NULL)
+    return;
+
+  if (conn->sock.sock != HSOCKET_FREE
+      && _httpc_pool_put(&conn->url, conn->url.protocol == PROTOCOL_HTTPS, &conn->sock))
+  {
+    log_verbose4("Parked connection to %s:%d (%d)", conn->url.host, conn->url.port, conn->sock.sock);
+    /* the pool owns the socket now */
+    hsocket_init(&conn->sock);
+  }
+  else
+  {
+    hsocket_close(&(conn->sock));
+  }
+  httpc_free(conn);
+
+  return;
+}
+
 int
 httpc_add_header(httpc_conn_t *conn, const char *key, const char *value)
 {
@@ -206,8 +403,7 @@ httpc_set_header(httpc_conn_t *conn, const char *key, const char *value)
   {
     if (p->key && !strcmp(p->key, key))
     {
-      free(p->value);
-      p->value = strdup(value);
+      hpairnode_set_value(p, value);
       return 1;
     }
   }
@@ -373,10 +569,33 @@ httpc_talk_to_server(hreq_method_t method, httpc_conn_t * conn,
   httpc_set_header(conn, HEADER_HOST, url.host);
 
   ssl = url.protocol == PROTOCOL_HTTPS ? 1 : 0;
+  conn->url = url;
+  conn->method = method;
+
+  /* Share an HTTP/2 session to the server, open connection, or take
+     one warmed up by httpc_prepare(). A connection kept alive by a
+     previous request is used as is. */
+  if (conn->h2 != NULL)
+    return H_OK;
+  if (conn->sock.sock != HSOCKET_FREE)
+    log_verbose2("Sending on open connection (%d)", conn->sock.sock);
+  else if ((conn->h2 = http2_session_find(&url)) != NULL)
+  {
+    conn->reused = 1;
+    return H_OK;
+  }
+  else if (_httpc_pool_take(&url, ssl, &conn->sock))
+    conn->reused = 1;
+  else if ((status = hsocket_open(&conn->sock, url.host, url.port, ssl)) != H_OK)
+    return status;
 
-  /* Open connection */
-  if ((status = hsocket_open(&conn->sock, url.host, url.port, ssl)) != H_OK)
+  /* the server chose HTTP/2 in the handshake */
+  if (hssl_http2(&conn->sock))
+  {
+    status = http2_session_new(&conn->sock, &url, &conn->h2);
+    hsocket_init(&conn->sock);
     return status;
+  }
 
   switch(method)
   {
@@ -420,6 +639,191 @@ httpc_talk_to_server(hreq_method_t method, httpc_conn_t * conn,
   return H_OK;
 }
 
+static void
+_httpc_pool_pending_add(int count)
+{
+  hmutex_lock(&_httpc_pool_lock);
+  _httpc_pool_pending += count;
+  hmutex_unlock(&_httpc_pool_lock);
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpc_prepare
+DESC: httpc_prepare(), counted in _httpc_pool_pending
+by the caller.
+----------------------------------------------------*/
+static herror_t
+_httpc_prepare(const char *urlstr)
+{
+  httpc_pool_entry_t *entry;
+  herror_t status;
+  hsocket_t sock;
+  hurl_t url;
+  http2_session_t *session;
+  int generation;
+  int ssl;
+  int i;
+
+  if ((status = hurl_parse(&url, urlstr)) != H_OK)
+  {
+    log_error2("Can not parse URL '%s'", SAVE_STR(urlstr));
+    return status;
+  }
+  ssl = url.protocol == PROTOCOL_HTTPS ? 1 : 0;
+
+  /* an HTTP/2 session takes all the requests */
+  if ((session = http2_session_find(&url)) != NULL)
+  {
+    http2_session_release(session);
+    return H_OK;
+  }
+
+  hmutex_lock(&_httpc_pool_lock);
+  for (i = 0, entry = NULL; i < HTTPC_POOL_SIZE; i++)
+  {
+    if (_httpc_pool[i].state == HTTPC_POOL_FREE)
+    {
+      if (entry == NULL)
+        entry = &_httpc_pool[i];
+    }
+    else if (_httpc_pool_match(&_httpc_pool[i], &url, ssl)
+             && (_httpc_pool[i].state == HTTPC_POOL_PENDING
+                 || time(NULL) - _httpc_pool[i].stamp <= HTTPC_POOL_MAX_IDLE))
+    {
+      hmutex_unlock(&_httpc_pool_lock);
+      return H_OK;
+    }
+  }
+  if (entry == NULL)
+  {
+    hmutex_unlock(&_httpc_pool_lock);
+    return herror_new("httpc_prepare", GENERAL_INVALID_PARAM,
+                      "Connection pool is full");
+  }
+  entry->state = HTTPC_POOL_PENDING;
+  entry->ssl = ssl;
+  entry->port = url.port;
+  strcpy(entry->host, url.host);
+  generation = _httpc_pool_generation;
+  hmutex_unlock(&_httpc_pool_lock);
+
+  log_verbose4("Warming up %s://%s:%d", ssl ? "https" : "http", url.host, url.port);
+
+  hsocket_init(&sock);
+  status = hsocket_open(&sock, url.host, url.port, ssl);
+
+  hmutex_lock(&_httpc_pool_lock);
+  if (generation != _httpc_pool_generation)
+  {
+    /* pool was cleared meanwhile, entry no longer belongs to us */
+    hmutex_unlock(&_httpc_pool_lock);
+    if (status == H_OK)
+      hsocket_close(&sock);
+    return status;
+  }
+  if (status != H_OK)
+  {
+    entry->state = HTTPC_POOL_FREE;
+    hmutex_unlock(&_httpc_pool_lock);
+    if (sock.sock >= 0)
+      hsocket_close(&sock);
+    return status;
+  }
+  if (hssl_http2(&sock))
+  {
+    /* kept as a session, released until a request finds it */
+    entry->state = HTTPC_POOL_FREE;
+    hmutex_unlock(&_httpc_pool_lock);
+    if ((status = http2_session_new(&sock, &url, &session)) != H_OK)
+      return status;
+    http2_session_release(session);
+    return H_OK;
+  }
+  entry->sock = sock;
+  entry->stamp = time(NULL);
+  entry->state = HTTPC_POOL_IDLE;
+  hmutex_unlock(&_httpc_pool_lock);
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: httpc_prepare
+DESC: Resolves the host of the given url, connects
+and completes the SSL handshake, then parks the
+connection for the next request to the same server.
+Does nothing if a connection is already parked or
+being opened.
+----------------------------------------------------*/
+herror_t
+httpc_prepare(const char *urlstr)
+{
+  herror_t status;
+
+  _httpc_pool_pending_add(1);
+  status = _httpc_prepare(urlstr);
+  _httpc_pool_pending_add(-1);
+
+  return status;
+}
+
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+_httpc_prepare_thread(void *data)
+{
+  herror_t status;
+
+  /* counted by httpc_prepare_async() */
+  if ((status = _httpc_prepare((char *) data)) != H_OK)
+  {
+    log_verbose2("Warm-up failed (%s)", herror_message(status));
+    herror_release(status);
+  }
+  free(data);
+  _httpc_pool_pending_add(-1);
+
+#ifdef WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/*--------------------------------------------------
+FUNCTION: httpc_prepare_async
+DESC: Same as httpc_prepare() but runs in a
+background thread and returns immediately.
+----------------------------------------------------*/
+herror_t
+httpc_prepare_async(const char *urlstr)
+{
+  char *url;
+
+  if (urlstr == NULL)
+    return herror_new("httpc_prepare_async", GENERAL_INVALID_PARAM,
+                      "URL is NULL");
+
+  if (!(url = strdup(urlstr)))
+    return herror_new("httpc_prepare_async", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+
+  /* counted before the thread runs: httpc_destroy() must not miss it */
+  _httpc_pool_pending_add(1);
+  if (hthread_start(_httpc_prepare_thread, url) != 0)
+  {
+    _httpc_pool_pending_add(-1);
+    free(url);
+    return herror_new("httpc_prepare_async", THREAD_BEGIN_ERROR,
+                      "Cannot start warm-up thread");
+  }
+
+  return H_OK;
+}
+
 /*--------------------------------------------------
 FUNCTION: httpc_get
 DESC:
@@ -432,6 +836,14 @@ httpc_get(httpc_conn_t * conn, hresponse_t ** out, const char *urlstr)
   if ((status = httpc_talk_to_server(HTTP_REQUEST_GET, conn, urlstr)) != H_OK)
     return status;
 
+  if (conn->h2 != NULL)
+  {
+    if ((status = http2_send(conn->h2, HTTP_REQUEST_GET, &conn->url,
+                             conn->header, NULL, 0, &conn->h2_queue)) != H_OK)
+      return status;
+    return http2_receive(&conn->h2_queue, out);
+  }
+
   if ((status = hresponse_new_from_socket(&(conn->sock), out)) != H_OK)
     return status;
 
@@ -451,26 +863,120 @@ httpc_post_begin(httpc_conn_t * conn, const char *url)
   if ((status = httpc_talk_to_server(HTTP_REQUEST_POST, conn, url)) != H_OK)
     return status;
 
-  conn->out = http_output_stream_new(&(conn->sock), conn->header);
+  /* the previous request on a kept alive connection is done */
+  if (conn->out != NULL)
+    http_output_stream_free(conn->out);
+
+  /* HTTP/2 requests are sent whole by httpc_post_finish() */
+  if (conn->h2 != NULL)
+    conn->out = http_output_stream_new_buffer();
+  else
+    conn->out = http_output_stream_new(&(conn->sock), conn->header);
+
+  if (conn->out == NULL)
+    return herror_new("httpc_post_begin", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
 
   return H_OK;
 }
 
 
 /*--------------------------------------------------
-FUNCTION: httpc_post_begin
+FUNCTION: httpc_post_finish
+DESC: Ends a "POST" request without waiting for
+the response, so that further requests can be sent
+on the same connection before the responses are
+read with httpc_receive().
+----------------------------------------------------*/
+herror_t
+httpc_post_finish(httpc_conn_t * conn)
+{
+  const byte_t *body;
+  int size;
+
+  if (conn->h2 != NULL)
+  {
+    body = http_output_stream_buffer(conn->out, &size);
+    return http2_send(conn->h2, conn->method, &conn->url, conn->header,
+                      body, size, &conn->h2_queue);
+  }
+
+  return http_output_stream_flush(conn->out);
+}
+
+
+/*--------------------------------------------------
+FUNCTION: httpc_receive
+DESC: Reads the next response from the connection.
+----------------------------------------------------*/
+herror_t
+httpc_receive(httpc_conn_t * conn, hresponse_t ** out)
+{
+  if (conn->h2 != NULL)
+    return http2_receive(&conn->h2_queue, out);
+
+  return hresponse_new_from_socket(&(conn->sock), out);
+}
+
+
+/*--------------------------------------------------
+FUNCTION: httpc_response_reusable
+DESC: Reads what is left of the response body and
+returns 1 if the connection can carry another
+request, 0 if it must be closed.
+----------------------------------------------------*/
+int
+httpc_response_reusable(hresponse_t * res)
+{
+  byte_t buffer[256];
+  char *value;
+
+  if (res == NULL || res->in == NULL || res->attachments != NULL)
+    return 0;
+
+  /* the stream is done, the session goes on */
+  if (res->version == HTTP_2)
+    return 1;
+
+  if (res->version == HTTP_1_0)
+    return 0;
+
+  value = hpairnode_get_ignore_case(res->header, HEADER_CONNECTION);
+  if (value != NULL && strncasecmp(value, "close", 6) == 0)
+    return 0;
+
+  /* without a length the body ends when the connection does */
+  if (res->in->type != HTTP_TRANSFER_CONTENT_LENGTH
+      && res->in->type != HTTP_TRANSFER_CHUNKED)
+    return 0;
+
+  while (http_input_stream_is_ready(res->in))
+  {
+    if (http_input_stream_read(res->in, buffer, sizeof(buffer)) <= 0)
+      break;
+  }
+
+  if (res->in->err != H_OK || http_input_stream_is_ready(res->in))
+    return 0;
+
+  return 1;
+}
+
+
+/*--------------------------------------------------
+FUNCTION: httpc_post_end
 DESC: End a "POST" method and receive the response.
-  You MUST call httpc_post_end() before!
+  You MUST call httpc_post_begin() before!
 ----------------------------------------------------*/
 herror_t
 httpc_post_end(httpc_conn_t * conn, hresponse_t ** out)
 {
   herror_t status;
 
-  if ((status = http_output_stream_flush(conn->out)) != H_OK)
+  if ((status = httpc_post_finish(conn)) != H_OK)
     return status;
 
-  if ((status = hresponse_new_from_socket(&(conn->sock), out)) != H_OK)
+  if ((status = httpc_receive(conn, out)) != H_OK)
     return status;
 
   return H_OK;
@@ -587,13 +1093,7 @@ httpc_mime_end(httpc_conn_t * conn, hresponse_t ** out)
   if (status != H_OK)
     return status;
 
-  if ((status = http_output_stream_flush(conn->out)) != H_OK)
-    return status;
-
-  if ((status = hresponse_new_from_socket(&(conn->sock), out)) != H_OK)
-    return status;
-
-  return H_OK;
+  return httpc_post_end(conn, out);
 }
 
 
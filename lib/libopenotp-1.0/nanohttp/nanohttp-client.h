@@ -28,6 +28,7 @@
 #include <nanohttp/nanohttp-socket.h>
 #include <nanohttp/nanohttp-response.h>
 #include <nanohttp/nanohttp-stream.h>
+#include <nanohttp/nanohttp-http2.h>
 
 typedef struct httpc_conn
 {
@@ -42,7 +43,11 @@ typedef struct httpc_conn
   int errcode;
   char errmsg[150];
   http_output_stream_t *out;
+  int reused;                   /* socket was taken from the pool */
   int id;                       /* uniq id */
+  hreq_method_t method;         /* method of the request being sent */
+  http2_session_t *h2;          /* HTTP/2 session used instead of sock */
+  http2_stream_t *h2_queue;     /* HTTP/2 requests sent, not answered */
 } httpc_conn_t;
 
 
@@ -77,6 +82,33 @@ herror_t httpc_init(int argc, char *argv[]);
  */
 void httpc_destroy(void);
 
+/**
+ *
+ * Opens a connection to the server of the given URL (DNS,
+ * TCP connect and SSL handshake) and parks it in the client
+ * connection pool. The next request to the same server takes
+ * the parked connection instead of opening a new one.
+ *
+ * @param url		The URL of the server to connect to.
+ *
+ * @return H_OK on success or a herror_t struct on failure.
+ *
+ * @see httpc_prepare_async
+ */
+herror_t httpc_prepare(const char *url);
+
+/**
+ *
+ * Runs httpc_prepare() in a background thread.
+ *
+ * @param url		The URL of the server to connect to.
+ *
+ * @return H_OK if the thread was started or a herror_t struct on failure.
+ *
+ * @see httpc_prepare
+ */
+herror_t httpc_prepare_async(const char *url);
+
 /**
  *
  * Creates a new connection.
@@ -103,6 +135,18 @@ void httpc_free(httpc_conn_t * conn);
  */
 void httpc_close_free(httpc_conn_t * conn);
 
+/**
+ *
+ * Parks the open connection in the client connection pool,
+ * so the next request to the same server can reuse it, and
+ * releases the connection object. Only call this when the
+ * last response was read completely.
+ *
+ * @see httpc_response_reusable, httpc_close_free
+ *
+ */
+void httpc_park_free(httpc_conn_t * conn);
+
 /**
  *
  * Sets header element (key,value) pair.
@@ -172,10 +216,30 @@ herror_t httpc_post_begin(httpc_conn_t * conn, const char *url);
 
 /**
   End a "POST" method and receive the response.
-  You MUST call httpc_post_end() before!
+  You MUST call httpc_post_begin() before!
 */
 herror_t httpc_post_end(httpc_conn_t * conn, hresponse_t ** out);
 
+/**
+  End a "POST" method without waiting for the response. More
+  requests can be sent on the same connection (pipelining) and
+  the responses read in the same order with httpc_receive().
+*/
+herror_t httpc_post_finish(httpc_conn_t * conn);
+
+/**
+  Receive the next response on the connection.
+*/
+herror_t httpc_receive(httpc_conn_t * conn, hresponse_t ** out);
+
+/**
+  Skips the unread part of the response body.
+
+  @returns 1 if the connection can be used for another request,
+  0 if the server closes it or the body could not be read.
+*/
+int httpc_response_reusable(hresponse_t * res);
+
 
 /* --------------------------------------------------------------
  DIME RELATED FUNCTIONS
@@ -33,6 +33,8 @@
 #include <stdlib.h>
 #endif
 
+#include <stddef.h>
+
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #endif
@@ -55,6 +57,8 @@
 
 #include "nanohttp-common.h"
 #include "nanohttp-logging.h"
+#include "nanohttp-pool.h"
+#include "nanohttp-thread.h"
 
 static int
 strcmpigcase(const char *s1, const char *s2)
@@ -91,7 +95,7 @@ herror_new(const char *func, int errcode, const char *format, ...)
 {
   va_list ap;
 
-  herror_impl_t *impl = (herror_impl_t *) malloc(sizeof(herror_impl_t));
+  herror_impl_t *impl = (herror_impl_t *) hpool_alloc(sizeof(herror_impl_t));
   impl->errcode = errcode;
   strcpy(impl->func, func);
   va_start(ap, format);
@@ -135,39 +139,123 @@ herror_release(herror_t err)
   herror_impl_t *impl = (herror_impl_t *) err;
   if (!err)
     return;
-  free(impl);
+  hpool_free(impl);
 }
 
 
-hpair_t *
-hpairnode_new(const char *key, const char *value, hpair_t * next)
+/*
+  Headers looked up for every message, indexed by the blocks of
+  hpairnode_parse_headers().
+*/
+static const char *_hpair_known_keys[] = {
+  HEADER_CONTENT_LENGTH,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_TYPE
+};
+
+#define HPAIR_KNOWN_MAX (sizeof(_hpair_known_keys) / sizeof(_hpair_known_keys[0]))
+
+static unsigned int _hpair_known_hash[HPAIR_KNOWN_MAX];
+static volatile long _hpair_known_ready = 0;
+
+/*
+  Nodes and text of a parsed header, in one allocation: the text
+  follows the 'count' nodes.
+*/
+typedef struct _hpair_block
 {
-  hpair_t *pair;
+  int count;
+  hpair_t *known[HPAIR_KNOWN_MAX];
+  hpair_t pairs[1];
+} hpair_block_t;
 
-  log_verbose3("new pair ('%s','%s')", SAVE_STR(key), SAVE_STR(value));
-  pair = (hpair_t *) malloc(sizeof(hpair_t));
+#define HPAIR_BLOCK(head) \
+  ((hpair_block_t *) ((char *) (head) - offsetof(hpair_block_t, pairs)))
 
-  if (key != NULL)
-  {
-    pair->key = (char *) malloc(strlen(key) + 1);
-    strcpy(pair->key, key);
-  }
-  else
+
+unsigned int
+hpairnode_hash(const char *key)
+{
+  unsigned int hash = 2166136261u;
+
+  if (key == NULL)
+    return 0;
+
+  while (*key)
   {
-    pair->key = NULL;
+    hash ^= (unsigned char) toupper((unsigned char) *key++);
+    hash *= 16777619u;
   }
 
-  if (value != NULL)
+  return hash;
+}
+
+static int
+_hpair_known_index(unsigned int hash, const char *key)
+{
+  unsigned int i;
+
+  if (!_hpair_known_ready)
   {
-    pair->value = (char *) malloc(strlen(value) + 1);
-    strcpy(pair->value, value);
+    /* concurrent first calls store the same values */
+    for (i = 0; i < HPAIR_KNOWN_MAX; i++)
+      _hpair_known_hash[i] = hpairnode_hash(_hpair_known_keys[i]);
+    hatomic_barrier();
+    _hpair_known_ready = 1;
   }
-  else
+
+  for (i = 0; i < HPAIR_KNOWN_MAX; i++)
+    if (_hpair_known_hash[i] == hash
+        && strcmpigcase(_hpair_known_keys[i], key))
+      return i;
+
+  return -1;
+}
+
+
+/*
+  The key and value strings of a pair are stored right after it
+  in the same pool block: one allocation per header instead of
+  three. A value replaced by hpairnode_set_value() may live in a
+  block of its own.
+*/
+static char *
+_hpairnode_inline_value(hpair_t * pair)
+{
+  char *key = (char *) (pair + 1);
+
+  return key + strlen(key) + 1;
+}
+
+hpair_t *
+hpairnode_new(const char *key, const char *value, hpair_t * next)
+{
+  hpair_t *pair;
+  size_t key_len, value_len;
+  char *ptr;
+
+  log_verbose3("new pair ('%s','%s')", SAVE_STR(key), SAVE_STR(value));
+
+  key_len = key != NULL ? strlen(key) : 0;
+  value_len = value != NULL ? strlen(value) : 0;
+  if (!(pair = (hpair_t *) hpool_alloc(sizeof(hpair_t) + key_len + value_len + 2)))
   {
-    pair->value = NULL;
+    log_error1("hpool_alloc failed");
+    return NULL;
   }
 
+  ptr = (char *) (pair + 1);
+  memcpy(ptr, key != NULL ? key : "", key_len + 1);
+  pair->key = key != NULL ? ptr : NULL;
+
+  ptr += key_len + 1;
+  memcpy(ptr, value != NULL ? value : "", value_len + 1);
+  pair->value = value != NULL ? ptr : NULL;
+
   pair->next = next;
+  pair->hash = hpairnode_hash(key);
+  pair->flags = 0;
 
   return pair;
 }
@@ -175,29 +263,93 @@ hpairnode_new(const char *key, const char *value, hpair_t * next)
 hpair_t *
 hpairnode_parse(const char *str, const char *delim, hpair_t * next)
 {
-  hpair_t *pair;
   char *key, *value;
-  int c;
-
-  pair = (hpair_t *) malloc(sizeof(hpair_t));
-  pair->key = "";
-  pair->value = "";
-  pair->next = next;
+  int c = 0;
 
   key = strtok_r((char *) str, delim, &value);
 
-  if (key != NULL)
+  if (value != NULL)
+    for (c = 0; value[c] == ' '; c++);  /* skip white space */
+
+  return hpairnode_new(key != NULL ? key : "", value != NULL ? &value[c] : "", next);
+}
+
+
+hpair_t *
+hpairnode_parse_headers(const char *str)
+{
+  hpair_block_t *block;
+  hpair_t *pair;
+  char *text, *line, *next, *end, *value;
+  size_t len;
+  int lines, i, k;
+
+  if (str == NULL)
+    return NULL;
+
+  /* one node per line at most */
+  len = strlen(str);
+  for (lines = 1, next = (char *) str; (next = strchr(next, '\n')); next++)
+    lines++;
+
+  if (!(block = (hpair_block_t *) malloc(offsetof(hpair_block_t, pairs)
+                                         + lines * sizeof(hpair_t) + len + 1)))
   {
-    pair->key = (char *) malloc(strlen(key) + 1);
-    strcpy(pair->key, key);
+    log_error1("malloc failed");
+    return NULL;
   }
-  if (value != NULL)
+  text = (char *) (block->pairs + lines);
+  memcpy(text, str, len + 1);
+
+  block->count = 0;
+  for (line = text; *line != '\0'; line = next)
   {
-    for (c = 0; value[c] == ' '; c++);  /* skip white space */
-    pair->value = (char *) malloc(strlen(&value[c]) + 1);
-    strcpy(pair->value, &value[c]);
+    if ((end = strchr(line, '\n')) != NULL)
+      next = end + 1;
+    else
+      next = end = line + strlen(line);
+    if (end > line && end[-1] == '\r')
+      end--;
+    *end = '\0';
+
+    /* end of header */
+    if (*line == '\0')
+      break;
+
+    if ((value = strchr(line, ':')) != NULL)
+      *value++ = '\0';
+    else
+      value = end;
+    while (*value == ' ')       /* skip white space */
+      value++;
+
+    pair = &(block->pairs[block->count++]);
+    pair->key = line;
+    pair->value = value;
+    pair->next = pair + 1;
+    pair->hash = hpairnode_hash(line);
+    pair->flags = HPAIR_FLAT;
   }
-  return pair;
+
+  if (block->count == 0)
+  {
+    free(block);
+    return NULL;
+  }
+  block->pairs[block->count - 1].next = NULL;
+  block->pairs[0].flags |= HPAIR_FLAT_HEAD;
+
+  /* the first of duplicated headers wins, as with hpairnode_get() */
+  memset(block->known, 0, sizeof(block->known));
+  for (i = 0; i < block->count; i++)
+  {
+    pair = &(block->pairs[i]);
+    if ((k = _hpair_known_index(pair->hash, pair->key)) >= 0
+        && block->known[k] == NULL)
+      block->known[k] = pair;
+  }
+
+  return block->pairs;
 }
 
 
@@ -269,16 +421,81 @@ hpairnode_dump_deep(hpair_t * pair)
 }
 
 
+static void
+_hpairnode_free_block(hpair_t * head)
+{
+  hpair_block_t *block = HPAIR_BLOCK(head);
+  int i;
+
+  for (i = 0; i < block->count; i++)
+    if (block->pairs[i].flags & HPAIR_VALUE_ALLOC)
+      free(block->pairs[i].value);
+
+  free(block);
+}
+
+
 void
 hpairnode_free(hpair_t * pair)
 {
   if (pair == NULL)
     return;
 
-  free(pair->key);
-  free(pair->value);
+  /* parsed headers are released with their first node */
+  if (pair->flags & HPAIR_FLAT)
+  {
+    if (pair->flags & HPAIR_FLAT_HEAD)
+      _hpairnode_free_block(pair);
+    else if (pair->flags & HPAIR_VALUE_ALLOC)
+    {
+      free(pair->value);
+      pair->value = NULL;
+      pair->flags &= ~HPAIR_VALUE_ALLOC;
+    }
+    return;
+  }
+
+  if (pair->key != (char *) (pair + 1))
+    free(pair->key);
+  if (pair->value != _hpairnode_inline_value(pair))
+    free(pair->value);
+
+  hpool_free(pair);
+}
+
+
+void
+hpairnode_set_value(hpair_t * pair, const char *value)
+{
+  char *inline_value;
+
+  if (pair->flags & HPAIR_FLAT)
+  {
+    if (!(pair->flags & HPAIR_VALUE_ALLOC) && value != NULL
+        && pair->value != NULL && strlen(value) <= strlen(pair->value))
+    {
+      strcpy(pair->value, value);
+      return;
+    }
+    if (pair->flags & HPAIR_VALUE_ALLOC)
+      free(pair->value);
+    pair->value = value != NULL ? strdup(value) : NULL;
+    pair->flags |= HPAIR_VALUE_ALLOC;
+    return;
+  }
+
+  inline_value = _hpairnode_inline_value(pair);
+
+  if (pair->value == inline_value && value != NULL
+      && strlen(value) <= strlen(inline_value))
+  {
+    strcpy(inline_value, value);
+    return;
+  }
 
-  free(pair);
+  if (pair->value != inline_value)
+    free(pair->value);
+  pair->value = value != NULL ? strdup(value) : NULL;
 }
 
 
@@ -289,6 +506,16 @@ hpairnode_free_deep(hpair_t * pair)
 
   while (pair != NULL)
   {
+    if (pair->flags & HPAIR_FLAT_HEAD)
+    {
+      /* skip the nodes of the block, freed with it */
+      hpair_block_t *block = HPAIR_BLOCK(pair);
+
+      tmp = block->pairs[block->count - 1].next;
+      _hpairnode_free_block(pair);
+      pair = tmp;
+      continue;
+    }
     tmp = pair->next;
     hpairnode_free(pair);
     pair = tmp;
@@ -298,14 +525,32 @@ hpairnode_free_deep(hpair_t * pair)
 char *
 hpairnode_get_ignore_case(hpair_t * pair, const char *key)
 {
+  hpair_block_t *block;
+  unsigned int hash;
+  int k = -2;
+
   if (key == NULL)
   {
     log_error1("key is NULL");
     return NULL;
   }
+  hash = hpairnode_hash(key);
   while (pair != NULL)
   {
-    if (pair->key != NULL)
+    if (pair->flags & HPAIR_FLAT_HEAD)
+    {
+      if (k == -2)
+        k = _hpair_known_index(hash, key);
+      if (k >= 0)
+      {
+        block = HPAIR_BLOCK(pair);
+        if (block->known[k] != NULL)
+          return block->known[k]->value;
+        pair = block->pairs[block->count - 1].next;
+        continue;
+      }
+    }
+    if (pair->key != NULL && pair->hash == hash)
     {
       if (strcmpigcase(pair->key, key))
       {
@@ -321,14 +566,17 @@ hpairnode_get_ignore_case(hpair_t * pair, const char *key)
 char *
 hpairnode_get(hpair_t * pair, const char *key)
 {
+  unsigned int hash;
+
   if (key == NULL)
   {
     log_error1("key is NULL");
     return NULL;
   }
+  hash = hpairnode_hash(key);
   while (pair != NULL)
   {
-    if (pair->key != NULL)
+    if (pair->key != NULL && pair->hash == hash)
     {
       if (!strcmp(pair->key, key))
       {
@@ -472,7 +720,8 @@ hurl_parse(hurl_t * url, const char *urlstr)
     url->context[0] = '\0';
   }
 
-  hurl_dump(url);
+  if (hlog_enabled(HLOG_VERBOSE))
+    hurl_dump(url);
 
   return H_OK;
 }
@@ -492,7 +741,7 @@ content_type_new(const char *content_type_str)
 
 
   /* Create object */
-  ct = (content_type_t *) malloc(sizeof(content_type_t));
+  ct = (content_type_t *) hpool_alloc(sizeof(content_type_t));
   ct->params = NULL;
 
   len = strlen(content_type_str);
@@ -573,7 +822,7 @@ content_type_free(content_type_t * ct)
     return;
 
   hpairnode_free_deep(ct->params);
-  free(ct);
+  hpool_free(ct);
 }
 
 
@@ -141,6 +141,8 @@
 #define NHTTP_ARG_CERTPASS	"-NHTTPcertpass"
 #define NHTTP_ARG_CA		"-NHTTPCA"
 #define NHTTP_ARG_HTTPS		"-NHTTPS"
+#define NHTTP_ARG_KTLS		"-NHTTPktls"
+#define NHTTP_ARG_HTTP2		"-NHTTPhttp2"
 
 #ifndef SAVE_STR
 #define SAVE_STR(str) ((str==0)?("(null)"):(str))
@@ -196,6 +198,8 @@
 #define HSOCKET_ERROR_IOCTL		1010
 #define HSOCKET_ERROR_SSLCLOSE		1011
 #define HSOCKET_ERROR_SSLCTX		1011
+#define HSOCKET_ERROR_CANCELLED		1012
+#define HSOCKET_ERROR_CLOSED		1013	/* closed or reset by the peer */
 
 /* URL errors */
 #define URL_ERROR_UNKNOWN_PROTOCOL	1101
@@ -237,6 +241,11 @@
 #define HSSL_ERROR_SERVER		1760
 #define HSSL_ERROR_CONNECT		1770
 
+/* HTTP/2 Errors */
+#define HTTP2_ERROR_PROTOCOL		1901
+#define HTTP2_ERROR_STREAM		1902
+#define HTTP2_ERROR_REFUSED		1903
+
 /*
 Set Sleep function platform depended
 */
@@ -253,7 +262,8 @@ Set Sleep function platform depended
 typedef enum _http_version
 {
   HTTP_1_0,
-  HTTP_1_1                      /* default */
+  HTTP_1_1,                     /* default */
+  HTTP_2                        /* stream of an HTTP/2 connection */
 } http_version_t;
 
 
@@ -296,6 +306,10 @@ void herror_release(herror_t err);
 /*
   hpairnode_t represents a pair (key, value) pair.
   This is also a linked list.
+
+  'hash' is the case insensitive hash of the key (see
+  hpairnode_hash()), compared before the keys themselves
+  while searching. 'flags' tells how the node was allocated.
  */
 typedef struct hpair hpair_t;
 struct hpair
@@ -303,12 +317,23 @@ struct hpair
   char *key;
   char *value;
   hpair_t *next;
+  unsigned int hash;
+  unsigned int flags;
 };
 
+/* node of a block built by hpairnode_parse_headers() */
+#define HPAIR_FLAT		0x01
+/* first node of such a block, owns it */
+#define HPAIR_FLAT_HEAD		0x02
+/* value replaced by hpairnode_set_value() in a block of its own */
+#define HPAIR_VALUE_ALLOC	0x04
+
 
 /**
   Creates a new pair with the given parameters. Both strings
-  key and value will be cloned while creating the pair. 
+  key and value will be cloned while creating the pair. They
+  are stored in the same block as the pair: change the value
+  with hpairnode_set_value(), never free() it.
 
   @param key the key of the (key,value) pair
   @param value the value of the (key,value) pair
@@ -339,13 +364,50 @@ hpair_t *hpairnode_parse(const char *str, const char *delim, hpair_t * next);
 
 
 /**
-  Frees a given pair.
+  Parses a block of "key: value" header lines, ending with an
+  empty line or with the string. The nodes and a copy of the
+  text, split in place, are stored in one block. The most used
+  headers (Content-Length, Transfer-Encoding, Connection and
+  Content-Type) are indexed, so hpairnode_get_ignore_case()
+  finds them without walking the list.
+
+  The pairs keep the order of the lines. Free the list with
+  hpairnode_free_deep(); nodes may be prepended to it but its
+  own nodes must not be unlinked.
+
+  @param str the header lines to parse
+
+  @returns the first pair or NULL if there was no header line
+    or no memory.
+*/
+hpair_t *hpairnode_parse_headers(const char *str);
+
+
+/**
+  Case insensitive hash of a key, as stored in hpair_t.hash.
+*/
+unsigned int hpairnode_hash(const char *key);
+
+
+/**
+  Frees a given pair. The first pair of a list parsed by
+  hpairnode_parse_headers() frees all the pairs of the list.
 
   @param pair the pair to free
 */
 void hpairnode_free(hpair_t * pair);
 
 
+/**
+  Replaces the value of a pair, reusing the storage of the
+  previous value when the new one fits.
+
+  @param pair the pair to change
+  @param value the new value (cloned)
+*/
+void hpairnode_set_value(hpair_t * pair, const char *value);
+
+
 /**
   Makes a deep free operation. All pairnodes,
   beginning with the given pari, in the 
@@ -0,0 +1,2512 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
+
+#ifdef MEM_DEBUG
+#include <utils/alloc.h>
+#endif
+
+#include "nanohttp-logging.h"
+#include "nanohttp-http2.h"
+#include "nanohttp-ssl.h"
+#include "nanohttp-thread.h"
+
+#ifdef WIN32
+#define strcasecmp(s1, s2) _stricmp(s1, s2)
+#define H2_SHUT_RDWR SD_BOTH
+#else
+#define H2_SHUT_RDWR SHUT_RDWR
+#endif
+
+/* frame types */
+#define H2_DATA			0x0
+#define H2_HEADERS		0x1
+#define H2_PRIORITY		0x2
+#define H2_RST_STREAM		0x3
+#define H2_SETTINGS		0x4
+#define H2_PUSH_PROMISE		0x5
+#define H2_PING			0x6
+#define H2_GOAWAY		0x7
+#define H2_WINDOW_UPDATE	0x8
+#define H2_CONTINUATION		0x9
+
+/* frame flags */
+#define H2_FLAG_END_STREAM	0x1
+#define H2_FLAG_ACK		0x1
+#define H2_FLAG_END_HEADERS	0x4
+#define H2_FLAG_PADDED		0x8
+#define H2_FLAG_PRIORITY	0x20
+
+/* settings */
+#define H2_SETTINGS_HEADER_TABLE_SIZE		0x1
+#define H2_SETTINGS_ENABLE_PUSH			0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS	0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE		0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE		0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE	0x6
+
+/* error codes */
+#define H2_NO_ERROR		0x0
+#define H2_PROTOCOL_ERROR	0x1
+#define H2_INTERNAL_ERROR	0x2
+#define H2_FLOW_CONTROL_ERROR	0x3
+#define H2_FRAME_SIZE_ERROR	0x6
+#define H2_REFUSED_STREAM	0x7
+#define H2_CANCEL		0x8
+#define H2_COMPRESSION_ERROR	0x9
+#define H2_ENHANCE_YOUR_CALM	0xb
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE		24
+#define H2_FRAME_HEADER		9
+#define H2_MAX_FRAME		16384		/* frames are never larger both ways */
+#define H2_DEFAULT_WINDOW	65535
+#define H2_DEFAULT_STREAMS	100		/* until the peer tells its limit */
+#define H2_MAX_WINDOW		0x7fffffff
+#define H2_MAX_ID		0x7fffffff
+#define H2_SESSION_WINDOW	(HTTP2_WINDOW * 16)	/* receive window of the connection */
+#define H2_SEND_CHUNK		65536		/* data sent at once by a stream */
+#define H2_POLL			1000		/* ms between the idle checks of the reader */
+
+#define HPACK_TABLE_SIZE	4096		/* dynamic table of each direction */
+#define HPACK_ENTRIES		(HPACK_TABLE_SIZE / 32)
+#define HPACK_STATIC		61
+#define HPACK_MAX_NAME		128
+
+/* growing byte buffer, 'failed' once an allocation failed */
+typedef struct h2_buffer
+{
+  byte_t *data;
+  int size;
+  int capacity;
+  int failed;
+} h2_buffer_t;
+
+typedef struct hpack_entry
+{
+  char *name;                   /* name and value share one block */
+  char *value;
+  int size;                     /* lengths + 32 (RFC 7541 4.1) */
+} hpack_entry_t;
+
+/* dynamic table, a ring with the newest entry at 'first' */
+typedef struct hpack_table
+{
+  hpack_entry_t entries[HPACK_ENTRIES];
+  int first;
+  int count;
+  int size;
+  int max_size;
+} hpack_table_t;
+
+struct http2_stream
+{
+  unsigned int id;              /* 0 until the request is sent */
+  http2_session_t *session;
+  http2_stream_t *next;         /* open streams of the session */
+  http2_stream_t *queue;        /* streams of the same requester */
+  int linked;
+
+  int ended;                    /* the message was received whole */
+  int dispatched;               /* server: given to a worker */
+  herror_t error;               /* reset or connection lost */
+  int activity;                 /* changes when something arrives */
+  int send_window;
+  int recv_unacked;             /* received bytes not given back yet */
+  hevent_t event;
+
+  int code;                     /* client: :status */
+  hreq_method_t method;         /* server: :method */
+  char *path;                   /* server: :path */
+  hpair_t *header;
+  hpair_t *tail;
+  int header_size;
+  int oversized;                /* header list over HTTP2_MAX_HEADERS */
+  byte_t *data;
+  int size;
+  int capacity;
+};
+
+struct http2_session
+{
+  hsocket_t sock;
+  int server;
+  int ssl;
+  int port;
+  char host[URL_MAX_HOST_SIZE];
+
+  /* socket writes and the HPACK encoder, taken before 'lock' */
+  hmutex_t io;
+  h2_buffer_t out;              /* frames to send */
+  h2_buffer_t block;            /* header block being encoded */
+  hpack_table_t encoder;
+  int encoder_update;           /* table size update owed to the peer */
+  int closed;                   /* the socket was closed */
+
+  /* the streams, the windows and the state */
+  hmutex_t lock;
+  int refs;
+  int users;                    /* client requests holding the session */
+  int registered;
+  int dead;
+  int failed;                   /* closed on a protocol error */
+  int goaway;                   /* no new streams */
+  unsigned int next_id;         /* client: next stream id */
+  int active;                   /* open streams */
+  int workers;                  /* server: streams being served */
+  http2_stream_t *streams;
+  time_t idle_since;
+  int peer_max_streams;
+  int peer_window;              /* initial send window of the streams */
+  int send_window;              /* send window of the connection */
+
+  /* reader only */
+  byte_t *in;
+  int in_size;
+  int preface;                  /* server: client preface received */
+  unsigned int last_id;         /* server: highest stream opened by the client */
+  int recv_unacked;
+  h2_buffer_t block_in;         /* header block being received */
+  unsigned int headers_stream;  /* stream of the CONTINUATION frames */
+  int headers_flags;
+  hpack_table_t decoder;
+  httpd_service service;
+};
+
+static http2_session_t *_http2_sessions[HTTP2_SESSIONS];
+static hmutex_t _http2_lock = HMUTEX_INITIALIZER;
+static volatile long _http2_readers = 0;
+
+static const char *_http2_methods[] = {
+  "POST", "GET", "OPTIONS", "HEAD", "PUT", "DELETE", "TRACE", "CONNECT"
+};
+
+/* RFC 7541 appendix A */
+static const struct
+{
+  const char *name;
+  const char *value;
+} _hpack_static[HPACK_STATIC] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""},
+  {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+  {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""},
+  {"content-location", ""}, {"content-range", ""},
+  {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""},
+  {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+  {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+  {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+  {"link", ""}, {"location", ""}, {"max-forwards", ""},
+  {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+  {"range", ""}, {"referer", ""}, {"refresh", ""},
+  {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+  {"strict-transport-security", ""}, {"transfer-encoding", ""},
+  {"user-agent", ""}, {"vary", ""}, {"via", ""},
+  {"www-authenticate", ""}
+};
+
+/* RFC 7541 appendix B, codes right aligned */
+static const unsigned int _hpack_huff_code[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const unsigned char _hpack_huff_bits[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+/* canonical decoding: codes of each length, symbols by code */
+static const short _hpack_huff_count[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const short _hpack_huff_sym[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+  45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+  95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+  58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+  106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+  88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+  0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+  167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+  132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+  173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+  151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+  183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+  171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+  255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+  246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+  6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+  249, 10, 13, 22, 256
+};
+
+/*
+ * -----------------------------------------------------
+ * Buffers
+ * -----------------------------------------------------
+ */
+
+static void
+_h2_buffer_put(h2_buffer_t * b, const void *data, int len)
+{
+  byte_t *tmp;
+  int capacity;
+
+  if (b->failed || len <= 0)
+    return;
+
+  if (b->size + len > b->capacity)
+  {
+    for (capacity = b->capacity ? b->capacity : 256; capacity < b->size + len;
+         capacity *= 2);
+    if (!(tmp = (byte_t *) realloc(b->data, capacity)))
+    {
+      b->failed = 1;
+      return;
+    }
+    b->data = tmp;
+    b->capacity = capacity;
+  }
+  memcpy(b->data + b->size, data, len);
+  b->size += len;
+}
+
+static void
+_h2_buffer_byte(h2_buffer_t * b, int c)
+{
+  byte_t value = (byte_t) c;
+
+  _h2_buffer_put(b, &value, 1);
+}
+
+static void
+_h2_buffer_free(h2_buffer_t * b)
+{
+  free(b->data);
+  b->data = NULL;
+  b->size = b->capacity = b->failed = 0;
+}
+
+static unsigned int
+_h2_get32(const byte_t * p)
+{
+  return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16)
+    | ((unsigned int) p[2] << 8) | p[3];
+}
+
+static void
+_h2_put32(byte_t * p, unsigned int value)
+{
+  p[0] = (byte_t) (value >> 24);
+  p[1] = (byte_t) (value >> 16);
+  p[2] = (byte_t) (value >> 8);
+  p[3] = (byte_t) value;
+}
+
+/*
+ * -----------------------------------------------------
+ * HPACK (RFC 7541)
+ * -----------------------------------------------------
+ */
+
+static hpack_entry_t *
+_hpack_entry(hpack_table_t * t, int index)
+{
+  return &t->entries[(t->first + index) % HPACK_ENTRIES];
+}
+
+/* drops the oldest entries until 'size' more octets fit */
+static void
+_hpack_evict(hpack_table_t * t, int size)
+{
+  hpack_entry_t *entry;
+
+  while (t->count > 0 && t->size + size > t->max_size)
+  {
+    entry = _hpack_entry(t, t->count - 1);
+    t->size -= entry->size;
+    free(entry->name);
+    entry->name = entry->value = NULL;
+    t->count--;
+  }
+}
+
+static void
+_hpack_resize(hpack_table_t * t, int max_size)
+{
+  t->max_size = max_size;
+  _hpack_evict(t, 0);
+}
+
+/* 'block' holds the name and the value, the table takes it */
+static void
+_hpack_insert(hpack_table_t * t, char *block, int nlen, int vlen)
+{
+  hpack_entry_t *entry;
+  int size = nlen + vlen + 32;
+
+  _hpack_evict(t, size);
+  if (size > t->max_size)
+  {
+    /* an entry larger than the table empties it */
+    free(block);
+    return;
+  }
+
+  t->first = (t->first + HPACK_ENTRIES - 1) % HPACK_ENTRIES;
+  entry = &t->entries[t->first];
+  entry->name = block;
+  entry->value = block + nlen + 1;
+  entry->size = size;
+  t->count++;
+  t->size += size;
+}
+
+static char *
+_hpack_block(const char *name, int nlen, const char *value, int vlen)
+{
+  char *block;
+
+  if (!(block = (char *) malloc(nlen + vlen + 2)))
+    return NULL;
+  memcpy(block, name, nlen);
+  block[nlen] = '\0';
+  memcpy(block + nlen + 1, value, vlen);
+  block[nlen + 1 + vlen] = '\0';
+
+  return block;
+}
+
+static int
+_hpack_lookup(hpack_table_t * t, unsigned int index, const char **name,
+              const char **value)
+{
+  hpack_entry_t *entry;
+
+  if (index == 0)
+    return -1;
+
+  if (index <= HPACK_STATIC)
+  {
+    *name = _hpack_static[index - 1].name;
+    *value = _hpack_static[index - 1].value;
+    return 0;
+  }
+
+  index -= HPACK_STATIC + 1;
+  if (index >= (unsigned int) t->count)
+    return -1;
+  entry = _hpack_entry(t, index);
+  *name = entry->name;
+  *value = entry->value;
+
+  return 0;
+}
+
+static int
+_hpack_get_int(const byte_t ** p, const byte_t * end, int prefix,
+               unsigned int *value)
+{
+  unsigned int max = (1 << prefix) - 1;
+  int shift = 0;
+  byte_t b;
+
+  if (*p >= end)
+    return -1;
+  *value = *(*p)++ & max;
+  if (*value < max)
+    return 0;
+
+  do
+  {
+    if (*p >= end || shift > 21)
+      return -1;
+    b = *(*p)++;
+    *value += (unsigned int) (b & 0x7f) << shift;
+    shift += 7;
+  }
+  while (b & 0x80);
+
+  return 0;
+}
+
+static void
+_hpack_put_int(h2_buffer_t * b, int prefix, int flags, unsigned int value)
+{
+  unsigned int max = (1 << prefix) - 1;
+
+  if (value < max)
+  {
+    _h2_buffer_byte(b, flags | value);
+    return;
+  }
+
+  _h2_buffer_byte(b, flags | max);
+  for (value -= max; value >= 128; value >>= 7)
+    _h2_buffer_byte(b, (value & 0x7f) | 0x80);
+  _h2_buffer_byte(b, value);
+}
+
+/* returns the length decoded into 'out' or -1 */
+static int
+_hpack_huffman_decode(const byte_t * in, int len, char *out)
+{
+  int code = 0, first = 0, index = 0, bits = 0, ones = 1, size = 0;
+  int i, k, bit, count, symbol;
+
+  for (i = 0; i < len; i++)
+  {
+    for (k = 7; k >= 0; k--)
+    {
+      bit = (in[i] >> k) & 1;
+      code |= bit;
+      ones &= bit;
+      bits++;
+      count = _hpack_huff_count[bits];
+      if (code - count < first)
+      {
+        if ((symbol = _hpack_huff_sym[index + (code - first)]) == 256)
+          return -1;
+        out[size++] = (char) symbol;
+        code = first = index = bits = 0;
+        ones = 1;
+      }
+      else
+      {
+        if (bits == 30)
+          return -1;
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+    }
+  }
+
+  /* the padding is the start of EOS, all ones and under a byte */
+  if (bits > 7 || !ones)
+    return -1;
+  out[size] = '\0';
+
+  return size;
+}
+
+/* returns a malloc'ed string or NULL on a decoding error */
+static char *
+_hpack_get_string(const byte_t ** p, const byte_t * end, int *len)
+{
+  unsigned int n;
+  int huffman;
+  char *s;
+
+  if (*p >= end)
+    return NULL;
+  huffman = **p & 0x80;
+  if (_hpack_get_int(p, end, 7, &n) || n > (unsigned int) (end - *p))
+    return NULL;
+
+  if (!(s = (char *) malloc(huffman ? n * 8 / 5 + 1 : n + 1)))
+    return NULL;
+
+  if (huffman)
+  {
+    if ((*len = _hpack_huffman_decode(*p, n, s)) < 0)
+    {
+      free(s);
+      return NULL;
+    }
+  }
+  else
+  {
+    memcpy(s, *p, n);
+    s[n] = '\0';
+    *len = n;
+  }
+  *p += n;
+
+  return s;
+}
+
+/* Huffman coded when it is shorter */
+static void
+_hpack_put_string(h2_buffer_t * b, const char *s, int len)
+{
+  unsigned long long acc = 0;
+  int i, bits = 0, c;
+
+  for (i = 0; i < len; i++)
+    bits += _hpack_huff_bits[(byte_t) s[i]];
+
+  if ((bits + 7) / 8 >= len)
+  {
+    _hpack_put_int(b, 7, 0x00, len);
+    _h2_buffer_put(b, s, len);
+    return;
+  }
+
+  _hpack_put_int(b, 7, 0x80, (bits + 7) / 8);
+  for (i = 0, bits = 0; i < len; i++)
+  {
+    c = (byte_t) s[i];
+    acc = (acc << _hpack_huff_bits[c]) | _hpack_huff_code[c];
+    for (bits += _hpack_huff_bits[c]; bits >= 8; bits -= 8)
+      _h2_buffer_byte(b, (int) (acc >> (bits - 8)) & 0xff);
+  }
+  if (bits > 0)
+    _h2_buffer_byte(b, (int) ((acc << (8 - bits)) | (0xff >> bits)) & 0xff);
+}
+
+/*
+  Encodes a field: indexed when the table has it, else literal with
+  incremental indexing, except for the credentials which are never
+  indexed and the values which change with each message.
+*/
+static void
+_hpack_encode(hpack_table_t * t, h2_buffer_t * b, const char *name,
+              const char *value)
+{
+  int i, index = 0, nlen = strlen(name), vlen = strlen(value);
+  hpack_entry_t *entry;
+  char *block = NULL;
+
+  for (i = 0; i < HPACK_STATIC; i++)
+  {
+    if (!strcmp(_hpack_static[i].name, name))
+    {
+      if (!strcmp(_hpack_static[i].value, value))
+      {
+        _hpack_put_int(b, 7, 0x80, i + 1);
+        return;
+      }
+      if (index == 0)
+        index = i + 1;
+    }
+  }
+  for (i = 0; i < t->count; i++)
+  {
+    entry = _hpack_entry(t, i);
+    if (!strcmp(entry->name, name))
+    {
+      if (!strcmp(entry->value, value))
+      {
+        _hpack_put_int(b, 7, 0x80, HPACK_STATIC + 1 + i);
+        return;
+      }
+      if (index == 0)
+        index = HPACK_STATIC + 1 + i;
+    }
+  }
+
+  if (!strcmp(name, "authorization") || !strcmp(name, "proxy-authorization")
+      || !strcmp(name, "cookie"))
+    _hpack_put_int(b, 4, 0x10, index);
+  else if (!strcmp(name, "content-length") || !strcmp(name, "date")
+           || !(block = _hpack_block(name, nlen, value, vlen)))
+    _hpack_put_int(b, 4, 0x00, index);
+  else
+    _hpack_put_int(b, 6, 0x40, index);
+
+  if (index == 0)
+    _hpack_put_string(b, name, nlen);
+  _hpack_put_string(b, value, vlen);
+
+  if (block != NULL)
+    _hpack_insert(t, block, nlen, vlen);
+}
+
+static void _http2_field(http2_stream_t * stream, const char *name,
+                         const char *value);
+
+/*
+  Decodes a header block into the stream, NULL to drop the fields.
+  Returns 0 or -1 on a compression error.
+*/
+static int
+_hpack_decode(hpack_table_t * t, const byte_t * p, int len,
+              http2_stream_t * stream)
+{
+  const byte_t *end = p + len;
+  const char *name, *value;
+  char *nbuf, *vbuf, *block;
+  unsigned int index;
+  int nlen, vlen, indexing, fields = 0;
+
+  while (p < end)
+  {
+    if (*p & 0x80)
+    {
+      if (_hpack_get_int(&p, end, 7, &index)
+          || _hpack_lookup(t, index, &name, &value))
+        return -1;
+      _http2_field(stream, name, value);
+      fields++;
+    }
+    else if ((*p & 0xe0) == 0x20)
+    {
+      /* size updates come before the fields */
+      if (fields > 0 || _hpack_get_int(&p, end, 5, &index)
+          || index > HPACK_TABLE_SIZE)
+        return -1;
+      _hpack_resize(t, index);
+    }
+    else
+    {
+      indexing = (*p & 0xc0) == 0x40;
+      if (_hpack_get_int(&p, end, indexing ? 6 : 4, &index))
+        return -1;
+
+      nbuf = NULL;
+      if (index != 0)
+      {
+        if (_hpack_lookup(t, index, &name, &value))
+          return -1;
+        nlen = strlen(name);
+      }
+      else if (!(name = nbuf = _hpack_get_string(&p, end, &nlen)))
+        return -1;
+
+      if (!(vbuf = _hpack_get_string(&p, end, &vlen)))
+      {
+        free(nbuf);
+        return -1;
+      }
+
+      _http2_field(stream, name, vbuf);
+      fields++;
+
+      if (indexing)
+      {
+        /* copied before the insertion may evict the name */
+        if (!(block = _hpack_block(name, nlen, vbuf, vlen)))
+        {
+          free(nbuf);
+          free(vbuf);
+          return -1;
+        }
+        _hpack_insert(t, block, nlen, vlen);
+      }
+      free(nbuf);
+      free(vbuf);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * -----------------------------------------------------
+ * Streams
+ * -----------------------------------------------------
+ */
+
+static http2_stream_t *
+_http2_stream_new(http2_session_t * s)
+{
+  http2_stream_t *stream;
+
+  if (!(stream = (http2_stream_t *) calloc(1, sizeof(http2_stream_t))))
+    return NULL;
+
+  if (hevent_init(&stream->event))
+  {
+    free(stream);
+    return NULL;
+  }
+  stream->session = s;
+  stream->error = H_OK;
+  stream->method = HTTP_REQUEST_UNKOWN;
+
+  return stream;
+}
+
+static void
+_http2_stream_free(http2_stream_t * stream)
+{
+  if (stream->error != H_OK)
+    herror_release(stream->error);
+  if (stream->header)
+    hpairnode_free_deep(stream->header);
+  free(stream->path);
+  free(stream->data);
+  hevent_destroy(&stream->event);
+  free(stream);
+}
+
+/* the functions below up to the frames are called with the lock held */
+
+static void
+_http2_link(http2_session_t * s, http2_stream_t * stream)
+{
+  stream->next = s->streams;
+  s->streams = stream;
+  stream->linked = 1;
+  s->active++;
+}
+
+static void
+_http2_unlink(http2_session_t * s, http2_stream_t * stream)
+{
+  http2_stream_t **p;
+
+  if (!stream->linked)
+    return;
+
+  for (p = &s->streams; *p; p = &(*p)->next)
+  {
+    if (*p == stream)
+    {
+      *p = stream->next;
+      break;
+    }
+  }
+  stream->linked = 0;
+  if (--s->active == 0)
+    s->idle_since = time(NULL);
+}
+
+static http2_stream_t *
+_http2_find(http2_session_t * s, unsigned int id)
+{
+  http2_stream_t *stream;
+
+  for (stream = s->streams; stream; stream = stream->next)
+    if (stream->id == id)
+      return stream;
+
+  return NULL;
+}
+
+static void
+_http2_signal_all(http2_session_t * s)
+{
+  http2_stream_t *stream;
+
+  for (stream = s->streams; stream; stream = stream->next)
+    hevent_set(&stream->event);
+}
+
+/*
+  Fails a stream. A server stream not given to a worker yet is
+  dropped, the others keep the error for their owner.
+*/
+static void
+_http2_stream_error(http2_session_t * s, http2_stream_t * stream,
+                    herror_t error)
+{
+  if (s->server && !stream->dispatched)
+  {
+    herror_release(error);
+    _http2_unlink(s, stream);
+    _http2_stream_free(stream);
+    return;
+  }
+
+  /* a complete response stays valid */
+  if (stream->error != H_OK || (!s->server && stream->ended))
+    herror_release(error);
+  else
+    stream->error = error;
+  hevent_set(&stream->event);
+}
+
+static hreq_method_t
+_http2_method(const char *value)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof(_http2_methods) / sizeof(char *)); i++)
+    if (!strcmp(_http2_methods[i], value))
+      return (hreq_method_t) i;
+
+  return HTTP_REQUEST_UNKOWN;
+}
+
+static void
+_http2_add_header(http2_stream_t * stream, const char *name,
+                  const char *value)
+{
+  hpair_t *pair;
+
+  if (!(pair = hpairnode_new(name, value, NULL)))
+  {
+    stream->oversized = 1;
+    return;
+  }
+  if (stream->tail)
+    stream->tail->next = pair;
+  else
+    stream->header = pair;
+  stream->tail = pair;
+}
+
+static void
+_http2_field(http2_stream_t * stream, const char *name, const char *value)
+{
+  if (stream == NULL || stream->oversized)
+    return;
+
+  stream->header_size += strlen(name) + strlen(value) + 32;
+  if (stream->header_size > HTTP2_MAX_HEADERS)
+  {
+    stream->oversized = 1;
+    return;
+  }
+
+  if (name[0] != ':')
+    _http2_add_header(stream, name, value);
+  else if (!strcmp(name, ":status"))
+    stream->code = atoi(value);
+  else if (!strcmp(name, ":method"))
+    stream->method = _http2_method(value);
+  else if (!strcmp(name, ":path"))
+  {
+    free(stream->path);
+    if (!(stream->path = strdup(value)))
+      stream->oversized = 1;
+  }
+  else if (!strcmp(name, ":authority"))
+    _http2_add_header(stream, HEADER_HOST, value);
+}
+
+/* appends received data, the body size is known from the header */
+static int
+_http2_stream_data(http2_stream_t * stream, const byte_t * data, int len)
+{
+  byte_t *tmp;
+  int capacity;
+
+  if (len == 0)
+    return 0;
+
+  if (stream->size + len > HTTP2_MAX_MESSAGE)
+    return -1;
+
+  if (stream->size + len > stream->capacity)
+  {
+    for (capacity = stream->capacity ? stream->capacity : 4096;
+         capacity < stream->size + len; capacity *= 2);
+    if (!(tmp = (byte_t *) realloc(stream->data, capacity)))
+      return -1;
+    stream->data = tmp;
+    stream->capacity = capacity;
+  }
+  memcpy(stream->data + stream->size, data, len);
+  stream->size += len;
+
+  return 0;
+}
+
+/*
+ * -----------------------------------------------------
+ * Frames
+ * -----------------------------------------------------
+ */
+
+static void
+_http2_frame_put(h2_buffer_t * b, int type, int flags, unsigned int id,
+                 const byte_t * payload, int len)
+{
+  byte_t header[H2_FRAME_HEADER];
+
+  header[0] = (byte_t) (len >> 16);
+  header[1] = (byte_t) (len >> 8);
+  header[2] = (byte_t) len;
+  header[3] = (byte_t) type;
+  header[4] = (byte_t) flags;
+  _h2_put32(header + 5, id);
+  _h2_buffer_put(b, header, H2_FRAME_HEADER);
+  _h2_buffer_put(b, payload, len);
+}
+
+/*
+  Marks the session dead and wakes its reader up, which closes the
+  connection and fails the streams.
+*/
+static void
+_http2_kill(http2_session_t * s)
+{
+  hmutex_lock(&s->lock);
+  s->dead = 1;
+  if (!s->closed)
+    shutdown(s->sock.sock, H2_SHUT_RDWR);
+  hmutex_unlock(&s->lock);
+}
+
+/*
+  Sends the frames queued in s->out, with the io lock held. The
+  cancellation token of the thread is put aside meanwhile: a frame
+  sent halfway would break the connection for all its streams.
+*/
+static herror_t
+_http2_flush(http2_session_t * s)
+{
+  hcancel_t *cancel;
+  herror_t status = H_OK;
+
+  if (s->closed)
+    status = herror_new("_http2_flush", HSOCKET_ERROR_SEND,
+                        "Connection closed");
+  else if (s->out.failed)
+    status = herror_new("_http2_flush", HSOCKET_ERROR_SEND,
+                        "Memory allocation failed");
+  else if (s->out.size > 0)
+  {
+    cancel = hsocket_get_cancel();
+    hsocket_set_cancel(NULL);
+    status = hsocket_nsend(&s->sock, s->out.data, s->out.size);
+    hsocket_set_cancel(cancel);
+  }
+  s->out.size = 0;
+
+  if (status != H_OK && !s->closed)
+  {
+    log_error2("HTTP/2 connection lost (%s)", herror_message(status));
+    s->out.failed = 0;
+    _http2_kill(s);
+  }
+
+  return status;
+}
+
+/* sends one frame, for the replies and the resets */
+static void
+_http2_control(http2_session_t * s, int type, int flags, unsigned int id,
+               const byte_t * payload, int len)
+{
+  herror_t status;
+
+  hmutex_lock(&s->io);
+  if (!s->closed)
+  {
+    _http2_frame_put(&s->out, type, flags, id, payload, len);
+    if ((status = _http2_flush(s)) != H_OK)
+      herror_release(status);
+  }
+  hmutex_unlock(&s->io);
+}
+
+static void
+_http2_reset(http2_session_t * s, unsigned int id, int code)
+{
+  byte_t payload[4];
+
+  _h2_put32(payload, code);
+  _http2_control(s, H2_RST_STREAM, 0, id, payload, 4);
+}
+
+static void
+_http2_window_update(http2_session_t * s, unsigned int id, int increment)
+{
+  byte_t payload[4];
+
+  _h2_put32(payload, increment);
+  _http2_control(s, H2_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static void
+_http2_goaway(http2_session_t * s, int code)
+{
+  byte_t payload[8];
+
+  _h2_put32(payload, s->last_id);
+  _h2_put32(payload + 4, code);
+  _http2_control(s, H2_GOAWAY, 0, 0, payload, 8);
+}
+
+/* queues the preface of our side: settings and connection window */
+static void
+_http2_preface(http2_session_t * s)
+{
+  byte_t settings[18], *p = settings, update[4];
+
+  if (!s->server)
+  {
+    _h2_buffer_put(&s->out, H2_PREFACE, H2_PREFACE_SIZE);
+    p[0] = 0;
+    p[1] = H2_SETTINGS_ENABLE_PUSH;
+    _h2_put32(p + 2, 0);
+  }
+  else
+  {
+    p[0] = 0;
+    p[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    _h2_put32(p + 2, HTTP2_MAX_STREAMS);
+  }
+  p += 6;
+  p[0] = 0;
+  p[1] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  _h2_put32(p + 2, HTTP2_WINDOW);
+  p += 6;
+  p[0] = 0;
+  p[1] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+  _h2_put32(p + 2, HTTP2_MAX_HEADERS);
+  _http2_frame_put(&s->out, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+  _h2_put32(update, H2_SESSION_WINDOW - H2_DEFAULT_WINDOW);
+  _http2_frame_put(&s->out, H2_WINDOW_UPDATE, 0, 0, update, 4);
+}
+
+/* headers of the connection itself, which HTTP/2 leaves out */
+static int
+_http2_hop_header(const char *name)
+{
+  return !strcasecmp(name, HEADER_HOST)
+    || !strcasecmp(name, HEADER_CONNECTION)
+    || !strcasecmp(name, "Keep-Alive")
+    || !strcasecmp(name, "Proxy-Connection")
+    || !strcasecmp(name, HEADER_TRANSFER_ENCODING)
+    || !strcasecmp(name, "Upgrade")
+    || !strcasecmp(name, "TE")
+    || !strcasecmp(name, HEADER_CONTENT_LENGTH);
+}
+
+/* encodes the pseudo headers, the header and the body length */
+static void
+_http2_encode_header(http2_session_t * s, const char **pseudo,
+                     hpair_t * header, int size)
+{
+  char name[HPACK_MAX_NAME], length[16];
+  int i;
+
+  s->block.size = 0;
+  if (s->encoder_update)
+  {
+    _hpack_put_int(&s->block, 5, 0x20, s->encoder.max_size);
+    s->encoder_update = 0;
+  }
+
+  for (i = 0; pseudo[i]; i += 2)
+    _hpack_encode(&s->encoder, &s->block, pseudo[i], pseudo[i + 1]);
+
+  for (; header; header = header->next)
+  {
+    if (!header->key || !header->value || _http2_hop_header(header->key))
+      continue;
+    if (strlen(header->key) >= sizeof(name))
+    {
+      log_warn2("Header '%s' left out", header->key);
+      continue;
+    }
+    for (i = 0; header->key[i]; i++)
+      name[i] = (header->key[i] >= 'A' && header->key[i] <= 'Z')
+        ? header->key[i] - 'A' + 'a' : header->key[i];
+    name[i] = '\0';
+    _hpack_encode(&s->encoder, &s->block, name, header->value);
+  }
+
+  if (size > 0 || s->server)
+  {
+    sprintf(length, "%d", size);
+    _hpack_encode(&s->encoder, &s->block, "content-length", length);
+  }
+}
+
+static void
+_http2_put_headers(http2_session_t * s, unsigned int id, int end_stream)
+{
+  int offset = 0, n;
+
+  do
+  {
+    n = s->block.size - offset;
+    if (n > H2_MAX_FRAME)
+      n = H2_MAX_FRAME;
+    _http2_frame_put(&s->out, offset == 0 ? H2_HEADERS : H2_CONTINUATION,
+                     (offset + n == s->block.size ? H2_FLAG_END_HEADERS : 0)
+                     | (offset == 0 && end_stream ? H2_FLAG_END_STREAM : 0),
+                     id, s->block.data + offset, n);
+    offset += n;
+  }
+  while (offset < s->block.size);
+}
+
+static void
+_http2_put_data(http2_session_t * s, unsigned int id, const byte_t * data,
+                int size, int end_stream)
+{
+  int n;
+
+  do
+  {
+    n = size > H2_MAX_FRAME ? H2_MAX_FRAME : size;
+    _http2_frame_put(&s->out, H2_DATA,
+                     n == size && end_stream ? H2_FLAG_END_STREAM : 0,
+                     id, data, n);
+    data += n;
+    size -= n;
+  }
+  while (size > 0);
+}
+
+/* takes what the windows allow of 'size' bytes, with the lock held */
+static int
+_http2_take_window(http2_session_t * s, http2_stream_t * stream, int size)
+{
+  int n = size;
+
+  if (n > H2_SEND_CHUNK)
+    n = H2_SEND_CHUNK;
+  if (n > stream->send_window)
+    n = stream->send_window;
+  if (n > s->send_window)
+    n = s->send_window;
+  if (n <= 0)
+    return 0;
+
+  stream->send_window -= n;
+  s->send_window -= n;
+
+  return n;
+}
+
+/*
+  Waits until something happens to the stream, at most until the
+  deadline (hclock_ms) and unless the request of the thread is
+  cancelled. Called and returns with the lock held.
+*/
+static herror_t
+_http2_wait(http2_session_t * s, http2_stream_t * stream, hclock_t deadline)
+{
+  hcancel_t *cancel = hsocket_get_cancel();
+  long left = (long) (deadline - hclock_ms());
+
+  if (hcancel_triggered(cancel))
+    return herror_new("_http2_wait", HSOCKET_ERROR_CANCELLED,
+                      "Request cancelled");
+  if (left <= 0)
+    return herror_new("_http2_wait", HSOCKET_ERROR_RECEIVE,
+                      "Timeout on HTTP/2 stream %u", stream->id);
+
+  hevent_reset(&stream->event);
+  hmutex_unlock(&s->lock);
+  hcancel_set_event(cancel, &stream->event);
+  hevent_timedwait(&stream->event, left);
+  hcancel_set_event(cancel, NULL);
+  hmutex_lock(&s->lock);
+
+  return H_OK;
+}
+
+static herror_t
+_http2_stream_failed(http2_session_t * s, http2_stream_t * stream)
+{
+  if (stream->error != H_OK)
+    return herror_new(herror_func(stream->error), herror_code(stream->error),
+                      "%s", herror_message(stream->error));
+
+  return herror_new("_http2_send_body", HSOCKET_ERROR_SEND,
+                    "Connection closed");
+}
+
+/* sends the rest of a body as the windows open */
+static herror_t
+_http2_send_body(http2_session_t * s, http2_stream_t * stream,
+                 const byte_t * data, int size)
+{
+  herror_t status = H_OK;
+  long timeout = hsocket_get_read_timeout();
+  hclock_t deadline = hclock_ms() + timeout;
+  int n = 0;
+
+  while (size > 0)
+  {
+    hmutex_lock(&s->lock);
+    while (!s->dead && stream->error == H_OK
+           && (n = _http2_take_window(s, stream, size)) == 0)
+    {
+      if ((status = _http2_wait(s, stream, deadline)) != H_OK)
+        break;
+    }
+    if (status == H_OK && (s->dead || stream->error != H_OK))
+      status = _http2_stream_failed(s, stream);
+    hmutex_unlock(&s->lock);
+    if (status != H_OK)
+      return status;
+
+    hmutex_lock(&s->io);
+    _http2_put_data(s, stream->id, data, n, n == size);
+    status = _http2_flush(s);
+    hmutex_unlock(&s->io);
+    if (status != H_OK)
+      return status;
+
+    data += n;
+    size -= n;
+    deadline = hclock_ms() + timeout;
+  }
+
+  return H_OK;
+}
+
+/*
+  Sends the header and the body of a message. A client stream gets
+  its id here: the ids must reach the peer in increasing order.
+*/
+static herror_t
+_http2_send_message(http2_session_t * s, http2_stream_t * stream,
+                    const char **pseudo, hpair_t * header,
+                    const byte_t * body, int size)
+{
+  herror_t status = H_OK;
+  int n = 0;
+
+  hmutex_lock(&s->io);
+  hmutex_lock(&s->lock);
+  if (stream->id == 0)
+  {
+    if (s->dead || s->goaway || s->next_id > H2_MAX_ID
+        || s->active >= s->peer_max_streams)
+      status = herror_new("http2_send", HTTP2_ERROR_REFUSED,
+                          "HTTP/2 connection does not take new streams");
+    else
+    {
+      stream->id = s->next_id;
+      s->next_id += 2;
+      stream->send_window = s->peer_window;
+      _http2_link(s, stream);
+    }
+  }
+  else if (s->dead || stream->error != H_OK)
+    status = _http2_stream_failed(s, stream);
+  hmutex_unlock(&s->lock);
+  if (status != H_OK)
+  {
+    hmutex_unlock(&s->io);
+    return status;
+  }
+
+  _http2_encode_header(s, pseudo, header, size);
+  if (s->block.failed)
+  {
+    /* the encoder table may not match the peer's anymore */
+    s->block.failed = 0;
+    _http2_kill(s);
+    hmutex_unlock(&s->io);
+    return herror_new("_http2_send_message", HSOCKET_ERROR_SEND,
+                      "Memory allocation failed");
+  }
+  _http2_put_headers(s, stream->id, size == 0);
+
+  if (size > 0)
+  {
+    hmutex_lock(&s->lock);
+    n = _http2_take_window(s, stream, size);
+    hmutex_unlock(&s->lock);
+    if (n > 0)
+      _http2_put_data(s, stream->id, body, n, n == size);
+  }
+  status = _http2_flush(s);
+  hmutex_unlock(&s->io);
+
+  if (status == H_OK && n < size)
+    status = _http2_send_body(s, stream, body + n, size - n);
+
+  return status;
+}
+
+/*
+ * -----------------------------------------------------
+ * Sessions
+ * -----------------------------------------------------
+ */
+
+static http2_session_t *
+_http2_session_new(hsocket_t * sock, int server)
+{
+  http2_session_t *s;
+
+  if (!(s = (http2_session_t *) calloc(1, sizeof(http2_session_t))))
+    return NULL;
+
+  if (!(s->in = (byte_t *) malloc(H2_FRAME_HEADER + H2_MAX_FRAME)))
+  {
+    free(s);
+    return NULL;
+  }
+  if (hmutex_init(&s->io))
+  {
+    free(s->in);
+    free(s);
+    return NULL;
+  }
+  if (hmutex_init(&s->lock))
+  {
+    hmutex_destroy(&s->io);
+    free(s->in);
+    free(s);
+    return NULL;
+  }
+
+  s->sock = *sock;
+  s->server = server;
+  s->encoder.max_size = HPACK_TABLE_SIZE;
+  s->decoder.max_size = HPACK_TABLE_SIZE;
+  s->next_id = 1;
+  s->peer_max_streams = H2_DEFAULT_STREAMS;
+  s->peer_window = H2_DEFAULT_WINDOW;
+  s->send_window = H2_DEFAULT_WINDOW;
+  s->idle_since = time(NULL);
+  s->refs = 1;
+  hsocket_set_blocking(&s->sock, 0);
+
+  return s;
+}
+
+static void
+_http2_session_free(http2_session_t * s)
+{
+  _hpack_resize(&s->encoder, 0);
+  _hpack_resize(&s->decoder, 0);
+  _h2_buffer_free(&s->out);
+  _h2_buffer_free(&s->block);
+  _h2_buffer_free(&s->block_in);
+  hmutex_destroy(&s->io);
+  hmutex_destroy(&s->lock);
+  free(s->in);
+  free(s);
+}
+
+static void
+_http2_unref(http2_session_t * s)
+{
+  int last;
+
+  hmutex_lock(&s->lock);
+  last = --s->refs == 0;
+  hmutex_unlock(&s->lock);
+
+  if (last)
+    _http2_session_free(s);
+}
+
+static void
+_http2_register(http2_session_t * s)
+{
+  int i;
+
+  hmutex_lock(&_http2_lock);
+  for (i = 0; i < HTTP2_SESSIONS; i++)
+  {
+    if (_http2_sessions[i] == NULL)
+    {
+      _http2_sessions[i] = s;
+      hmutex_lock(&s->lock);
+      s->registered = 1;
+      s->refs++;
+      hmutex_unlock(&s->lock);
+      break;
+    }
+  }
+  hmutex_unlock(&_http2_lock);
+}
+
+static void
+_http2_unregister(http2_session_t * s)
+{
+  int i, found = 0;
+
+  hmutex_lock(&_http2_lock);
+  for (i = 0; i < HTTP2_SESSIONS; i++)
+  {
+    if (_http2_sessions[i] == s)
+    {
+      _http2_sessions[i] = NULL;
+      found = 1;
+    }
+  }
+  hmutex_unlock(&_http2_lock);
+
+  if (found)
+  {
+    hmutex_lock(&s->lock);
+    s->registered = 0;
+    hmutex_unlock(&s->lock);
+    _http2_unref(s);
+  }
+}
+
+/*
+  The message of a stream is complete: wakes the client up, or
+  starts the worker of a server stream. Returns the code of the
+  reset to send, the stream is gone then.
+*/
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+_http2_worker(void *data);
+
+static int
+_http2_end(http2_session_t * s, http2_stream_t * stream)
+{
+  stream->ended = 1;
+  if (!s->server)
+  {
+    hevent_set(&stream->event);
+    return 0;
+  }
+
+  if (stream->oversized)
+  {
+    _http2_unlink(s, stream);
+    _http2_stream_free(stream);
+    return H2_ENHANCE_YOUR_CALM;
+  }
+
+  stream->dispatched = 1;
+  s->workers++;
+  s->refs++;
+  if (hthread_start(_http2_worker, stream) == 0)
+    return 0;
+
+  log_error1("Cannot start HTTP/2 stream thread");
+  s->workers--;
+  s->refs--;
+  _http2_unlink(s, stream);
+  _http2_stream_free(stream);
+
+  return H2_REFUSED_STREAM;
+}
+
+static int
+_http2_unpad(int flags, byte_t ** p, int *len)
+{
+  int pad;
+
+  if (!(flags & H2_FLAG_PADDED))
+    return 0;
+  if (*len < 1 || (pad = **p) >= *len)
+    return -1;
+  (*p)++;
+  *len -= 1 + pad;
+
+  return 0;
+}
+
+static int
+_http2_headers_end(http2_session_t * s, unsigned int id)
+{
+  http2_stream_t *stream;
+  char *value;
+  int reset = 0, length;
+
+  if (s->block_in.failed)
+    return H2_INTERNAL_ERROR;
+
+  hmutex_lock(&s->lock);
+  stream = _http2_find(s, id);
+  if (s->server && stream == NULL && (id & 1) && id > s->last_id)
+  {
+    s->last_id = id;
+    if (s->goaway || s->active >= HTTP2_MAX_STREAMS
+        || !(stream = _http2_stream_new(s)))
+      reset = H2_REFUSED_STREAM;
+    else
+    {
+      stream->id = id;
+      stream->send_window = s->peer_window;
+      _http2_link(s, stream);
+    }
+  }
+  if (stream && (stream->ended || stream->error != H_OK))
+    stream = NULL;
+
+  /* decoded also without stream: the table must follow the peer */
+  if (_hpack_decode(&s->decoder, s->block_in.data, s->block_in.size, stream))
+  {
+    hmutex_unlock(&s->lock);
+    return H2_COMPRESSION_ERROR;
+  }
+
+  if (stream)
+  {
+    stream->activity++;
+    if (!s->server && stream->code >= 100 && stream->code < 200)
+    {
+      /* informational response, the final one follows */
+      stream->code = 0;
+      stream->header_size = 0;
+      if (stream->header)
+        hpairnode_free_deep(stream->header);
+      stream->header = stream->tail = NULL;
+    }
+    else if (s->headers_flags & H2_FLAG_END_STREAM)
+      reset = _http2_end(s, stream);
+    else if (stream->oversized)
+    {
+      reset = H2_ENHANCE_YOUR_CALM;
+      _http2_stream_error(s, stream,
+                          herror_new("http2_receive", HTTP2_ERROR_STREAM,
+                                     "HTTP/2 header list too large"));
+    }
+    else if (stream->data == NULL
+             && (value = hpairnode_get_ignore_case(stream->header,
+                                                   HEADER_CONTENT_LENGTH))
+             && (length = atoi(value)) > 0 && length <= HTTP2_MAX_MESSAGE
+             && (stream->data = (byte_t *) malloc(length)))
+      stream->capacity = length;
+  }
+  hmutex_unlock(&s->lock);
+
+  if (reset)
+    _http2_reset(s, id, reset);
+
+  return 0;
+}
+
+static int
+_http2_settings(http2_session_t * s, int flags, byte_t * p, int len)
+{
+  http2_stream_t *stream;
+  unsigned int ident, value;
+  int table = -1, delta;
+
+  if (flags & H2_FLAG_ACK)
+    return len == 0 ? 0 : H2_FRAME_SIZE_ERROR;
+  if (len % 6)
+    return H2_FRAME_SIZE_ERROR;
+
+  for (; len > 0; p += 6, len -= 6)
+  {
+    ident = (p[0] << 8) | p[1];
+    value = _h2_get32(p + 2);
+    switch (ident)
+    {
+    case H2_SETTINGS_HEADER_TABLE_SIZE:
+      table = value > HPACK_TABLE_SIZE ? HPACK_TABLE_SIZE : (int) value;
+      break;
+    case H2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+      hmutex_lock(&s->lock);
+      s->peer_max_streams = value > H2_MAX_ID ? H2_MAX_ID : (int) value;
+      hmutex_unlock(&s->lock);
+      break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > H2_MAX_WINDOW)
+        return H2_FLOW_CONTROL_ERROR;
+      hmutex_lock(&s->lock);
+      delta = (int) value - s->peer_window;
+      s->peer_window = value;
+      for (stream = s->streams; stream; stream = stream->next)
+        stream->send_window += delta;
+      _http2_signal_all(s);
+      hmutex_unlock(&s->lock);
+      break;
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      /* our frames keep the minimum size */
+      if (value < 16384 || value > 16777215)
+        return H2_PROTOCOL_ERROR;
+      break;
+    }
+  }
+
+  if (table >= 0)
+  {
+    hmutex_lock(&s->io);
+    if (table != s->encoder.max_size)
+    {
+      _hpack_resize(&s->encoder, table);
+      s->encoder_update = 1;
+    }
+    hmutex_unlock(&s->io);
+  }
+
+  _http2_control(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+
+  return 0;
+}
+
+/*
+  Handles a received frame. Returns 0 or the code of a connection
+  error.
+*/
+static int
+_http2_frame(http2_session_t * s, int type, int flags, unsigned int id,
+             byte_t * p, int len)
+{
+  http2_stream_t *stream;
+  unsigned int value;
+  int reset = 0, update = 0;
+
+  if (s->headers_stream != 0 && type != H2_CONTINUATION)
+    return H2_PROTOCOL_ERROR;
+
+  switch (type)
+  {
+  case H2_DATA:
+    if (id == 0)
+      return H2_PROTOCOL_ERROR;
+    s->recv_unacked += len;
+    if (_http2_unpad(flags, &p, &len))
+      return H2_PROTOCOL_ERROR;
+
+    hmutex_lock(&s->lock);
+    if ((stream = _http2_find(s, id)) != NULL && !stream->ended
+        && stream->error == H_OK)
+    {
+      stream->activity++;
+      stream->recv_unacked += len;
+      if (_http2_stream_data(stream, p, len))
+      {
+        reset = H2_CANCEL;
+        _http2_stream_error(s, stream,
+                            herror_new("http2_receive", HTTP2_ERROR_STREAM,
+                                       "HTTP/2 message too large"));
+      }
+      else if (flags & H2_FLAG_END_STREAM)
+        reset = _http2_end(s, stream);
+      else if (stream->recv_unacked >= HTTP2_WINDOW / 2)
+      {
+        update = stream->recv_unacked;
+        stream->recv_unacked = 0;
+      }
+    }
+    hmutex_unlock(&s->lock);
+
+    if (reset)
+      _http2_reset(s, id, reset);
+    if (update)
+      _http2_window_update(s, id, update);
+    if (s->recv_unacked >= H2_SESSION_WINDOW / 2)
+    {
+      _http2_window_update(s, 0, s->recv_unacked);
+      s->recv_unacked = 0;
+    }
+    return 0;
+
+  case H2_HEADERS:
+    if (id == 0 || _http2_unpad(flags, &p, &len))
+      return H2_PROTOCOL_ERROR;
+    if (flags & H2_FLAG_PRIORITY)
+    {
+      if (len < 5)
+        return H2_PROTOCOL_ERROR;
+      p += 5;
+      len -= 5;
+    }
+    s->block_in.size = 0;
+    _h2_buffer_put(&s->block_in, p, len);
+    s->headers_flags = flags;
+    if (!(flags & H2_FLAG_END_HEADERS))
+    {
+      s->headers_stream = id;
+      return 0;
+    }
+    return _http2_headers_end(s, id);
+
+  case H2_CONTINUATION:
+    if (id == 0 || id != s->headers_stream)
+      return H2_PROTOCOL_ERROR;
+    if (s->block_in.size + len > HTTP2_MAX_HEADERS)
+      return H2_ENHANCE_YOUR_CALM;
+    _h2_buffer_put(&s->block_in, p, len);
+    if (!(flags & H2_FLAG_END_HEADERS))
+      return 0;
+    s->headers_stream = 0;
+    return _http2_headers_end(s, id);
+
+  case H2_RST_STREAM:
+    if (id == 0)
+      return H2_PROTOCOL_ERROR;
+    if (len != 4)
+      return H2_FRAME_SIZE_ERROR;
+    value = _h2_get32(p);
+    hmutex_lock(&s->lock);
+    if ((stream = _http2_find(s, id)) != NULL)
+      _http2_stream_error(s, stream,
+                          herror_new("http2_receive",
+                                     value == H2_REFUSED_STREAM
+                                     ? HTTP2_ERROR_REFUSED : HTTP2_ERROR_STREAM,
+                                     "HTTP/2 stream reset by peer (%u)", value));
+    hmutex_unlock(&s->lock);
+    return 0;
+
+  case H2_SETTINGS:
+    if (id != 0)
+      return H2_PROTOCOL_ERROR;
+    return _http2_settings(s, flags, p, len);
+
+  case H2_PUSH_PROMISE:
+    /* push is disabled */
+    return H2_PROTOCOL_ERROR;
+
+  case H2_PING:
+    if (id != 0)
+      return H2_PROTOCOL_ERROR;
+    if (len != 8)
+      return H2_FRAME_SIZE_ERROR;
+    if (!(flags & H2_FLAG_ACK))
+      _http2_control(s, H2_PING, H2_FLAG_ACK, 0, p, 8);
+    return 0;
+
+  case H2_GOAWAY:
+    if (id != 0)
+      return H2_PROTOCOL_ERROR;
+    if (len < 8)
+      return H2_FRAME_SIZE_ERROR;
+    value = _h2_get32(p) & H2_MAX_ID;
+    log_verbose3("HTTP/2 peer going away (last stream %u, code %u)", value,
+                 _h2_get32(p + 4));
+    hmutex_lock(&s->lock);
+    s->goaway = 1;
+    /* the streams above the last one were not processed */
+    for (stream = s->streams; stream; stream = stream->next)
+      if (!s->server && stream->id > value && !stream->ended)
+        _http2_stream_error(s, stream,
+                            herror_new("http2_receive", HTTP2_ERROR_REFUSED,
+                                       "HTTP/2 connection going away"));
+    hmutex_unlock(&s->lock);
+    _http2_unregister(s);
+    return 0;
+
+  case H2_WINDOW_UPDATE:
+    if (len != 4)
+      return H2_FRAME_SIZE_ERROR;
+    value = _h2_get32(p) & H2_MAX_WINDOW;
+    hmutex_lock(&s->lock);
+    if (id == 0)
+    {
+      if (value == 0 || (long long) s->send_window + value > H2_MAX_WINDOW)
+      {
+        hmutex_unlock(&s->lock);
+        return value == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR;
+      }
+      s->send_window += value;
+      _http2_signal_all(s);
+    }
+    else if ((stream = _http2_find(s, id)) != NULL)
+    {
+      if (value == 0 || (long long) stream->send_window + value > H2_MAX_WINDOW)
+      {
+        reset = value == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR;
+        _http2_stream_error(s, stream,
+                            herror_new("http2_receive", HTTP2_ERROR_STREAM,
+                                       "HTTP/2 flow control error"));
+      }
+      else
+      {
+        stream->send_window += value;
+        hevent_set(&stream->event);
+      }
+    }
+    hmutex_unlock(&s->lock);
+    if (reset)
+      _http2_reset(s, id, reset);
+    return 0;
+
+  default:
+    /* PRIORITY and unknown frames are ignored */
+    return 0;
+  }
+}
+
+/*
+  Reads and handles the frames of the connection until it fails,
+  the peer closes it or no stream was open for 'idle' seconds.
+*/
+static void
+_http2_run(http2_session_t * s, int idle)
+{
+  herror_t status;
+  size_t count;
+  int offset, len, error = 0, dead, closing = 0;
+  byte_t *p;
+
+  for (;;)
+  {
+    hmutex_lock(&s->lock);
+    if (!s->dead && s->active == 0 && s->workers == 0 && s->users == 0
+        && (s->goaway || (!s->server && !s->registered)
+            || time(NULL) - s->idle_since >= idle))
+    {
+      log_verbose2("Closing idle HTTP/2 connection (%d)", s->sock.sock);
+      s->dead = 1;
+      closing = 1;
+    }
+    dead = s->dead;
+    hmutex_unlock(&s->lock);
+    if (dead)
+    {
+      /* killed after a send failure or by http2_destroy */
+      if (!closing)
+        error = -1;
+      break;
+    }
+
+    hmutex_lock(&s->io);
+    status = hssl_read_nowait(&s->sock, (char *) s->in + s->in_size,
+                              H2_FRAME_HEADER + H2_MAX_FRAME - s->in_size,
+                              &count);
+    hmutex_unlock(&s->io);
+    if (status != H_OK)
+    {
+      log_verbose2("HTTP/2 connection closed (%s)", herror_message(status));
+      herror_release(status);
+      error = -1;
+      break;
+    }
+    if (count == 0)
+    {
+      if (hsocket_wait(s->sock.sock, 0, H2_POLL) < 0)
+      {
+        error = -1;
+        break;
+      }
+      continue;
+    }
+    s->in_size += count;
+
+    offset = 0;
+    if (s->server && !s->preface)
+    {
+      if (s->in_size < H2_PREFACE_SIZE)
+        continue;
+      if (memcmp(s->in, H2_PREFACE, H2_PREFACE_SIZE))
+      {
+        log_error1("Bad HTTP/2 client preface");
+        error = -1;
+        break;
+      }
+      s->preface = 1;
+      offset = H2_PREFACE_SIZE;
+    }
+
+    while (s->in_size - offset >= H2_FRAME_HEADER)
+    {
+      p = s->in + offset;
+      len = (p[0] << 16) | (p[1] << 8) | p[2];
+      if (len > H2_MAX_FRAME)
+      {
+        error = H2_FRAME_SIZE_ERROR;
+        break;
+      }
+      if (s->in_size - offset < H2_FRAME_HEADER + len)
+        break;
+      error = _http2_frame(s, p[3], p[4], _h2_get32(p + 5) & H2_MAX_ID,
+                           p + H2_FRAME_HEADER, len);
+      offset += H2_FRAME_HEADER + len;
+      if (error)
+        break;
+    }
+    if (error)
+    {
+      log_error2("HTTP/2 protocol error (%d)", error);
+      s->failed = 1;
+      break;
+    }
+    s->in_size -= offset;
+    memmove(s->in, s->in + offset, s->in_size);
+  }
+
+  /* idle close or connection error */
+  if (error >= 0)
+    _http2_goaway(s, error);
+
+  /* the streams sending stop waiting for the windows */
+  hmutex_lock(&s->lock);
+  s->dead = 1;
+  _http2_signal_all(s);
+  hmutex_unlock(&s->lock);
+}
+
+/*
+  Closes the connection after the reader stopped: fails the streams
+  still waiting and drops the server streams not served yet.
+*/
+static void
+_http2_close(http2_session_t * s)
+{
+  http2_stream_t *stream, *next;
+
+  _http2_unregister(s);
+
+  hmutex_lock(&s->io);
+  hmutex_lock(&s->lock);
+  s->dead = 1;
+  s->closed = 1;
+  for (stream = s->streams; stream; stream = next)
+  {
+    next = stream->next;
+    if (s->failed)
+      _http2_stream_error(s, stream,
+                          herror_new("http2_receive", HTTP2_ERROR_PROTOCOL,
+                                     "HTTP/2 protocol error"));
+    else if (!stream->ended || s->server)
+      _http2_stream_error(s, stream,
+                          herror_new("http2_receive", HSOCKET_ERROR_RECEIVE,
+                                     "HTTP/2 connection closed"));
+  }
+  hmutex_unlock(&s->lock);
+  if (!s->server)
+    hsocket_close(&s->sock);
+  hmutex_unlock(&s->io);
+}
+
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+_http2_reader(void *data)
+{
+  http2_session_t *s = (http2_session_t *) data;
+
+  _http2_run(s, HTTP2_MAX_IDLE);
+  _http2_close(s);
+  _http2_unref(s);
+  hatomic_dec(&_http2_readers);
+
+#ifdef WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * -----------------------------------------------------
+ * Client
+ * -----------------------------------------------------
+ */
+
+http2_session_t *
+http2_session_find(hurl_t * url)
+{
+  http2_session_t *s, *found = NULL;
+  int i;
+
+  hmutex_lock(&_http2_lock);
+  for (i = 0; i < HTTP2_SESSIONS && found == NULL; i++)
+  {
+    if ((s = _http2_sessions[i]) == NULL || s->port != url->port
+        || s->ssl != (url->protocol == PROTOCOL_HTTPS)
+        || strcmp(s->host, url->host))
+      continue;
+
+    hmutex_lock(&s->lock);
+    if (!s->dead && !s->goaway && s->active < s->peer_max_streams)
+    {
+      s->refs++;
+      s->users++;
+      found = s;
+    }
+    hmutex_unlock(&s->lock);
+  }
+  hmutex_unlock(&_http2_lock);
+
+  if (found != NULL)
+    log_verbose3("Reusing HTTP/2 connection to %s:%d", url->host, url->port);
+
+  return found;
+}
+
+herror_t
+http2_session_new(hsocket_t * sock, hurl_t * url, http2_session_t ** out)
+{
+  http2_session_t *s;
+  herror_t status;
+
+  if (!(s = _http2_session_new(sock, 0)))
+  {
+    hsocket_close(sock);
+    return herror_new("http2_session_new", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  }
+  s->ssl = url->protocol == PROTOCOL_HTTPS;
+  s->port = url->port;
+  strcpy(s->host, url->host);
+  s->users = 1;
+
+  hmutex_lock(&s->io);
+  _http2_preface(s);
+  status = _http2_flush(s);
+  hmutex_unlock(&s->io);
+  if (status != H_OK)
+  {
+    hsocket_close(&s->sock);
+    _http2_session_free(s);
+    return status;
+  }
+
+  /* the reader holds a reference */
+  s->refs++;
+  hatomic_inc(&_http2_readers);
+  if (hthread_start(_http2_reader, s) != 0)
+  {
+    hatomic_dec(&_http2_readers);
+    hsocket_close(&s->sock);
+    _http2_session_free(s);
+    return herror_new("http2_session_new", THREAD_BEGIN_ERROR,
+                      "Cannot start HTTP/2 reader thread");
+  }
+  _http2_register(s);
+
+  log_verbose4("HTTP/2 connection to %s:%d (%d)", url->host, url->port,
+               sock->sock);
+  *out = s;
+
+  return H_OK;
+}
+
+void
+http2_session_release(http2_session_t * s)
+{
+  int last;
+
+  if (s == NULL)
+    return;
+
+  hmutex_lock(&s->lock);
+  s->users--;
+  last = --s->refs == 0;
+  hmutex_unlock(&s->lock);
+
+  if (last)
+    _http2_session_free(s);
+}
+
+herror_t
+http2_send(http2_session_t * s, hreq_method_t method, hurl_t * url,
+           hpair_t * header, const byte_t * body, int size,
+           http2_stream_t ** queue)
+{
+  http2_stream_t *stream;
+  herror_t status;
+  const char *pseudo[9];
+  const char *authority;
+  int reset;
+
+  if (method < 0 || method >= HTTP_REQUEST_UNKOWN)
+    return herror_new("http2_send", GENERAL_INVALID_PARAM,
+                      "Unknown request method");
+
+  if (hsocket_cancelled())
+    return herror_new("http2_send", HSOCKET_ERROR_CANCELLED,
+                      "Request cancelled");
+
+  if (!(stream = _http2_stream_new(s)))
+    return herror_new("http2_send", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+
+  if (!(authority = hpairnode_get_ignore_case(header, HEADER_HOST)))
+    authority = url->host;
+
+  pseudo[0] = ":method";
+  pseudo[1] = _http2_methods[method];
+  pseudo[2] = ":scheme";
+  pseudo[3] = url->protocol == PROTOCOL_HTTPS ? "https" : "http";
+  pseudo[4] = ":authority";
+  pseudo[5] = authority;
+  pseudo[6] = ":path";
+  pseudo[7] = url->context[0] != '\0' ? url->context : "/";
+  pseudo[8] = NULL;
+
+  if ((status = _http2_send_message(s, stream, pseudo, header, body, size)) != H_OK)
+  {
+    hmutex_lock(&s->lock);
+    reset = stream->linked && !s->dead;
+    _http2_unlink(s, stream);
+    hmutex_unlock(&s->lock);
+    if (reset)
+      _http2_reset(s, stream->id, H2_CANCEL);
+    _http2_stream_free(stream);
+    return status;
+  }
+
+  while (*queue)
+    queue = &(*queue)->queue;
+  *queue = stream;
+
+  return H_OK;
+}
+
+herror_t
+http2_receive(http2_stream_t ** queue, hresponse_t ** out)
+{
+  http2_stream_t *stream = *queue;
+  http2_session_t *s;
+  http_input_stream_t *in;
+  hpair_t *header;
+  herror_t status = H_OK;
+  long timeout = hsocket_get_read_timeout();
+  hclock_t deadline;
+  int activity, reset, code;
+
+  if (stream == NULL)
+    return herror_new("http2_receive", GENERAL_INVALID_PARAM,
+                      "No request sent");
+  *queue = stream->queue;
+  s = stream->session;
+
+  hmutex_lock(&s->lock);
+  activity = stream->activity;
+  deadline = hclock_ms() + timeout;
+  while (!stream->ended && stream->error == H_OK)
+  {
+    if ((status = _http2_wait(s, stream, deadline)) != H_OK)
+      break;
+    /* the timeout runs from the last data, as for HTTP/1.1 reads */
+    if (stream->activity != activity)
+    {
+      activity = stream->activity;
+      deadline = hclock_ms() + timeout;
+    }
+  }
+  if (status == H_OK && stream->error != H_OK)
+  {
+    status = stream->error;
+    stream->error = H_OK;
+  }
+  reset = status != H_OK && !stream->ended && !s->dead;
+  _http2_unlink(s, stream);
+  hmutex_unlock(&s->lock);
+
+  if (status != H_OK)
+  {
+    if (reset)
+      _http2_reset(s, stream->id, H2_CANCEL);
+    _http2_stream_free(stream);
+    return status;
+  }
+
+  if (stream->oversized)
+  {
+    _http2_stream_free(stream);
+    return herror_new("http2_receive", HTTP2_ERROR_STREAM,
+                      "HTTP/2 header list too large");
+  }
+
+  if (!(in = http_input_stream_new_from_buffer(stream->data, stream->size)))
+  {
+    _http2_stream_free(stream);
+    return herror_new("http2_receive", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  }
+  stream->data = NULL;
+  header = stream->header;
+  stream->header = NULL;
+  code = stream->code;
+  _http2_stream_free(stream);
+
+  return hresponse_new_from_stream(code, header, in, out);
+}
+
+void
+http2_abort(http2_stream_t ** queue)
+{
+  http2_stream_t *stream;
+  http2_session_t *s;
+  int reset;
+
+  while ((stream = *queue) != NULL)
+  {
+    *queue = stream->queue;
+    s = stream->session;
+
+    hmutex_lock(&s->lock);
+    reset = !stream->ended && !s->dead;
+    _http2_unlink(s, stream);
+    hmutex_unlock(&s->lock);
+
+    if (reset)
+      _http2_reset(s, stream->id, H2_CANCEL);
+    _http2_stream_free(stream);
+  }
+}
+
+void
+http2_destroy(void)
+{
+  http2_session_t *s;
+  int i, wait;
+
+  for (i = 0; i < HTTP2_SESSIONS; i++)
+  {
+    hmutex_lock(&_http2_lock);
+    s = _http2_sessions[i];
+    if (s != NULL)
+    {
+      /* kept alive by the registry until unregistered below */
+      hmutex_lock(&s->lock);
+      s->goaway = 1;
+      hmutex_unlock(&s->lock);
+    }
+    hmutex_unlock(&_http2_lock);
+
+    if (s != NULL)
+    {
+      _http2_kill(s);
+      _http2_unregister(s);
+    }
+  }
+
+  /* the readers use SSL until they exit */
+  for (wait = 50; wait > 0 && _http2_readers > 0; wait--)
+    hthread_msleep(100);
+}
+
+/*
+ * -----------------------------------------------------
+ * Server
+ * -----------------------------------------------------
+ */
+
+int
+http2_server_detect(hsocket_t * sock)
+{
+  char buffer[H2_PREFACE_SIZE];
+  int count;
+
+  if (sock->ssl)
+    return hssl_http2(sock);
+
+  /* prior knowledge: the client starts with the preface */
+  if (hsocket_wait(sock->sock, 0, 0) != 1)
+    return 0;
+  if ((count = recv(sock->sock, buffer, sizeof(buffer), MSG_PEEK)) < 3)
+    return 0;
+
+  return !memcmp(buffer, H2_PREFACE, count);
+}
+
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+_http2_worker(void *data)
+{
+  http2_stream_t *stream = (http2_stream_t *) data;
+  http2_session_t *s = stream->session;
+  http_input_stream_t *in;
+  httpd_conn_t *conn = NULL;
+  hrequest_t *req = NULL;
+  herror_t status;
+  const byte_t *body = NULL;
+  const char *pseudo[3];
+  char code[8];
+  int size = 0;
+
+  in = http_input_stream_new_from_buffer(stream->data, stream->size);
+  if (in != NULL)
+    stream->data = NULL;
+
+  status = hrequest_new_from_stream(stream->method,
+                                    stream->path ? stream->path : "/",
+                                    stream->header, in, &req);
+  stream->header = NULL;
+
+  if (status != H_OK)
+  {
+    log_error2("Cannot create HTTP/2 request (%s)", herror_message(status));
+    herror_release(status);
+    _http2_reset(s, stream->id, H2_INTERNAL_ERROR);
+  }
+  else if (!(conn = httpd_new(NULL)))
+    _http2_reset(s, stream->id, H2_INTERNAL_ERROR);
+  else
+  {
+    s->service(conn, req);
+
+    if (conn->out)
+      body = http_output_stream_buffer(conn->out, &size);
+    sprintf(code, "%d", conn->code ? conn->code : 500);
+    pseudo[0] = ":status";
+    pseudo[1] = code;
+    pseudo[2] = NULL;
+    if ((status = _http2_send_message(s, stream, pseudo, conn->header,
+                                      body, size)) != H_OK)
+    {
+      log_verbose3("HTTP/2 stream %u not answered (%s)", stream->id,
+                   herror_message(status));
+      herror_release(status);
+    }
+  }
+
+  if (conn)
+    httpd_free(conn);
+  if (req)
+    hrequest_free(req);
+
+  hmutex_lock(&s->lock);
+  _http2_unlink(s, stream);
+  s->workers--;
+  hmutex_unlock(&s->lock);
+  _http2_stream_free(stream);
+  _http2_unref(s);
+
+#ifdef WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+herror_t
+http2_serve(hsocket_t * sock, httpd_service service, int idle)
+{
+  http2_session_t *s;
+  herror_t status;
+  int nodelay = 1;
+
+  if (!(s = _http2_session_new(sock, 1)))
+    return herror_new("http2_serve", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  s->service = service;
+
+  /* the replies of the streams are small frames in between */
+  setsockopt(sock->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay,
+             sizeof(nodelay));
+
+  hmutex_lock(&s->io);
+  _http2_preface(s);
+  status = _http2_flush(s);
+  hmutex_unlock(&s->io);
+
+  if (status == H_OK)
+    _http2_run(s, idle);
+
+  /* the workers answer their streams, or fail once the socket is closed */
+  hmutex_lock(&s->lock);
+  while (s->workers > 0)
+  {
+    hmutex_unlock(&s->lock);
+    hthread_msleep(10);
+    hmutex_lock(&s->lock);
+  }
+  hmutex_unlock(&s->lock);
+
+  _http2_close(s);
+  hsocket_set_blocking(sock, 1);
+  _http2_unref(s);
+
+  return status;
+}
@@ -0,0 +1,138 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifndef NANO_HTTP_HTTP2_H
+#define NANO_HTTP_HTTP2_H
+
+#include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-socket.h>
+#include <nanohttp/nanohttp-request.h>
+#include <nanohttp/nanohttp-response.h>
+#include <nanohttp/nanohttp-server.h>
+
+/*
+  HTTP/2 (RFC 7540) transport. A client connection on which ALPN
+  chose "h2" becomes a session shared by the requests of all the
+  threads to the same server: each request is a stream of its own,
+  so the exchanges of concurrent authentications run side by side
+  on one TCP and TLS connection. Headers are HPACK (RFC 7541)
+  compressed with a dynamic table, the headers repeated by each
+  SOAP request take a byte or two once they were sent.
+
+  A reader thread per session takes the frames off the connection
+  and hands the responses to the waiting requests, which send their
+  own frames. Messages are buffered whole in memory, up to
+  HTTP2_MAX_MESSAGE bytes.
+
+  The server side serves the streams of a connection in threads of
+  their own, through the usual service callbacks.
+*/
+
+#define HTTP2_SESSIONS		8		/* client sessions kept, one per server */
+#define HTTP2_MAX_IDLE		30		/* seconds a client session is kept without streams */
+#define HTTP2_MAX_STREAMS	100		/* concurrent streams accepted by the server */
+#define HTTP2_WINDOW		(1 << 20)	/* receive window of a stream */
+#define HTTP2_MAX_MESSAGE	(16 << 20)	/* largest message body */
+#define HTTP2_MAX_HEADERS	65536		/* largest header list */
+
+typedef struct http2_session http2_session_t;
+typedef struct http2_stream http2_stream_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+  Finds a session to the server of the URL which can take one more
+  stream and takes a reference on it.
+
+  @returns the session or NULL if there is none.
+*/
+  http2_session_t *http2_session_find(hurl_t * url);
+
+/**
+  Starts a client session on a connection where HTTP/2 was
+  negotiated and keeps it for the next requests to the server.
+  The session owns the socket afterwards, also on failure.
+
+  @param out receives the session with a reference for the caller
+*/
+  herror_t http2_session_new(hsocket_t * sock, hurl_t * url,
+                             http2_session_t ** out);
+
+/**
+  Releases a reference taken by http2_session_find or
+  http2_session_new.
+*/
+  void http2_session_release(http2_session_t * session);
+
+/**
+  Sends a request on a new stream and appends the stream to
+  'queue' for http2_receive. The header is in HTTP/1.1 form: the
+  Host header gives the authority and the headers of the
+  connection itself are left out.
+
+  @returns H_OK, or HTTP2_ERROR_REFUSED if the session does not
+  take new streams anymore: the request was not sent and can be
+  tried on another connection.
+*/
+  herror_t http2_send(http2_session_t * session, hreq_method_t method,
+                      hurl_t * url, hpair_t * header, const byte_t * body,
+                      int size, http2_stream_t ** queue);
+
+/**
+  Waits for the response of the first stream of 'queue', within the
+  read timeout of the calling thread, and removes the stream.
+*/
+  herror_t http2_receive(http2_stream_t ** queue, hresponse_t ** out);
+
+/**
+  Resets the streams of 'queue' whose response was not read and
+  frees them.
+*/
+  void http2_abort(http2_stream_t ** queue);
+
+/**
+  Closes all client sessions. Called by httpc_destroy.
+*/
+  void http2_destroy(void);
+
+/**
+  Tells whether a server connection speaks HTTP/2: negotiated by
+  ALPN, or a cleartext connection starting with the client preface
+  (prior knowledge).
+*/
+  int http2_server_detect(hsocket_t * sock);
+
+/**
+  Serves an HTTP/2 connection until the client closes it or no
+  stream was open for 'idle' seconds. Each request is given to
+  'service' in a thread of its own, with a httpd_conn_t without
+  socket: the response is collected and sent as the reply of the
+  stream. The socket is left open.
+*/
+  herror_t http2_serve(hsocket_t * sock, httpd_service service, int idle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -69,15 +69,15 @@ VisualC_funcname(const char *file, int line)
 #endif
 #endif
 
-static log_level_t loglevel = HLOG_DEBUG;
+log_level_t hlog_level = HLOG_DEBUG;
 static char logfile[75] = { '\0' };
 static int log_background = 0;
 
 log_level_t
 hlog_set_level(log_level_t level)
 {
-  log_level_t old = loglevel;
-  loglevel = level;
+  log_level_t old = hlog_level;
+  hlog_level = level;
   return old;
 }
 
@@ -85,7 +85,7 @@ hlog_set_level(log_level_t level)
 log_level_t
 hlog_get_level(void)
 {
-  return loglevel;
+  return hlog_level;
 }
 
 
@@ -120,7 +120,7 @@ _log_write(log_level_t level, const char *prefix,
   char buffer2[1054];
   FILE *f;
 
-  if (level < loglevel)
+  if (level < hlog_level)
     return;
 
   if (!log_background || hlog_get_file())
@@ -43,6 +43,9 @@ typedef enum log_level
 extern "C" {
 #endif
 
+/* current level, read by the log macros; set it with hlog_set_level() */
+extern log_level_t hlog_level;
+
 extern log_level_t hlog_set_level(log_level_t level);
 extern log_level_t hlog_get_level(void);
 
@@ -67,41 +70,90 @@ extern void hlog_error(const char *FUNC, const char *format, ...);
 #endif
 
 /*
- * XXX: This isn't the "right" way
- *
- * #define log_debug(fmt, ...)	fprintf(stderr, "EMERGENCY: %s: " fmt "\n", \
- *                                              __FUNCTION__, ## __VA_ARGS__)
+ * The log macros check the level before their arguments are evaluated,
+ * so a disabled message costs a load and a compare. Messages below
+ * HLOG_MIN_LEVEL are not compiled at all: build with, for instance,
+ * -DHLOG_MIN_LEVEL=2 to keep only the info, warning and error messages.
+ * The value is the number of the level in log_level_t (0 for verbose).
  *
+ * Dumps made of several messages are guarded by the caller with
+ * hlog_enabled(), to skip the whole walk.
  */
-#define log_verbose1(a1) hlog_verbose(__FUNCTION__, a1)
-#define log_verbose2(a1,a2) hlog_verbose(__FUNCTION__, a1,a2)
-#define log_verbose3(a1,a2,a3) hlog_verbose(__FUNCTION__, a1,a2,a3)
-#define log_verbose4(a1,a2,a3,a4) hlog_verbose(__FUNCTION__, a1,a2,a3,a4)
-#define log_verbose5(a1,a2,a3,a4,a5) hlog_verbose(__FUNCTION__, a1,a2,a3,a4,a5)
-
-#define log_debug1(a1) hlog_debug(__FUNCTION__, a1)
-#define log_debug2(a1,a2) hlog_debug(__FUNCTION__, a1,a2)
-#define log_debug3(a1,a2,a3) hlog_debug(__FUNCTION__, a1,a2,a3)
-#define log_debug4(a1,a2,a3,a4) hlog_debug(__FUNCTION__, a1,a2,a3,a4)
-#define log_debug5(a1,a2,a3,a4,a5) hlog_debug(__FUNCTION__, a1,a2,a3,a4,a5)
-
-#define log_info1(a1) hlog_info(__FUNCTION__, a1)
-#define log_info2(a1,a2) hlog_info(__FUNCTION__, a1,a2)
-#define log_info3(a1,a2,a3) hlog_info(__FUNCTION__, a1,a2,a3)
-#define log_info4(a1,a2,a3,a4) hlog_info(__FUNCTION__, a1,a2,a3,a4)
-#define log_info5(a1,a2,a3,a4,a5) hlog_info(__FUNCTION__, a1,a2,a3,a4,a5)
-
-#define log_warn1(a1) hlog_warn(__FUNCTION__, a1)
-#define log_warn2(a1,a2) hlog_warn(__FUNCTION__, a1,a2)
-#define log_warn3(a1,a2,a3) hlog_warn(__FUNCTION__, a1,a2,a3)
-#define log_warn4(a1,a2,a3,a4) hlog_warn(__FUNCTION__, a1,a2,a3,a4)
-#define log_warn5(a1,a2,a3,a4,a5) hlog_warn(__FUNCTION__, a1,a2,a3,a4,a5)
-
-#define log_error1(a1) hlog_error(__FUNCTION__, a1)
-#define log_error2(a1,a2) hlog_error(__FUNCTION__, a1,a2)
-#define log_error3(a1,a2,a3) hlog_error(__FUNCTION__, a1,a2,a3)
-#define log_error4(a1,a2,a3,a4) hlog_error(__FUNCTION__, a1,a2,a3,a4)
-#define log_error5(a1,a2,a3,a4,a5) hlog_error(__FUNCTION__, a1,a2,a3,a4,a5)
+#ifndef HLOG_MIN_LEVEL
+#define HLOG_MIN_LEVEL 0
+#endif
+
+#define hlog_enabled(level) ((level) >= HLOG_MIN_LEVEL && (level) >= hlog_level)
+
+#if HLOG_MIN_LEVEL <= 0
+#define log_verbose1(a1) do { if (hlog_enabled(HLOG_VERBOSE)) hlog_verbose(__FUNCTION__, a1); } while (0)
+#define log_verbose2(a1,a2) do { if (hlog_enabled(HLOG_VERBOSE)) hlog_verbose(__FUNCTION__, a1,a2); } while (0)
+#define log_verbose3(a1,a2,a3) do { if (hlog_enabled(HLOG_VERBOSE)) hlog_verbose(__FUNCTION__, a1,a2,a3); } while (0)
+#define log_verbose4(a1,a2,a3,a4) do { if (hlog_enabled(HLOG_VERBOSE)) hlog_verbose(__FUNCTION__, a1,a2,a3,a4); } while (0)
+#define log_verbose5(a1,a2,a3,a4,a5) do { if (hlog_enabled(HLOG_VERBOSE)) hlog_verbose(__FUNCTION__, a1,a2,a3,a4,a5); } while (0)
+#else
+#define log_verbose1(a1) do { } while (0)
+#define log_verbose2(a1,a2) do { } while (0)
+#define log_verbose3(a1,a2,a3) do { } while (0)
+#define log_verbose4(a1,a2,a3,a4) do { } while (0)
+#define log_verbose5(a1,a2,a3,a4,a5) do { } while (0)
+#endif
+
+#if HLOG_MIN_LEVEL <= 1
+#define log_debug1(a1) do { if (hlog_enabled(HLOG_DEBUG)) hlog_debug(__FUNCTION__, a1); } while (0)
+#define log_debug2(a1,a2) do { if (hlog_enabled(HLOG_DEBUG)) hlog_debug(__FUNCTION__, a1,a2); } while (0)
+#define log_debug3(a1,a2,a3) do { if (hlog_enabled(HLOG_DEBUG)) hlog_debug(__FUNCTION__, a1,a2,a3); } while (0)
+#define log_debug4(a1,a2,a3,a4) do { if (hlog_enabled(HLOG_DEBUG)) hlog_debug(__FUNCTION__, a1,a2,a3,a4); } while (0)
+#define log_debug5(a1,a2,a3,a4,a5) do { if (hlog_enabled(HLOG_DEBUG)) hlog_debug(__FUNCTION__, a1,a2,a3,a4,a5); } while (0)
+#else
+#define log_debug1(a1) do { } while (0)
+#define log_debug2(a1,a2) do { } while (0)
+#define log_debug3(a1,a2,a3) do { } while (0)
+#define log_debug4(a1,a2,a3,a4) do { } while (0)
+#define log_debug5(a1,a2,a3,a4,a5) do { } while (0)
+#endif
+
+#if HLOG_MIN_LEVEL <= 2
+#define log_info1(a1) do { if (hlog_enabled(HLOG_INFO)) hlog_info(__FUNCTION__, a1); } while (0)
+#define log_info2(a1,a2) do { if (hlog_enabled(HLOG_INFO)) hlog_info(__FUNCTION__, a1,a2); } while (0)
+#define log_info3(a1,a2,a3) do { if (hlog_enabled(HLOG_INFO)) hlog_info(__FUNCTION__, a1,a2,a3); } while (0)
+#define log_info4(a1,a2,a3,a4) do { if (hlog_enabled(HLOG_INFO)) hlog_info(__FUNCTION__, a1,a2,a3,a4); } while (0)
+#define log_info5(a1,a2,a3,a4,a5) do { if (hlog_enabled(HLOG_INFO)) hlog_info(__FUNCTION__, a1,a2,a3,a4,a5); } while (0)
+#else
+#define log_info1(a1) do { } while (0)
+#define log_info2(a1,a2) do { } while (0)
+#define log_info3(a1,a2,a3) do { } while (0)
+#define log_info4(a1,a2,a3,a4) do { } while (0)
+#define log_info5(a1,a2,a3,a4,a5) do { } while (0)
+#endif
+
+#if HLOG_MIN_LEVEL <= 3
+#define log_warn1(a1) do { if (hlog_enabled(HLOG_WARN)) hlog_warn(__FUNCTION__, a1); } while (0)
+#define log_warn2(a1,a2) do { if (hlog_enabled(HLOG_WARN)) hlog_warn(__FUNCTION__, a1,a2); } while (0)
+#define log_warn3(a1,a2,a3) do { if (hlog_enabled(HLOG_WARN)) hlog_warn(__FUNCTION__, a1,a2,a3); } while (0)
+#define log_warn4(a1,a2,a3,a4) do { if (hlog_enabled(HLOG_WARN)) hlog_warn(__FUNCTION__, a1,a2,a3,a4); } while (0)
+#define log_warn5(a1,a2,a3,a4,a5) do { if (hlog_enabled(HLOG_WARN)) hlog_warn(__FUNCTION__, a1,a2,a3,a4,a5); } while (0)
+#else
+#define log_warn1(a1) do { } while (0)
+#define log_warn2(a1,a2) do { } while (0)
+#define log_warn3(a1,a2,a3) do { } while (0)
+#define log_warn4(a1,a2,a3,a4) do { } while (0)
+#define log_warn5(a1,a2,a3,a4,a5) do { } while (0)
+#endif
+
+#if HLOG_MIN_LEVEL <= 4
+#define log_error1(a1) do { if (hlog_enabled(HLOG_ERROR)) hlog_error(__FUNCTION__, a1); } while (0)
+#define log_error2(a1,a2) do { if (hlog_enabled(HLOG_ERROR)) hlog_error(__FUNCTION__, a1,a2); } while (0)
+#define log_error3(a1,a2,a3) do { if (hlog_enabled(HLOG_ERROR)) hlog_error(__FUNCTION__, a1,a2,a3); } while (0)
+#define log_error4(a1,a2,a3,a4) do { if (hlog_enabled(HLOG_ERROR)) hlog_error(__FUNCTION__, a1,a2,a3,a4); } while (0)
+#define log_error5(a1,a2,a3,a4,a5) do { if (hlog_enabled(HLOG_ERROR)) hlog_error(__FUNCTION__, a1,a2,a3,a4,a5); } while (0)
+#else
+#define log_error1(a1) do { } while (0)
+#define log_error2(a1,a2) do { } while (0)
+#define log_error3(a1,a2,a3) do { } while (0)
+#define log_error4(a1,a2,a3,a4) do { } while (0)
+#define log_error5(a1,a2,a3,a4,a5) do { } while (0)
+#endif
 
 #ifdef __cplusplus
 }
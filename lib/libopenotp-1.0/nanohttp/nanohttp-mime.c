@@ -738,7 +738,8 @@ _mime_received_bytes(void *data, const unsigned char *bytes, int size)
           cbdata->header[cbdata->header_index++] = '\0';
           cbdata->header_search = 4;
           cbdata->current_part->header = _mime_process_header(cbdata->header);
-          hpairnode_dump_deep(cbdata->current_part->header);
+          if (hlog_enabled(HLOG_VERBOSE))
+            hpairnode_dump_deep(cbdata->current_part->header);
           /* set id */
           id = hpairnode_get(cbdata->current_part->header, HEADER_CONTENT_ID);
           if (id != NULL)
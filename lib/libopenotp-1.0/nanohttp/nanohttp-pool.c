@@ -0,0 +1,300 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "nanohttp-pool.h"
+#include "nanohttp-thread.h"
+
+/* keeps the payload aligned like malloc does. The size is padded to
+   16 bytes: on 32 bit x86 a double or a long long is only 4 byte
+   aligned in a structure, while malloc returns 16 byte aligned blocks. */
+typedef union _hpool_header
+{
+  struct
+  {
+    int size_class;             /* -1 for blocks too large for the pool */
+    void *next;                 /* free list link */
+  } info;
+  double align_double;
+  long long align_long_long;
+  void *align_pointer;
+  char align_size[16];
+} hpool_header_t;
+
+typedef struct _hpool_cache
+{
+  hpool_header_t *free[HPOOL_CLASSES];
+  int count[HPOOL_CLASSES];
+  struct _hpool_cache *next;    /* list of all the caches */
+} hpool_cache_t;
+
+/* the lock protects the creation and the deletion of the key and
+   the list of the caches of the threads */
+static hmutex_t _hpool_lock = HMUTEX_INITIALIZER;
+static hpool_cache_t *_hpool_caches = NULL;
+#ifdef WIN32
+static DWORD _hpool_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t _hpool_key;
+static volatile int _hpool_key_ok = 0;
+#endif
+
+/*--------------------------------------------------
+FUNCTION: _hpool_cache_free
+DESC: Gives the blocks of a cache back to malloc.
+----------------------------------------------------*/
+static void
+_hpool_cache_free(hpool_cache_t * cache)
+{
+  hpool_header_t *block;
+  int i;
+
+  for (i = 0; i < HPOOL_CLASSES; i++)
+  {
+    while ((block = cache->free[i]) != NULL)
+    {
+      cache->free[i] = (hpool_header_t *) block->info.next;
+      free(block);
+    }
+  }
+  free(cache);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hpool_cache_release
+DESC: Gives the blocks of an exiting thread back to
+malloc.
+----------------------------------------------------*/
+#ifdef WIN32
+static VOID WINAPI
+#else
+static void
+#endif
+_hpool_cache_release(void *data)
+{
+  hpool_cache_t *cache = (hpool_cache_t *) data, **ptr;
+  int found = 0;
+
+  if (cache == NULL)
+    return;
+
+  /* not in the list once hpool_destroy has drained it */
+  hmutex_lock(&_hpool_lock);
+  for (ptr = &_hpool_caches; *ptr != NULL; ptr = &(*ptr)->next)
+  {
+    if (*ptr == cache)
+    {
+      *ptr = cache->next;
+      found = 1;
+      break;
+    }
+  }
+  hmutex_unlock(&_hpool_lock);
+
+  if (found)
+    _hpool_cache_free(cache);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hpool_cache
+DESC: Returns the free lists of the calling thread,
+or NULL if they cannot be created.
+----------------------------------------------------*/
+static hpool_cache_t *
+_hpool_cache(void)
+{
+  hpool_cache_t *cache;
+
+#ifdef WIN32
+  if (_hpool_key == FLS_OUT_OF_INDEXES)
+  {
+    hmutex_lock(&_hpool_lock);
+    if (_hpool_key == FLS_OUT_OF_INDEXES)
+      _hpool_key = FlsAlloc(_hpool_cache_release);
+    hmutex_unlock(&_hpool_lock);
+    if (_hpool_key == FLS_OUT_OF_INDEXES)
+      return NULL;
+  }
+  if ((cache = (hpool_cache_t *) FlsGetValue(_hpool_key)) != NULL)
+    return cache;
+#else
+  if (!_hpool_key_ok)
+  {
+    hmutex_lock(&_hpool_lock);
+    if (!_hpool_key_ok)
+      _hpool_key_ok = pthread_key_create(&_hpool_key, _hpool_cache_release) == 0;
+    hmutex_unlock(&_hpool_lock);
+    if (!_hpool_key_ok)
+      return NULL;
+  }
+  if ((cache = (hpool_cache_t *) pthread_getspecific(_hpool_key)) != NULL)
+    return cache;
+#endif
+
+  if (!(cache = (hpool_cache_t *) calloc(1, sizeof(hpool_cache_t))))
+    return NULL;
+
+#ifdef WIN32
+  if (!FlsSetValue(_hpool_key, cache))
+#else
+  if (pthread_setspecific(_hpool_key, cache) != 0)
+#endif
+  {
+    free(cache);
+    return NULL;
+  }
+
+  hmutex_lock(&_hpool_lock);
+  cache->next = _hpool_caches;
+  _hpool_caches = cache;
+  hmutex_unlock(&_hpool_lock);
+
+  return cache;
+}
+
+static int
+_hpool_class(size_t size)
+{
+  int c;
+
+  for (c = 0; c < HPOOL_CLASSES; c++)
+  {
+    if (size <= ((size_t) HPOOL_MIN_SIZE << c))
+      return c;
+  }
+  return -1;
+}
+
+/*--------------------------------------------------
+FUNCTION: hpool_alloc
+----------------------------------------------------*/
+void *
+hpool_alloc(size_t size)
+{
+  hpool_header_t *block;
+  hpool_cache_t *cache;
+  int c = _hpool_class(size);
+
+  if (c >= 0 && (cache = _hpool_cache()) != NULL && cache->free[c] != NULL)
+  {
+    block = cache->free[c];
+    cache->free[c] = (hpool_header_t *) block->info.next;
+    cache->count[c]--;
+    return block + 1;
+  }
+
+  if (c >= 0)
+    size = (size_t) HPOOL_MIN_SIZE << c;
+  if (!(block = (hpool_header_t *) malloc(sizeof(hpool_header_t) + size)))
+    return NULL;
+  block->info.size_class = c;
+
+  return block + 1;
+}
+
+/*--------------------------------------------------
+FUNCTION: hpool_free
+----------------------------------------------------*/
+void
+hpool_free(void *ptr)
+{
+  hpool_header_t *block;
+  hpool_cache_t *cache;
+  int c;
+
+  if (ptr == NULL)
+    return;
+
+  block = (hpool_header_t *) ptr - 1;
+  c = block->info.size_class;
+  if (c >= 0 && (cache = _hpool_cache()) != NULL
+      && cache->count[c] < HPOOL_CACHE_MAX)
+  {
+    block->info.next = cache->free[c];
+    cache->free[c] = block;
+    cache->count[c]++;
+    return;
+  }
+
+  free(block);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: hpool_destroy
+DESC: Gives the free lists of all the threads back
+to malloc and releases the key of the thread caches.
+----------------------------------------------------*/
+void
+hpool_destroy(void)
+{
+  hpool_cache_t *cache;
+#ifdef WIN32
+  DWORD key;
+#else
+  pthread_key_t key;
+  int key_ok;
+#endif
+
+  hmutex_lock(&_hpool_lock);
+#ifdef WIN32
+  key = _hpool_key;
+  _hpool_key = FLS_OUT_OF_INDEXES;
+#else
+  key = _hpool_key;
+  key_ok = _hpool_key_ok;
+  _hpool_key_ok = 0;
+#endif
+  hmutex_unlock(&_hpool_lock);
+
+  /* FlsFree runs the callback for the values of the fibers, which
+     takes the lock */
+#ifdef WIN32
+  if (key != FLS_OUT_OF_INDEXES)
+    FlsFree(key);
+#else
+  if (key_ok)
+    pthread_key_delete(key);
+#endif
+
+  hmutex_lock(&_hpool_lock);
+  cache = _hpool_caches;
+  _hpool_caches = NULL;
+  hmutex_unlock(&_hpool_lock);
+
+  while (cache != NULL)
+  {
+    hpool_cache_t *next = cache->next;
+    _hpool_cache_free(cache);
+    cache = next;
+  }
+
+  return;
+}
@@ -0,0 +1,71 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifndef NANO_HTTP_POOL_H
+#define NANO_HTTP_POOL_H
+
+#include <stddef.h>
+
+/*
+  Allocator for the small fixed size objects of each HTTP exchange
+  (connections, responses, streams, header pairs, errors). Blocks
+  are rounded up to a power of two size class and kept on free
+  lists private to the thread which released them, so a thread
+  doing requests in a loop stops calling malloc once its lists are
+  filled. Each list holds HPOOL_CACHE_MAX blocks at most and is
+  given back to malloc when the thread exits or by hpool_destroy.
+  Larger blocks go to malloc directly.
+
+  Blocks from hpool_alloc must be released with hpool_free, from
+  any thread.
+*/
+
+#define HPOOL_MIN_SIZE		64
+#define HPOOL_CLASSES		6	/* 64 to 2048 bytes */
+#define HPOOL_CACHE_MAX		32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Allocates size bytes, aligned like malloc.
+
+  @returns the block or NULL if memory is exhausted.
+*/
+void *hpool_alloc(size_t size);
+
+/**
+  Releases a block of hpool_alloc. NULL is ignored.
+*/
+void hpool_free(void *ptr);
+
+/**
+  Gives the free lists of all the threads back to malloc and
+  releases the thread key, once no other thread uses the pool.
+  Blocks still allocated can be released with hpool_free after it.
+*/
+void hpool_destroy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -67,21 +67,78 @@ hrequest_new(void)
   return req;
 }
 
+/*
+  parse and save path+query parse:
+  /path/of/target?key1=value1&key2=value2...
+*/
+static int
+_hrequest_parse_path(hrequest_t * req, char *data)
+{
+  hpair_t *qpair = NULL, *tmppair;
+  char *tmp2;
+  char *saveptr2;
+  char *saveptr3;
+  char *key;
+  char *opt_key;
+  char *opt_value;
+
+  tmp2 = data;
+  key = (char *) strtok_r(tmp2, "?", &saveptr2);
+  tmp2 = saveptr2;
+
+  /* save path */
+  /* req->path = (char *) malloc(strlen(key) + 1); */
+  if (key != NULL)
+    strncpy(req->path, key, REQUEST_MAX_PATH_SIZE);
+
+  /* parse options */
+  for (;;)
+  {
+    key = (char *) strtok_r(tmp2, "&", &saveptr2);
+    tmp2 = saveptr2;
+
+    if (key == NULL)
+      break;
+
+    opt_key = (char *) strtok_r(key, "=", &saveptr3);
+    opt_value = saveptr3;
+
+    if (opt_value == NULL)
+      opt_value = "";
+
+    /* create option pair */
+    if (opt_key != NULL)
+    {
+      if (!(tmppair = hpairnode_new(opt_key, opt_value, NULL)))
+        return -1;
+
+      if (req->query == NULL)
+      {
+        req->query = qpair = tmppair;
+      }
+      else
+      {
+        qpair->next = tmppair;
+        qpair = tmppair;
+      }
+    }
+  }
+
+  return 0;
+}
+
 static hrequest_t *
 _hrequest_parse_header(char *data)
 {
   hrequest_t *req;
-  hpair_t *hpair = NULL, *qpair = NULL, *tmppair = NULL;
+  hpair_t *hpair = NULL, *tmppair = NULL;
 
   char *tmp;
   char *tmp2;
   char *saveptr;
   char *saveptr2;
-  char *saveptr3;
   char *result;
   char *key;
-  char *opt_key;
-  char *opt_value;
   int firstline = 1;
 
   req = hrequest_new();
@@ -145,58 +202,8 @@ _hrequest_parse_header(char *data)
        * /path/of/target?key1=value1&key2=value2...
        */
 
-      if (key != NULL)
-      {
-        tmp2 = key;
-        key = (char *) strtok_r(tmp2, "?", &saveptr2);
-        tmp2 = saveptr2;
-
-        /* save path */
-        /* req->path = (char *) malloc(strlen(key) + 1); */
-        strncpy(req->path, key, REQUEST_MAX_PATH_SIZE);
-
-        /* parse options */
-        for (;;)
-        {
-          key = (char *) strtok_r(tmp2, "&", &saveptr2);
-          tmp2 = saveptr2;
-
-          if (key == NULL)
-            break;
-
-          opt_key = (char *) strtok_r(key, "=", &saveptr3);
-          opt_value = saveptr3;
-
-          if (opt_value == NULL)
-            opt_value = "";
-
-          /* create option pair */
-          if (opt_key != NULL)
-          {
-            if (!(tmppair = (hpair_t *) malloc(sizeof(hpair_t))))
-            {
-              log_error2("malloc failed (%s)", strerror(errno));
-              return NULL;
-            }
-
-            if (req->query == NULL)
-            {
-              req->query = qpair = tmppair;
-            }
-            else
-            {
-              qpair->next = tmppair;
-              qpair = tmppair;
-            }
-
-            /* fill hpairnode_t struct */
-            qpair->next = NULL;
-            qpair->key = strdup(opt_key);
-            qpair->value = strdup(opt_value);
-
-          }
-        }
-      }
+      if (key != NULL && _hrequest_parse_path(req, key) < 0)
+        return NULL;
     }
     else
     {
@@ -237,6 +244,34 @@ _hrequest_parse_header(char *data)
 }
 
 
+/* Check for MIME message */
+static herror_t
+_hrequest_get_attachments(hrequest_t * req)
+{
+  attachments_t *mimeMessage;
+  herror_t status;
+
+  if ((req->content_type &&
+       !strcmp(req->content_type->type, "multipart/related")))
+  {
+    status = mime_get_attachments(req->content_type, req->in, &mimeMessage);
+    if (status != H_OK)
+    {
+      /* TODO (#1#): Handle error */
+      return status;
+    }
+    else
+    {
+      req->attachments = mimeMessage;
+      req->in =
+        http_input_stream_new_from_file(mimeMessage->root_part->filename);
+    }
+  }
+
+  return H_OK;
+}
+
+
 void
 hrequest_free(hrequest_t * req)
 {
@@ -268,7 +303,6 @@ hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out)
   herror_t status;
   hrequest_t *req;
   char buffer[MAX_HEADER_SIZE + 1];
-  attachments_t *mimeMessage;
 
   memset(buffer, 0, MAX_HEADER_SIZE);
   /* Read header */
@@ -298,23 +332,59 @@ hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out)
   /* Create input stream */
   req->in = http_input_stream_new(sock, req->header);
 
-  /* Check for MIME message */
-  if ((req->content_type &&
-       !strcmp(req->content_type->type, "multipart/related")))
+  if ((status = _hrequest_get_attachments(req)) != H_OK)
   {
-    status = mime_get_attachments(req->content_type, req->in, &mimeMessage);
-    if (status != H_OK)
-    {
-      /* TODO (#1#): Handle error */
-      hrequest_free(req);
-      return status;
-    }
-    else
-    {
-      req->attachments = mimeMessage;
-      req->in =
-        http_input_stream_new_from_file(mimeMessage->root_part->filename);
-    }
+    hrequest_free(req);
+    return status;
+  }
+
+  *out = req;
+  return H_OK;
+}
+
+
+herror_t
+hrequest_new_from_stream(hreq_method_t method, const char *path,
+                         hpair_t * header, http_input_stream_t * in,
+                         hrequest_t ** out)
+{
+  herror_t status;
+  hrequest_t *req;
+  char buffer[REQUEST_MAX_PATH_SIZE];
+  char *content_type;
+
+  if (!(req = hrequest_new()))
+  {
+    hpairnode_free_deep(header);
+    if (in)
+      http_input_stream_free(in);
+    return herror_new("hrequest_new_from_stream", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  }
+
+  req->method = method;
+  req->version = HTTP_2;
+  req->header = header;
+  req->in = in;
+  req->path[0] = '\0';
+
+  strncpy(buffer, path, REQUEST_MAX_PATH_SIZE - 1);
+  buffer[REQUEST_MAX_PATH_SIZE - 1] = '\0';
+  if (_hrequest_parse_path(req, buffer) < 0)
+  {
+    hrequest_free(req);
+    return herror_new("hrequest_new_from_stream", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  }
+
+  content_type = hpairnode_get_ignore_case(req->header, HEADER_CONTENT_TYPE);
+  if (content_type != NULL)
+    req->content_type = content_type_new(content_type);
+
+  if ((status = _hrequest_get_attachments(req)) != H_OK)
+  {
+    hrequest_free(req);
+    return status;
   }
 
   *out = req;
@@ -50,6 +50,15 @@ extern "C" {
 #endif
 
 herror_t hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out);
+
+/**
+  Creates a request from what an HTTP/2 stream received.
+  'path' may carry a query string. The request owns 'header'
+  and 'in' afterwards, also when it could not be created.
+*/
+herror_t hrequest_new_from_stream(hreq_method_t method, const char *path,
+                                  hpair_t * header, http_input_stream_t * in,
+                                  hrequest_t ** out);
 void hrequest_free(hrequest_t * req);
 
 #ifdef __cplusplus
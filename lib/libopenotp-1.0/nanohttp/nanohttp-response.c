@@ -44,6 +44,7 @@
 #include "nanohttp-logging.h"
 #include "nanohttp-common.h"
 #include "nanohttp-response.h"
+#include "nanohttp-pool.h"
 
 static hresponse_t *
 hresponse_new()
@@ -51,7 +52,7 @@ hresponse_new()
   hresponse_t *res;
 
   /* create response object */
-  if (!(res = (hresponse_t *) malloc(sizeof(hresponse_t)))) {
+  if (!(res = (hresponse_t *) hpool_alloc(sizeof(hresponse_t)))) {
 
 	  log_error2("malloc failed (%s)", strerror(errno));
 	  return NULL;
@@ -117,27 +118,12 @@ _hresponse_parse_header(const char *buffer)
 
   /* *** parse header *** */
   /* [key]: [value] */
-  for (;;)
-  {
-    str = strtok_r(s1, "\n", &s2);
-    s1 = s2;
-
-    /* check if header ends without body */
-    if (str == NULL)
-    {
-      return res;
-    }
-    /* check also for end of header */
-    if (!strcmp(str, "\r"))
-    {
-      break;
-    }
-    str[strlen(str) - 1] = '\0';
-    res->header = hpairnode_parse(str, ":", res->header);
-  }
+  if (*s1 == '\n')
+    s1++;
+  res->header = hpairnode_parse_headers(s1);
 
   /* Check Content-type */
-  str = hpairnode_get(res->header, HEADER_CONTENT_TYPE);
+  str = hpairnode_get_ignore_case(res->header, HEADER_CONTENT_TYPE);
   if (str != NULL)
     res->content_type = content_type_new(str);
 
@@ -146,13 +132,50 @@ _hresponse_parse_header(const char *buffer)
 }
 
 
+/* Check for MIME message */
+static herror_t
+_hresponse_get_attachments(hresponse_t * res)
+{
+  attachments_t *mimeMessage;
+  herror_t status;
+
+  if ((res->content_type &&
+       !strcmp(res->content_type->type, "multipart/related")))
+  {
+    status = mime_get_attachments(res->content_type, res->in, &mimeMessage);
+    if (status != H_OK)
+    {
+      /* TODO (#1#): Handle error */
+      return status;
+    }
+    else
+    {
+      res->attachments = mimeMessage;
+      http_input_stream_free(res->in);
+      res->in =
+        http_input_stream_new_from_file(mimeMessage->root_part->filename);
+      if (!res->in)
+      {
+        /* TODO (#1#): Handle error */
+
+      }
+      else
+      {
+        /* res->in->deleteOnExit = 1; */
+      }
+    }
+  }
+
+  return H_OK;
+}
+
+
 herror_t
 hresponse_new_from_socket(hsocket_t *sock, hresponse_t ** out)
 {
-  int i = 0, count;
+  int i = 0, count, received = 0;
   herror_t status;
   hresponse_t *res;
-  attachments_t *mimeMessage;
   char buffer[MAX_HEADER_SIZE + 1];
 
 read_header:                   /* for errorcode: 100 (continue) */
@@ -161,9 +184,18 @@ read_header:                   /* for errorcode: 100 (continue) */
   {
     if ((status = hsocket_read(sock, &(buffer[i]), 1, 1, &count)) != H_OK)
     {
-      log_error1("Socket read error");
+      if (herror_code(status) != HSOCKET_ERROR_CANCELLED)
+        log_error1("Socket read error");
+      /* HSOCKET_ERROR_CLOSED only when no response byte came */
+      if (received && herror_code(status) == HSOCKET_ERROR_CLOSED)
+      {
+        herror_release(status);
+        return herror_new("hresponse_new_from_socket", HSOCKET_ERROR_RECEIVE,
+                          "Connection closed in the response header");
+      }
       return status;
     }
+    received = 1;
 
     buffer[i + 1] = '\0';       /* for strmp */
 
@@ -197,34 +229,46 @@ read_header:                   /* for errorcode: 100 (continue) */
   /* Create input stream */
   res->in = http_input_stream_new(sock, res->header);
 
+  if ((status = _hresponse_get_attachments(res)) != H_OK)
+  {
+    hresponse_free(res);
+    return status;
+  }
+  *out = res;
+  return H_OK;
+}
 
-  /* Check for MIME message */
-  if ((res->content_type &&
-       !strcmp(res->content_type->type, "multipart/related")))
+
+herror_t
+hresponse_new_from_stream(int code, hpair_t * header,
+                          http_input_stream_t * in, hresponse_t ** out)
+{
+  herror_t status;
+  hresponse_t *res;
+  char *str;
+
+  if (!(res = hresponse_new()))
   {
-    status = mime_get_attachments(res->content_type, res->in, &mimeMessage);
-    if (status != H_OK)
-    {
-      /* TODO (#1#): Handle error */
-      hresponse_free(res);
-      return status;
-    }
-    else
-    {
-      res->attachments = mimeMessage;
-      http_input_stream_free(res->in);
-      res->in =
-        http_input_stream_new_from_file(mimeMessage->root_part->filename);
-      if (!res->in)
-      {
-        /* TODO (#1#): Handle error */
+    hpairnode_free_deep(header);
+    if (in)
+      http_input_stream_free(in);
+    return herror_new("hresponse_new_from_stream", GENERAL_INVALID_PARAM,
+                      "Memory allocation failed");
+  }
 
-      }
-      else
-      {
-        /* res->in->deleteOnExit = 1; */
-      }
-    }
+  res->version = HTTP_2;
+  res->errcode = code;
+  res->header = header;
+  res->in = in;
+
+  str = hpairnode_get_ignore_case(res->header, HEADER_CONTENT_TYPE);
+  if (str != NULL)
+    res->content_type = content_type_new(str);
+
+  if ((status = _hresponse_get_attachments(res)) != H_OK)
+  {
+    hresponse_free(res);
+    return status;
   }
   *out = res;
   return H_OK;
@@ -249,5 +293,5 @@ hresponse_free(hresponse_t * res)
 
   if (res->attachments)
     attachments_free(res->attachments);
-  free(res);
+  hpool_free(res);
 }
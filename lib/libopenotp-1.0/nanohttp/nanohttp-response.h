@@ -48,6 +48,15 @@ extern "C" {
 #endif
 
 herror_t hresponse_new_from_socket(hsocket_t *sock, hresponse_t ** out);
+
+/**
+  Creates a response from what an HTTP/2 stream received. The
+  response owns 'header' and 'in' afterwards, also when it
+  could not be created.
+*/
+herror_t hresponse_new_from_stream(int code, hpair_t * header,
+                                   http_input_stream_t * in,
+                                   hresponse_t ** out);
 void hresponse_free(hresponse_t * res);
 
 #ifdef __cplusplus
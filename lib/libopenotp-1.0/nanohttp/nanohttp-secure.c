@@ -0,0 +1,273 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "nanohttp-secure.h"
+#include "nanohttp-thread.h"
+#include "nanohttp-logging.h"
+
+/*
+  Header at the start of each chunk of pages; the first chunk is
+  the arena itself. Keeps the blocks aligned like malloc does.
+*/
+struct hsecure
+{
+  struct hsecure *next;         /* next chunk, or next kept arena */
+  size_t size;                  /* bytes mapped, header included */
+  size_t used;                  /* bytes handed out, header included */
+  int locked;
+  int reserved;
+};
+
+#define HSECURE_ALIGN		16
+#define HSECURE_HEADER		((sizeof(hsecure_t) + HSECURE_ALIGN - 1) & ~(size_t) (HSECURE_ALIGN - 1))
+
+static hsecure_t *_hsecure_kept = NULL;
+static int _hsecure_kept_count = 0;
+static int _hsecure_lock_failed = 0;
+static hmutex_t _hsecure_lock = HMUTEX_INITIALIZER;
+
+/*--------------------------------------------------
+FUNCTION: _hsecure_map
+DESC: Maps a chunk of at least 'size' bytes, header
+included, locks it and keeps it out of core dumps.
+----------------------------------------------------*/
+static hsecure_t *
+_hsecure_map(size_t size)
+{
+  hsecure_t *chunk;
+  size_t page;
+
+#ifdef WIN32
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  page = info.dwPageSize;
+#else
+  page = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+  if (size < HSECURE_CHUNK_SIZE)
+    size = HSECURE_CHUNK_SIZE;
+  size = (size + page - 1) / page * page;
+
+#ifdef WIN32
+  if (!(chunk = (hsecure_t *) VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+                                           PAGE_READWRITE)))
+    return NULL;
+  chunk->locked = VirtualLock(chunk, size) != 0;
+#else
+  if ((chunk = (hsecure_t *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                                  0)) == MAP_FAILED)
+    return NULL;
+#ifdef MADV_DONTDUMP
+  madvise(chunk, size, MADV_DONTDUMP);
+#endif
+  chunk->locked = mlock(chunk, size) == 0;
+#endif
+
+  if (!chunk->locked && !_hsecure_lock_failed)
+  {
+    _hsecure_lock_failed = 1;
+    log_warn1("Cannot lock the memory of the secrets, it may be swapped");
+  }
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = HSECURE_HEADER;
+  return chunk;
+}
+
+static void
+_hsecure_unmap(hsecure_t * chunk)
+{
+#ifdef WIN32
+  if (chunk->locked)
+    VirtualUnlock(chunk, chunk->size);
+  VirtualFree(chunk, 0, MEM_RELEASE);
+#else
+  size_t size = chunk->size;
+
+  if (chunk->locked)
+    munlock(chunk, size);
+  munmap(chunk, size);
+#endif
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_wipe
+----------------------------------------------------*/
+#if !defined(WIN32) && !(defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25)))
+/* called through a volatile pointer, the call cannot be left out */
+static void *(*volatile _hsecure_memset) (void *, int, size_t) = memset;
+#endif
+
+void
+hsecure_wipe(void *ptr, size_t size)
+{
+  if (ptr == NULL || size == 0)
+    return;
+#if defined(WIN32)
+  SecureZeroMemory(ptr, size);
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+  explicit_bzero(ptr, size);
+#else
+  _hsecure_memset(ptr, 0, size);
+#endif
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_new
+----------------------------------------------------*/
+hsecure_t *
+hsecure_new(void)
+{
+  hsecure_t *secure;
+
+  hmutex_lock(&_hsecure_lock);
+  if ((secure = _hsecure_kept) != NULL)
+  {
+    _hsecure_kept = secure->next;
+    _hsecure_kept_count--;
+  }
+  hmutex_unlock(&_hsecure_lock);
+
+  if (secure == NULL)
+    return _hsecure_map(HSECURE_CHUNK_SIZE);
+
+  secure->next = NULL;
+  return secure;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_alloc
+----------------------------------------------------*/
+void *
+hsecure_alloc(hsecure_t * secure, size_t size)
+{
+  hsecure_t *chunk;
+  void *ptr;
+
+  size = (size + HSECURE_ALIGN - 1) & ~(size_t) (HSECURE_ALIGN - 1);
+
+  /* the newest chunk is second, after the arena itself */
+  chunk = secure->next != NULL ? secure->next : secure;
+  if (chunk->size - chunk->used < size)
+  {
+    if (secure->size - secure->used >= size)
+      chunk = secure;
+    else
+    {
+      if (!(chunk = _hsecure_map(HSECURE_HEADER + size)))
+        return NULL;
+      chunk->next = secure->next;
+      secure->next = chunk;
+    }
+  }
+
+  ptr = (char *) chunk + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_strdup
+----------------------------------------------------*/
+char *
+hsecure_strdup(hsecure_t * secure, const char *str)
+{
+  size_t len;
+  char *copy;
+
+  if (str == NULL)
+    return NULL;
+
+  len = strlen(str) + 1;
+  if ((copy = (char *) hsecure_alloc(secure, len)) != NULL)
+    memcpy(copy, str, len);
+  return copy;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_free
+----------------------------------------------------*/
+void
+hsecure_free(hsecure_t * secure)
+{
+  hsecure_t *chunk, *next;
+
+  if (secure == NULL)
+    return;
+
+  for (chunk = secure->next; chunk != NULL; chunk = next)
+  {
+    next = chunk->next;
+    hsecure_wipe((char *) chunk + HSECURE_HEADER, chunk->used - HSECURE_HEADER);
+    _hsecure_unmap(chunk);
+  }
+
+  hsecure_wipe((char *) secure + HSECURE_HEADER, secure->used - HSECURE_HEADER);
+  secure->used = HSECURE_HEADER;
+
+  hmutex_lock(&_hsecure_lock);
+  if (_hsecure_kept_count < HSECURE_KEEP)
+  {
+    secure->next = _hsecure_kept;
+    _hsecure_kept = secure;
+    _hsecure_kept_count++;
+    secure = NULL;
+  }
+  hmutex_unlock(&_hsecure_lock);
+
+  if (secure != NULL)
+    _hsecure_unmap(secure);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsecure_destroy
+----------------------------------------------------*/
+void
+hsecure_destroy(void)
+{
+  hsecure_t *secure;
+
+  hmutex_lock(&_hsecure_lock);
+  secure = _hsecure_kept;
+  _hsecure_kept = NULL;
+  _hsecure_kept_count = 0;
+  hmutex_unlock(&_hsecure_lock);
+
+  while (secure != NULL)
+  {
+    hsecure_t *next = secure->next;
+    _hsecure_unmap(secure);
+    secure = next;
+  }
+}
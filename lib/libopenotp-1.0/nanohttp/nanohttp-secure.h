@@ -0,0 +1,90 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifndef NANO_HTTP_SECURE_H
+#define NANO_HTTP_SECURE_H
+
+#include <stddef.h>
+
+/*
+  Arenas for the secrets of one exchange: the passwords of a request
+  and the request once serialized. An arena is made of pages locked
+  in memory, so that they are never written to swap, and left out
+  of core dumps where the system allows it (MADV_DONTDUMP). Blocks
+  are carved out of the pages one after the other and are not freed
+  one by one: releasing the arena wipes all that was used in a
+  single pass.
+
+  Released arenas are kept for the next exchanges, HSECURE_KEEP at
+  most: mapping and locking pages costs far more than the mallocs
+  they replace. If the pages cannot be locked (RLIMIT_MEMLOCK) the
+  arena still works, unlocked, and is still wiped.
+*/
+
+#define HSECURE_CHUNK_SIZE	4096	/* pages of an arena, more are added on demand */
+#define HSECURE_KEEP		8	/* released arenas kept for reuse */
+
+typedef struct hsecure hsecure_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Takes an empty arena.
+
+  @returns the arena or NULL if memory is exhausted.
+*/
+hsecure_t *hsecure_new(void);
+
+/**
+  Allocates 'size' bytes from the arena, aligned like malloc.
+
+  @returns the block or NULL if memory is exhausted.
+*/
+void *hsecure_alloc(hsecure_t * secure, size_t size);
+
+/**
+  Copies a string into the arena. NULL gives NULL.
+*/
+char *hsecure_strdup(hsecure_t * secure, const char *str);
+
+/**
+  Wipes all the blocks of the arena and releases it. NULL is
+  ignored.
+*/
+void hsecure_free(hsecure_t * secure);
+
+/**
+  Overwrites 'size' bytes with zeros, in a way the compiler may not
+  leave out even when the memory is released next.
+*/
+void hsecure_wipe(void *ptr, size_t size);
+
+/**
+  Unmaps the arenas kept for reuse.
+*/
+void hsecure_destroy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -80,6 +80,7 @@
 #include "nanohttp-logging.h"
 #include "nanohttp-server.h"
 #include "nanohttp-ssl.h"
+#include "nanohttp-http2.h"
 
 typedef struct _conndata
 {
@@ -120,6 +121,8 @@ static conndata_t *_httpd_connection;
 static int _httpd_enable_service_list = 0;
 static int _httpd_enable_statistics = 0;
 
+static int _httpd_http2 = 0;
+
 #ifdef WIN32
 static DWORD _httpd_terminate_signal = CTRL_C_EVENT;
 static int _httpd_max_idle = 120;
@@ -157,6 +160,10 @@ _httpd_parse_arguments(int argc, char **argv)
     {
       _httpd_timeout = atoi(argv[i]);
     }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_HTTP2))
+    {
+      _httpd_http2 = atoi(argv[i]);
+    }
   }
 
   log_verbose2("socket bind to port '%d'", _httpd_port);
@@ -418,6 +425,16 @@ httpd_send_header(httpd_conn_t * res, int code, const char *text)
   hpair_t *cur;
   herror_t status;
 
+  /* HTTP/2 stream: the header is sent with the collected body */
+  if (res->sock == NULL)
+  {
+    res->code = code;
+    if (!(res->out = http_output_stream_new_buffer()))
+      return herror_new("httpd_send_header", GENERAL_INVALID_PARAM,
+                        "Memory allocation failed");
+    return H_OK;
+  }
+
   /* set status code */
   sprintf(header, "HTTP/1.1 %d %s\r\n", code, text);
 
@@ -492,7 +509,8 @@ httpd_request_print(hrequest_t * req)
                (req->method == HTTP_REQUEST_POST) ? "POST" : "GET");
   log_verbose2(" Path   : '%s'", req->path);
   log_verbose2(" Spec   : '%s'",
-               (req->version == HTTP_1_0) ? "HTTP/1.0" : "HTTP/1.1");
+               (req->version == HTTP_1_0) ? "HTTP/1.0" :
+               (req->version == HTTP_2) ? "HTTP/2" : "HTTP/1.1");
   log_verbose1(" Parsed query string :");
 
   for (pair = req->query; pair; pair = pair->next)
@@ -523,6 +541,7 @@ httpd_new(hsocket_t * sock)
   conn->out = NULL;
   conn->content_type[0] = '\0';
   conn->header = NULL;
+  conn->code = 0;
 
   return conn;
 }
@@ -638,6 +657,89 @@ _httpd_authenticate_request(hrequest_t * req, httpd_auth auth)
   return ret;
 }
 
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_dispatch
+ * DESC: Gives a request to its service.
+ * Returns 1 if the connection must be closed afterwards.
+ * -----------------------------------------------------
+ */
+static int
+_httpd_dispatch(httpd_conn_t * rconn, hrequest_t * req)
+{
+  hservice_t *service;
+  int done = 0;
+
+  if ((service = httpd_find_service(req->path)))
+  {
+    log_verbose3("service '%s' for '%s' found", service->ctx, req->path);
+
+    if (_httpd_authenticate_request(req, service->auth))
+    {
+      if (service->func != NULL)
+      {
+        service->func(rconn, req);
+        if (rconn->out
+            && rconn->out->type == HTTP_TRANSFER_CONNECTION_CLOSE)
+        {
+          log_verbose1("Connection close requested");
+          done = 1;
+        }
+      }
+      else
+      {
+        char buffer[256];
+
+        sprintf(buffer,
+                "service '%s' not registered properly (func == NULL)",
+                req->path);
+        log_verbose1(buffer);
+        httpd_send_internal_error(rconn, buffer);
+      }
+    }
+    else
+    {
+      char *template =
+        "<html>"
+        "<head>"
+        "<title>Unauthorized</title>"
+        "</head>"
+        "<body>"
+        "<h1>Unauthorized request logged</h1>" "</body>" "</html>";
+
+      httpd_set_header(rconn, HEADER_WWW_AUTHENTICATE,
+                       "Basic realm=\"nanoHTTP\"");
+      httpd_send_header(rconn, 401, "Unauthorized");
+      http_output_stream_write_string(rconn->out, template);
+      done = 1;
+    }
+  }
+  else
+  {
+    char buffer[256];
+    sprintf(buffer, "no service for '%s' found", req->path);
+    log_verbose1(buffer);
+    httpd_send_internal_error(rconn, buffer);
+    done = 1;
+  }
+
+  return done;
+}
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_serve_stream
+ * DESC: Service of the HTTP/2 streams.
+ * -----------------------------------------------------
+ */
+static void
+_httpd_serve_stream(httpd_conn_t * rconn, hrequest_t * req)
+{
+  if (hlog_enabled(HLOG_VERBOSE))
+    httpd_request_print(req);
+  _httpd_dispatch(rconn, req);
+}
+
 /*
  * -----------------------------------------------------
  * FUNCTION: httpd_session_main
@@ -654,7 +756,6 @@ httpd_session_main(void *data)
   hrequest_t *req;              /* only for test */
   conndata_t *conn;
   httpd_conn_t *rconn;
-  hservice_t *service;
   herror_t status;
   int done;
 
@@ -665,6 +766,19 @@ httpd_session_main(void *data)
   rconn = httpd_new(&(conn->sock));
 
   done = 0;
+  if (_httpd_http2 && http2_server_detect(&(conn->sock)))
+  {
+    log_verbose2("HTTP/2 connection on socket %d", conn->sock.sock);
+    conn->atime = time(NULL);
+    if ((status = http2_serve(&(conn->sock), _httpd_serve_stream,
+                              _httpd_timeout)) != H_OK)
+    {
+      log_error2("http2_serve failed (%s)", herror_message(status));
+      herror_release(status);
+    }
+    done = 1;
+  }
+
   while (!done)
   {
     log_verbose3("starting HTTP request on socket %p (%d)", conn->sock, conn->sock.sock);
@@ -679,6 +793,7 @@ httpd_session_main(void *data)
       switch ((code = herror_code(status)))
       {
       case HSOCKET_ERROR_SSLCLOSE:
+      case HSOCKET_ERROR_CLOSED:
       case HSOCKET_ERROR_RECEIVE:
         log_error2("hrequest_new_from_socket failed (%s)",
                    herror_message(status));
@@ -694,7 +809,8 @@ httpd_session_main(void *data)
     {
       char *conn_str;
 
-      httpd_request_print(req);
+      if (hlog_enabled(HLOG_VERBOSE))
+        httpd_request_print(req);
 
       conn_str = hpairnode_get_ignore_case(req->header, HEADER_CONNECTION);
       if (conn_str && strncasecmp(conn_str, "close", 6) == 0)
@@ -703,58 +819,8 @@ httpd_session_main(void *data)
       if (!done)
         done = req->version == HTTP_1_0 ? 1 : 0;
 
-      if ((service = httpd_find_service(req->path)))
-      {
-        log_verbose3("service '%s' for '%s' found", service->ctx, req->path);
-
-        if (_httpd_authenticate_request(req, service->auth))
-        {
-          if (service->func != NULL)
-          {
-            service->func(rconn, req);
-            if (rconn->out
-                && rconn->out->type == HTTP_TRANSFER_CONNECTION_CLOSE)
-            {
-              log_verbose1("Connection close requested");
-              done = 1;
-            }
-          }
-          else
-          {
-            char buffer[256];
-
-            sprintf(buffer,
-                    "service '%s' not registered properly (func == NULL)",
-                    req->path);
-            log_verbose1(buffer);
-            httpd_send_internal_error(rconn, buffer);
-          }
-        }
-        else
-        {
-          char *template =
-            "<html>"
-            "<head>"
-            "<title>Unauthorized</title>"
-            "</head>"
-            "<body>"
-            "<h1>Unauthorized request logged</h1>" "</body>" "</html>";
-
-          httpd_set_header(rconn, HEADER_WWW_AUTHENTICATE,
-                           "Basic realm=\"nanoHTTP\"");
-          httpd_send_header(rconn, 401, "Unauthorized");
-          http_output_stream_write_string(rconn->out, template);
-          done = 1;
-        }
-      }
-      else
-      {
-        char buffer[256];
-        sprintf(buffer, "no service for '%s' found", req->path);
-        log_verbose1(buffer);
-        httpd_send_internal_error(rconn, buffer);
+      if (_httpd_dispatch(rconn, req))
         done = 1;
-      }
       hrequest_free(req);
     }
   }
@@ -795,8 +861,7 @@ httpd_set_header(httpd_conn_t * conn, const char *key, const char *value)
   {
     if (p->key && !strcmp(p->key, key))
     {
-      free(p->value);
-      p->value = strdup(value);
+      hpairnode_set_value(p, value);
       return 1;
     }
   }
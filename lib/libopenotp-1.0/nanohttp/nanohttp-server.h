@@ -38,6 +38,7 @@ typedef struct httpd_conn
   char content_type[25];
   http_output_stream_t *out;
   hpair_t *header;
+  int code;                     /* status sent, for HTTP/2 streams */
 }
 httpd_conn_t;
 
@@ -93,6 +94,14 @@ extern "C"
 
   hservice_t *httpd_services(void);
 
+/**
+  Creates the connection object given to the services. Without
+  socket (HTTP/2 streams) the response is collected in memory by
+  httpd_send_header and the output stream.
+*/
+  httpd_conn_t *httpd_new(hsocket_t * sock);
+  void httpd_free(httpd_conn_t * conn);
+
   herror_t httpd_send_header(httpd_conn_t * res, int code, const char *text);
 
   int httpd_set_header(httpd_conn_t * conn, const char *key,
@@ -41,6 +41,10 @@
 #include <arpa/inet.h>
 #endif
 
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
+
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
@@ -53,6 +57,12 @@
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
@@ -65,9 +75,14 @@
 #include <string.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #ifdef WIN32
 #include "wsockcompat.h"
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <process.h>
 
 #define inline
@@ -89,6 +104,71 @@ typedef int ssize_t;
 #include "nanohttp-socket.h"
 #include "nanohttp-common.h"
 #include "nanohttp-ssl.h"
+#include "nanohttp-cache.h"
+#include "nanohttp-thread.h"
+#include "nanohttp-server.h"
+
+/* timeouts of the calling thread in ms, 0 for the httpd timeout */
+static HTHREAD_LOCAL int _hsocket_connect_timeout = 0;
+static HTHREAD_LOCAL int _hsocket_read_timeout = 0;
+static HTHREAD_LOCAL long _hsocket_connect_time = -1;
+
+/* cancellation token of the calling thread */
+static HTHREAD_LOCAL hcancel_t *_hsocket_cancel = NULL;
+
+/*
+  Source addresses: the local address of the connections to a
+  server, learned from the connected socket and kept until the
+  network changes. The changes are noticed without a thread,
+  each lookup checks for pending notifications: a netlink
+  socket on Linux, an address list change request on WIN32.
+  Elsewhere an address is routed again after
+  HSOCKET_SOURCE_TTL seconds.
+*/
+#define HSOCKET_SOURCES		8
+#define HSOCKET_SOURCE_TTL	60
+
+typedef struct _hsocket_source
+{
+  char host[64];
+  struct in_addr server;
+  struct in_addr local;
+  time_t learned;               /* 0 once the network changed */
+} hsocket_source_t;
+
+static hsocket_source_t _hsocket_sources[HSOCKET_SOURCES];
+static int _hsocket_sources_next = 0;
+static hmutex_t _hsocket_sources_lock = HMUTEX_INITIALIZER;
+
+/* 0 not opened yet, 1 watching, -1 not available */
+static int _hsocket_netwatch_state = 0;
+#ifdef WIN32
+static SOCKET _hsocket_netwatch = INVALID_SOCKET;
+static WSAOVERLAPPED _hsocket_netwatch_ov;
+#else
+static int _hsocket_netwatch = -1;
+#endif
+
+/*
+  A token is a descriptor which becomes readable when it is
+  triggered and stays so, added to the select() sets of the
+  socket waits: an eventfd on Linux, a pipe on the other
+  unices and a UDP socket connected to itself on WIN32,
+  where select() only takes sockets.
+*/
+struct hcancel
+{
+  volatile long triggered;
+#ifdef WIN32
+  SOCKET fd[2];
+#else
+  int fd[2];
+#endif
+  hevent_t *event;
+};
+
+/* protects the events of the tokens */
+static hmutex_t _hcancel_lock = HMUTEX_INITIALIZER;
 
 #ifdef WIN32
 static inline void
@@ -139,6 +219,20 @@ FUNCTION: hsocket_module_destroy
 void
 hsocket_module_destroy(void)
 {
+  hmutex_lock(&_hsocket_sources_lock);
+  if (_hsocket_netwatch_state > 0)
+  {
+#ifdef WIN32
+    closesocket(_hsocket_netwatch);
+    WSACloseEvent(_hsocket_netwatch_ov.hEvent);
+#else
+    close(_hsocket_netwatch);
+#endif
+  }
+  _hsocket_netwatch_state = 0;
+  memset(_hsocket_sources, 0, sizeof(_hsocket_sources));
+  hmutex_unlock(&_hsocket_sources_lock);
+
   _hsocket_module_sys_destroy();
 
   return;
@@ -169,46 +263,641 @@ hsocket_free(hsocket_t * sock)
 }
 
 /*--------------------------------------------------
-FUNCTION: hsocket_open
+FUNCTION: hsocket_set_timeouts
+DESC: Sets the connect and read timeouts of the
+calling thread, until the next call.
 ----------------------------------------------------*/
-herror_t
-hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl)
+void
+hsocket_set_timeouts(int connect_msec, int read_msec)
+{
+  _hsocket_connect_timeout = connect_msec > 0 ? connect_msec : 0;
+  _hsocket_read_timeout = read_msec > 0 ? read_msec : 0;
+  _hsocket_connect_time = -1;
+}
+
+long
+hsocket_get_connect_time(void)
+{
+  return _hsocket_connect_time;
+}
+
+static int
+_hsocket_timeout(int msec)
+{
+  return msec > 0 ? msec : httpd_get_timeout() * 1000;
+}
+
+int
+hsocket_get_read_timeout(void)
+{
+  return _hsocket_timeout(_hsocket_read_timeout);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_set_blocking
+----------------------------------------------------*/
+void
+hsocket_set_blocking(hsocket_t * sock, int blocking)
+{
+#ifdef WIN32
+  u_long mode = blocking ? 0 : 1;
+
+  ioctlsocket(sock->sock, FIONBIO, &mode);
+#else
+  int flags = fcntl(sock->sock, F_GETFL, 0);
+
+  fcntl(sock->sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+/*--------------------------------------------------
+FUNCTION: hcancel_new
+----------------------------------------------------*/
+hcancel_t *
+hcancel_new(void)
+{
+  hcancel_t *cancel;
+#ifdef WIN32
+  struct sockaddr_in addr;
+  int len;
+#endif
+
+  if (!(cancel = (hcancel_t *) calloc(1, sizeof(hcancel_t))))
+    return NULL;
+
+#ifdef WIN32
+  cancel->fd[0] = cancel->fd[1] = socket(AF_INET, SOCK_DGRAM, 0);
+  if (cancel->fd[0] == INVALID_SOCKET)
+  {
+    free(cancel);
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  len = sizeof(addr);
+  if (bind(cancel->fd[0], (struct sockaddr *) &addr, sizeof(addr)) != 0
+      || getsockname(cancel->fd[0], (struct sockaddr *) &addr, &len) != 0
+      || connect(cancel->fd[0], (struct sockaddr *) &addr, sizeof(addr)) != 0)
+  {
+    closesocket(cancel->fd[0]);
+    free(cancel);
+    return NULL;
+  }
+#elif defined(__linux__)
+  if ((cancel->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    free(cancel);
+    return NULL;
+  }
+  cancel->fd[1] = cancel->fd[0];
+#else
+  if (pipe(cancel->fd) != 0)
+  {
+    free(cancel);
+    return NULL;
+  }
+  fcntl(cancel->fd[1], F_SETFL, fcntl(cancel->fd[1], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(cancel->fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(cancel->fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+  return cancel;
+}
+
+/*--------------------------------------------------
+FUNCTION: hcancel_free
+----------------------------------------------------*/
+void
+hcancel_free(hcancel_t * cancel)
+{
+  if (cancel == NULL)
+    return;
+
+#ifdef WIN32
+  closesocket(cancel->fd[0]);
+#else
+  close(cancel->fd[0]);
+  if (cancel->fd[1] != cancel->fd[0])
+    close(cancel->fd[1]);
+#endif
+  free(cancel);
+}
+
+/*--------------------------------------------------
+FUNCTION: hcancel_trigger
+----------------------------------------------------*/
+void
+hcancel_trigger(hcancel_t * cancel)
+{
+#ifdef __linux__
+  uint64_t one = 1;
+#endif
+
+  if (cancel == NULL || !hatomic_cas(&cancel->triggered, 0, 1))
+    return;
+
+#ifdef WIN32
+  send(cancel->fd[1], "c", 1, 0);
+#elif defined(__linux__)
+  if (write(cancel->fd[1], &one, sizeof(one)) < 0)
+    log_warn2("Cannot trigger cancellation (%s)", strerror(errno));
+#else
+  if (write(cancel->fd[1], "c", 1) < 0)
+    log_warn2("Cannot trigger cancellation (%s)", strerror(errno));
+#endif
+
+  hmutex_lock(&_hcancel_lock);
+  if (cancel->event != NULL)
+    hevent_set(cancel->event);
+  hmutex_unlock(&_hcancel_lock);
+}
+
+int
+hcancel_triggered(hcancel_t * cancel)
+{
+  return cancel != NULL && cancel->triggered;
+}
+
+void
+hcancel_set_event(hcancel_t * cancel, hevent_t * event)
+{
+  if (cancel == NULL)
+    return;
+
+  hmutex_lock(&_hcancel_lock);
+  cancel->event = event;
+  if (event != NULL && cancel->triggered)
+    hevent_set(event);
+  hmutex_unlock(&_hcancel_lock);
+}
+
+void
+hsocket_set_cancel(hcancel_t * cancel)
+{
+  _hsocket_cancel = cancel;
+}
+
+hcancel_t *
+hsocket_get_cancel(void)
+{
+  return _hsocket_cancel;
+}
+
+int
+hsocket_cancelled(void)
+{
+  return hcancel_triggered(_hsocket_cancel);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_wait
+DESC: select() on the socket and on the token of the
+calling thread.
+----------------------------------------------------*/
+int
+hsocket_wait(int sock, int write, int msec)
+{
+  struct timeval timeout;
+  fd_set rfds, wfds, efds;
+  int ret, max;
+
+  if (hcancel_triggered(_hsocket_cancel))
+    return HSOCKET_CANCELLED;
+
+  if (msec <= 0)
+    msec = _hsocket_timeout(_hsocket_read_timeout);
+  timeout.tv_sec = msec / 1000;
+  timeout.tv_usec = (msec % 1000) * 1000;
+
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  FD_ZERO(&efds);
+  if (write)
+  {
+    FD_SET(sock, &wfds);
+    /* WIN32 reports failed connects there */
+    FD_SET(sock, &efds);
+  }
+  else
+    FD_SET(sock, &rfds);
+  max = sock;
+  if (_hsocket_cancel != NULL)
+  {
+    FD_SET(_hsocket_cancel->fd[0], &rfds);
+    if ((int) _hsocket_cancel->fd[0] > max)
+      max = (int) _hsocket_cancel->fd[0];
+  }
+
+  ret = select(max + 1, &rfds, &wfds, &efds, &timeout);
+  if (ret > 0 && _hsocket_cancel != NULL && FD_ISSET(_hsocket_cancel->fd[0], &rfds))
+    return HSOCKET_CANCELLED;
+  return ret > 0 ? 1 : ret;
+}
+
+/* _hsocket_connect() result on timeout */
+#define HSOCKET_CONNECT_TIMEOUT	-4
+
+/*--------------------------------------------------
+FUNCTION: _hsocket_connect
+DESC: Connects without waiting past deadline.
+Returns 0 on success, -1 on error,
+HSOCKET_CONNECT_TIMEOUT and HSOCKET_CANCELLED.
+----------------------------------------------------*/
+static int
+_hsocket_connect(hsocket_t * dsock, struct sockaddr_in *address, hclock_t deadline)
+{
+  hclock_t start;
+  long left;
+  int ret, err;
+#ifdef WIN32
+  int len;
+#else
+  socklen_t len;
+#endif
+
+  start = hclock_ms();
+  hsocket_set_blocking(dsock, 0);
+
+  ret = connect(dsock->sock, (struct sockaddr *) address, sizeof(*address));
+#ifdef WIN32
+  if (ret != 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+  if (ret != 0 && errno == EINPROGRESS)
+#endif
+  {
+    for (;;)
+    {
+      left = (long) (deadline - hclock_ms());
+      if (left <= 0)
+      {
+        ret = HSOCKET_CONNECT_TIMEOUT;
+        break;
+      }
+      ret = hsocket_wait(dsock->sock, 1, left);
+#ifndef WIN32
+      if (ret < 0 && ret != HSOCKET_CANCELLED && errno == EINTR)
+        continue;
+#endif
+      if (ret == 0)
+        ret = HSOCKET_CONNECT_TIMEOUT;
+      else if (ret > 0)
+      {
+        err = 0;
+        len = sizeof(err);
+        getsockopt(dsock->sock, SOL_SOCKET, SO_ERROR, (char *) &err, &len);
+        ret = err ? -1 : 0;
+#ifndef WIN32
+        if (err)
+          errno = err;
+#endif
+      }
+      break;
+    }
+  }
+
+  if (ret == 0)
+  {
+    hsocket_set_blocking(dsock, 1);
+    _hsocket_connect_time = (long) (hclock_ms() - start);
+    /* requests are written in pieces on kept alive connections,
+       do not wait for the ack of the previous one */
+    err = 1;
+    setsockopt(dsock->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &err, sizeof(err));
+  }
+  return ret;
+}
+
+/*
+  Address of a host, from the cache file when it is open.
+  Returns 1 if it came from the cache, 0 if it was resolved
+  and -1 on failure. getaddrinfo() is safe to call from the
+  prober, the warm-ups and the requests at once.
+*/
+static int
+_hsocket_resolve(const char *hostname, struct in_addr *addr)
+{
+  struct addrinfo hints, *result;
+
+  if (hcache_get(HCACHE_DNS, hostname, addr, sizeof(*addr)) == sizeof(*addr))
+    return 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, NULL, &hints, &result) != 0)
+    return -1;
+  *addr = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+  freeaddrinfo(result);
+  hcache_put(HCACHE_DNS, hostname, addr, sizeof(*addr), HCACHE_DNS_TTL);
+  return 0;
+}
+
+/* starts watching the network, with the sources lock held */
+static void
+_hsocket_netwatch_open(void)
+{
+#if defined(__linux__)
+  struct sockaddr_nl addr;
+
+  _hsocket_netwatch_state = -1;
+  if ((_hsocket_netwatch =
+       socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              NETLINK_ROUTE)) < 0)
+    return;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+  if (bind(_hsocket_netwatch, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+  {
+    close(_hsocket_netwatch);
+    return;
+  }
+  _hsocket_netwatch_state = 1;
+#elif defined(WIN32)
+  DWORD bytes;
+
+  _hsocket_netwatch_state = -1;
+  if ((_hsocket_netwatch = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+    return;
+
+  memset(&_hsocket_netwatch_ov, 0, sizeof(_hsocket_netwatch_ov));
+  if ((_hsocket_netwatch_ov.hEvent = WSACreateEvent()) == WSA_INVALID_EVENT)
+  {
+    closesocket(_hsocket_netwatch);
+    return;
+  }
+  if (WSAIoctl(_hsocket_netwatch, SIO_ADDRESS_LIST_CHANGE, NULL, 0, NULL, 0,
+               &bytes, &_hsocket_netwatch_ov, NULL) == SOCKET_ERROR &&
+      WSAGetLastError() != WSA_IO_PENDING)
+  {
+    closesocket(_hsocket_netwatch);
+    WSACloseEvent(_hsocket_netwatch_ov.hEvent);
+    return;
+  }
+  _hsocket_netwatch_state = 1;
+#else
+  _hsocket_netwatch_state = -1;
+#endif
+}
+
+/*
+  Forgets the learned addresses if the network changed since the
+  last call, with the sources lock held.
+*/
+static void
+_hsocket_netwatch_check(void)
+{
+  int changed = 0, i;
+
+  if (_hsocket_netwatch_state == 0)
+    _hsocket_netwatch_open();
+  if (_hsocket_netwatch_state < 0)
+    return;
+
+#if defined(__linux__)
+  {
+    char buffer[4096];
+    ssize_t n;
+
+    /* ENOBUFS: notifications were lost, the network changed anyway */
+    while ((n = recv(_hsocket_netwatch, buffer, sizeof(buffer),
+                     MSG_DONTWAIT)) > 0 || (n < 0 && errno == ENOBUFS))
+      changed = 1;
+  }
+#elif defined(WIN32)
+  {
+    DWORD bytes;
+
+    if (WSAWaitForMultipleEvents(1, &_hsocket_netwatch_ov.hEvent, FALSE, 0,
+                                 FALSE) == WSA_WAIT_EVENT_0)
+    {
+      changed = 1;
+      WSAResetEvent(_hsocket_netwatch_ov.hEvent);
+      if (WSAIoctl(_hsocket_netwatch, SIO_ADDRESS_LIST_CHANGE, NULL, 0, NULL,
+                   0, &bytes, &_hsocket_netwatch_ov, NULL) == SOCKET_ERROR &&
+          WSAGetLastError() != WSA_IO_PENDING)
+      {
+        closesocket(_hsocket_netwatch);
+        WSACloseEvent(_hsocket_netwatch_ov.hEvent);
+        _hsocket_netwatch_state = -1;
+      }
+    }
+  }
+#endif
+
+  if (changed)
+  {
+    log_verbose1("Network changed, forgetting the source addresses");
+    for (i = 0; i < HSOCKET_SOURCES; i++)
+      _hsocket_sources[i].learned = 0;
+  }
+}
+
+/* records the local address of a connection to 'hostname' */
+static void
+_hsocket_source_learn(const char *hostname, struct in_addr *server,
+                      struct in_addr *local)
+{
+  int i;
+
+  if (strlen(hostname) >= sizeof(_hsocket_sources[0].host))
+    return;
+
+  hmutex_lock(&_hsocket_sources_lock);
+  _hsocket_netwatch_check();
+
+  for (i = 0; i < HSOCKET_SOURCES; i++)
+  {
+    if (!strcmp(_hsocket_sources[i].host, hostname))
+      break;
+  }
+  if (i == HSOCKET_SOURCES)
+  {
+    i = _hsocket_sources_next;
+    _hsocket_sources_next = (i + 1) % HSOCKET_SOURCES;
+    strcpy(_hsocket_sources[i].host, hostname);
+  }
+  _hsocket_sources[i].server = *server;
+  _hsocket_sources[i].local = *local;
+  _hsocket_sources[i].learned = time(NULL);
+
+  hmutex_unlock(&_hsocket_sources_lock);
+}
+
+/*
+  Local address the system chooses to reach 'server': the one of
+  a UDP socket connected to it, nothing is sent.
+*/
+static int
+_hsocket_route(struct in_addr *server, int port, struct in_addr *local)
 {
   struct sockaddr_in address;
-  struct hostent *host;
-  char *ip;
+#ifdef WIN32
+  SOCKET sock;
+  int len;
+#else
+  int sock;
+  socklen_t len;
+#endif
+  int ret = -1;
+
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    return -1;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons((unsigned short) port);
+  address.sin_addr = *server;
+
+  if (connect(sock, (struct sockaddr *) &address, sizeof(address)) == 0)
+  {
+    len = sizeof(address);
+    if (getsockname(sock, (struct sockaddr *) &address, &len) == 0 &&
+        address.sin_addr.s_addr != INADDR_ANY)
+    {
+      *local = address.sin_addr;
+      ret = 0;
+    }
+  }
+
+#ifdef WIN32
+  closesocket(sock);
+#else
+  close(sock);
+#endif
+  return ret;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_source_address
+----------------------------------------------------*/
+int
+hsocket_source_address(const char *hostname, int port, char *addr, int size)
+{
+  struct in_addr server, local;
+  int found = 0, i;
+  char *str;
+
+  hmutex_lock(&_hsocket_sources_lock);
+  _hsocket_netwatch_check();
+
+  for (i = 0; i < HSOCKET_SOURCES; i++)
+  {
+    if (!strcmp(_hsocket_sources[i].host, hostname))
+    {
+      found = 1;
+      server = _hsocket_sources[i].server;
+      local = _hsocket_sources[i].local;
+      if (_hsocket_sources[i].learned != 0 &&
+          (_hsocket_netwatch_state > 0 ||
+           time(NULL) - _hsocket_sources[i].learned < HSOCKET_SOURCE_TTL))
+        found = 2;
+      break;
+    }
+  }
+  hmutex_unlock(&_hsocket_sources_lock);
+
+  if (found < 2)
+  {
+    /* a server not connected yet is resolved like hsocket_open() does */
+    if (!found && _hsocket_resolve(hostname, &server) < 0)
+      return -1;
+    if (_hsocket_route(&server, port, &local) != 0)
+      return -1;
+    _hsocket_source_learn(hostname, &server, &local);
+  }
+
+  str = inet_ntoa(local);
+  if (str == NULL || (int) strlen(str) >= size)
+    return -1;
+  strcpy(addr, str);
+  return 0;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hsocket_open
+DESC: Connects and does the TLS handshake, all of it
+before deadline.
+----------------------------------------------------*/
+static herror_t
+_hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl,
+              hclock_t deadline)
+{
+  struct sockaddr_in address, local;
+  char key[HCACHE_KEY_SIZE];
+  int cached, ret;
+#ifdef WIN32
+  int len;
+#else
+  socklen_t len;
+#endif
+
+  if (hsocket_cancelled())
+    return herror_new("hsocket_open", HSOCKET_ERROR_CANCELLED,
+                      "Socket error (cancelled)");
 
   if ((dsock->sock = socket(AF_INET, SOCK_STREAM, 0)) <= 0)
     return herror_new("hsocket_open", HSOCKET_ERROR_CREATE,
                       "Socket error (%s)", strerror(errno));
 
-  /* Get host data */
-  if (!(host = gethostbyname(hostname)))
-    return herror_new("hsocket_open", HSOCKET_ERROR_GET_HOSTNAME,
-                      "Socket error (%s)", strerror(errno));
-
-  ip = inet_ntoa(*(struct in_addr *) *host->h_addr_list);
-  address.sin_addr.s_addr = inet_addr(ip);
-   
-  /* set server addresss */
-  address.sin_family = host->h_addrtype;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
   address.sin_port = htons((unsigned short) port);
 
+  /* Get host data, from the cache file when it is open */
+  if ((cached = _hsocket_resolve(hostname, &address.sin_addr)) < 0)
+    return herror_new("hsocket_open", HSOCKET_ERROR_GET_HOSTNAME,
+                      "Cannot resolve %s", hostname);
+
   log_verbose4("Opening %s://%s:%i", ssl ? "https" : "http", hostname, port);
 
   /* connect to the server */
-  if (connect(dsock->sock, (struct sockaddr *) &address, sizeof(address)) !=
-      0)
+  if ((ret = _hsocket_connect(dsock, &address, deadline)) != 0)
+  {
+    if (ret == HSOCKET_CANCELLED)
+      return herror_new("hsocket_open", HSOCKET_ERROR_CANCELLED,
+                        "Socket error (cancelled)");
+    if (cached)
+    {
+      /* the server may have moved, resolve it again in the time left */
+      log_verbose2("Dropping cached address of %s", hostname);
+      hcache_remove(HCACHE_DNS, hostname);
+      if (deadline - hclock_ms() > 0)
+      {
+#ifdef WIN32
+        closesocket(dsock->sock);
+#else
+        close(dsock->sock);
+#endif
+        return _hsocket_open(dsock, hostname, port, ssl, deadline);
+      }
+    }
+    if (ret == HSOCKET_CONNECT_TIMEOUT)
+      return herror_new("hsocket_open", HSOCKET_ERROR_CONNECT,
+                        "Socket error (connect timeout)");
     return herror_new("hsocket_open", HSOCKET_ERROR_CONNECT,
                       "Socket error (%s)", strerror(errno));
+  }
+
+  len = sizeof(local);
+  if (getsockname(dsock->sock, (struct sockaddr *) &local, &len) == 0)
+    _hsocket_source_learn(hostname, &address.sin_addr, &local.sin_addr);
 
   if (ssl)
   {
     herror_t status;
 
-    if ((status = hssl_client_ssl(dsock)) != H_OK)
+    /* no snprintf in visual c, long names are not cached */
+    if (strlen(hostname) < sizeof(key) - 8)
+      sprintf(key, "%s:%i", hostname, port);
+    else
+      key[0] = '\0';
+    if ((status = hssl_client_ssl_session(dsock, key[0] ? key : NULL, deadline)) != H_OK)
     {
-      log_error2("hssl_client_ssl failed (%s)", herror_message(status));
+      if (herror_code(status) != HSOCKET_ERROR_CANCELLED)
+        log_error2("hssl_client_ssl failed (%s)", herror_message(status));
       return status;
     }
   }
@@ -216,6 +905,18 @@ hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl)
   return H_OK;
 }
 
+/*--------------------------------------------------
+FUNCTION: hsocket_open
+----------------------------------------------------*/
+herror_t
+hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl)
+{
+  /* one connect timeout for the connect, its retry with a fresh
+     address and the TLS handshake */
+  return _hsocket_open(dsock, hostname, port, ssl,
+                       hclock_ms() + _hsocket_timeout(_hsocket_connect_timeout));
+}
+
 /*--------------------------------------------------
 FUNCTION: hsocket_bind
 ----------------------------------------------------*/
@@ -312,6 +1013,7 @@ herror_t
 hsocket_accept(hsocket_t * sock, hsocket_t * dest)
 {
   herror_t status;
+  int nodelay = 1;
 
   if (sock->sock < 0)
     return herror_new("hsocket_accept", HSOCKET_ERROR_NOT_INITIALIZED,
@@ -320,6 +1022,12 @@ hsocket_accept(hsocket_t * sock, hsocket_t * dest)
   if ((status = _hsocket_sys_accept(sock, dest)) != H_OK)
     return status;
 
+  /* the header and the body of a reply are written apart, on a
+     kept alive connection the client would hold the ack of the
+     first */
+  setsockopt(dest->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay,
+             sizeof(nodelay));
+
   if ((status = hssl_server_ssl(dest)) != H_OK)
   {
     log_warn2("SSL startup failed (%s)", herror_message(status));
@@ -392,6 +1100,7 @@ hsocket_close(hsocket_t * sock)
   hssl_cleanup(sock);
 
   _hsocket_sys_close(sock);
+  sock->sock = HSOCKET_FREE;
 
   log_verbose1("socket closed");
 
@@ -412,6 +1121,9 @@ hsocket_nsend(hsocket_t * sock, const byte_t * bytes, int n)
   if (sock->sock < 0)
     return herror_new("hsocket_nsend", HSOCKET_ERROR_NOT_INITIALIZED,
                       "hsocket not initialized");
+  if (hsocket_cancelled())
+    return herror_new("hsocket_nsend", HSOCKET_ERROR_CANCELLED,
+                      "Socket error (cancelled)");
 
   /* log_verbose2( "SENDING %s", bytes ); */
 
@@ -445,14 +1157,12 @@ hsocket_send(hsocket_t * sock, const char *str)
 int
 hsocket_select_read(int sock, char *buf, size_t len)
 {
-  struct timeval timeout;
-  fd_set fds;
   int ret;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
-  timeout.tv_sec = httpd_get_timeout();
-  timeout.tv_usec = 0;
-  ret = select(sock + 1, &fds, NULL, NULL, &timeout);
+  ret = hsocket_wait(sock, 0, 0);
+  if (ret == HSOCKET_CANCELLED) {
+    log_verbose2("Socket %d cancelled", sock);
+    return HSOCKET_CANCELLED;
+  }
   if (ret == 0) {
     log_verbose2("Socket %d timeout", sock);
     return -1;
@@ -468,17 +1178,57 @@ hsocket_select_read(int sock, char *buf, size_t len)
   }
 #ifdef WIN32
   ret = recv(sock, buf, len, 0);
+  if (ret == 0 || (ret < 0 && (WSAGetLastError() == WSAECONNRESET || WSAGetLastError() == WSAECONNABORTED))) {
 #else
   ret = read(sock, buf, len);
+  if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
 #endif
+    log_verbose2("Socket %d closed by peer", sock);
+    return HSOCKET_CLOSED;
+  }
   // RCDEVS ADDED
-  if (ret <= 0) {
+  if (ret < 0) {
     log_verbose2("Socket %d read error", sock);
     return -1;
   }
   return ret;
 }
 
+/*--------------------------------------------------
+FUNCTION: hsocket_is_alive
+DESC: Checks without blocking whether an idle
+connection is still usable. An idle peer must not
+send anything, so pending input on a plain socket
+(or an EOF) means the server dropped it. TLS peers
+may still send post-handshake records (session
+tickets), which are consumed by the next read.
+----------------------------------------------------*/
+int
+hsocket_is_alive(hsocket_t * sock)
+{
+  struct timeval timeout;
+  fd_set fds;
+  char ch;
+  int ret;
+
+  if (sock->sock < 0)
+    return 0;
+
+  FD_ZERO(&fds);
+  FD_SET(sock->sock, &fds);
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  if ((ret = select(sock->sock + 1, &fds, NULL, NULL, &timeout)) == 0)
+    return 1;
+  if (ret < 0)
+    return 0;
+
+  if (recv(sock->sock, &ch, 1, MSG_PEEK) <= 0)
+    return 0;
+
+  return sock->ssl ? 1 : 0;
+}
+
 herror_t
 hsocket_read(hsocket_t * sock, byte_t * buffer, int total, int force,
              int *received)
@@ -497,7 +1247,8 @@ hsocket_read(hsocket_t * sock, byte_t * buffer, int total, int force,
          hssl_read(sock, &buffer[totalRead], (size_t) total - totalRead,
                    &count)) != H_OK)
     {
-      log_warn2("hssl_read failed (%s)", herror_message(status));
+      if (herror_code(status) != HSOCKET_ERROR_CANCELLED)
+        log_warn2("hssl_read failed (%s)", herror_message(status));
       return status;
     }
 
@@ -40,9 +40,23 @@
 #endif
 
 #include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-thread.h>
 
 #define	HSOCKET_FREE	-1
 
+/* hsocket_select_read() and hsocket_wait() result when the
+   request of the calling thread was cancelled */
+#define HSOCKET_CANCELLED	-2
+
+/* hsocket_select_read() result when the peer closed or reset the
+   connection */
+#define HSOCKET_CLOSED	-3
+
+/*
+  Cancellation token (see hsocket_set_cancel)
+*/
+typedef struct hcancel hcancel_t;
+
 /*
   Socket definition
 */
@@ -101,7 +115,10 @@ extern "C"
 
 /**
   Connects to a given host. The hostname can be an IP number 
-  or a humen readable hostname.
+  or a humen readable hostname. The connect timeout of the calling
+  thread (see hsocket_set_timeouts()) covers the whole opening: the
+  connect, a second one if the cached address failed, and the TLS
+  handshake.
   
   @param sock the destonation socket object to use
   @param host hostname 
@@ -197,6 +214,124 @@ extern "C"
 
 
   int hsocket_select_read(int sock, char *buf, size_t len);
+
+/**
+  Sets the connect and read timeouts of the sockets used
+  by the calling thread, until the next call. A timeout
+  of 0 is the httpd timeout (see httpd_set_timeout()).
+  Also clears the connect time.
+
+  @param connect_msec connect timeout in milliseconds
+  @param read_msec timeout of each read in milliseconds
+*/
+  void hsocket_set_timeouts(int connect_msec, int read_msec);
+
+/**
+  @returns the time taken by the last connection opened
+  by the calling thread since hsocket_set_timeouts(), in
+  milliseconds, or -1 if none was opened.
+*/
+  long hsocket_get_connect_time(void);
+
+/**
+  Gives the local address of the connections to a server: the
+  address the server sees as the source of the requests. It is
+  learned from the last connection opened to 'hostname' and kept
+  until the network interfaces or routes change; a server not
+  connected yet is resolved and routed without sending anything.
+
+  @param addr receives the address in dotted form
+  @param size size of 'addr', 16 bytes are enough
+
+  @returns 0 on success, -1 if the server cannot be reached.
+*/
+  int hsocket_source_address(const char *hostname, int port, char *addr,
+                             int size);
+
+/**
+  @returns the read timeout of the calling thread in
+  milliseconds, the httpd timeout if none was set.
+*/
+  int hsocket_get_read_timeout(void);
+
+/**
+  Creates a cancellation token. A triggered token makes the
+  connect, the TLS handshake, the reads and the waits of the
+  threads using it fail at once with HSOCKET_ERROR_CANCELLED.
+
+  @returns the token or NULL if it could not be created.
+*/
+  hcancel_t *hcancel_new(void);
+
+/**
+  Frees a token which no thread uses anymore.
+*/
+  void hcancel_free(hcancel_t * cancel);
+
+/**
+  Cancels the requests using the token, from any thread.
+  A token stays triggered until it is freed.
+*/
+  void hcancel_trigger(hcancel_t * cancel);
+
+/**
+  @returns 1 if the token was triggered, 0 otherwise or if
+  cancel is NULL.
+*/
+  int hcancel_triggered(hcancel_t * cancel);
+
+/**
+  Sets the event to set when the token is triggered (NULL
+  to remove it), so that a thread waiting on its own event
+  wakes up. The event is set at once if the token already
+  was triggered.
+*/
+  void hcancel_set_event(hcancel_t * cancel, hevent_t * event);
+
+/**
+  Sets the token of the requests of the calling thread (NULL
+  for none), until the next call.
+*/
+  void hsocket_set_cancel(hcancel_t * cancel);
+
+/**
+  @returns the token of the calling thread or NULL.
+*/
+  hcancel_t *hsocket_get_cancel(void);
+
+/**
+  @returns 1 if the token of the calling thread was
+  triggered, 0 otherwise.
+*/
+  int hsocket_cancelled(void);
+
+/**
+  Waits until the socket can be read (or written if write
+  is 1), at most msec milliseconds (0 for the read timeout).
+
+  @returns 1 if the socket is ready, 0 on timeout, -1 on
+  error and HSOCKET_CANCELLED if the request of the calling
+  thread was cancelled.
+*/
+  int hsocket_wait(int sock, int write, int msec);
+
+/**
+  Switches the socket to blocking (1) or non-blocking (0)
+  mode.
+*/
+  void hsocket_set_blocking(hsocket_t * sock, int blocking);
+
+/**
+  Checks whether an idle connection can still be used
+  without blocking.
+
+  @param sock the connected socket to check
+
+  @returns 1 if the connection looks usable, 0 if it
+  was closed by the peer.
+*/
+  int hsocket_is_alive(hsocket_t * sock);
+
 /**
   Reads data from the socket.
 
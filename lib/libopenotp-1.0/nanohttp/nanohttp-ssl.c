@@ -71,10 +71,87 @@
 #endif
 #endif
 
+#ifdef HAVE_SSL
+#include <sys/stat.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+#endif
+
+/* kernel TLS needs OpenSSL 3 built with enable-ktls and the Linux tls module */
+#if defined(HAVE_SSL) && defined(__linux__)
+#include <openssl/ssl.h>
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HSSL_KTLS
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+#endif
+
 #include "nanohttp-logging.h"
 #include "nanohttp-common.h"
 #include "nanohttp-socket.h"
 #include "nanohttp-ssl.h"
+#include "nanohttp-thread.h"
+
+#ifdef WIN32
+#define _hssl_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define _hssl_peer_reset() (WSAGetLastError() == WSAECONNRESET || WSAGetLastError() == WSAECONNABORTED)
+#else
+#define _hssl_would_block() (errno == EAGAIN || errno == EWOULDBLOCK)
+#define _hssl_peer_reset() (errno == ECONNRESET || errno == EPIPE)
+#endif
+
+/*--------------------------------------------------
+FUNCTION: _hssl_plain_send
+DESC: send() on a plain socket, waiting for room if
+the socket is non-blocking (HTTP/2 connections).
+----------------------------------------------------*/
+static herror_t
+_hssl_plain_send(hsocket_t * sock, const char *buf, size_t len, size_t * sent)
+{
+  int count, wait;
+
+  while ((count = send(sock->sock, buf, len, 0)) == -1 && _hssl_would_block())
+  {
+    if ((wait = hsocket_wait(sock->sock, 1, 0)) == HSOCKET_CANCELLED)
+      return herror_new("hssl_write", HSOCKET_ERROR_CANCELLED, "send cancelled");
+    if (wait <= 0)
+      return herror_new("hssl_write", HSOCKET_ERROR_SEND, "send failed (%s)",
+                        wait == 0 ? "timeout" : strerror(errno));
+  }
+  if (count == -1)
+    return herror_new("hssl_write", _hssl_peer_reset() ? HSOCKET_ERROR_CLOSED : HSOCKET_ERROR_SEND,
+                      "send failed (%s)", strerror(errno));
+  *sent = count;
+
+  return H_OK;
+}
+
+static herror_t
+_hssl_plain_read_nowait(hsocket_t * sock, char *buf, size_t len,
+                        size_t * received)
+{
+  int count;
+
+  if ((count = recv(sock->sock, buf, len, 0)) > 0)
+  {
+    *received = count;
+    return H_OK;
+  }
+  if (count == -1 && _hssl_would_block())
+  {
+    *received = 0;
+    return H_OK;
+  }
+  if (count == 0)
+    return herror_new("hssl_read_nowait", HSOCKET_ERROR_RECEIVE,
+                      "Connection closed by peer");
+  return herror_new("hssl_read_nowait", HSOCKET_ERROR_RECEIVE,
+                    "recv failed (%s)", strerror(errno));
+}
 
 #ifdef HAVE_SSL
 
@@ -84,7 +161,74 @@ static char *ca_list = NULL;
 static SSL_CTX *context = NULL;
 
 static int enabled = 0;
+static int session_key_index = -1;
+
+/* kernel TLS is off until turned on (hssl_set_ktls or -NHTTPktls), and
+   used when hssl_module_init finds the tls module */
+static int ktls = 0;
+static int ktls_available = 0;
+
+/* ALPN (OpenSSL 1.0.2) offers and accepts HTTP/2 before HTTP/1.1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+#define HSSL_ALPN
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+#endif
+static int http2 = 0;
+
+/* certificate, key and trust store parsed once and shared by the contexts */
+typedef struct hssl_file
+{
+  char *path;
+  time_t mtime;
+  long size;
+} hssl_file_t;
+
+static struct
+{
+  hssl_file_t cert_file;
+  hssl_file_t ca_file;
+  X509 *cert;
+  EVP_PKEY *key;
+  X509_STORE *store;
+  STACK_OF(X509_NAME) *ca_names;
+  unsigned int generation;      /* bumped on each load, 0 before the first */
+  time_t checked;
+} identity;
+
+static hmutex_t context_lock = HMUTEX_INITIALIZER;
+
+/* leaf certificates verified recently, by SHA-256 fingerprint */
+typedef struct hssl_verified
+{
+  unsigned char md[SHA256_DIGEST_LENGTH];
+  unsigned int generation;
+  time_t expires;
+} hssl_verified_t;
+
+static hssl_verified_t verify_cache[HSSL_VERIFY_CACHE_SIZE];
+static int verify_next = 0;
+static hmutex_t verify_lock = HMUTEX_INITIALIZER;
+
+/* client sessions by server key. They stay in this process: a resumed
+   session skips the verification of the server certificate, so it is
+   never read from a file which another process could write. */
+typedef struct hssl_session_entry
+{
+  char *key;
+  SSL_SESSION *session;
+} hssl_session_entry_t;
+
+static hssl_session_entry_t session_cache[HSSL_SESSION_CACHE_SIZE];
+static int session_next = 0;
+static hmutex_t session_lock = HMUTEX_INITIALIZER;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_STORE_CTX_get0_cert(ctx)	((ctx)->cert)
+#define X509_STORE_up_ref(store)	CRYPTO_add(&(store)->references, 1, CRYPTO_LOCK_X509_STORE)
+#endif
+
+static void _hssl_verify_cache_flush(void);
+static void _hssl_session_flush(void);
 static int _hssl_dummy_verify_cert(X509 * cert);
 int (*_hssl_verify_cert) (X509 * cert) = _hssl_dummy_verify_cert;
 
@@ -134,6 +278,74 @@ _hssl_get_error(SSL * ssl, int ret)
 }
 
 
+/*
+  Whether the SSL call which returned ret failed because the peer
+  closed or reset the connection.
+*/
+static int
+_hssl_peer_closed(SSL * ssl, int ret)
+{
+  switch (SSL_get_error(ssl, ret))
+  {
+  case SSL_ERROR_ZERO_RETURN:
+    return 1;
+  case SSL_ERROR_SYSCALL:
+    return ret == 0 || _hssl_peer_reset();
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+  case SSL_ERROR_SSL:
+    return ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/*
+  Waits for the socket after the SSL call 'call' which returned
+  ret, if it only needs more data or room (non-blocking client
+  connections), until deadline if it is not 0 and for the read
+  timeout otherwise. Returns H_OK to make the call again.
+*/
+static herror_t
+_hssl_wait(SSL * ssl, int sock, int ret, const char *func, const char *call,
+           int code, hclock_t deadline)
+{
+  long msec = 0;
+  int wait;
+
+  if (deadline != 0 && (msec = (long) (deadline - hclock_ms())) <= 0)
+    return herror_new(func, code, "%s failed (timeout)", call);
+
+  switch (SSL_get_error(ssl, ret))
+  {
+  case SSL_ERROR_WANT_READ:
+    wait = hsocket_wait(sock, 0, (int) msec);
+    break;
+  case SSL_ERROR_WANT_WRITE:
+    wait = hsocket_wait(sock, 1, (int) msec);
+    break;
+  default:
+    /* reads and writes tell a connection dropped by the peer apart */
+    if ((code == HSOCKET_ERROR_RECEIVE || code == HSOCKET_ERROR_SEND)
+        && _hssl_peer_closed(ssl, ret))
+      return herror_new(func, HSOCKET_ERROR_CLOSED, "%s failed (closed by peer)", call);
+    return herror_new(func, code, "%s failed (%s)", call,
+                      _hssl_get_error(ssl, ret));
+  }
+
+  if (wait == HSOCKET_CANCELLED)
+    return herror_new(func, HSOCKET_ERROR_CANCELLED, "%s cancelled", call);
+#ifndef WIN32
+  if (wait < 0 && errno == EINTR)
+    return H_OK;
+#endif
+  if (wait <= 0)
+    return herror_new(func, code, "%s failed (%s)", call,
+                      wait == 0 ? "timeout" : "select error");
+  return H_OK;
+}
+
+
 static int
 _hssl_password_callback(char *buf, int num, int rwflag, void *userdata)
 {
@@ -179,6 +391,8 @@ void
 hssl_set_hssl_verify_cert(int func(X509 * cert))
 {
   _hssl_verify_cert = func;
+  _hssl_verify_cache_flush();
+  _hssl_session_flush();
 }
 
 static int
@@ -239,6 +453,18 @@ hssl_enable(void)
   enabled = 1;
 }
 
+void
+hssl_set_ktls(int on)
+{
+  ktls = on;
+}
+
+void
+hssl_set_http2(int on)
+{
+  http2 = on;
+}
+
 static void
 _hssl_parse_arguments(int argc, char **argv)
 {
@@ -263,6 +489,14 @@ _hssl_parse_arguments(int argc, char **argv)
     {
       enabled = 1;
     }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_KTLS))
+    {
+      ktls = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_HTTP2))
+    {
+      http2 = atoi(argv[i]);
+    }
   }
 
   return;
@@ -281,6 +515,7 @@ _hssl_library_init(void)
     SSL_load_error_strings();
     ERR_load_crypto_strings();
     OpenSSL_add_ssl_algorithms();
+    session_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
     initialized = 1;
   }
 
@@ -288,63 +523,313 @@ _hssl_library_init(void)
 }
 
 
-static herror_t
-_hssl_server_context_init(void)
+/*--------------------------------------------------
+FUNCTION: _hssl_file_changed
+DESC: Tells whether the file differs from the one
+last loaded and updates the saved stamp.
+----------------------------------------------------*/
+static int
+_hssl_file_changed(const char *path, hssl_file_t * file)
 {
-  log_verbose3("enabled=%i, certificate=%p", enabled, certificate);
+  struct stat st;
+  int changed;
 
-  if (!enabled) return H_OK;
-
-  if (!(context = SSL_CTX_new(SSLv23_method())))
+  if (path == NULL || *path == '\0' || stat(path, &st) != 0)
   {
-    log_error1("Cannot create SSL context");
-    return herror_new("_hssl_server_context_init", HSSL_ERROR_CONTEXT,
-                      "Unable to create SSL context");
+    st.st_mtime = 0;
+    st.st_size = 0;
   }
+  changed = (file->path == NULL) != (path == NULL)
+    || (path != NULL && strcmp(file->path, path))
+    || file->mtime != st.st_mtime || file->size != (long) st.st_size;
 
-  if (certificate != NULL && !(SSL_CTX_use_certificate_file(context, certificate, SSL_FILETYPE_PEM)))
+  if (changed)
   {
-    log_error2("Cannot read certificate file: \"%s\"", certificate);
-    SSL_CTX_free(context);
-    return herror_new("_hssl_server_context_init", HSSL_ERROR_CERTIFICATE,
-                      "Unable to use SSL certificate \"%s\"", certificate);
+    if (file->path != NULL)
+      free(file->path);
+    file->path = path != NULL ? strdup(path) : NULL;
+    file->mtime = st.st_mtime;
+    file->size = (long) st.st_size;
   }
+  return changed;
+}
 
-  SSL_CTX_set_default_passwd_cb(context, _hssl_password_callback);
+static void
+_hssl_identity_free(void)
+{
+  if (identity.cert)
+    X509_free(identity.cert);
+  if (identity.key)
+    EVP_PKEY_free(identity.key);
+  if (identity.store)
+    X509_STORE_free(identity.store);
+  if (identity.ca_names)
+    sk_X509_NAME_pop_free(identity.ca_names, X509_NAME_free);
+  identity.cert = NULL;
+  identity.key = NULL;
+  identity.store = NULL;
+  identity.ca_names = NULL;
+}
 
-  if (certificate != NULL && !(SSL_CTX_use_PrivateKey_file(context, certificate, SSL_FILETYPE_PEM)))
+/*--------------------------------------------------
+FUNCTION: _hssl_identity_load
+DESC: Parses the certificate, the private key and the
+CA list, only the first time or when a path or a file
+changed. 'loaded' tells whether they were read.
+----------------------------------------------------*/
+static herror_t
+_hssl_identity_load(int *loaded)
+{
+  FILE *fp;
+  int cert_changed, ca_changed;
+
+  identity.checked = time(NULL);
+  cert_changed = _hssl_file_changed(certificate, &identity.cert_file);
+  ca_changed = _hssl_file_changed(ca_list, &identity.ca_file);
+  *loaded = 0;
+  if (!cert_changed && !ca_changed && identity.generation > 0)
+    return H_OK;
+
+  _hssl_identity_free();
+  identity.generation++;
+  *loaded = 1;
+
+  if (certificate != NULL)
   {
-    log_error2("Cannot read key file: \"%s\"", certificate);
-    SSL_CTX_free(context);
-    return herror_new("_hssl_server_context_init", HSSL_ERROR_PEM,
-                      "Unable to use private key");
+    if (!(fp = fopen(certificate, "r"))
+        || !(identity.cert = PEM_read_X509(fp, NULL, NULL, NULL)))
+    {
+      if (fp)
+        fclose(fp);
+      log_error2("Cannot read certificate file: \"%s\"", certificate);
+      /* read again on the next check */
+      _hssl_file_changed(NULL, &identity.cert_file);
+      return herror_new("_hssl_identity_load", HSSL_ERROR_CERTIFICATE,
+                        "Unable to use SSL certificate \"%s\"", certificate);
+    }
+    rewind(fp);
+    identity.key = PEM_read_PrivateKey(fp, NULL, _hssl_password_callback, NULL);
+    fclose(fp);
+    if (!identity.key)
+    {
+      log_error2("Cannot read key file: \"%s\"", certificate);
+      _hssl_file_changed(NULL, &identity.cert_file);
+      return herror_new("_hssl_identity_load", HSSL_ERROR_PEM,
+                        "Unable to use private key");
+    }
   }
 
   if (ca_list != NULL && *ca_list != '\0')
   {
-    if (!(SSL_CTX_load_verify_locations(context, ca_list, NULL)))
+    if (!(identity.store = X509_STORE_new())
+        || !X509_STORE_load_locations(identity.store, ca_list, NULL))
     {
-      SSL_CTX_free(context);
       log_error2("Cannot read CA list: \"%s\"", ca_list);
-      return herror_new("_hssl_server_context_init", HSSL_ERROR_CA_LIST,
-                        "Unable to read certification authorities \"%s\"");
+      _hssl_file_changed(NULL, &identity.ca_file);
+      return herror_new("_hssl_identity_load", HSSL_ERROR_CA_LIST,
+                        "Unable to read certification authorities \"%s\"",
+                        ca_list);
     }
-
-    SSL_CTX_set_client_CA_list(context, SSL_load_client_CA_file(ca_list));
+    identity.ca_names = SSL_load_client_CA_file(ca_list);
     log_verbose1("Certification authority contacted");
   }
 
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hssl_verify_cache_get
+DESC: Tells whether the leaf certificate was verified
+recently against the trust store of this generation.
+----------------------------------------------------*/
+static int
+_hssl_verify_cache_get(const unsigned char *md, unsigned int generation)
+{
+  time_t now = time(NULL);
+  int i, found = 0;
+
+  hmutex_lock(&verify_lock);
+  for (i = 0; i < HSSL_VERIFY_CACHE_SIZE && !found; i++)
+  {
+    found = verify_cache[i].generation == generation
+      && verify_cache[i].expires > now
+      && !memcmp(verify_cache[i].md, md, sizeof(verify_cache[i].md));
+  }
+  hmutex_unlock(&verify_lock);
+
+  return found;
+}
+
+static void
+_hssl_verify_cache_put(const unsigned char *md, unsigned int generation)
+{
+  hmutex_lock(&verify_lock);
+  memcpy(verify_cache[verify_next].md, md, sizeof(verify_cache[verify_next].md));
+  verify_cache[verify_next].generation = generation;
+  verify_cache[verify_next].expires = time(NULL) + HSSL_VERIFY_CACHE_TTL;
+  verify_next = (verify_next + 1) % HSSL_VERIFY_CACHE_SIZE;
+  hmutex_unlock(&verify_lock);
+}
+
+static void
+_hssl_verify_cache_flush(void)
+{
+  hmutex_lock(&verify_lock);
+  memset(verify_cache, 0, sizeof(verify_cache));
+  hmutex_unlock(&verify_lock);
+}
+
+/*--------------------------------------------------
+FUNCTION: _hssl_verify_chain
+DESC: Certificate verification of the contexts. A
+peer presenting a certificate verified recently skips
+chain building; its validity period is still checked.
+'arg' is the generation of the files the SSL context
+was built from: a connection made on a context built
+before a reload neither uses nor fills the entries of
+the new trust store.
+----------------------------------------------------*/
+static int
+_hssl_verify_chain(X509_STORE_CTX * ctx, void *arg)
+{
+  unsigned int generation = (unsigned int) (size_t) arg;
+  X509 *leaf = X509_STORE_CTX_get0_cert(ctx);
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  int ret;
+
+  if (leaf != NULL && X509_digest(leaf, EVP_sha256(), md, &length)
+      && length == SHA256_DIGEST_LENGTH)
+  {
+    if (_hssl_verify_cache_get(md, generation)
+        && X509_cmp_current_time(X509_get_notAfter(leaf)) > 0
+        && X509_cmp_current_time(X509_get_notBefore(leaf)) < 0)
+    {
+      log_verbose1("Certificate verified (cached)");
+      X509_STORE_CTX_set_error(ctx, X509_V_OK);
+      return 1;
+    }
+  }
+  else
+    length = 0;
+
+  if ((ret = X509_verify_cert(ctx)) == 1 && length > 0)
+    _hssl_verify_cache_put(md, generation);
+
+  return ret;
+}
+
+#ifdef HSSL_ALPN
+/*--------------------------------------------------
+FUNCTION: _hssl_alpn_select
+DESC: Server side ALPN, picks HTTP/2 if the client
+offers it.
+----------------------------------------------------*/
+static int
+_hssl_alpn_select(SSL * ssl, const unsigned char **out, unsigned char *outlen,
+                  const unsigned char *in, unsigned int inlen, void *arg)
+{
+  if (SSL_select_next_proto((unsigned char **) out, outlen, alpn_protos,
+                            sizeof(alpn_protos) - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+
+  return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+/*--------------------------------------------------
+FUNCTION: _hssl_context_new
+DESC: Creates an SSL context using the parsed
+certificate, key and trust store.
+----------------------------------------------------*/
+static herror_t
+_hssl_context_new(SSL_CTX ** ctx)
+{
+  if (!(*ctx = SSL_CTX_new(SSLv23_method())))
+  {
+    log_error1("Cannot create SSL context");
+    return herror_new("_hssl_context_new", HSSL_ERROR_CONTEXT,
+                      "Unable to create SSL context");
+  }
+
+  if (identity.cert != NULL && (!SSL_CTX_use_certificate(*ctx, identity.cert)
+                                || !SSL_CTX_use_PrivateKey(*ctx, identity.key)))
+  {
+    log_error2("Cannot use certificate: \"%s\"", certificate);
+    SSL_CTX_free(*ctx);
+    *ctx = NULL;
+    return herror_new("_hssl_context_new", HSSL_ERROR_PEM,
+                      "Unable to use private key");
+  }
+
+  if (identity.store != NULL)
+  {
+    X509_STORE_up_ref(identity.store);
+    SSL_CTX_set_cert_store(*ctx, identity.store);
+    if (identity.ca_names != NULL)
+      SSL_CTX_set_client_CA_list(*ctx, SSL_dup_CA_list(identity.ca_names));
+  }
+
   if (ca_list != NULL) {
-     SSL_CTX_set_verify(context, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, _hssl_cert_verify_callback);
+     SSL_CTX_set_verify(*ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, _hssl_cert_verify_callback);
+     SSL_CTX_set_cert_verify_callback(*ctx, _hssl_verify_chain,
+                                      (void *) (size_t) identity.generation);
      log_verbose1("Certificate verification callback registered");
   } else {
      // no verification and no callback
-     SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL);
+     SSL_CTX_set_verify(*ctx, SSL_VERIFY_NONE, NULL);
   }
   
-  SSL_CTX_set_mode(context, SSL_MODE_AUTO_RETRY);
+  SSL_CTX_set_mode(*ctx, SSL_MODE_AUTO_RETRY);
+
+  SSL_CTX_set_session_cache_mode(*ctx, SSL_SESS_CACHE_OFF);
+
+#ifdef HSSL_KTLS
+  /* OpenSSL installs the keys in the socket after the handshake when
+     the kernel supports the cipher, and keeps the records otherwise */
+  if (ktls && ktls_available)
+    SSL_CTX_set_options(*ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+#ifdef HSSL_ALPN
+  if (http2)
+    SSL_CTX_set_alpn_select_cb(*ctx, _hssl_alpn_select, NULL);
+#endif
+
+  return H_OK;
+}
+
+
+static herror_t
+_hssl_server_context_init(void)
+{
+  herror_t status;
+  SSL_CTX *ctx;
+  int loaded;
+
+  log_verbose3("enabled=%i, certificate=%p", enabled, certificate);
+
+  if (!enabled) return H_OK;
 
-  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  hmutex_lock(&context_lock);
+  if ((status = _hssl_identity_load(&loaded)) == H_OK
+      && (status = _hssl_context_new(&ctx)) == H_OK)
+  {
+    /* connections in progress keep a reference to the old context */
+    if (context)
+      SSL_CTX_free(context);
+    context = ctx;
+  }
+  hmutex_unlock(&context_lock);
+  if (status != H_OK)
+    return status;
+
+  if (loaded)
+  {
+    _hssl_verify_cache_flush();
+    _hssl_session_flush();
+  }
 
   _hssl_superseed();
 
@@ -352,18 +837,90 @@ _hssl_server_context_init(void)
 }
 
 
+/*--------------------------------------------------
+FUNCTION: _hssl_new
+DESC: Creates an SSL object, first replacing the
+context if the certificate or CA files changed.
+----------------------------------------------------*/
+static SSL *
+_hssl_new(void)
+{
+  herror_t status;
+  SSL_CTX *ctx;
+  SSL *ssl;
+  int loaded = 0;
+
+  hmutex_lock(&context_lock);
+  if (context && time(NULL) - identity.checked >= HSSL_RELOAD_INTERVAL)
+  {
+    status = _hssl_identity_load(&loaded);
+    if (status == H_OK && loaded)
+      status = _hssl_context_new(&ctx);
+    if (status != H_OK)
+    {
+      /* keep the working context */
+      log_error2("SSL files not reloaded (%s)", herror_message(status));
+      herror_release(status);
+      loaded = 0;
+    }
+    else if (loaded)
+    {
+      log_info1("SSL certificate or CA files reloaded");
+      SSL_CTX_free(context);
+      context = ctx;
+    }
+  }
+  ssl = context ? SSL_new(context) : NULL;
+  hmutex_unlock(&context_lock);
+
+  /* sessions were verified against the previous files */
+  if (loaded)
+  {
+    _hssl_verify_cache_flush();
+    _hssl_session_flush();
+  }
+
+  return ssl;
+}
+
+
 static void
 _hssl_server_context_destroy(void)
 {
+  hmutex_lock(&context_lock);
   if (context)
   {
     SSL_CTX_free(context);
     context = NULL;
   }
+  hmutex_unlock(&context_lock);
   return;
 }
 
 
+/*--------------------------------------------------
+FUNCTION: _hssl_ktls_probe
+DESC: Tells whether the kernel has the tls module.
+The module is loaded if needed and refuses a socket
+which is not connected yet.
+----------------------------------------------------*/
+static int
+_hssl_ktls_probe(void)
+{
+#ifdef HSSL_KTLS
+  int fd, ret;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return 0;
+  ret = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0
+    || errno == ENOTCONN;
+  close(fd);
+  return ret;
+#else
+  return 0;
+#endif
+}
+
 herror_t
 hssl_module_init(int argc, char **argv)
 {
@@ -373,6 +930,8 @@ hssl_module_init(int argc, char **argv)
   {
     _hssl_library_init();
     log_verbose1("SSL enabled");
+    if (ktls && !(ktls_available = _hssl_ktls_probe()))
+      log_verbose1("Kernel TLS not available, records handled by OpenSSL");
   }
   else
   {
@@ -386,6 +945,7 @@ void
 hssl_module_destroy(void)
 {
   _hssl_server_context_destroy();
+  _hssl_session_flush();
 
   return;
 }
@@ -398,15 +958,202 @@ hssl_enabled(void)
 }
 
 
+/*--------------------------------------------------
+FUNCTION: _hssl_session_find
+DESC: Returns the slot of the session cached for this
+server, or -1. Called with session_lock held.
+----------------------------------------------------*/
+static int
+_hssl_session_find(const char *key)
+{
+  int i;
+
+  for (i = 0; i < HSSL_SESSION_CACHE_SIZE; i++)
+    if (session_cache[i].key && !strcmp(session_cache[i].key, key))
+      return i;
+
+  return -1;
+}
+
+static void
+_hssl_session_clear(int i)
+{
+  free(session_cache[i].key);
+  if (session_cache[i].session)
+    SSL_SESSION_free(session_cache[i].session);
+  session_cache[i].key = NULL;
+  session_cache[i].session = NULL;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hssl_session_load
+DESC: Offers the session cached for this server, if
+any, for resumption.
+----------------------------------------------------*/
+static void
+_hssl_session_load(SSL * ssl, const char *key)
+{
+  SSL_SESSION *session;
+  int i;
+
+  hmutex_lock(&session_lock);
+  if ((i = _hssl_session_find(key)) >= 0)
+  {
+    session = session_cache[i].session;
+    if ((long) time(NULL) - SSL_SESSION_get_time(session) < SSL_SESSION_get_timeout(session))
+      /* takes its own reference */
+      SSL_set_session(ssl, session);
+    else
+      _hssl_session_clear(i);
+  }
+  hmutex_unlock(&session_lock);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hssl_session_store
+DESC: Keeps the current session of a client
+connection for the next connection to this server.
+----------------------------------------------------*/
+static void
+_hssl_session_store(SSL * ssl)
+{
+  SSL_SESSION *session;
+  const char *key;
+  char *copy;
+  int i;
+
+  if (session_key_index < 0
+      || !(key = (const char *) SSL_get_ex_data(ssl, session_key_index)))
+    return;
+
+  if (!(session = SSL_get1_session(ssl)))
+    return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(session))
+  {
+    SSL_SESSION_free(session);
+    return;
+  }
+#endif
+
+  if (!(copy = strdup(key)))
+  {
+    SSL_SESSION_free(session);
+    return;
+  }
+
+  hmutex_lock(&session_lock);
+  if ((i = _hssl_session_find(key)) < 0)
+  {
+    i = session_next;
+    session_next = (session_next + 1) % HSSL_SESSION_CACHE_SIZE;
+  }
+  _hssl_session_clear(i);
+  session_cache[i].key = copy;
+  /* the reference of SSL_get1_session goes to the cache */
+  session_cache[i].session = session;
+  hmutex_unlock(&session_lock);
+
+  return;
+}
+
+static void
+_hssl_session_remove(const char *key)
+{
+  int i;
+
+  hmutex_lock(&session_lock);
+  if ((i = _hssl_session_find(key)) >= 0)
+    _hssl_session_clear(i);
+  hmutex_unlock(&session_lock);
+}
+
+static void
+_hssl_session_flush(void)
+{
+  int i;
+
+  hmutex_lock(&session_lock);
+  for (i = 0; i < HSSL_SESSION_CACHE_SIZE; i++)
+    _hssl_session_clear(i);
+  hmutex_unlock(&session_lock);
+}
+
+/*--------------------------------------------------
+FUNCTION: _hssl_ktls
+DESC: Returns the directions of the connection
+handled by kernel TLS (HSSL_KTLS_SEND, HSSL_KTLS_RECV).
+----------------------------------------------------*/
+static const char *
+_hssl_ktls_name(int flags)
+{
+  switch (flags)
+  {
+  case HSSL_KTLS_SEND | HSSL_KTLS_RECV:
+    return "send and receive";
+  case HSSL_KTLS_SEND:
+    return "send only";
+  case HSSL_KTLS_RECV:
+    return "receive only";
+  default:
+    return "not available";
+  }
+}
+
+static int
+_hssl_ktls(SSL * ssl)
+{
+  int flags = 0;
+
+#ifdef HSSL_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    flags |= HSSL_KTLS_SEND;
+  if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+    flags |= HSSL_KTLS_RECV;
+#endif
+  return flags;
+}
+
+int
+hssl_ktls(hsocket_t * sock)
+{
+  return sock->ssl ? _hssl_ktls(sock->ssl) : 0;
+}
+
+int
+hssl_http2(hsocket_t * sock)
+{
+#ifdef HSSL_ALPN
+  const unsigned char *proto;
+  unsigned int length;
+
+  if (sock->ssl)
+  {
+    SSL_get0_alpn_selected(sock->ssl, &proto, &length);
+    return length == 2 && !memcmp(proto, "h2", 2);
+  }
+#endif
+  return 0;
+}
+
 herror_t
 hssl_client_ssl(hsocket_t * sock)
+{
+  return hssl_client_ssl_session(sock, NULL, 0);
+}
+
+herror_t
+hssl_client_ssl_session(hsocket_t * sock, const char *key, hclock_t deadline)
 {
   SSL *ssl;
   int ret;
 
   log_verbose1("Starting SSL client initialization");
 
-  if (!(ssl = SSL_new(context)))
+  if (!(ssl = _hssl_new()))
   {
     log_error1("Cannot create new SSL object");
     return herror_new("hssl_client_ssl", HSSL_ERROR_CLIENT, "SSL_new failed");
@@ -414,14 +1161,40 @@ hssl_client_ssl(hsocket_t * sock)
 
   SSL_set_fd(ssl, sock->sock);
 
-  if ((ret = SSL_connect(ssl)) <= 0)
+  if (key != NULL && session_key_index >= 0)
+  {
+    _hssl_session_load(ssl, key);
+    SSL_set_ex_data(ssl, session_key_index, strdup(key));
+  }
+
+#ifdef HSSL_ALPN
+  if (http2)
+    SSL_set_alpn_protos(ssl, alpn_protos, sizeof(alpn_protos) - 1);
+#endif
+
+  /* client connections stay non-blocking so that the handshake
+     and the reads also wait for the cancellation of the thread */
+  hsocket_set_blocking(sock, 0);
+
+  while ((ret = SSL_connect(ssl)) <= 0)
   {
     herror_t err;
 
-    log_error2("SSL connect error (%s)", _hssl_get_error(ssl, -1));
-    err =
-      herror_new("hssl_client_ssl", HSSL_ERROR_CONNECT,
-                 "SSL_connect failed (%s)", _hssl_get_error(ssl, ret));
+    if ((err =
+         _hssl_wait(ssl, sock->sock, ret, "hssl_client_ssl", "SSL_connect",
+                    HSSL_ERROR_CONNECT, deadline)) == H_OK)
+      continue;
+
+    if (herror_code(err) == HSOCKET_ERROR_CANCELLED)
+      log_verbose1("SSL connect cancelled");
+    else
+      log_error2("SSL connect error (%s)", herror_message(err));
+    /* a stale session must not be offered again */
+    if (key != NULL && SSL_session_reused(ssl)
+        && herror_code(err) != HSOCKET_ERROR_CANCELLED)
+      _hssl_session_remove(key);
+    if (session_key_index >= 0)
+      free(SSL_get_ex_data(ssl, session_key_index));
     SSL_free(ssl);
     return err;
   }
@@ -435,6 +1208,18 @@ hssl_client_ssl(hsocket_t * sock)
      did not verify"); SSL_free(ssl); return herror_new("hssl_client_ssl",
      HSSL_ERROR_CERTIFICATE, "Verfiy certificate failed"); } */
 
+  if (key != NULL)
+  {
+    log_verbose3("SSL session for %s %s", key,
+                 SSL_session_reused(ssl) ? "resumed" : "created");
+    /* TLS 1.3 tickets come later and are stored by hssl_cleanup */
+    if (!SSL_session_reused(ssl))
+      _hssl_session_store(ssl);
+  }
+
+  if (ktls && ktls_available)
+    log_verbose2("kernel TLS: %s", _hssl_ktls_name(_hssl_ktls(ssl)));
+
   log_verbose1("SSL client initialization completed");
 
   sock->ssl = ssl;
@@ -442,12 +1227,15 @@ hssl_client_ssl(hsocket_t * sock)
   return H_OK;
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 static int
 _hssl_bio_read(BIO * b, char *out, int outl)
 {
+  int ret = hsocket_select_read(b->num, out, outl);
 
-  return hsocket_select_read(b->num, out, outl);;
+  return ret < 0 ? -1 : ret;
 }
+#endif
 
 herror_t
 hssl_server_ssl(hsocket_t * sock)
@@ -461,7 +1249,7 @@ hssl_server_ssl(hsocket_t * sock)
 
   log_verbose2("Starting SSL initialization for socket %d", sock->sock);
 
-  if (!(ssl = SSL_new(context)))
+  if (!(ssl = _hssl_new()))
   {
     log_warn1("SSL_new failed");
     return herror_new("hssl_server_ssl", HSSL_ERROR_SERVER,
@@ -477,7 +1265,9 @@ hssl_server_ssl(hsocket_t * sock)
     return NULL;
   }
   // BIO_set_callback(sbio, hssl_bio_cb);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
   sbio->method->bread = _hssl_bio_read;
+#endif
   SSL_set_bio(ssl, sbio, sbio);
 
 
@@ -495,6 +1285,9 @@ hssl_server_ssl(hsocket_t * sock)
     return err;
   }
 
+  if (ktls && ktls_available)
+    log_verbose3("kernel TLS on socket %d: %s", sock->sock, _hssl_ktls_name(_hssl_ktls(ssl)));
+
   sock->ssl = ssl;
 
   return H_OK;
@@ -506,6 +1299,11 @@ hssl_cleanup(hsocket_t * sock)
 {
   if (sock->ssl)
   {
+    if (session_key_index >= 0 && SSL_get_ex_data(sock->ssl, session_key_index))
+    {
+      _hssl_session_store(sock->ssl);
+      free(SSL_get_ex_data(sock->ssl, session_key_index));
+    }
     SSL_shutdown(sock->ssl);
     SSL_free(sock->ssl);
     sock->ssl = NULL;
@@ -517,20 +1315,30 @@ hssl_cleanup(hsocket_t * sock)
 herror_t
 hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 {
+  herror_t status;
   int count;
 
 /* log_verbose4("sock->sock=%d sock->ssl=%p, len=%li", sock->sock, sock->ssl, len); */
 
   if (sock->ssl)
   {
-    if ((count = SSL_read(sock->ssl, buf, len)) < 1)
-      return herror_new("SSL_read", HSOCKET_ERROR_RECEIVE,
-                        "SSL_read failed (%s)", _hssl_get_error(sock->ssl,
-                                                                count));
+    while ((count = SSL_read(sock->ssl, buf, len)) < 1)
+    {
+      if ((status =
+           _hssl_wait(sock->ssl, sock->sock, count, "SSL_read", "SSL_read",
+                      HSOCKET_ERROR_RECEIVE, 0)) != H_OK)
+        return status;
+    }
   }
   else
   {
-    if ((count = hsocket_select_read(sock->sock, buf, len)) == -1)
+    if ((count = hsocket_select_read(sock->sock, buf, len)) == HSOCKET_CANCELLED)
+      return herror_new("hssl_read", HSOCKET_ERROR_CANCELLED,
+                        "recv cancelled");
+    if (count == HSOCKET_CLOSED)
+      return herror_new("hssl_read", HSOCKET_ERROR_CLOSED,
+                        "Connection closed by peer");
+    if (count == -1)
       return herror_new("hssl_read", HSOCKET_ERROR_RECEIVE,
                         "recv failed (%s)", strerror(errno));
   }
@@ -543,28 +1351,60 @@ hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 herror_t
 hssl_write(hsocket_t * sock, const char *buf, size_t len, size_t * sent)
 {
+  herror_t status;
   int count;
 
 /*  log_verbose4("sock->sock=%d, sock->ssl=%p, len=%li", sock->sock, sock->ssl, len); */
 
   if (sock->ssl)
   {
-    if ((count = SSL_write(sock->ssl, buf, len)) == -1)
-      return herror_new("SSL_write", HSOCKET_ERROR_SEND,
-                        "SSL_write failed (%s)", _hssl_get_error(sock->ssl,
-                                                                 count));
+    while ((count = SSL_write(sock->ssl, buf, len)) <= 0)
+    {
+      if ((status =
+           _hssl_wait(sock->ssl, sock->sock, count, "SSL_write", "SSL_write",
+                      HSOCKET_ERROR_SEND, 0)) != H_OK)
+        return status;
+    }
   }
   else
   {
-    if ((count = send(sock->sock, buf, len, 0)) == -1)
-      return herror_new("hssl_write", HSOCKET_ERROR_SEND, "send failed (%s)",
-                        strerror(errno));
+    return _hssl_plain_send(sock, buf, len, sent);
   }
   *sent = count;
 
   return H_OK;
 }
 
+
+herror_t
+hssl_read_nowait(hsocket_t * sock, char *buf, size_t len, size_t * received)
+{
+  int count;
+
+  if (!sock->ssl)
+    return _hssl_plain_read_nowait(sock, buf, len, received);
+
+  if ((count = SSL_read(sock->ssl, buf, len)) > 0)
+  {
+    *received = count;
+    return H_OK;
+  }
+
+  switch (SSL_get_error(sock->ssl, count))
+  {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    *received = 0;
+    return H_OK;
+  case SSL_ERROR_ZERO_RETURN:
+    return herror_new("hssl_read_nowait", HSOCKET_ERROR_SSLCLOSE,
+                      "Connection closed by peer");
+  default:
+    return herror_new("hssl_read_nowait", HSOCKET_ERROR_RECEIVE,
+                      "SSL_read failed (%s)", _hssl_get_error(sock->ssl, count));
+  }
+}
+
 #else
 
 herror_t
@@ -572,7 +1412,12 @@ hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 {
   int count;
 
-  if ((count = hsocket_select_read(sock->sock, buf, len)) == -1)
+  if ((count = hsocket_select_read(sock->sock, buf, len)) == HSOCKET_CANCELLED)
+    return herror_new("hssl_read", HSOCKET_ERROR_CANCELLED, "recv cancelled");
+  if (count == HSOCKET_CLOSED)
+    return herror_new("hssl_read", HSOCKET_ERROR_CLOSED,
+                      "Connection closed by peer");
+  if (count == -1)
     return herror_new("hssl_read", HSOCKET_ERROR_RECEIVE, "recv failed (%s)",
                       strerror(errno));
   *received = count;
@@ -583,13 +1428,14 @@ hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 herror_t
 hssl_write(hsocket_t * sock, const char *buf, size_t len, size_t * sent)
 {
-  int count;
+  return _hssl_plain_send(sock, buf, len, sent);
+}
 
-  if ((count = send(sock->sock, buf, len, 0)) == -1)
-    return herror_new("hssl_write", HSOCKET_ERROR_SEND, "send failed (%s)",
-                      strerror(errno));
-  *sent = count;
-  return H_OK;
+
+herror_t
+hssl_read_nowait(hsocket_t * sock, char *buf, size_t len, size_t * received)
+{
+  return _hssl_plain_read_nowait(sock, buf, len, received);
 }
 
 #endif
@@ -28,6 +28,20 @@
 #include <config.h>
 #endif
 
+/* certificate and CA files are checked for changes at most this often (seconds) */
+#define HSSL_RELOAD_INTERVAL	60
+
+/* verified peer certificates remembered, and for how long (seconds) */
+#define HSSL_VERIFY_CACHE_SIZE	64
+#define HSSL_VERIFY_CACHE_TTL	3600
+
+/* client sessions kept for resumption, one per server */
+#define HSSL_SESSION_CACHE_SIZE	32
+
+/* hssl_ktls() flags */
+#define HSSL_KTLS_SEND	1
+#define HSSL_KTLS_RECV	2
+
 #ifdef HAVE_SSL
 
 #ifdef HAVE_OPENSSL_SSL_H
@@ -51,6 +65,20 @@ extern "C"
   void hssl_set_certpass(char *c);
   void hssl_set_ca(char *c);
   void hssl_enable(void);
+/**
+ * Turns kernel TLS (Linux, OpenSSL 3 with enable-ktls) on or off for
+ * the connections made after the next hssl_module_init. It is off by
+ * default; when it is on, hssl_module_init checks that the kernel has
+ * the tls module and connections fall back to user space records when
+ * the kernel cannot take over a cipher.
+ */
+  void hssl_set_ktls(int on);
+/**
+ * Turns HTTP/2 on or off for the connections made after the next
+ * hssl_module_init: the clients offer "h2" by ALPN before
+ * "http/1.1" and the server accepts it. Off by default.
+ */
+  void hssl_set_http2(int on);
 
   int hssl_enabled(void);
 
@@ -60,10 +88,29 @@ extern "C"
  *
  */
   herror_t hssl_client_ssl(hsocket_t * sock);
+/**
+ * Like hssl_client_ssl, resuming and keeping the TLS session of the
+ * server key ("host:port") in the memory of the process. The
+ * handshake fails with HSSL_ERROR_CONNECT at deadline (hclock_ms()
+ * value), 0 for none.
+ */
+  herror_t hssl_client_ssl_session(hsocket_t * sock, const char *key,
+                                   hclock_t deadline);
   herror_t hssl_server_ssl(hsocket_t * sock);
 
   void hssl_cleanup(hsocket_t * sock);
 
+/**
+ * @returns the directions handled by kernel TLS on the connection,
+ *          HSSL_KTLS_SEND and/or HSSL_KTLS_RECV, 0 for none.
+ */
+  int hssl_ktls(hsocket_t * sock);
+
+/**
+ * @returns 1 if HTTP/2 was negotiated by ALPN on the connection.
+ */
+  int hssl_http2(hsocket_t * sock);
+
 /*
  * Callback for password checker
  */
@@ -115,6 +162,12 @@ hssl_client_ssl(hsocket_t * sock)
   return H_OK;
 }
 
+static inline herror_t
+hssl_client_ssl_session(hsocket_t * sock, const char *key, hclock_t deadline)
+{
+  return H_OK;
+}
+
 static inline herror_t
 hssl_server_ssl(hsocket_t * sock)
 {
@@ -127,6 +180,30 @@ hssl_cleanup(hsocket_t * sock)
   return;
 }
 
+static inline void
+hssl_set_ktls(int on)
+{
+  return;
+}
+
+static inline int
+hssl_ktls(hsocket_t * sock)
+{
+  return 0;
+}
+
+static inline void
+hssl_set_http2(int on)
+{
+  return;
+}
+
+static inline int
+hssl_http2(hsocket_t * sock)
+{
+  return 0;
+}
+
 #endif /* HAVE_SSL */
 
 #ifdef __cplusplus
@@ -138,6 +215,12 @@ extern "C"
                      size_t * received);
   herror_t hssl_write(hsocket_t * sock, const char *buf, size_t len,
                       size_t * sent);
+/**
+ * Reads what the connection has without waiting, the socket must be
+ * non-blocking. *received is 0 if there is nothing yet.
+ */
+  herror_t hssl_read_nowait(hsocket_t * sock, char *buf, size_t len,
+                            size_t * received);
 
 #ifdef __cplusplus
 }
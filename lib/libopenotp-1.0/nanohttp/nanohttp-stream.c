@@ -29,6 +29,10 @@
 #include <stdio.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -43,6 +47,7 @@
 
 #include "nanohttp-logging.h"
 #include "nanohttp-stream.h"
+#include "nanohttp-pool.h"
 
 /*
 -------------------------------------------------------------------
@@ -52,12 +57,6 @@ HTTP INPUT STREAM
 -------------------------------------------------------------------
 */
 
-static int
-_http_stream_is_content_length(hpair_t * header)
-{
-  return hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH) != NULL;
-}
-
 static int
 _http_stream_is_chunked(hpair_t * header)
 {
@@ -86,7 +85,7 @@ http_input_stream_new(hsocket_t *sock, hpair_t * header)
   /* Paranoya check */
   /* if (header == NULL) return NULL; */
   /* Create object */
-  if (!(result = (http_input_stream_t *) malloc(sizeof(http_input_stream_t))))
+  if (!(result = (http_input_stream_t *) hpool_alloc(sizeof(http_input_stream_t))))
   {
     log_error2("malloc failed (%s)", strerror(errno));
     return NULL;
@@ -94,14 +93,16 @@ http_input_stream_new(hsocket_t *sock, hpair_t * header)
 
   result->sock = sock;
   result->err = H_OK;
+  result->buffer = NULL;
 
   /* Find connection type */
-  hpairnode_dump_deep(header);
+  if (hlog_enabled(HLOG_VERBOSE))
+    hpairnode_dump_deep(header);
   /* Check if Content-type */
-  if (_http_stream_is_content_length(header))
+  if ((content_length =
+       hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH)) != NULL)
   {
     log_verbose1("Stream transfer with 'Content-length'");
-    content_length = hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH);
     result->content_length = atoi(content_length);
     result->received = 0;
     result->type = HTTP_TRANSFER_CONTENT_LENGTH;
@@ -143,7 +144,7 @@ http_input_stream_new_from_file(const char *filename)
   }
 
   /* Create object */
-  if (!(result = (http_input_stream_t *) malloc(sizeof(http_input_stream_t)))) 
+  if (!(result = (http_input_stream_t *) hpool_alloc(sizeof(http_input_stream_t)))) 
   {
     log_error2("malloc failed (%s)", strerror(errno));
     fclose(fd);
@@ -153,11 +154,38 @@ http_input_stream_new_from_file(const char *filename)
   result->type = HTTP_TRANSFER_FILE;
   result->fd = fd;
   result->deleteOnExit = 0;
+  result->buffer = NULL;
   strcpy(result->filename, filename);
 
   return result;
 }
 
+/**
+  Creates a new input stream reading a memory buffer,
+  which it frees with itself.
+*/
+http_input_stream_t *
+http_input_stream_new_from_buffer(byte_t * buffer, int size)
+{
+  http_input_stream_t *result;
+
+  if (!(result = (http_input_stream_t *) hpool_alloc(sizeof(http_input_stream_t))))
+  {
+    log_error2("malloc failed (%s)", strerror(errno));
+    return NULL;
+  }
+
+  result->sock = NULL;
+  result->err = H_OK;
+  result->type = HTTP_TRANSFER_BUFFER;
+  result->buffer = buffer;
+  result->content_length = size;
+  result->received = 0;
+  result->fd = NULL;
+
+  return result;
+}
+
 /**
   Free input stream
 */
@@ -171,8 +199,12 @@ http_input_stream_free(http_input_stream_t * stream)
       log_info2("Removing '%s'", stream->filename);
     /* remove(stream->filename); */
   }
+  else if (stream->type == HTTP_TRANSFER_BUFFER)
+  {
+    free(stream->buffer);
+  }
 
-  free(stream);
+  hpool_free(stream);
 }
 
 static int
@@ -199,6 +231,19 @@ _http_input_stream_is_file_ready(http_input_stream_t * stream)
   return !feof(stream->fd);
 }
 
+static int
+_http_input_stream_buffer_read(http_input_stream_t * stream, byte_t * dest,
+                               int size)
+{
+  if (stream->content_length - stream->received < size)
+    size = stream->content_length - stream->received;
+
+  memcpy(dest, stream->buffer + stream->received, size);
+  stream->received += size;
+
+  return size;
+}
+
 static int
 _http_input_stream_content_length_read(http_input_stream_t * stream,
                                        byte_t * dest, int size)
@@ -281,6 +326,38 @@ _http_input_stream_chunked_read_chunk_size(http_input_stream_t * stream)
   return -1;
 }
 
+/*
+  Consumes the (usually empty) trailer after the last chunk, so the
+  next response on a keep-alive connection starts at a status line.
+*/
+static int
+_http_input_stream_chunked_read_trailer(http_input_stream_t * stream)
+{
+  int status, len = 0;
+  byte_t ch;
+  herror_t err;
+
+  while (1)
+  {
+    if ((err = hsocket_read(stream->sock, &ch, 1, 1, &status)) != H_OK)
+    {
+      stream->err = err;
+      return -1;
+    }
+
+    if (ch == '\n')
+    {
+      if (len == 0)
+        return 0;
+      len = 0;
+    }
+    else if (ch != '\r')
+    {
+      len++;
+    }
+  }
+}
+
 static int
 _http_input_stream_chunked_read(http_input_stream_t * stream, byte_t * dest,
                                 int size)
@@ -290,6 +367,10 @@ _http_input_stream_chunked_read(http_input_stream_t * stream, byte_t * dest,
   char ch;
   herror_t err;
 
+  /* last chunk already received */
+  if (stream->chunk_size == 0)
+    return 0;
+
   while (size > 0)
   {
     remain = stream->chunk_size - stream->received;
@@ -334,6 +415,8 @@ _http_input_stream_chunked_read(http_input_stream_t * stream, byte_t * dest,
       }
       else if (stream->chunk_size == 0)
       {
+        if (_http_input_stream_chunked_read_trailer(stream) < 0)
+          return -1;
         return read;
       }
       remain = stream->chunk_size;
@@ -445,6 +528,8 @@ http_input_stream_is_ready(http_input_stream_t * stream)
     return _http_input_stream_is_connection_closed_ready(stream);
   case HTTP_TRANSFER_FILE:
     return _http_input_stream_is_file_ready(stream);
+  case HTTP_TRANSFER_BUFFER:
+    return _http_input_stream_is_content_length_ready(stream);
   default:
     return 0;
   }
@@ -482,6 +567,9 @@ http_input_stream_read(http_input_stream_t * stream, byte_t * dest, int size)
   case HTTP_TRANSFER_FILE:
     len = _http_input_stream_file_read(stream, dest, size);
     break;
+  case HTTP_TRANSFER_BUFFER:
+    len = _http_input_stream_buffer_read(stream, dest, size);
+    break;
   default:
     stream->err = herror_new("http_input_stream_read",
                              STREAM_ERROR_INVALID_TYPE,
@@ -517,7 +605,7 @@ http_output_stream_new(hsocket_t *sock, hpair_t * header)
     return NULL;
 */
   /* Create object */
-  if (!(result = (http_output_stream_t *) malloc(sizeof(http_output_stream_t))))
+  if (!(result = (http_output_stream_t *) hpool_alloc(sizeof(http_output_stream_t))))
   {
     log_error2("malloc failed (%s)", strerror(errno));
     return NULL;
@@ -525,14 +613,15 @@ http_output_stream_new(hsocket_t *sock, hpair_t * header)
 
   result->sock = sock;
   result->sent = 0;
+  result->buffer = NULL;
 
   /* Find connection type */
 
   /* Check if Content-type */
-  if (_http_stream_is_content_length(header))
+  if ((content_length =
+       hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH)) != NULL)
   {
     log_verbose1("Stream transfer with 'Content-length'");
-    content_length = hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH);
     result->content_length = atoi(content_length);
     result->type = HTTP_TRANSFER_CONTENT_LENGTH;
   }
@@ -552,17 +641,75 @@ http_output_stream_new(hsocket_t *sock, hpair_t * header)
   return result;
 }
 
+/**
+  Creates a new output stream collecting the data in memory.
+*/
+http_output_stream_t *
+http_output_stream_new_buffer(void)
+{
+  http_output_stream_t *result;
+
+  if (!(result = (http_output_stream_t *) hpool_alloc(sizeof(http_output_stream_t))))
+  {
+    log_error2("malloc failed (%s)", strerror(errno));
+    return NULL;
+  }
+
+  result->sock = NULL;
+  result->type = HTTP_TRANSFER_BUFFER;
+  result->sent = 0;
+  result->content_length = 0;
+  result->buffer = NULL;
+
+  return result;
+}
+
+const byte_t *
+http_output_stream_buffer(http_output_stream_t * stream, int *size)
+{
+  *size = stream->type == HTTP_TRANSFER_BUFFER ? stream->sent : 0;
+
+  return *size > 0 ? stream->buffer : NULL;
+}
+
 /**
   Free output stream
 */
 void
 http_output_stream_free(http_output_stream_t * stream)
 {
-  free(stream);
+  if (stream->type == HTTP_TRANSFER_BUFFER)
+    free(stream->buffer);
+
+  hpool_free(stream);
 
   return;
 }
 
+static herror_t
+_http_output_stream_buffer_write(http_output_stream_t * stream,
+                                 const byte_t * bytes, int size)
+{
+  byte_t *buffer;
+  int length;
+
+  if (stream->sent + size > stream->content_length)
+  {
+    for (length = stream->content_length ? stream->content_length : 1024;
+         length < stream->sent + size; length *= 2);
+    if (!(buffer = (byte_t *) realloc(stream->buffer, length)))
+      return herror_new("http_output_stream_write", GENERAL_INVALID_PARAM,
+                        "Memory allocation failed");
+    stream->buffer = buffer;
+    stream->content_length = length;
+  }
+
+  memcpy(stream->buffer + stream->sent, bytes, size);
+  stream->sent += size;
+
+  return H_OK;
+}
+
 /**
   Writes 'size' bytes of 'bytes' into stream.
   Returns socket error flags or H_OK.
@@ -574,6 +721,9 @@ http_output_stream_write(http_output_stream_t * stream,
   herror_t status;
   char chunked[15];
 
+  if (stream->type == HTTP_TRANSFER_BUFFER)
+    return _http_output_stream_buffer_write(stream, bytes, size);
+
   if (stream->type == HTTP_TRANSFER_CHUNKED)
   {
     sprintf(chunked, "%x\r\n", size);
@@ -72,7 +72,11 @@ typedef enum http_transfer_type
 
   /** This transfer style will be used by MIME support 
     and for debug purposes.*/
-  HTTP_TRANSFER_FILE
+  HTTP_TRANSFER_FILE,
+
+  /** The stream reads/writes a memory buffer (messages of
+    HTTP/2 streams) */
+  HTTP_TRANSFER_BUFFER
 } http_transfer_type_t;
 
 
@@ -94,6 +98,9 @@ typedef struct http_input_stream
   FILE *fd;
   char filename[255];
   int deleteOnExit;             /* default is 0 */
+
+  /* buffer handling, 'received' is the read offset */
+  byte_t *buffer;
 } http_input_stream_t;
 
 
@@ -107,6 +114,9 @@ typedef struct http_output_stream
   http_transfer_type_t type;
   int content_length;
   int sent;
+
+  /* buffer handling, 'sent' bytes used of 'content_length' */
+  byte_t *buffer;
 } http_output_stream_t;
 
 
@@ -153,6 +163,23 @@ http_input_stream_t *http_input_stream_new(hsocket_t *sock, hpair_t *header);
 http_input_stream_t *http_input_stream_new_from_file(const char *filename);
 
 
+/**
+  Creates a new input stream reading a memory buffer. The
+  transfer style is always HTTP_TRANSFER_BUFFER.
+
+  @param buffer the data, allocated with malloc(). The stream
+    owns it and frees it with itself.
+  @param size the size of the data
+
+  @returns a http_input_stream_t object or NULL if there is
+  no memory left.
+
+  @see   http_input_stream_free
+*/
+http_input_stream_t *http_input_stream_new_from_buffer(byte_t * buffer,
+                                                       int size);
+
+
 /**
   Free input stream. Note that the socket will not be closed
   by this functions.
@@ -220,6 +247,28 @@ http_output_stream_t *http_output_stream_new(hsocket_t *sock,
                                              hpair_t * header);
 
 
+/**
+  Creates a new output stream collecting the data in memory
+  instead of sending it. The transfer style is always
+  HTTP_TRANSFER_BUFFER.
+
+  @returns a http_output_stream_t object or NULL if there is
+  no memory left.
+
+  @see http_output_stream_buffer, http_output_stream_free
+*/
+http_output_stream_t *http_output_stream_new_buffer(void);
+
+
+/**
+  Returns the data written to a HTTP_TRANSFER_BUFFER stream
+  and its size, NULL if there is none. The buffer belongs to
+  the stream.
+*/
+const byte_t *http_output_stream_buffer(http_output_stream_t * stream,
+                                        int *size);
+
+
 /**
   Free output stream. Note that this functions will not 
   close any socket connections.
@@ -0,0 +1,350 @@
+/******************************************************************
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2013  RCDevs SA
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+******************************************************************/
+#ifndef NANO_HTTP_THREAD_H
+#define NANO_HTTP_THREAD_H
+
+/*
+  Small portability layer for the locks, atomic counters, clocks
+  and background threads used by the client side modules. The
+  server keeps its own WIN32/pthread code in nanohttp-server.c.
+*/
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#ifdef WIN32
+
+typedef HANDLE hmutex_t;
+#define HMUTEX_INITIALIZER NULL
+
+typedef unsigned (__stdcall *hthread_func_t)(void *);
+
+typedef HANDLE hthread_t;
+
+typedef HANDLE hevent_t;
+
+#define HTHREAD_LOCAL __declspec(thread)
+
+#define hatomic_inc(ptr)	InterlockedIncrement(ptr)
+#define hatomic_dec(ptr)	InterlockedDecrement(ptr)
+#define hatomic_barrier()	MemoryBarrier()
+#define hatomic_cas(ptr, old, new)	(InterlockedCompareExchange(ptr, new, old) == (old))
+
+#else
+
+typedef pthread_mutex_t hmutex_t;
+#define HMUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+typedef void *(*hthread_func_t)(void *);
+
+typedef pthread_t hthread_t;
+
+#define HTHREAD_LOCAL __thread
+
+typedef struct hevent
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int set;
+} hevent_t;
+
+#define hatomic_inc(ptr)	__sync_add_and_fetch(ptr, 1)
+#define hatomic_dec(ptr)	__sync_sub_and_fetch(ptr, 1)
+#define hatomic_barrier()	__sync_synchronize()
+#define hatomic_cas(ptr, old, new)	__sync_bool_compare_and_swap(ptr, old, new)
+
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Locks a statically initialized (HMUTEX_INITIALIZER) mutex.
+  On WIN32 the mutex object is created on first use.
+*/
+static inline void
+hmutex_lock(hmutex_t *mutex)
+{
+#ifdef WIN32
+  if (*mutex == NULL)
+  {
+    HANDLE m = CreateMutex(NULL, FALSE, NULL);
+    if (InterlockedCompareExchangePointer((PVOID *) mutex, m, NULL) != NULL)
+      CloseHandle(m);
+  }
+  WaitForSingleObject(*mutex, INFINITE);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline void
+hmutex_unlock(hmutex_t *mutex)
+{
+#ifdef WIN32
+  ReleaseMutex(*mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+/**
+  Initializes a mutex which is not statically allocated.
+
+  @returns 0 on success, -1 if the mutex could not be created.
+*/
+static inline int
+hmutex_init(hmutex_t *mutex)
+{
+#ifdef WIN32
+  *mutex = CreateMutex(NULL, FALSE, NULL);
+  return *mutex != NULL ? 0 : -1;
+#else
+  return pthread_mutex_init(mutex, NULL) ? -1 : 0;
+#endif
+}
+
+static inline void
+hmutex_destroy(hmutex_t *mutex)
+{
+#ifdef WIN32
+  if (*mutex != NULL)
+    CloseHandle(*mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+/**
+  One-shot event: hevent_wait() returns once hevent_set() has
+  been called, also if it was called before the wait.
+
+  @returns 0 on success, -1 if the event could not be created.
+*/
+static inline int
+hevent_init(hevent_t *event)
+{
+#ifdef WIN32
+  *event = CreateEvent(NULL, TRUE, FALSE, NULL);
+  return *event != NULL ? 0 : -1;
+#else
+  event->set = 0;
+  if (pthread_mutex_init(&event->mutex, NULL))
+    return -1;
+  if (pthread_cond_init(&event->cond, NULL))
+  {
+    pthread_mutex_destroy(&event->mutex);
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+static inline void
+hevent_set(hevent_t *event)
+{
+#ifdef WIN32
+  SetEvent(*event);
+#else
+  pthread_mutex_lock(&event->mutex);
+  event->set = 1;
+  pthread_cond_broadcast(&event->cond);
+  pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/**
+  Clears the event so that it can be waited for again. A
+  hevent_set() racing with the reset may be lost: check the
+  condition after the reset, before waiting.
+*/
+static inline void
+hevent_reset(hevent_t *event)
+{
+#ifdef WIN32
+  ResetEvent(*event);
+#else
+  pthread_mutex_lock(&event->mutex);
+  event->set = 0;
+  pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+static inline void
+hevent_wait(hevent_t *event)
+{
+#ifdef WIN32
+  WaitForSingleObject(*event, INFINITE);
+#else
+  pthread_mutex_lock(&event->mutex);
+  while (!event->set)
+    pthread_cond_wait(&event->cond, &event->mutex);
+  pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/**
+  Waits for the event at most 'msec' milliseconds.
+
+  @returns 0 if the event was set, -1 on timeout.
+*/
+static inline int
+hevent_timedwait(hevent_t *event, long msec)
+{
+#ifdef WIN32
+  return WaitForSingleObject(*event, (DWORD) msec) == WAIT_OBJECT_0 ? 0 : -1;
+#else
+  struct timespec ts;
+  int ret = 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += msec / 1000;
+  ts.tv_nsec += (msec % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&event->mutex);
+  while (!event->set && ret == 0)
+    ret = pthread_cond_timedwait(&event->cond, &event->mutex, &ts);
+  ret = event->set ? 0 : -1;
+  pthread_mutex_unlock(&event->mutex);
+  return ret;
+#endif
+}
+
+static inline void
+hevent_destroy(hevent_t *event)
+{
+#ifdef WIN32
+  CloseHandle(*event);
+#else
+  pthread_cond_destroy(&event->cond);
+  pthread_mutex_destroy(&event->mutex);
+#endif
+}
+
+/**
+  Starts a detached thread.
+
+  @returns 0 on success, -1 if the thread could not be created.
+*/
+static inline int
+hthread_start(hthread_func_t func, void *data)
+{
+#ifdef WIN32
+  HANDLE tid;
+
+  if ((tid = (HANDLE) _beginthreadex(NULL, 65535, func, data, 0, NULL)) == 0)
+    return -1;
+  CloseHandle(tid);
+#else
+  pthread_t tid;
+  pthread_attr_t attr;
+  int err;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create(&tid, &attr, func, data);
+  pthread_attr_destroy(&attr);
+  if (err)
+    return -1;
+#endif
+  return 0;
+}
+
+/**
+  Starts a thread which must be waited for with hthread_join().
+
+  @returns 0 on success, -1 if the thread could not be created.
+*/
+static inline int
+hthread_create(hthread_t *thread, hthread_func_t func, void *data)
+{
+#ifdef WIN32
+  if ((*thread = (HANDLE) _beginthreadex(NULL, 65535, func, data, 0, NULL)) == 0)
+    return -1;
+  return 0;
+#else
+  return pthread_create(thread, NULL, func, data) ? -1 : 0;
+#endif
+}
+
+/**
+  Waits for a thread started with hthread_create() to return.
+*/
+static inline void
+hthread_join(hthread_t thread)
+{
+#ifdef WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+/**
+  Time of hclock_ms(), 64 bits on every platform so that it does not
+  wrap (a 32 bit tick count wraps after 49.7 days of uptime).
+*/
+typedef long long hclock_t;
+
+/**
+  Monotonic clock in milliseconds, for measuring intervals only.
+*/
+static inline hclock_t
+hclock_ms(void)
+{
+#ifdef WIN32
+  return (hclock_t) GetTickCount64();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+#endif
+}
+
+static inline void
+hthread_msleep(int msec)
+{
+#ifdef WIN32
+  Sleep(msec);
+#else
+  usleep(msec * 1000);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,16 +20,45 @@
 #include "openotp.h"
 #include "libcsoap/soap-client.h"
 #include "nanohttp/nanohttp-client.h"
+#include "nanohttp/nanohttp-cache.h"
+#include "nanohttp/nanohttp-pool.h"
+#include "nanohttp/nanohttp-secure.h"
+#include "endpoint.h"
+#include "broker.h"
 #ifdef HAVE_SSL
 #include "nanohttp/nanohttp-ssl.h"
 #endif
 
-#define OPENOTP_SIMPLE_LOGIN 1
-#define OPENOTP_NORMAL_LOGIN 2
-#define OPENOTP_COMPAT_LOGIN 3
-
 char *__openotp_url1 = NULL;
 char *__openotp_url2 = NULL;
+static char *__openotp_broker = NULL;
+
+static endpoint_group_t __openotp_endpoints = ENDPOINT_GROUP_INITIALIZER("OpenOTP", OPENOTP_URN, OPENOTP_STATUS_METHOD, OPENOTP_STATUS_RESPONSE);
+
+// names of the responses, shared by the XML parsers of all the threads
+static const char *const __openotp_names[] = {
+   OPENOTP_URN, OPENOTP_SIMPLE_LOGIN_RESPONSE, OPENOTP_NORMAL_LOGIN_RESPONSE, OPENOTP_COMPAT_LOGIN_RESPONSE,
+   OPENOTP_CHALLENGE_RESPONSE, OPENOTP_STATUS_RESPONSE, "code", "message", "session", "timeout", "data", "status", NULL
+};
+
+// domain routing (see openotp_route_add), set up before the first request and the prober start,
+// then sealed and only read afterwards, without lock
+#define OPENOTP_ROUTE_MAX 32
+#define OPENOTP_ROUTE_SLOTS 64   // power of two, twice OPENOTP_ROUTE_MAX at least
+
+typedef struct openotp_route_t {
+   char *domain;
+   unsigned int hash;       // endpoint_hash() of the domain
+   int policy;
+   char *urls;              // copy of the URL list, split in place
+   endpoint_group_t group;
+} openotp_route_t;
+
+static openotp_route_t *__openotp_routes[OPENOTP_ROUTE_MAX];
+static openotp_route_t *__openotp_route_table[OPENOTP_ROUTE_SLOTS];   // open addressing on the domain hash
+static int __openotp_route_count = 0;
+static hmutex_t __openotp_route_lock = HMUTEX_INITIALIZER;   // openotp_route_add() against the sealing
+static volatile long __openotp_route_sealed = 0;
 
 int openotp_initialize (char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)()) {
    herror_t err = H_OK;
@@ -44,6 +73,14 @@ int openotp_initialize (char *url, char *cert, char *pass, char *ca, int timeout
       return 0;
    }
    
+   // requests are forwarded to a local broker process (see openotp_broker_serve)
+   if (strncmp(url, BROKER_URL_PREFIX, strlen(BROKER_URL_PREFIX)) == 0) {
+      __openotp_url1 = url;
+      __openotp_url2 = NULL;
+      __openotp_broker = url + strlen(BROKER_URL_PREFIX);
+      return 1;
+   }
+   
    char *ptr = strchr(url, ',');
    if (ptr != NULL) {
       __openotp_url1 = url;
@@ -53,6 +90,7 @@ int openotp_initialize (char *url, char *cert, char *pass, char *ca, int timeout
       __openotp_url1 = url;
       __openotp_url2 = NULL;
    }
+   endpoint_group_set(&__openotp_endpoints, __openotp_url1, __openotp_url2);
    
    #ifdef HAVE_SSL
    if ((__openotp_url1 != NULL && strncmp(__openotp_url1, "https://", 8) == 0) ||
@@ -80,16 +118,181 @@ int openotp_initialize (char *url, char *cert, char *pass, char *ca, int timeout
       herror_release(err);
       return 0;
    }
+   soap_env_parser_seed(__openotp_names);
    
    if (timeout != 0) httpd_set_timeout(timeout);
    return 1;
 }
 
+static openotp_route_t *openotp_route_find(const char *domain) {
+   openotp_route_t *route;
+   unsigned int hash, slot;
+   
+   hash = endpoint_hash(domain);
+   for (slot = hash & (OPENOTP_ROUTE_SLOTS-1); (route = __openotp_route_table[slot]) != NULL; slot = (slot+1) & (OPENOTP_ROUTE_SLOTS-1)) {
+      if (route->hash == hash && strcasecmp(route->domain, domain) == 0) return route;
+   }
+   return NULL;
+}
+
+static void openotp_route_free(openotp_route_t *route) {
+   if (route->domain != NULL) free(route->domain);
+   if (route->urls != NULL) free(route->urls);
+   free(route);
+}
+
+static void openotp_route_clear(void) {
+   int i;
+   
+   hmutex_lock(&__openotp_route_lock);
+   for (i = 0; i < __openotp_route_count; i++) {
+      endpoint_group_reset(&__openotp_routes[i]->group);
+      hmutex_destroy(&__openotp_routes[i]->group.lock);
+      openotp_route_free(__openotp_routes[i]);
+      __openotp_routes[i] = NULL;
+   }
+   memset(__openotp_route_table, 0, sizeof(__openotp_route_table));
+   __openotp_route_count = 0;
+   __openotp_route_sealed = 0;
+   hmutex_unlock(&__openotp_route_lock);
+}
+
+// refuses new routes from now on: a route added by openotp_route_add() is complete once sealed
+static void openotp_route_seal(void) {
+   if (__openotp_route_sealed) {
+      hatomic_barrier();
+      return;
+   }
+   hmutex_lock(&__openotp_route_lock);
+   __openotp_route_sealed = 1;
+   hmutex_unlock(&__openotp_route_lock);
+}
+
+// servers of a user, and the one to try first or -1
+static endpoint_group_t *openotp_route(const char *domain, const char *username, int *preferred) {
+   openotp_route_t *route = NULL;
+   const char *suffix;
+   
+   *preferred = -1;
+   openotp_route_seal();
+   if (__openotp_route_count == 0) return &__openotp_endpoints;
+   
+   if (domain != NULL && *domain != 0) route = openotp_route_find(domain);
+   else if (username != NULL && (suffix = strrchr(username, '@')) != NULL) route = openotp_route_find(suffix+1);
+   if (route == NULL) return &__openotp_endpoints;
+   
+   if (route->policy == OPENOTP_ROUTE_HASH && username != NULL) *preferred = endpoint_pick(&route->group, endpoint_hash(username));
+   return &route->group;
+}
+
+static endpoint_group_t *openotp_login_route(int type, void *request, int *preferred) {
+   if (type == OPENOTP_SIMPLE_LOGIN) {
+      openotp_simple_login_req_t *simple_request = request;
+      return openotp_route(simple_request->domain, simple_request->username, preferred);
+   }
+   openotp_normal_login_req_t *normal_request = request;
+   return openotp_route(normal_request->domain, normal_request->username, preferred);
+}
+
+int openotp_route_add (char *domain, char *url, int policy, void(*log_handler)()) {
+   openotp_route_t *route = NULL;
+   char *urls[ENDPOINT_MAX];
+   char *ptr;
+   unsigned int slot;
+   int i, count = 0, https;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   if (__openotp_broker != NULL) {
+      if (log_handler != NULL) (*log_handler)("domain routes are set in the broker process");
+      return 0;
+   }
+   if (domain == NULL || *domain == 0 || url == NULL || *url == 0) {
+      if (log_handler != NULL) (*log_handler)("missing route domain or URL");
+      return 0;
+   }
+   if (policy != OPENOTP_ROUTE_FAILOVER && policy != OPENOTP_ROUTE_HASH) {
+      if (log_handler != NULL) (*log_handler)("invalid route policy");
+      return 0;
+   }
+   
+   hmutex_lock(&__openotp_route_lock);
+   if (__openotp_route_sealed) {
+      if (log_handler != NULL) (*log_handler)("routes are added before the first request and the prober start");
+      goto error;
+   }
+   if (__openotp_route_count > 0 && openotp_route_find(domain) != NULL) {
+      if (log_handler != NULL) (*log_handler)("route already set for this domain");
+      goto error;
+   }
+   if (__openotp_route_count == OPENOTP_ROUTE_MAX) {
+      if (log_handler != NULL) (*log_handler)("too many domain routes");
+      goto error;
+   }
+   
+   route = calloc(1, sizeof(openotp_route_t));
+   if (route == NULL || (route->domain = strdup(domain)) == NULL || (route->urls = strdup(url)) == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   
+   for (ptr = route->urls; ptr != NULL; count++) {
+      if (count == ENDPOINT_MAX) {
+	 if (log_handler != NULL) (*log_handler)("too many URLs in route");
+	 goto error;
+      }
+      urls[count] = ptr;
+      if ((ptr = strchr(ptr, ',')) != NULL) *ptr++ = 0;
+   }
+   
+   // the SSL settings are the ones of openotp_initialize()
+   https = (__openotp_url1 != NULL && strncmp(__openotp_url1, "https://", 8) == 0) ||
+           (__openotp_url2 != NULL && strncmp(__openotp_url2, "https://", 8) == 0);
+   for (i = 0; i < count; i++) {
+      if (strncmp(urls[i], "https://", 8) == 0 && !https) {
+	 if (log_handler != NULL) (*log_handler)("HTTPS route needs HTTPS servers in openotp_initialize");
+	 goto error;
+      }
+   }
+   
+   if (hmutex_init(&route->group.lock) != 0) {
+      if (log_handler != NULL) (*log_handler)("mutex creation failed");
+      goto error;
+   }
+   route->group.name = "OpenOTP";
+   route->group.urn = OPENOTP_URN;
+   route->group.status_method = OPENOTP_STATUS_METHOD;
+   route->group.status_response = OPENOTP_STATUS_RESPONSE;
+   endpoint_group_set_urls(&route->group, urls, count);
+   route->hash = endpoint_hash(domain);
+   route->policy = policy;
+   
+   for (slot = route->hash & (OPENOTP_ROUTE_SLOTS-1); __openotp_route_table[slot] != NULL; slot = (slot+1) & (OPENOTP_ROUTE_SLOTS-1));
+   __openotp_route_table[slot] = route;
+   __openotp_routes[__openotp_route_count++] = route;
+   hmutex_unlock(&__openotp_route_lock);
+   return 1;
+   
+   error:
+   hmutex_unlock(&__openotp_route_lock);
+   if (route != NULL) openotp_route_free(route);
+   return 0;
+}
+
 int openotp_terminate (void(*log_handler)()) {
    if (__openotp_url1 == NULL) {
       if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
       return 0;
    }
+   if (__openotp_broker != NULL) {
+      __openotp_broker = NULL;
+      __openotp_url1 = NULL;
+      return 1;
+   }
+   openotp_route_clear();
+   endpoint_group_reset(&__openotp_endpoints);
    __openotp_url1 = NULL;
    __openotp_url2 = NULL;
    #ifdef HAVE_SSL
@@ -100,23 +303,246 @@ int openotp_terminate (void(*log_handler)()) {
    }
    #endif
    soap_client_destroy();
+   hsecure_destroy();
+   hpool_destroy();
    return 1;
 }
 
-openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_handler)()) {
-   openotp_login_rep_t *response = NULL;
-   SoapCtx *soap_request = NULL;
-   SoapCtx *soap_response = NULL;
+int openotp_prober_start (int interval, int ttl, void(*log_handler)()) {
+   int i, ok = 1;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   if (__openotp_broker != NULL) return 1;
+   // the probers keep the groups of the routes
+   openotp_route_seal();
+   if (!endpoint_prober_start(&__openotp_endpoints, interval, ttl)) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP prober already running or thread creation failed");
+      return 0;
+   }
+   for (i = 0; i < __openotp_route_count; i++) {
+      if (!endpoint_prober_start(&__openotp_routes[i]->group, interval, ttl)) {
+	 if (log_handler != NULL) (*log_handler)("OpenOTP prober thread creation failed");
+	 ok = 0;
+      }
+   }
+   return ok;
+}
+
+int openotp_prober_stop (void(*log_handler)()) {
+   int i;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   endpoint_prober_stop(&__openotp_endpoints);
+   hmutex_lock(&__openotp_route_lock);
+   for (i = 0; i < __openotp_route_count; i++) endpoint_prober_stop(&__openotp_routes[i]->group);
+   hmutex_unlock(&__openotp_route_lock);
+   return 1;
+}
+
+int openotp_cache_open (char *path, void(*log_handler)()) {
    herror_t err = H_OK;
-   xmlNodePtr method, node;
-   char *value, *name;
    
+   if (path == NULL) {
+      if (log_handler != NULL) (*log_handler)("missing cache file path");
+      return 0;
+   }
+   err = hcache_open(path);
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+      return 0;
+   }
+   return 1;
+}
+
+int openotp_cache_close (void(*log_handler)()) {
+   if (!hcache_enabled()) {
+      if (log_handler != NULL) (*log_handler)("cache file not open");
+      return 0;
+   }
+   hcache_close();
+   return 1;
+}
+
+int openotp_broker_serve (char *path, void(*log_handler)()) {
    if (__openotp_url1 == NULL) {
       if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
-      return NULL;
+      return 0;
+   }
+   if (__openotp_broker != NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP initialized with a broker URL");
+      return 0;
+   }
+   if (path == NULL) {
+      if (log_handler != NULL) (*log_handler)("missing broker socket path");
+      return 0;
    }
+   return broker_serve(path, log_handler);
+}
+
+int openotp_broker_stop (void(*log_handler)()) {
+   broker_stop();
+   return 1;
+}
+
+int openotp_admission_set (int limit, int max_wait, void(*log_handler)()) {
+   int i;
    
-   if (request == NULL) return NULL;
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   // the broker process queues the requests of its clients
+   if (__openotp_broker != NULL) return 1;
+   endpoint_admission_set(&__openotp_endpoints, limit, max_wait);
+   hmutex_lock(&__openotp_route_lock);
+   for (i = 0; i < __openotp_route_count; i++) endpoint_admission_set(&__openotp_routes[i]->group, limit, max_wait);
+   hmutex_unlock(&__openotp_route_lock);
+   return 1;
+}
+
+void openotp_set_http2 (int enable) {
+   #ifdef HAVE_SSL
+   hssl_set_http2(enable);
+   #endif
+}
+
+void openotp_set_priority (int priority, int timeout) {
+   endpoint_set_priority(priority, timeout);
+}
+
+openotp_cancel_t *openotp_cancel_new (void(*log_handler)()) {
+   hcancel_t *cancel;
+   
+   cancel = hcancel_new();
+   if (cancel == NULL && log_handler != NULL) (*log_handler)("cancellation token creation failed");
+   return (openotp_cancel_t*)cancel;
+}
+
+void openotp_set_cancel (openotp_cancel_t *cancel) {
+   hsocket_set_cancel((hcancel_t*)cancel);
+}
+
+void openotp_cancel (openotp_cancel_t *cancel) {
+   hcancel_trigger((hcancel_t*)cancel);
+}
+
+void openotp_cancel_free (openotp_cancel_t *cancel) {
+   hcancel_free((hcancel_t*)cancel);
+}
+
+openotp_secure_t *openotp_secure_new (void(*log_handler)()) {
+   hsecure_t *secure;
+   
+   secure = hsecure_new();
+   if (secure == NULL && log_handler != NULL) (*log_handler)("secure memory allocation failed");
+   return (openotp_secure_t*)secure;
+}
+
+char *openotp_secure_strdup (openotp_secure_t *secure, const char *str) {
+   if (secure == NULL) return NULL;
+   return hsecure_strdup((hsecure_t*)secure, str);
+}
+
+void openotp_secure_free (openotp_secure_t *secure) {
+   hsecure_free((hsecure_t*)secure);
+}
+
+int openotp_admission_stats (openotp_admission_stats_t *stats, void(*log_handler)()) {
+   endpoint_admission_stats_t counters;
+   int i;
+   
+   if (stats == NULL) {
+      if (log_handler != NULL) (*log_handler)("missing stats parameter");
+      return 0;
+   }
+   endpoint_admission_stats(&__openotp_endpoints, &counters);
+   stats->admitted = counters.admitted;
+   stats->queued = counters.queued;
+   stats->shed = counters.shed;
+   stats->queue_time = counters.queue_time;
+   stats->queue_time_max = counters.queue_time_max;
+   stats->active = counters.active;
+   stats->waiting = counters.waiting;
+   
+   // the routed groups count with the default one
+   hmutex_lock(&__openotp_route_lock);
+   for (i = 0; i < __openotp_route_count; i++) {
+      endpoint_admission_stats(&__openotp_routes[i]->group, &counters);
+      stats->admitted += counters.admitted;
+      stats->queued += counters.queued;
+      stats->shed += counters.shed;
+      stats->queue_time += counters.queue_time;
+      if (counters.queue_time_max > stats->queue_time_max) stats->queue_time_max = counters.queue_time_max;
+      stats->active += counters.active;
+      stats->waiting += counters.waiting;
+   }
+   hmutex_unlock(&__openotp_route_lock);
+   return 1;
+}
+
+int openotp_prepare (void(*log_handler)()) {
+   herror_t err = H_OK;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   
+   if (__openotp_broker != NULL) return 1;
+   
+   // open and park the connection to the primary server in background
+   err = httpc_prepare_async(__openotp_url1);
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+      return 0;
+   }
+   return 1;
+}
+
+int openotp_source_address (char *addr, int size, void(*log_handler)()) {
+   herror_t err = H_OK;
+   int order[ENDPOINT_MAX];
+   hurl_t url;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   if (addr == NULL || size < 16) {
+      if (log_handler != NULL) (*log_handler)("missing or too small address buffer");
+      return 0;
+   }
+   // the connections are made by the broker process
+   if (__openotp_broker != NULL) {
+      if (log_handler != NULL) (*log_handler)("source address not known with a broker URL");
+      return 0;
+   }
+   
+   endpoint_order(&__openotp_endpoints, order);
+   err = hurl_parse(&url, __openotp_endpoints.endpoints[order[0]].url);
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+      return 0;
+   }
+   if (hsocket_source_address(url.host, url.port, addr, size) != 0) {
+      if (log_handler != NULL) (*log_handler)("no route to the OpenOTP server");
+      return 0;
+   }
+   return 1;
+}
+
+static SoapCtx *openotp_login_build(int type, void *request, void(*log_handler)()) {
+   SoapCtx *soap_request = NULL;
+   herror_t err = H_OK;
    
    switch (type) {
     case OPENOTP_SIMPLE_LOGIN: {
@@ -182,9 +608,21 @@ openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_ha
     }
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __openotp_url1, "");
-   if (err != H_OK && __openotp_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __openotp_url2, "");
-   if (err != H_OK) goto error;
+   return soap_request;
+   
+   error:
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+   }
+   if (soap_request != NULL) soap_ctx_free(soap_request);
+   return NULL;
+}
+
+static openotp_login_rep_t *openotp_login_parse(int type, SoapCtx *soap_response, void(*log_handler)()) {
+   openotp_login_rep_t *response = NULL;
+   xmlNodePtr method, node;
+   char *value, *name;
    
    node = soap_env_get_fault(soap_response->env);
    if (node != NULL) {
@@ -242,6 +680,46 @@ openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_ha
       node = soap_xml_get_next(node);
    }
    
+   return response;
+   
+   error:
+   if (response != NULL) openotp_login_rep_free(response);
+   return NULL;
+}
+
+// the challenge of a login must go to the server which issued the session
+static void openotp_login_bind(endpoint_group_t *group, openotp_login_rep_t *response, int index) {
+   if (response->code == OPENOTP_CHALLENGE && response->session != NULL) {
+      endpoint_affinity_set(group, response->session, index, response->timeout);
+   }
+}
+
+openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_handler)()) {
+   openotp_login_rep_t *response = NULL;
+   endpoint_group_t *group;
+   SoapCtx *soap_request = NULL;
+   SoapCtx *soap_response = NULL;
+   herror_t err = H_OK;
+   int index = -1;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return NULL;
+   }
+   
+   if (request == NULL) return NULL;
+   if (__openotp_broker != NULL) return broker_login(__openotp_broker, type, request, log_handler);
+   
+   soap_request = openotp_login_build(type, request, log_handler);
+   if (soap_request == NULL) goto error;
+   
+   group = openotp_login_route(type, request, &index);
+   err = endpoint_invoke_to(group, index, soap_request, &soap_response, &index);
+   if (err != H_OK) goto error;
+   
+   response = openotp_login_parse(type, soap_response, log_handler);
+   if (response != NULL) openotp_login_bind(group, response, index);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -253,7 +731,6 @@ openotp_login_rep_t *openotp_login_wrapper(int type, void *request, void(*log_ha
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
    if (soap_response != NULL) soap_ctx_free(soap_response);
-   if (response != NULL) openotp_login_rep_free(response);
    return NULL;
 }
 
@@ -269,20 +746,10 @@ openotp_login_rep_t *openotp_login(openotp_login_req_t *request, void(*log_handl
    return openotp_login_wrapper(OPENOTP_COMPAT_LOGIN, (void*)request, log_handler);
 }
 
-openotp_challenge_rep_t *openotp_challenge(openotp_challenge_req_t *request, void(*log_handler)()) {
-   openotp_challenge_rep_t *response = NULL;
+static SoapCtx *openotp_challenge_build(openotp_challenge_req_t *request, void(*log_handler)()) {
    SoapCtx *soap_request = NULL;
-   SoapCtx *soap_response = NULL;
    herror_t err = H_OK;
-   xmlNodePtr method, node;
-   char *value, *name;
-
-   if (__openotp_url1 == NULL) {
-      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
-      return NULL;
-   }
    
-   if (request == NULL) return NULL;
    if (request->username == NULL || request->session == NULL || request->otpPassword == NULL)  return NULL;
    
    err = soap_ctx_new_with_method(OPENOTP_URN, OPENOTP_CHALLENGE_METHOD, &soap_request);
@@ -295,9 +762,21 @@ openotp_challenge_rep_t *openotp_challenge(openotp_challenge_req_t *request, voi
       if (soap_env_add_item(soap_request->env, "xsd:string", "domain", request->domain) == NULL) goto error;
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __openotp_url1, "");
-   if (err != H_OK && __openotp_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __openotp_url2, "");
-   if (err != H_OK) goto error;
+   return soap_request;
+   
+   error:
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+   }
+   if (soap_request != NULL) soap_ctx_free(soap_request);
+   return NULL;
+}
+
+static openotp_challenge_rep_t *openotp_challenge_parse(SoapCtx *soap_response, void(*log_handler)()) {
+   openotp_challenge_rep_t *response = NULL;
+   xmlNodePtr method, node;
+   char *value, *name;
    
    if (soap_env_get_fault(soap_response->env)) {
       if (log_handler != NULL) (*log_handler)("received SOAP fault");
@@ -339,6 +818,40 @@ openotp_challenge_rep_t *openotp_challenge(openotp_challenge_req_t *request, voi
       node = soap_xml_get_next(node);
    }
    
+   return response;
+   
+   error:
+   if (response != NULL) openotp_challenge_rep_free(response);
+   return NULL;
+}
+
+openotp_challenge_rep_t *openotp_challenge(openotp_challenge_req_t *request, void(*log_handler)()) {
+   openotp_challenge_rep_t *response = NULL;
+   endpoint_group_t *group;
+   SoapCtx *soap_request = NULL;
+   SoapCtx *soap_response = NULL;
+   herror_t err = H_OK;
+   int index, preferred;
+
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return NULL;
+   }
+   
+   if (request == NULL) return NULL;
+   if (__openotp_broker != NULL) return broker_challenge(__openotp_broker, request, log_handler);
+   
+   soap_request = openotp_challenge_build(request, log_handler);
+   if (soap_request == NULL) goto error;
+   
+   group = openotp_route(request->domain, request->username, &preferred);
+   if ((index = endpoint_affinity_get(group, request->session)) < 0) index = preferred;
+   err = endpoint_invoke_to(group, index, soap_request, &soap_response, &index);
+   if (err != H_OK) goto error;
+   
+   response = openotp_challenge_parse(soap_response, log_handler);
+   if (response != NULL && response->code != OPENOTP_CHALLENGE) endpoint_affinity_clear(group, request->session);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -350,28 +863,248 @@ openotp_challenge_rep_t *openotp_challenge(openotp_challenge_req_t *request, voi
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
    if (soap_response != NULL) soap_ctx_free(soap_response);
-   if (response != NULL) openotp_challenge_rep_free(response);
    return NULL;
 }
 
+/*
+ * Sends the non NULL requests of soap_requests pipelined on one connection
+ * per server group, groups[i] being the group of request i.
+ * soap_responses[i] is set for each request which got a SOAP response and
+ * NULL for the others. affinity[i] gives the endpoint to try first for
+ * request i (or -1) and receives the endpoint which answered.
+ */
+static void openotp_batch_invoke(endpoint_group_t **groups, SoapCtx **soap_requests, SoapCtx **soap_responses, int *affinity, int count, void(*log_handler)()) {
+   endpoint_group_t *group;
+   SoapCtx **calls = NULL;
+   SoapCtx **replies = NULL;
+   herror_t *errors = NULL;
+   int *preferred = NULL;
+   int *indexes = NULL;
+   int *members = NULL;
+   char *sent = NULL;
+   herror_t err = H_OK;
+   int i, g, n;
+   
+   for (i = 0; i < count; i++) soap_responses[i] = NULL;
+   
+   calls = malloc(count * sizeof(SoapCtx*));
+   replies = malloc(count * sizeof(SoapCtx*));
+   errors = malloc(count * sizeof(herror_t));
+   preferred = malloc(count * sizeof(int));
+   indexes = malloc(count * sizeof(int));
+   members = malloc(count * sizeof(int));
+   sent = calloc(count, 1);
+   if (calls == NULL || replies == NULL || errors == NULL || preferred == NULL || indexes == NULL || members == NULL || sent == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   
+   for (g = 0; g < count; g++) {
+      if (soap_requests[g] == NULL || sent[g]) continue;
+      group = groups[g];
+      
+      for (i = g, n = 0; i < count; i++) {
+	 if (soap_requests[i] == NULL || groups[i] != group) continue;
+	 sent[i] = 1;
+	 members[n] = i;
+	 preferred[n] = affinity[i];
+	 calls[n++] = soap_requests[i];
+      }
+      
+      err = endpoint_invoke_batch_to(group, preferred, calls, replies, errors, indexes, n);
+      if (err != H_OK) {
+	 for (i = 0; i < n; i++) {
+	    if (replies[i] != NULL) soap_ctx_free(replies[i]);
+	    if (errors[i] != H_OK) herror_release(errors[i]);
+	 }
+	 // the requests of the other groups are still sent
+	 if (log_handler != NULL) (*log_handler)(herror_message(err));
+	 herror_release(err);
+	 err = H_OK;
+	 continue;
+      }
+      
+      for (i = 0; i < n; i++) {
+	 if (errors[i] != H_OK) {
+	    if (log_handler != NULL) (*log_handler)(herror_message(errors[i]));
+	    herror_release(errors[i]);
+	 }
+	 affinity[members[i]] = indexes[i];
+	 soap_responses[members[i]] = replies[i];
+      }
+   }
+   
+   error:
+   if (calls != NULL) free(calls);
+   if (replies != NULL) free(replies);
+   if (errors != NULL) free(errors);
+   if (preferred != NULL) free(preferred);
+   if (indexes != NULL) free(indexes);
+   if (members != NULL) free(members);
+   if (sent != NULL) free(sent);
+}
+
+int openotp_login_batch(openotp_login_req_t **requests, openotp_login_rep_t **responses, int count, void(*log_handler)()) {
+   endpoint_group_t **groups = NULL;
+   SoapCtx **soap_requests = NULL;
+   SoapCtx **soap_responses = NULL;
+   int *affinity = NULL;
+   int i, done = 0;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   
+   if (requests == NULL || responses == NULL || count <= 0) return 0;
+   for (i = 0; i < count; i++) responses[i] = NULL;
+   
+   // one broker round trip per request
+   if (__openotp_broker != NULL) {
+      for (i = 0; i < count; i++) {
+	 if (requests[i] != NULL) responses[i] = broker_login(__openotp_broker, OPENOTP_COMPAT_LOGIN, requests[i], log_handler);
+	 if (responses[i] != NULL) done++;
+      }
+      return done;
+   }
+   
+   groups = malloc(count * sizeof(endpoint_group_t*));
+   soap_requests = malloc(count * sizeof(SoapCtx*));
+   soap_responses = malloc(count * sizeof(SoapCtx*));
+   affinity = malloc(count * sizeof(int));
+   if (groups == NULL || soap_requests == NULL || soap_responses == NULL || affinity == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   
+   for (i = 0; i < count; i++) {
+      soap_requests[i] = requests[i] != NULL ? openotp_login_build(OPENOTP_COMPAT_LOGIN, (void*)requests[i], log_handler) : NULL;
+      affinity[i] = -1;
+      groups[i] = soap_requests[i] != NULL ? openotp_login_route(OPENOTP_COMPAT_LOGIN, (void*)requests[i], &affinity[i]) : NULL;
+   }
+   
+   openotp_batch_invoke(groups, soap_requests, soap_responses, affinity, count, log_handler);
+   
+   for (i = 0; i < count; i++) {
+      if (soap_responses[i] != NULL) {
+	 responses[i] = openotp_login_parse(OPENOTP_COMPAT_LOGIN, soap_responses[i], log_handler);
+	 if (responses[i] != NULL) {
+	    openotp_login_bind(groups[i], responses[i], affinity[i]);
+	    done++;
+	 }
+	 soap_ctx_free(soap_responses[i]);
+      }
+      if (soap_requests[i] != NULL) soap_ctx_free(soap_requests[i]);
+   }
+   
+   error:
+   if (groups != NULL) free(groups);
+   if (soap_requests != NULL) free(soap_requests);
+   if (soap_responses != NULL) free(soap_responses);
+   if (affinity != NULL) free(affinity);
+   return done;
+}
+
+int openotp_challenge_batch(openotp_challenge_req_t **requests, openotp_challenge_rep_t **responses, int count, void(*log_handler)()) {
+   endpoint_group_t **groups = NULL;
+   SoapCtx **soap_requests = NULL;
+   SoapCtx **soap_responses = NULL;
+   int *affinity = NULL;
+   int i, preferred, done = 0;
+   
+   if (__openotp_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
+      return 0;
+   }
+   
+   if (requests == NULL || responses == NULL || count <= 0) return 0;
+   for (i = 0; i < count; i++) responses[i] = NULL;
+   
+   if (__openotp_broker != NULL) {
+      for (i = 0; i < count; i++) {
+	 if (requests[i] != NULL) responses[i] = broker_challenge(__openotp_broker, requests[i], log_handler);
+	 if (responses[i] != NULL) done++;
+      }
+      return done;
+   }
+   
+   groups = malloc(count * sizeof(endpoint_group_t*));
+   soap_requests = malloc(count * sizeof(SoapCtx*));
+   soap_responses = malloc(count * sizeof(SoapCtx*));
+   affinity = malloc(count * sizeof(int));
+   if (groups == NULL || soap_requests == NULL || soap_responses == NULL || affinity == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      goto error;
+   }
+   
+   for (i = 0; i < count; i++) {
+      soap_requests[i] = requests[i] != NULL ? openotp_challenge_build(requests[i], log_handler) : NULL;
+      affinity[i] = -1;
+      groups[i] = NULL;
+      if (soap_requests[i] == NULL) continue;
+      groups[i] = openotp_route(requests[i]->domain, requests[i]->username, &preferred);
+      if ((affinity[i] = endpoint_affinity_get(groups[i], requests[i]->session)) < 0) affinity[i] = preferred;
+   }
+   
+   openotp_batch_invoke(groups, soap_requests, soap_responses, affinity, count, log_handler);
+   
+   for (i = 0; i < count; i++) {
+      if (soap_responses[i] != NULL) {
+	 responses[i] = openotp_challenge_parse(soap_responses[i], log_handler);
+	 if (responses[i] != NULL) {
+	    if (responses[i]->code != OPENOTP_CHALLENGE) endpoint_affinity_clear(groups[i], requests[i]->session);
+	    done++;
+	 }
+	 soap_ctx_free(soap_responses[i]);
+      }
+      if (soap_requests[i] != NULL) soap_ctx_free(soap_requests[i]);
+   }
+   
+   error:
+   if (groups != NULL) free(groups);
+   if (soap_requests != NULL) free(soap_requests);
+   if (soap_responses != NULL) free(soap_responses);
+   if (affinity != NULL) free(affinity);
+   return done;
+}
+
 openotp_status_rep_t *openotp_status(void(*log_handler)()) {
    openotp_status_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
+   endpoint_flight_t *flight = NULL;
+   char *key;
    herror_t err = H_OK;
    xmlNodePtr method, node;
-   char *value, *name;
+   char *value, *name, *message;
+   int status;
    
    if (__openotp_url1 == NULL) {
       if (log_handler != NULL) (*log_handler)("OpenOTP not initialized");
       return NULL;
    }
+   if (__openotp_broker != NULL) return broker_status(__openotp_broker, log_handler);
+   
+   // answer from the background prober if its last check is recent enough
+   if (endpoint_cached_status(&__openotp_endpoints, &status, &message)) {
+      response = malloc(sizeof(openotp_status_rep_t));
+      if (response == NULL) {
+	 if (message != NULL) free(message);
+	 if (log_handler != NULL) (*log_handler)("memory allocation failed");
+	 return NULL;
+      }
+      response->status = status;
+      response->message = message;
+      return response;
+   }
       
    err = soap_ctx_new_with_method(OPENOTP_URN, OPENOTP_STATUS_METHOD, &soap_request);
    if (err != H_OK) goto error;
+   soap_request->idempotent = 1;
    
-   err = soap_client_invoke(soap_request, &soap_response, __openotp_url1, "");
-   if (err != H_OK && __openotp_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __openotp_url2, "");
+   key = endpoint_flight_key(OPENOTP_STATUS_METHOD, 0);
+   err = endpoint_invoke_shared(&__openotp_endpoints, -1, key, soap_request, &soap_response, NULL, &flight);
+   if (key != NULL) free(key);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -414,7 +1147,7 @@ openotp_status_rep_t *openotp_status(void(*log_handler)()) {
    }
    
    soap_ctx_free(soap_request);
-   soap_ctx_free(soap_response);
+   endpoint_response_free(flight, soap_response);
    return response;
    
    error:
@@ -423,7 +1156,7 @@ openotp_status_rep_t *openotp_status(void(*log_handler)()) {
       herror_release(err);
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
-   if (soap_response != NULL) soap_ctx_free(soap_response);
+   if (soap_response != NULL) endpoint_response_free(flight, soap_response);
    if (response != NULL) openotp_status_rep_free(response);
    return NULL;
 }
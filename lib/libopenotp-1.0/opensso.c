@@ -20,6 +20,8 @@
 #include "opensso.h"
 #include "libcsoap/soap-client.h"
 #include "nanohttp/nanohttp-client.h"
+#include "nanohttp/nanohttp-pool.h"
+#include "endpoint.h"
 #ifdef HAVE_SSL
 #include "nanohttp/nanohttp-ssl.h"
 #endif
@@ -27,6 +29,244 @@
 char *__opensso_url1 = NULL;
 char *__opensso_url2 = NULL;
 
+static endpoint_group_t __opensso_endpoints = ENDPOINT_GROUP_INITIALIZER("OpenSSO", OPENSSO_URN, OPENSSO_STATUS_METHOD, OPENSSO_STATUS_RESPONSE);
+
+// Successful session checks cached by opensso_cache_enable(), sharded by
+// session so that concurrent checks of different sessions rarely wait on
+// the same lock.
+
+typedef struct opensso_cache_entry_t {
+   unsigned int hash;
+   char *session;
+   char *data;           // request data, the reply depends on it
+   time_t deadline;      // end of the session when known, 0 otherwise
+   time_t expires;       // end of validity of the cached reply, 0 for none
+   time_t stored;
+   int code;
+   char *message;
+   char *rep_data;
+   int timeout;
+   time_t used;
+} opensso_cache_entry_t;
+
+typedef struct opensso_cache_shard_t {
+   hmutex_t lock;
+   unsigned long stops;  // bumped by each stop of a session of the shard
+   opensso_cache_entry_t entries[OPENSSO_CACHE_SLOTS];
+} opensso_cache_shard_t;
+
+static opensso_cache_shard_t __opensso_cache[OPENSSO_CACHE_SHARDS];
+static volatile long __opensso_cache_ttl = 0;
+static hmutex_t __opensso_cache_init = HMUTEX_INITIALIZER;
+static volatile long __opensso_cache_ready = 0;
+
+static unsigned int opensso_cache_hash(const char *session) {
+   unsigned int hash = 2166136261u;
+   while (*session) {
+      hash ^= (unsigned char)*session++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static char *opensso_cache_strdup(const char *str) {
+   return str != NULL ? strdup(str) : NULL;
+}
+
+static int opensso_cache_streq(const char *s1, const char *s2) {
+   if (s1 == NULL || s2 == NULL) return s1 == s2;
+   return strcmp(s1, s2) == 0;
+}
+
+static void opensso_cache_clear_entry(opensso_cache_entry_t *entry) {
+   if (entry->session != NULL) free(entry->session);
+   if (entry->data != NULL) free(entry->data);
+   if (entry->message != NULL) free(entry->message);
+   if (entry->rep_data != NULL) free(entry->rep_data);
+   memset(entry, 0, sizeof(opensso_cache_entry_t));
+}
+
+// the shard locks are set up once, the first time the cache is enabled
+// (on WIN32 hmutex_lock() creates them on first use)
+static void opensso_cache_setup(void) {
+   int i;
+   if (__opensso_cache_ready) return;
+   hmutex_lock(&__opensso_cache_init);
+   if (!__opensso_cache_ready) {
+      for (i = 0; i < OPENSSO_CACHE_SHARDS; i++) {
+	 #ifdef WIN32
+	 __opensso_cache[i].lock = HMUTEX_INITIALIZER;
+	 #else
+	 pthread_mutex_init(&__opensso_cache[i].lock, NULL);
+	 #endif
+      }
+      hatomic_barrier();
+      __opensso_cache_ready = 1;
+   }
+   hmutex_unlock(&__opensso_cache_init);
+}
+
+static void opensso_cache_flush(void) {
+   int i, j;
+   if (!__opensso_cache_ready) return;
+   for (i = 0; i < OPENSSO_CACHE_SHARDS; i++) {
+      hmutex_lock(&__opensso_cache[i].lock);
+      for (j = 0; j < OPENSSO_CACHE_SLOTS; j++) opensso_cache_clear_entry(&__opensso_cache[i].entries[j]);
+      hmutex_unlock(&__opensso_cache[i].lock);
+   }
+}
+
+// returns the entry of the session, or the slot to reuse for it if 'create' is set
+static opensso_cache_entry_t *opensso_cache_find(opensso_cache_shard_t *shard, unsigned int hash, const char *session, int create, time_t now) {
+   opensso_cache_entry_t *entry, *victim = NULL;
+   int i;
+   
+   for (i = 0; i < OPENSSO_CACHE_SLOTS; i++) {
+      entry = &shard->entries[i];
+      if (entry->session != NULL && entry->hash == hash && strcmp(entry->session, session) == 0) return entry;
+   }
+   if (!create) return NULL;
+   
+   // prefer a free or dead slot, then the least recently used one
+   for (i = 0; i < OPENSSO_CACHE_SLOTS; i++) {
+      entry = &shard->entries[i];
+      if (entry->session == NULL || (entry->expires <= now && (entry->deadline == 0 || entry->deadline <= now))) {
+	 victim = entry;
+	 break;
+      }
+      if (victim == NULL || entry->used < victim->used) victim = entry;
+   }
+   opensso_cache_clear_entry(victim);
+   victim->session = strdup(session);
+   if (victim->session == NULL) return NULL;
+   victim->hash = hash;
+   return victim;
+}
+
+// remembers the lifetime of a new session, which bounds its cached checks
+static void opensso_cache_start(const char *session, int timeout) {
+   unsigned int hash;
+   opensso_cache_shard_t *shard;
+   opensso_cache_entry_t *entry;
+   time_t now;
+   
+   if (__opensso_cache_ttl <= 0 || session == NULL) return;
+   hash = opensso_cache_hash(session);
+   shard = &__opensso_cache[hash % OPENSSO_CACHE_SHARDS];
+   now = time(NULL);
+   
+   hmutex_lock(&shard->lock);
+   entry = opensso_cache_find(shard, hash, session, 1, now);
+   if (entry != NULL) {
+      if (entry->message != NULL) free(entry->message);
+      if (entry->rep_data != NULL) free(entry->rep_data);
+      if (entry->data != NULL) free(entry->data);
+      entry->message = entry->rep_data = entry->data = NULL;
+      entry->expires = 0;
+      entry->deadline = timeout > 0 ? now + timeout : 0;
+      entry->used = now;
+   }
+   hmutex_unlock(&shard->lock);
+}
+
+// forgets the session, and the checks in progress which started before
+// do not store their reply (see opensso_cache_put)
+static void opensso_cache_remove(const char *session) {
+   unsigned int hash;
+   opensso_cache_shard_t *shard;
+   opensso_cache_entry_t *entry;
+   
+   if (!__opensso_cache_ready || session == NULL) return;
+   hash = opensso_cache_hash(session);
+   shard = &__opensso_cache[hash % OPENSSO_CACHE_SHARDS];
+   
+   hmutex_lock(&shard->lock);
+   shard->stops++;
+   entry = opensso_cache_find(shard, hash, session, 0, 0);
+   if (entry != NULL) opensso_cache_clear_entry(entry);
+   hmutex_unlock(&shard->lock);
+}
+
+// returns a copy of the cached reply of a check, NULL on miss. 'stops' is
+// set to the stop count of the shard, to give back to opensso_cache_put().
+static opensso_check_rep_t *opensso_cache_get(opensso_check_req_t *request, unsigned long *stops) {
+   unsigned int hash;
+   opensso_cache_shard_t *shard;
+   opensso_cache_entry_t *entry;
+   opensso_check_rep_t *response = NULL;
+   time_t now;
+   
+   *stops = 0;
+   if (__opensso_cache_ttl <= 0) return NULL;
+   hash = opensso_cache_hash(request->session);
+   shard = &__opensso_cache[hash % OPENSSO_CACHE_SHARDS];
+   now = time(NULL);
+   
+   hmutex_lock(&shard->lock);
+   *stops = shard->stops;
+   entry = opensso_cache_find(shard, hash, request->session, 0, now);
+   if (entry != NULL && entry->expires > now && opensso_cache_streq(entry->data, request->data)) {
+      response = malloc(sizeof(opensso_check_rep_t));
+      if (response != NULL) {
+	 response->code = entry->code;
+	 response->message = opensso_cache_strdup(entry->message);
+	 response->data = opensso_cache_strdup(entry->rep_data);
+	 // the session timeout keeps running while the reply is cached
+	 response->timeout = entry->timeout > 0 ? entry->timeout - (int)(now - entry->stored) : 0;
+	 if (response->timeout < 1 && entry->timeout > 0) response->timeout = 1;
+	 entry->used = now;
+      }
+   }
+   hmutex_unlock(&shard->lock);
+   return response;
+}
+
+// 'stops' comes from opensso_cache_get() before the check was sent: a stop
+// since then may have ended the session after the server answered
+static void opensso_cache_put(opensso_check_req_t *request, opensso_check_rep_t *response, unsigned long stops) {
+   unsigned int hash;
+   opensso_cache_shard_t *shard;
+   opensso_cache_entry_t *entry;
+   time_t now, expires;
+   long ttl = __opensso_cache_ttl;
+   
+   if (ttl <= 0) return;
+   hash = opensso_cache_hash(request->session);
+   shard = &__opensso_cache[hash % OPENSSO_CACHE_SHARDS];
+   now = time(NULL);
+   
+   hmutex_lock(&shard->lock);
+   // a failed check forgets the session
+   if (response->code != OPENSSO_SUCCESS || shard->stops != stops) {
+      entry = opensso_cache_find(shard, hash, request->session, 0, now);
+      if (entry != NULL) opensso_cache_clear_entry(entry);
+      hmutex_unlock(&shard->lock);
+      return;
+   }
+   entry = opensso_cache_find(shard, hash, request->session, 1, now);
+   if (entry != NULL) {
+      expires = now + ttl;
+      if (response->timeout > 0 && now + response->timeout < expires) expires = now + response->timeout;
+      if (entry->deadline != 0 && entry->deadline < expires) expires = entry->deadline;
+      if (entry->data != NULL) free(entry->data);
+      if (entry->message != NULL) free(entry->message);
+      if (entry->rep_data != NULL) free(entry->rep_data);
+      entry->data = opensso_cache_strdup(request->data);
+      entry->message = opensso_cache_strdup(response->message);
+      entry->rep_data = opensso_cache_strdup(response->data);
+      entry->code = response->code;
+      entry->timeout = response->timeout;
+      entry->stored = now;
+      entry->used = now;
+      entry->expires = expires;
+      if (response->timeout > 0) entry->deadline = now + response->timeout;
+      // do not serve a partial copy
+      if ((request->data != NULL && entry->data == NULL) || (response->message != NULL && entry->message == NULL) ||
+	  (response->data != NULL && entry->rep_data == NULL)) entry->expires = 0;
+   }
+   hmutex_unlock(&shard->lock);
+}
+
 int opensso_initialize (char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)()) {
    herror_t err = H_OK;
    
@@ -49,6 +289,7 @@ int opensso_initialize (char *url, char *cert, char *pass, char *ca, int timeout
       __opensso_url1 = url;
       __opensso_url2 = NULL;
    }
+   endpoint_group_set(&__opensso_endpoints, __opensso_url1, __opensso_url2);
    
    #ifdef HAVE_SSL
    if ((__opensso_url1 != NULL && strncmp(__opensso_url1, "https://", 8) == 0) ||
@@ -83,6 +324,9 @@ int opensso_terminate (void(*log_handler)()) {
       if (log_handler != NULL) (*log_handler)("OpenSSO not initialized");
       return 0;
    }
+   endpoint_group_reset(&__opensso_endpoints);
+   __opensso_cache_ttl = 0;
+   opensso_cache_flush();
    __opensso_url1 = NULL;
    __opensso_url2 = NULL;
    #ifdef HAVE_SSL
@@ -92,14 +336,63 @@ int opensso_terminate (void(*log_handler)()) {
    }
    #endif
    soap_client_destroy();
+   hpool_destroy();
    return 1;
 }
 
+int opensso_prober_start (int interval, int ttl, void(*log_handler)()) {
+   if (__opensso_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenSSO not initialized");
+      return 0;
+   }
+   if (!endpoint_prober_start(&__opensso_endpoints, interval, ttl)) {
+      if (log_handler != NULL) (*log_handler)("OpenSSO prober already running or thread creation failed");
+      return 0;
+   }
+   return 1;
+}
+
+int opensso_prober_stop (void(*log_handler)()) {
+   if (__opensso_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenSSO not initialized");
+      return 0;
+   }
+   endpoint_prober_stop(&__opensso_endpoints);
+   return 1;
+}
+
+int opensso_cache_enable (int ttl, void(*log_handler)()) {
+   if (__opensso_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("OpenSSO not initialized");
+      return 0;
+   }
+   if (ttl < 0) ttl = 0;
+   opensso_cache_setup();
+   __opensso_cache_ttl = ttl;
+   if (ttl == 0) opensso_cache_flush();
+   return 1;
+}
+
+// stops the session of a cancelled start, without the token of the thread
+static void opensso_release(char *session) {
+   opensso_stop_req_t request;
+   opensso_stop_rep_t *response;
+   hcancel_t *cancel;
+   
+   cancel = hsocket_get_cancel();
+   hsocket_set_cancel(NULL);
+   request.session = session;
+   response = opensso_stop(&request, NULL);
+   if (response != NULL) opensso_stop_rep_free(response);
+   hsocket_set_cancel(cancel);
+}
+
 opensso_start_rep_t *opensso_start(opensso_start_req_t *request, void(*log_handler)()) {
    opensso_start_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
    herror_t err = H_OK;
+   int index = -1;
    xmlNodePtr method, node;
    char *value, *name;
    
@@ -131,8 +424,7 @@ opensso_start_rep_t *opensso_start(opensso_start_req_t *request, void(*log_handl
       if (soap_env_add_item(soap_request->env, "xsd:string", "settings", request->settings) == NULL) goto error;
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __opensso_url1, "");
-   if (err != H_OK && __opensso_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __opensso_url2, "");
+   err = endpoint_invoke_to(&__opensso_endpoints, -1, soap_request, &soap_response, &index);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -180,6 +472,17 @@ opensso_start_rep_t *opensso_start(opensso_start_req_t *request, void(*log_handl
       node = soap_xml_get_next(node);
    }
    
+   // the checks of the session must go to the server which issued it
+   if (response->session != NULL) endpoint_affinity_set(&__opensso_endpoints, response->session, index, response->timeout);
+   
+   // the caller gave up while the reply was on its way: the session must not stay open
+   if (hsocket_cancelled()) {
+      if (log_handler != NULL) (*log_handler)("OpenSSO request cancelled");
+      if (response->code == OPENSSO_SUCCESS && response->session != NULL) opensso_release(response->session);
+      goto error;
+   }
+   if (response->code == OPENSSO_SUCCESS) opensso_cache_start(response->session, response->timeout);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -211,13 +514,18 @@ opensso_stop_rep_t *opensso_stop(opensso_stop_req_t *request, void(*log_handler)
    if (request == NULL) return NULL;
    if (request->session == NULL) return NULL;
    
+   // whatever the server answers, the session is not served from the cache anymore
+   opensso_cache_remove(request->session);
+   
    err = soap_ctx_new_with_method(OPENSSO_URN, OPENSSO_STOP_METHOD, &soap_request);
    if (err != H_OK) goto error;
    
    if (soap_env_add_item(soap_request->env, "xsd:string", "session", request->session) == NULL) goto error;
    
-   err = soap_client_invoke(soap_request, &soap_response, __opensso_url1, "");
-   if (err != H_OK && __opensso_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __opensso_url2, "");
+   err = endpoint_invoke_to(&__opensso_endpoints, endpoint_affinity_get(&__opensso_endpoints, request->session), soap_request, &soap_response, NULL);
+   // again, for the checks answered while the stop was in progress (even
+   // on failure, the server may have ended the session)
+   opensso_cache_remove(request->session);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -258,6 +566,8 @@ opensso_stop_rep_t *opensso_stop(opensso_stop_req_t *request, void(*log_handler)
       node = soap_xml_get_next(node);
    }
    
+   endpoint_affinity_clear(&__opensso_endpoints, request->session);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -277,6 +587,9 @@ opensso_check_rep_t *opensso_check(opensso_check_req_t *request, void(*log_handl
    opensso_check_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
+   endpoint_flight_t *flight = NULL;
+   unsigned long stops;
+   char *key, generation[32];
    herror_t err = H_OK;
    xmlNodePtr method, node;
    char *value, *name;
@@ -289,6 +602,9 @@ opensso_check_rep_t *opensso_check(opensso_check_req_t *request, void(*log_handl
    if (request == NULL) return NULL;
    if (request->session == NULL) return NULL;
    
+   response = opensso_cache_get(request, &stops);
+   if (response != NULL) return response;
+   
    err = soap_ctx_new_with_method(OPENSSO_URN, OPENSSO_CHECK_METHOD, &soap_request);
    if (err != H_OK) goto error;
    
@@ -297,8 +613,11 @@ opensso_check_rep_t *opensso_check(opensso_check_req_t *request, void(*log_handl
       if (soap_env_add_item(soap_request->env, "xsd:string", "data", request->data) == NULL) goto error;
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __opensso_url1, "");
-   if (err != H_OK && __opensso_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __opensso_url2, "");
+   // a check started after a stop does not join one sent before it
+   sprintf(generation, "%lu", stops);
+   key = endpoint_flight_key(OPENSSO_CHECK_METHOD, 3, request->session, request->data, generation);
+   err = endpoint_invoke_shared(&__opensso_endpoints, endpoint_affinity_get(&__opensso_endpoints, request->session), key, soap_request, &soap_response, NULL, &flight);
+   if (key != NULL) free(key);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -346,8 +665,10 @@ opensso_check_rep_t *opensso_check(opensso_check_req_t *request, void(*log_handl
       node = soap_xml_get_next(node);
    }
    
+   opensso_cache_put(request, response, stops);
+   
    soap_ctx_free(soap_request);
-   soap_ctx_free(soap_response);
+   endpoint_response_free(flight, soap_response);
    return response;
    
    error:
@@ -356,7 +677,7 @@ opensso_check_rep_t *opensso_check(opensso_check_req_t *request, void(*log_handl
       herror_release(err);
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
-   if (soap_response != NULL) soap_ctx_free(soap_response);
+   if (soap_response != NULL) endpoint_response_free(flight, soap_response);
    if (response != NULL) opensso_check_rep_free(response);
    return NULL;
 }
@@ -365,20 +686,38 @@ opensso_status_rep_t *opensso_status(void(*log_handler)()) {
    opensso_status_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
+   endpoint_flight_t *flight = NULL;
+   char *key;
    herror_t err = H_OK;
    xmlNodePtr method, node;
-   char *value, *name;
+   char *value, *name, *message;
+   int status;
    
    if (__opensso_url1 == NULL) {
       if (log_handler != NULL) (*log_handler)("OpenSSO not initialized");
       return NULL;
    }
    
+   // answer from the background prober if its last check is recent enough
+   if (endpoint_cached_status(&__opensso_endpoints, &status, &message)) {
+      response = malloc(sizeof(opensso_status_rep_t));
+      if (response == NULL) {
+	 if (message != NULL) free(message);
+	 if (log_handler != NULL) (*log_handler)("memory allocation failed");
+	 return NULL;
+      }
+      response->status = status;
+      response->message = message;
+      return response;
+   }
+   
    err = soap_ctx_new_with_method(OPENSSO_URN, OPENSSO_STATUS_METHOD, &soap_request);
    if (err != H_OK) goto error;
+   soap_request->idempotent = 1;
    
-   err = soap_client_invoke(soap_request, &soap_response, __opensso_url1, "");
-   if (err != H_OK && __opensso_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __opensso_url2, "");
+   key = endpoint_flight_key(OPENSSO_STATUS_METHOD, 0);
+   err = endpoint_invoke_shared(&__opensso_endpoints, -1, key, soap_request, &soap_response, NULL, &flight);
+   if (key != NULL) free(key);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -421,7 +760,7 @@ opensso_status_rep_t *opensso_status(void(*log_handler)()) {
    }
    
    soap_ctx_free(soap_request);
-   soap_ctx_free(soap_response);
+   endpoint_response_free(flight, soap_response);
    return response;
    
    error:
@@ -430,7 +769,7 @@ opensso_status_rep_t *opensso_status(void(*log_handler)()) {
       herror_release(err);
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
-   if (soap_response != NULL) soap_ctx_free(soap_response);
+   if (soap_response != NULL) endpoint_response_free(flight, soap_response);
    if (response != NULL) opensso_status_rep_free(response);
    return NULL;
 }
@@ -37,6 +37,11 @@
 #define OPENSSO_STATUS_REQUEST "openssoStatusRequest"
 #define OPENSSO_STATUS_RESPONSE "openssoStatusResponse"
 
+// OpenSSO session check cache (see opensso_cache_enable)
+
+#define OPENSSO_CACHE_SHARDS 16
+#define OPENSSO_CACHE_SLOTS 64
+
 // OpenSSO response codes
 
 #define OPENSSO_FAILURE 0
@@ -105,6 +110,25 @@ typedef struct opensso_status_rep_t {
 EXPORT int opensso_initialize(char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)());
 EXPORT int opensso_terminate(void(*log_handler)());
 
+/*
+ * opensso_prober_start() starts a background thread which checks every OpenSSO server each
+ * 'interval' seconds with the status method and keeps a connection ready. Requests are
+ * sent to the servers which are up first and opensso_status() is answered from the last
+ * check if it is not older than 'ttl' seconds (set 0 to always query the server).
+ * opensso_prober_stop() stops the thread; opensso_terminate() stops it as well.
+ */
+EXPORT int opensso_prober_start(int interval, int ttl, void(*log_handler)());
+EXPORT int opensso_prober_stop(void(*log_handler)());
+
+/*
+ * opensso_cache_enable() lets opensso_check() answer from the last successful check of
+ * the same session and data for at most 'ttl' seconds, and never past the session
+ * timeout returned by opensso_start() or opensso_check() (set 0 to disable and flush).
+ * opensso_stop() and failed checks remove the session. A session stopped through
+ * another client stays valid here until its entry expires: keep 'ttl' short.
+ */
+EXPORT int opensso_cache_enable(int ttl, void(*log_handler)());
+
 // OpenSSO functions
 
 EXPORT opensso_start_rep_t *opensso_start(opensso_start_req_t *request, void(*log_handler)());
@@ -20,6 +20,9 @@
 #include "tiqr.h"
 #include "libcsoap/soap-client.h"
 #include "nanohttp/nanohttp-client.h"
+#include "nanohttp/nanohttp-pool.h"
+#include "nanohttp/nanohttp-secure.h"
+#include "endpoint.h"
 #ifdef HAVE_SSL
 #include "nanohttp/nanohttp-ssl.h"
 #endif
@@ -27,6 +30,11 @@
 char *__tiqr_url1 = NULL;
 char *__tiqr_url2 = NULL;
 
+static endpoint_group_t __tiqr_endpoints = ENDPOINT_GROUP_INITIALIZER("TiQR", TIQR_URN, TIQR_STATUS_METHOD, TIQR_STATUS_RESPONSE);
+
+static void tiqr_poll_stop(void);
+static void tiqr_release(char *session);
+
 int tiqr_initialize (char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)()) {
    herror_t err = H_OK;
    
@@ -49,6 +57,7 @@ int tiqr_initialize (char *url, char *cert, char *pass, char *ca, int timeout, v
       __tiqr_url1 = url;
       __tiqr_url2 = NULL;
    }
+   endpoint_group_set(&__tiqr_endpoints, __tiqr_url1, __tiqr_url2);
    
    #ifdef HAVE_SSL
    if ((__tiqr_url1 != NULL && strncmp(__tiqr_url1, "https://", 8) == 0) ||
@@ -83,6 +92,8 @@ int tiqr_terminate (void(*log_handler)()) {
       if (log_handler != NULL) (*log_handler)("TiQR not initialized");
       return 0;
    }
+   tiqr_poll_stop();
+   endpoint_group_reset(&__tiqr_endpoints);
    __tiqr_url1 = NULL;
    __tiqr_url2 = NULL;
    #ifdef HAVE_SSL
@@ -92,6 +103,28 @@ int tiqr_terminate (void(*log_handler)()) {
    }
    #endif
    soap_client_destroy();
+   hpool_destroy();
+   return 1;
+}
+
+int tiqr_prober_start (int interval, int ttl, void(*log_handler)()) {
+   if (__tiqr_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("TiQR not initialized");
+      return 0;
+   }
+   if (!endpoint_prober_start(&__tiqr_endpoints, interval, ttl)) {
+      if (log_handler != NULL) (*log_handler)("TiQR prober already running or thread creation failed");
+      return 0;
+   }
+   return 1;
+}
+
+int tiqr_prober_stop (void(*log_handler)()) {
+   if (__tiqr_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("TiQR not initialized");
+      return 0;
+   }
+   endpoint_prober_stop(&__tiqr_endpoints);
    return 1;
 }
 
@@ -100,6 +133,7 @@ tiqr_start_rep_t *tiqr_start(tiqr_start_req_t *request, void(*log_handler)()) {
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
    herror_t err = H_OK;
+   int index = -1;
    xmlNodePtr method, node;
    char *value, *name;
    
@@ -123,8 +157,7 @@ tiqr_start_rep_t *tiqr_start(tiqr_start_req_t *request, void(*log_handler)()) {
       if (soap_env_add_item(soap_request->env, "xsd:string", "settings", request->settings) == NULL) goto error;
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
+   err = endpoint_invoke_to(&__tiqr_endpoints, -1, soap_request, &soap_response, &index);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -191,6 +224,16 @@ tiqr_start_rep_t *tiqr_start(tiqr_start_req_t *request, void(*log_handler)()) {
       node = soap_xml_get_next(node);
    }
    
+   // the checks of the session must go to the server which issued it
+   if (response->code != TIQR_FAILURE && response->session != NULL) endpoint_affinity_set(&__tiqr_endpoints, response->session, index, response->timeout);
+   
+   // the caller gave up while the reply was on its way
+   if (hsocket_cancelled()) {
+      if (log_handler != NULL) (*log_handler)("TiQR request cancelled");
+      if (response->code != TIQR_FAILURE && response->session != NULL) tiqr_release(response->session);
+      goto error;
+   }
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -206,20 +249,10 @@ tiqr_start_rep_t *tiqr_start(tiqr_start_req_t *request, void(*log_handler)()) {
    return NULL;
 }
 
-tiqr_check_rep_t *tiqr_check(tiqr_check_req_t *request, void(*log_handler)()) {
-   tiqr_check_rep_t *response = NULL;
+static SoapCtx *tiqr_check_build(tiqr_check_req_t *request, void(*log_handler)()) {
    SoapCtx *soap_request = NULL;
-   SoapCtx *soap_response = NULL;
    herror_t err = H_OK;
-   xmlNodePtr method, node;
-   char *value, *name;
    
-   if (__tiqr_url1 == NULL) {
-      if (log_handler != NULL) (*log_handler)("TiQR not initialized");
-      return NULL;
-   }
-   
-   if (request == NULL) return NULL;
    if (request->session == NULL) return NULL;
    
    err = soap_ctx_new_with_method(TIQR_URN, TIQR_CHECK_METHOD, &soap_request);
@@ -229,10 +262,22 @@ tiqr_check_rep_t *tiqr_check(tiqr_check_req_t *request, void(*log_handler)()) {
    if (request->ldapPassword != NULL) { 
       if (soap_env_add_item(soap_request->env, "xsd:string", "ldapPassword", request->ldapPassword) == NULL) goto error;
    }
-     
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
-   if (err != H_OK) goto error;
+   
+   return soap_request;
+   
+   error:
+   if (err != H_OK) {
+      if (log_handler != NULL) (*log_handler)(herror_message(err));
+      herror_release(err);
+   }
+   if (soap_request != NULL) soap_ctx_free(soap_request);
+   return NULL;
+}
+
+static tiqr_check_rep_t *tiqr_check_parse(SoapCtx *soap_response, void(*log_handler)()) {
+   tiqr_check_rep_t *response = NULL;
+   xmlNodePtr method, node;
+   char *value, *name;
    
    if (soap_env_get_fault(soap_response->env)) {
       if (log_handler != NULL) (*log_handler)("received SOAP fault");
@@ -283,6 +328,40 @@ tiqr_check_rep_t *tiqr_check(tiqr_check_req_t *request, void(*log_handler)()) {
       node = soap_xml_get_next(node);
    }
    
+   return response;
+   
+   error:
+   if (response != NULL) tiqr_check_rep_free(response);
+   return NULL;
+}
+
+tiqr_check_rep_t *tiqr_check(tiqr_check_req_t *request, void(*log_handler)()) {
+   tiqr_check_rep_t *response = NULL;
+   SoapCtx *soap_request = NULL;
+   SoapCtx *soap_response = NULL;
+   herror_t err = H_OK;
+   int index;
+   
+   if (__tiqr_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("TiQR not initialized");
+      return NULL;
+   }
+   
+   if (request == NULL) return NULL;
+   
+   soap_request = tiqr_check_build(request, log_handler);
+   if (soap_request == NULL) goto error;
+   
+   index = endpoint_affinity_get(&__tiqr_endpoints, request->session);
+   err = endpoint_invoke_to(&__tiqr_endpoints, index, soap_request, &soap_response, NULL);
+   if (err != H_OK) {
+      if (herror_code(err) == HSOCKET_ERROR_CANCELLED) tiqr_release(request->session);
+      goto error;
+   }
+   
+   response = tiqr_check_parse(soap_response, log_handler);
+   if (response != NULL && response->code != TIQR_PENDING) endpoint_affinity_clear(&__tiqr_endpoints, request->session);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -294,7 +373,6 @@ tiqr_check_rep_t *tiqr_check(tiqr_check_req_t *request, void(*log_handler)()) {
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
    if (soap_response != NULL) soap_ctx_free(soap_response);
-   if (response != NULL) tiqr_check_rep_free(response);
    return NULL;
 }
 
@@ -327,9 +405,11 @@ tiqr_offline_check_rep_t *tiqr_offline_check(tiqr_offline_check_req_t *request,
       if (soap_env_add_item(soap_request->env, "xsd:string", "ldapPassword", request->ldapPassword) == NULL) goto error;
    }
    
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
-   if (err != H_OK) goto error;
+   err = endpoint_invoke_to(&__tiqr_endpoints, endpoint_affinity_get(&__tiqr_endpoints, request->session), soap_request, &soap_response, NULL);
+   if (err != H_OK) {
+      if (herror_code(err) == HSOCKET_ERROR_CANCELLED) tiqr_release(request->session);
+      goto error;
+   }
    
    if (soap_env_get_fault(soap_response->env)) {
       if (log_handler != NULL) (*log_handler)("received SOAP fault");
@@ -407,8 +487,7 @@ tiqr_cancel_rep_t *tiqr_cancel(tiqr_cancel_req_t *request, void(*log_handler)())
    
    if (soap_env_add_item(soap_request->env, "xsd:string", "session", request->session) == NULL) goto error;
    
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
+   err = endpoint_invoke_to(&__tiqr_endpoints, endpoint_affinity_get(&__tiqr_endpoints, request->session), soap_request, &soap_response, NULL);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -449,6 +528,8 @@ tiqr_cancel_rep_t *tiqr_cancel(tiqr_cancel_req_t *request, void(*log_handler)())
       node = soap_xml_get_next(node);
    }
    
+   endpoint_affinity_clear(&__tiqr_endpoints, request->session);
+   
    soap_ctx_free(soap_request);
    soap_ctx_free(soap_response);
    return response;
@@ -468,6 +549,8 @@ tiqr_session_qr_rep_t *tiqr_session_qr(tiqr_session_qr_req_t *request, void(*log
    tiqr_session_qr_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
+   endpoint_flight_t *flight = NULL;
+   char *key;
    herror_t err = H_OK;
    xmlNodePtr method, node;
    char *value, *name;
@@ -485,8 +568,9 @@ tiqr_session_qr_rep_t *tiqr_session_qr(tiqr_session_qr_req_t *request, void(*log
    
    if (soap_env_add_item(soap_request->env, "xsd:string", "session", request->session) == NULL) goto error;
    
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
+   key = endpoint_flight_key(TIQR_SESSION_QR_METHOD, 1, request->session);
+   err = endpoint_invoke_shared(&__tiqr_endpoints, endpoint_affinity_get(&__tiqr_endpoints, request->session), key, soap_request, &soap_response, NULL, &flight);
+   if (key != NULL) free(key);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -552,7 +636,7 @@ tiqr_session_qr_rep_t *tiqr_session_qr(tiqr_session_qr_req_t *request, void(*log
    }
    
    soap_ctx_free(soap_request);
-   soap_ctx_free(soap_response);
+   endpoint_response_free(flight, soap_response);
    return response;
    
    error:
@@ -561,7 +645,7 @@ tiqr_session_qr_rep_t *tiqr_session_qr(tiqr_session_qr_req_t *request, void(*log
       herror_release(err);
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
-   if (soap_response != NULL) soap_ctx_free(soap_response);
+   if (soap_response != NULL) endpoint_response_free(flight, soap_response);
    if (response != NULL) tiqr_session_qr_rep_free(response);
    return NULL;
 }
@@ -570,20 +654,38 @@ tiqr_status_rep_t *tiqr_status(void(*log_handler)()) {
    tiqr_status_rep_t *response = NULL;
    SoapCtx *soap_request = NULL;
    SoapCtx *soap_response = NULL;
+   endpoint_flight_t *flight = NULL;
+   char *key;
    herror_t err = H_OK;
    xmlNodePtr method, node;
-   char *value, *name;
+   char *value, *name, *message;
+   int status;
    
    if (__tiqr_url1 == NULL) {
       if (log_handler != NULL) (*log_handler)("TiQR not initialized");
       return NULL;
    }
    
+   // answer from the background prober if its last check is recent enough
+   if (endpoint_cached_status(&__tiqr_endpoints, &status, &message)) {
+      response = malloc(sizeof(tiqr_status_rep_t));
+      if (response == NULL) {
+	 if (message != NULL) free(message);
+	 if (log_handler != NULL) (*log_handler)("memory allocation failed");
+	 return NULL;
+      }
+      response->status = status;
+      response->message = message;
+      return response;
+   }
+   
    err = soap_ctx_new_with_method(TIQR_URN, TIQR_STATUS_METHOD, &soap_request);
    if (err != H_OK) goto error;
+   soap_request->idempotent = 1;
    
-   err = soap_client_invoke(soap_request, &soap_response, __tiqr_url1, "");
-   if (err != H_OK && __tiqr_url2 != NULL) err = soap_client_invoke(soap_request, &soap_response, __tiqr_url2, "");
+   key = endpoint_flight_key(TIQR_STATUS_METHOD, 0);
+   err = endpoint_invoke_shared(&__tiqr_endpoints, -1, key, soap_request, &soap_response, NULL, &flight);
+   if (key != NULL) free(key);
    if (err != H_OK) goto error;
    
    if (soap_env_get_fault(soap_response->env)) {
@@ -626,7 +728,7 @@ tiqr_status_rep_t *tiqr_status(void(*log_handler)()) {
    }
    
    soap_ctx_free(soap_request);
-   soap_ctx_free(soap_response);
+   endpoint_response_free(flight, soap_response);
    return response;
    
    error:
@@ -635,11 +737,327 @@ tiqr_status_rep_t *tiqr_status(void(*log_handler)()) {
       herror_release(err);
    }
    if (soap_request != NULL) soap_ctx_free(soap_request);
-   if (soap_response != NULL) soap_ctx_free(soap_response);
+   if (soap_response != NULL) endpoint_response_free(flight, soap_response);
    if (response != NULL) tiqr_status_rep_free(response);
    return NULL;
 }
 
+/*
+ * TiQR poller
+ *
+ * Pending sessions are checked by one background thread. The checks which
+ * are due are sent together, pipelined on one connection. Each session is
+ * checked after TIQR_POLL_MIN_DELAY, then the delay grows by half up to
+ * TIQR_POLL_MAX_DELAY, with +/-25% jitter so that QR screens opened at the
+ * same time do not poll in step.
+ */
+
+#define TIQR_POLL_MIN_DELAY 1000	// milliseconds
+#define TIQR_POLL_MAX_DELAY 8000	// milliseconds
+#define TIQR_POLL_DEFAULT_TIMEOUT 120	// seconds
+#define TIQR_POLL_BATCH 32
+
+typedef struct tiqr_poll_t {
+   char *session;
+   char *ldapPassword;
+   hclock_t deadline;
+   hclock_t due;
+   int delay;
+   volatile long cancelled;
+   void (*handler)(tiqr_check_rep_t*, void*);
+   void *userdata;
+   struct tiqr_poll_t *next;
+} tiqr_poll_t;
+
+// the list is only unlinked and freed by the poller thread, or by
+// tiqr_poll_stop() once the thread is joined
+static tiqr_poll_t *__tiqr_polls = NULL;
+static hmutex_t __tiqr_poll_lock = HMUTEX_INITIALIZER;
+static volatile long __tiqr_poll_run = 0;
+static hthread_t __tiqr_poll_thread;
+static int __tiqr_poll_joinable = 0;     // a thread was started and not joined yet
+static hcancel_t *__tiqr_poll_cancel = NULL;   // aborts the check in progress on stop
+static unsigned long __tiqr_poll_seed = 0;
+
+static void tiqr_poll_schedule(tiqr_poll_t *poll, hclock_t now) {
+   int delay;
+   
+   // only the poller thread draws from the seed
+   __tiqr_poll_seed = __tiqr_poll_seed * 1103515245 + 12345;
+   delay = poll->delay * 3 / 4 + (int)((__tiqr_poll_seed >> 16) % (unsigned long)(poll->delay / 2 + 1));
+   poll->due = now + delay;
+   if (poll->due - poll->deadline > 0) poll->due = poll->deadline;
+   poll->delay = poll->delay * 3 / 2;
+   if (poll->delay > TIQR_POLL_MAX_DELAY) poll->delay = TIQR_POLL_MAX_DELAY;
+}
+
+static void tiqr_poll_free(tiqr_poll_t *poll) {
+   if (poll->session != NULL) free(poll->session);
+   if (poll->ldapPassword != NULL) {
+      hsecure_wipe(poll->ldapPassword, strlen(poll->ldapPassword));
+      free(poll->ldapPassword);
+   }
+   free(poll);
+}
+
+static void tiqr_poll_unlink(tiqr_poll_t *poll) {
+   tiqr_poll_t **ptr;
+   
+   hmutex_lock(&__tiqr_poll_lock);
+   for (ptr = &__tiqr_polls; *ptr != NULL; ptr = &(*ptr)->next) {
+      if (*ptr == poll) {
+	 *ptr = poll->next;
+	 break;
+      }
+   }
+   hmutex_unlock(&__tiqr_poll_lock);
+}
+
+// completes a session which will not be checked anymore
+static void tiqr_poll_finish(tiqr_poll_t *poll, tiqr_check_rep_t *response) {
+   tiqr_cancel_req_t cancel_request;
+   tiqr_cancel_rep_t *cancel_response;
+   
+   // a final reply needs no cancel, even if one was asked in the meantime
+   if (poll->cancelled && response == NULL) {
+      cancel_request.session = poll->session;
+      cancel_response = tiqr_cancel(&cancel_request, NULL);
+      if (cancel_response != NULL) tiqr_cancel_rep_free(cancel_response);
+   }
+   (*poll->handler)(response, poll->userdata);
+   tiqr_poll_free(poll);
+}
+
+static void tiqr_poll_check(tiqr_poll_t **polls, int count) {
+   SoapCtx *soap_requests[TIQR_POLL_BATCH];
+   SoapCtx *soap_responses[TIQR_POLL_BATCH];
+   herror_t errors[TIQR_POLL_BATCH];
+   tiqr_poll_t *batch[TIQR_POLL_BATCH];
+   int preferred[TIQR_POLL_BATCH];
+   tiqr_check_req_t request;
+   tiqr_check_rep_t *response;
+   herror_t err;
+   int i, n;
+   
+   for (i = 0, n = 0; i < count; i++) {
+      request.session = polls[i]->session;
+      request.ldapPassword = polls[i]->ldapPassword;
+      soap_requests[n] = tiqr_check_build(&request, NULL);
+      if (soap_requests[n] == NULL) continue;
+      preferred[n] = endpoint_affinity_get(&__tiqr_endpoints, polls[i]->session);
+      batch[n++] = polls[i];
+   }
+   if (n == 0) return;
+   
+   err = endpoint_invoke_batch_to(&__tiqr_endpoints, preferred, soap_requests, soap_responses, errors, NULL, n);
+   if (err != H_OK) {
+      herror_release(err);
+      for (i = 0; i < n; i++) {
+	 if (soap_responses[i] != NULL) soap_ctx_free(soap_responses[i]);
+	 if (errors[i] != H_OK) herror_release(errors[i]);
+	 soap_responses[i] = NULL;
+	 errors[i] = H_OK;
+      }
+   }
+   
+   for (i = 0; i < n; i++) {
+      response = NULL;
+      if (errors[i] != H_OK) herror_release(errors[i]);
+      if (soap_responses[i] != NULL) {
+	 response = tiqr_check_parse(soap_responses[i], NULL);
+	 soap_ctx_free(soap_responses[i]);
+      }
+      soap_ctx_free(soap_requests[i]);
+      
+      // transport errors are retried until the deadline like pending replies
+      if (response != NULL && response->code != TIQR_PENDING) {
+	 endpoint_affinity_clear(&__tiqr_endpoints, batch[i]->session);
+	 tiqr_poll_unlink(batch[i]);
+	 tiqr_poll_finish(batch[i], response);
+      } else {
+	 if (response != NULL) tiqr_check_rep_free(response);
+	 tiqr_poll_schedule(batch[i], hclock_ms());
+      }
+   }
+}
+
+static
+#ifdef WIN32
+unsigned __stdcall
+#else
+void *
+#endif
+tiqr_poll_thread(void *data) {
+   tiqr_poll_t *due[TIQR_POLL_BATCH];
+   tiqr_poll_t *poll, **ptr, *done;
+   hclock_t now;
+   int n;
+   
+   hsocket_set_cancel(__tiqr_poll_cancel);
+   while (__tiqr_poll_run) {
+      now = hclock_ms();
+      done = NULL;
+      n = 0;
+      
+      hmutex_lock(&__tiqr_poll_lock);
+      if (__tiqr_polls == NULL) {
+	 // restarted by tiqr_poll_add()
+	 __tiqr_poll_run = 0;
+	 hmutex_unlock(&__tiqr_poll_lock);
+	 break;
+      }
+      ptr = &__tiqr_polls;
+      while ((poll = *ptr) != NULL) {
+	 if (poll->cancelled || now - poll->deadline > 0) {
+	    *ptr = poll->next;
+	    poll->next = done;
+	    done = poll;
+	    continue;
+	 }
+	 if (now - poll->due >= 0 && n < TIQR_POLL_BATCH) due[n++] = poll;
+	 ptr = &poll->next;
+      }
+      hmutex_unlock(&__tiqr_poll_lock);
+      
+      while ((poll = done) != NULL) {
+	 done = poll->next;
+	 tiqr_poll_finish(poll, NULL);
+      }
+      if (n > 0) tiqr_poll_check(due, n);
+      else hthread_msleep(100);
+   }
+   hsocket_set_cancel(NULL);
+   
+#ifdef WIN32
+   return 0;
+#else
+   return NULL;
+#endif
+}
+
+int tiqr_poll_add(tiqr_check_req_t *request, int timeout, void(*handler)(tiqr_check_rep_t*, void*), void *userdata, void(*log_handler)()) {
+   tiqr_poll_t *poll;
+   hclock_t now;
+   
+   if (__tiqr_url1 == NULL) {
+      if (log_handler != NULL) (*log_handler)("TiQR not initialized");
+      return 0;
+   }
+   
+   if (request == NULL || request->session == NULL || handler == NULL) return 0;
+   if (timeout <= 0) timeout = TIQR_POLL_DEFAULT_TIMEOUT;
+   
+   poll = malloc(sizeof(tiqr_poll_t));
+   if (poll == NULL) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      return 0;
+   }
+   now = hclock_ms();
+   poll->session = strdup(request->session);
+   poll->ldapPassword = request->ldapPassword != NULL ? strdup(request->ldapPassword) : NULL;
+   poll->deadline = now + timeout * 1000L;
+   poll->due = now + TIQR_POLL_MIN_DELAY;
+   poll->delay = TIQR_POLL_MIN_DELAY * 3 / 2;
+   poll->cancelled = 0;
+   poll->handler = handler;
+   poll->userdata = userdata;
+   if (poll->session == NULL || (request->ldapPassword != NULL && poll->ldapPassword == NULL)) {
+      if (log_handler != NULL) (*log_handler)("memory allocation failed");
+      tiqr_poll_free(poll);
+      return 0;
+   }
+   
+   hmutex_lock(&__tiqr_poll_lock);
+   poll->next = __tiqr_polls;
+   __tiqr_polls = poll;
+   if (!__tiqr_poll_run) {
+      if (__tiqr_poll_seed == 0) __tiqr_poll_seed = (unsigned long)now;
+      // the previous thread left when the list got empty, it holds no lock
+      if (__tiqr_poll_joinable) {
+	 hthread_join(__tiqr_poll_thread);
+	 __tiqr_poll_joinable = 0;
+      }
+      if (__tiqr_poll_cancel == NULL) __tiqr_poll_cancel = hcancel_new();
+      __tiqr_poll_run = 1;
+      if (__tiqr_poll_cancel == NULL || hthread_create(&__tiqr_poll_thread, tiqr_poll_thread, NULL) != 0) {
+	 __tiqr_poll_run = 0;
+	 __tiqr_polls = poll->next;
+	 hmutex_unlock(&__tiqr_poll_lock);
+	 if (log_handler != NULL) (*log_handler)("TiQR poller thread creation failed");
+	 tiqr_poll_free(poll);
+	 return 0;
+      }
+      __tiqr_poll_joinable = 1;
+   }
+   hmutex_unlock(&__tiqr_poll_lock);
+   return 1;
+}
+
+int tiqr_poll_cancel(char *session, void(*log_handler)()) {
+   tiqr_poll_t *poll;
+   int found = 0;
+   
+   if (session == NULL) return 0;
+   
+   hmutex_lock(&__tiqr_poll_lock);
+   for (poll = __tiqr_polls; poll != NULL; poll = poll->next) {
+      if (strcmp(poll->session, session) == 0 && !poll->cancelled) {
+	 poll->cancelled = 1;
+	 found = 1;
+      }
+   }
+   hmutex_unlock(&__tiqr_poll_lock);
+   
+   if (!found) {
+      if (log_handler != NULL) (*log_handler)("TiQR session not polled");
+      return 0;
+   }
+   return 1;
+}
+
+static void tiqr_release_done(tiqr_check_rep_t *response, void *userdata) {
+   if (response != NULL) tiqr_check_rep_free(response);
+}
+
+// Cancels the session of a cancelled request with tiqr_cancel() from the
+// poller thread, so that the caller does not wait for one more round trip.
+static void tiqr_release(char *session) {
+   tiqr_check_req_t request;
+   
+   request.session = session;
+   request.ldapPassword = NULL;
+   if (tiqr_poll_add(&request, 0, tiqr_release_done, NULL, NULL)) tiqr_poll_cancel(session, NULL);
+}
+
+static void tiqr_poll_stop(void) {
+   tiqr_poll_t *poll;
+   hthread_t thread;
+   int joinable;
+   
+   hmutex_lock(&__tiqr_poll_lock);
+   __tiqr_poll_run = 0;
+   thread = __tiqr_poll_thread;
+   joinable = __tiqr_poll_joinable;
+   __tiqr_poll_joinable = 0;
+   hmutex_unlock(&__tiqr_poll_lock);
+   
+   // the check in progress is cancelled, the thread leaves after it
+   if (joinable) {
+      hcancel_trigger(__tiqr_poll_cancel);
+      hthread_join(thread);
+   }
+   if (__tiqr_poll_cancel != NULL) {
+      hcancel_free(__tiqr_poll_cancel);
+      __tiqr_poll_cancel = NULL;
+   }
+   
+   // the sessions left are reported as not completed
+   while ((poll = __tiqr_polls) != NULL) {
+      __tiqr_polls = poll->next;
+      tiqr_poll_finish(poll, NULL);
+   }
+}
+
 tiqr_start_req_t *tiqr_start_req_new(void) {
    tiqr_start_req_t *request = malloc(sizeof(tiqr_start_req_t));
    if (request == NULL) return NULL;
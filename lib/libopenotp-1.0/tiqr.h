@@ -142,6 +142,16 @@ typedef struct tiqr_status_rep_t {
 EXPORT int tiqr_initialize(char *url, char *cert, char *pass, char *ca, int timeout, void(*log_handler)());
 EXPORT int tiqr_terminate(void(*log_handler)());
 
+/*
+ * tiqr_prober_start() starts a background thread which checks every TiQR server each
+ * 'interval' seconds with the status method and keeps a connection ready. Requests are
+ * sent to the servers which are up first and tiqr_status() is answered from the last
+ * check if it is not older than 'ttl' seconds (set 0 to always query the server).
+ * tiqr_prober_stop() stops the thread; tiqr_terminate() stops it as well.
+ */
+EXPORT int tiqr_prober_start(int interval, int ttl, void(*log_handler)());
+EXPORT int tiqr_prober_stop(void(*log_handler)());
+
 // tiqr functions
 
 EXPORT tiqr_start_rep_t *tiqr_start(tiqr_start_req_t *request, void(*log_handler)());
@@ -173,4 +183,22 @@ EXPORT void tiqr_session_qr_rep_free(tiqr_session_qr_rep_t *response);
 
 EXPORT void tiqr_status_rep_free(tiqr_status_rep_t *response); 
 
+/*
+ * tiqr_poll_add() hands a pending session over to a background poller which calls tiqr_check()
+ * until the reply is not TIQR_PENDING anymore. Checks are spaced with an increasing delay (1 to
+ * 8 seconds) and sent together with the checks of other sessions on one connection.
+ * Parameters:
+ * - request: session and optional ldapPassword (copied)
+ * - timeout: stop polling after this many seconds, use tiqr_start_rep_t.timeout (set 0 for default)
+ * - handler: called from the poller thread with the final tiqr_check() reply, or NULL if the
+ *   session timed out or was cancelled; the reply must be freed with tiqr_check_rep_free()
+ * - userdata: passed to the handler
+ * - log_handler: log handler function (set NULL to disable)
+ * tiqr_poll_cancel() stops polling a session and cancels it with tiqr_cancel(), unless its final
+ * reply came first (the handler then gets that reply). tiqr_terminate() aborts the check in
+ * progress, waits for the poller thread and completes all the sessions still polled.
+ */
+EXPORT int tiqr_poll_add(tiqr_check_req_t *request, int timeout, void(*handler)(tiqr_check_rep_t*, void*), void *userdata, void(*log_handler)());
+EXPORT int tiqr_poll_cancel(char *session, void(*log_handler)());
+
 #endif